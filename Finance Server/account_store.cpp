@@ -0,0 +1,436 @@
+#include "account_store.h"
+#include "logger.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <cerrno>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+using namespace std;
+
+// The SIMD kernels read balances with plain vector loads
+static_assert(sizeof(atomic<int64_t>) == sizeof(int64_t) && ATOMIC_LLONG_LOCK_FREE == 2,
+              "account balances must be lock-free 64-bit atomics");
+
+/*
+ * Interest kernels
+ *
+ * Each sets b[i] = b[i] > 0 ? round(b[i] * rate) : b[i] over n balances,
+ * rounding half to even. Lanes that need no change (zero, negative or
+ * inactive accounts) are never written. A changed lane is committed with a
+ * CAS against the value the kernel read; if a deposit or withdrawal got
+ * there first, the lane is recomputed from the current value. All kernels
+ * produce identical balances.
+ */
+typedef void (*InterestKernel)(atomic<int64_t>* b, size_t n, double rate);
+
+// Applies interest to one balance, retrying until the update sticks
+static inline void accrue(atomic<int64_t>& balance, int64_t seen, int64_t updated, double rate) {
+    while (!balance.compare_exchange_weak(seen, updated)) {
+        if (seen <= 0) return;
+        updated = llrint(seen * rate);
+    }
+}
+
+static void interest_scalar(atomic<int64_t>* b, size_t n, double rate) {
+    for (size_t i = 0; i < n; i++) {
+        int64_t cur = b[i].load(memory_order_relaxed);
+        if (cur > 0) accrue(b[i], cur, llrint(cur * rate), rate);
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+// AVX2 has no int64 <-> double conversion: below 2^51 adding 1.5 * 2^52
+// puts the integer in the low mantissa bits (and rounds half to even)
+static const int64_t MAGIC_BITS = 0x4338000000000000LL;
+static const double MAGIC = 6755399441055744.0;
+static const int64_t AVX2_LIMIT = 1LL << 50;
+
+__attribute__((target("avx2")))
+static void interest_avx2(atomic<int64_t>* b, size_t n, double rate) {
+    const __m256d r = _mm256_set1_pd(rate);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i limit = _mm256_set1_epi64x(AVX2_LIMIT);
+    const __m256i magic_bits = _mm256_set1_epi64x(MAGIC_BITS);
+    const __m256d magic = _mm256_set1_pd(MAGIC);
+    alignas(32) int64_t seen[4], updated[4];
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_load_si256(reinterpret_cast<const __m256i*>(b + i));
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, zero)));
+        if (!mask) continue;
+
+        if (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(v, limit)))) {
+            // Too large for the conversion trick
+            interest_scalar(b + i, 4, rate);
+            continue;
+        }
+
+        __m256d d = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_add_epi64(v, magic_bits)), magic);
+        __m256d t = _mm256_add_pd(_mm256_mul_pd(d, r), magic);
+        __m256i out = _mm256_sub_epi64(_mm256_castpd_si256(t), magic_bits);
+
+        _mm256_store_si256(reinterpret_cast<__m256i*>(seen), v);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(updated), out);
+        for (int lane = 0; lane < 4; lane++) {
+            if (mask & (1 << lane)) accrue(b[i + lane], seen[lane], updated[lane], rate);
+        }
+    }
+    interest_scalar(b + i, n - i, rate);
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static void interest_avx512(atomic<int64_t>* b, size_t n, double rate) {
+    const __m512d r = _mm512_set1_pd(rate);
+    const __m512i zero = _mm512_setzero_si512();
+    alignas(64) int64_t seen[8], updated[8];
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m512i v = _mm512_load_si512(b + i);
+        __mmask8 mask = _mm512_cmpgt_epi64_mask(v, zero);
+        if (!mask) continue;
+
+        __m512d d = _mm512_cvtepi64_pd(v);
+        __m512i out = _mm512_cvtpd_epi64(_mm512_mul_pd(d, r));
+
+        _mm512_store_si512(seen, v);
+        _mm512_store_si512(updated, out);
+        for (int lane = 0; lane < 8; lane++) {
+            if (mask & (1 << lane)) accrue(b[i + lane], seen[lane], updated[lane], rate);
+        }
+    }
+    interest_scalar(b + i, n - i, rate);
+}
+#endif
+
+// Picks the widest kernel the CPU supports
+static InterestKernel select_kernel(const char** name) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) {
+        *name = "avx512";
+        return interest_avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return interest_avx2;
+    }
+#endif
+    *name = "scalar";
+    return interest_scalar;
+}
+
+static const char* kernel_label = "scalar";
+static const InterestKernel interest_kernel = select_kernel(&kernel_label);
+
+// Radix tree over page indices: 6 levels of 512 slots cover 54 bits,
+// enough for every non-negative 64-bit ID at 1024 accounts per page
+static const int RADIX_BITS = 9;
+static const size_t RADIX_FANOUT = 1 << RADIX_BITS;
+static const int RADIX_DEPTH = 6;
+
+// Most pages the registry can hold (2^38 accounts)
+static const size_t MAX_PAGES = 1ULL << 28;
+
+// Arena slabs are mapped in units of this size
+static const size_t SLAB_SIZE = 64 * 1024 * 1024;
+
+struct AccountStore::Page {
+    atomic<int64_t> balances[PAGE_SIZE];
+    atomic<uint64_t> active[PAGE_SIZE / 64];
+    uint64_t index;
+};
+
+struct AccountStore::Node {
+    atomic<void*> slots[RADIX_FANOUT];
+};
+
+static inline size_t radix_slot(uint64_t page_index, int level) {
+    return (page_index >> (RADIX_BITS * (RADIX_DEPTH - 1 - level))) & (RADIX_FANOUT - 1);
+}
+
+/**
+ * Creates an empty store; no account memory is used until the first request
+ *
+ * @param limit Upper bound on user IDs, 0 for none
+ *
+ * @throws Exits with error message if the arena cannot be mapped
+ */
+AccountStore::AccountStore(uint64_t limit)
+    : limit(limit), pages(0), slab_cursor(nullptr), slab_left(0) {
+    void* mem = mmap(NULL, MAX_PAGES * sizeof(Page*), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        LOG_ERROR("Error reserving account registry " << strerror(errno));
+        throw("Error reserving account registry");
+    }
+    registry = static_cast<Page**>(mem);
+
+    lock_guard<mutex> lock(grow_mutex);
+    root = new (arena_alloc(sizeof(Node))) Node;
+}
+
+AccountStore::~AccountStore() {
+    for (auto& slab : slabs) munmap(slab.first, slab.second);
+    munmap(registry, MAX_PAGES * sizeof(Page*));
+}
+
+/**
+ * Carves zeroed, cache-line aligned memory out of the arena
+ *
+ * Slabs are anonymous mappings, so their memory starts out zeroed and is
+ * only backed by RAM once touched. Caller holds grow_mutex.
+ */
+void* AccountStore::arena_alloc(size_t bytes) {
+    bytes = (bytes + 63) & ~size_t(63);
+    if (bytes > slab_left) {
+        size_t size = bytes > SLAB_SIZE ? bytes : SLAB_SIZE;
+        void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            LOG_ERROR_LIMITED("Error growing account arena " << strerror(errno));
+            throw("Error growing account arena");
+        }
+        slabs.push_back(make_pair(mem, size));
+        slab_cursor = static_cast<char*>(mem);
+        slab_left = size;
+    }
+    void* out = slab_cursor;
+    slab_cursor += bytes;
+    slab_left -= bytes;
+    return out;
+}
+
+// Lock-free lookup, nullptr if the page was never touched
+AccountStore::Page* AccountStore::find_page(uint64_t page_index) const {
+    const Node* node = root;
+    for (int level = 0; level < RADIX_DEPTH - 1; level++) {
+        node = static_cast<const Node*>(node->slots[radix_slot(page_index, level)].load(memory_order_acquire));
+        if (!node) return nullptr;
+    }
+    return static_cast<Page*>(node->slots[radix_slot(page_index, RADIX_DEPTH - 1)].load(memory_order_acquire));
+}
+
+// Lookup that allocates the page (and any missing tree nodes) on first touch
+AccountStore::Page* AccountStore::get_page(uint64_t page_index) {
+    Page* page = find_page(page_index);
+    if (page) return page;
+
+    lock_guard<mutex> lock(grow_mutex);
+    Node* node = root;
+    for (int level = 0; level < RADIX_DEPTH - 1; level++) {
+        atomic<void*>& slot = node->slots[radix_slot(page_index, level)];
+        Node* child = static_cast<Node*>(slot.load(memory_order_acquire));
+        if (!child) {
+            child = new (arena_alloc(sizeof(Node))) Node;
+            slot.store(child, memory_order_release);
+        }
+        node = child;
+    }
+
+    atomic<void*>& slot = node->slots[radix_slot(page_index, RADIX_DEPTH - 1)];
+    page = static_cast<Page*>(slot.load(memory_order_acquire));
+    if (page) return page;  // Created while we waited for the lock
+
+    size_t position = pages.load(memory_order_relaxed);
+    if (position == MAX_PAGES) {
+        LOG_ERROR_LIMITED("Account table is full");
+        throw("Account table is full");
+    }
+
+    page = new (arena_alloc(sizeof(Page))) Page;
+    page->index = page_index;
+    registry[position] = page;
+    pages.store(position + 1, memory_order_release);
+    slot.store(page, memory_order_release);
+    return page;
+}
+
+AccountStore::Page* AccountStore::page_at(size_t position) const {
+    return registry[position];
+}
+
+// New accounts start at zero, so activation only has to set the bit
+void AccountStore::activate(Page* page, size_t slot) {
+    uint64_t bit = 1ULL << (slot % 64);
+    if (!(page->active[slot / 64].load(memory_order_relaxed) & bit)) {
+        page->active[slot / 64].fetch_or(bit);
+    }
+}
+
+/**
+ * Adds cents to an account
+ *
+ * @return Balance after the deposit
+ */
+int64_t AccountStore::deposit(uint64_t id, int64_t cents) {
+    Page* page = get_page(id / PAGE_SIZE);
+    size_t slot = id % PAGE_SIZE;
+    activate(page, slot);
+    return page->balances[slot].fetch_add(cents) + cents;
+}
+
+void AccountStore::set_balance(uint64_t id, int64_t cents) {
+    Page* page = get_page(id / PAGE_SIZE);
+    size_t slot = id % PAGE_SIZE;
+    activate(page, slot);
+    page->balances[slot].store(cents);
+}
+
+/**
+ * Removes cents from an account if the balance covers it
+ *
+ * @param balance Set to the balance after the withdrawal
+ * @return False if funds are insufficient
+ */
+bool AccountStore::withdraw(uint64_t id, int64_t cents, int64_t& balance) {
+    Page* page = get_page(id / PAGE_SIZE);
+    size_t slot = id % PAGE_SIZE;
+    activate(page, slot);
+
+    atomic<int64_t>& b = page->balances[slot];
+    int64_t cur = b.load();
+    do {
+        if (cur < cents) return false;
+    } while (!b.compare_exchange_weak(cur, cur - cents));
+    balance = cur - cents;
+    return true;
+}
+
+// Reads never create anything: an account nobody has deposited to reads 0
+int64_t AccountStore::balance(uint64_t id) const {
+    Page* page = find_page(id / PAGE_SIZE);
+    size_t slot = id % PAGE_SIZE;
+    if (!page || !(page->active[slot / 64].load(memory_order_relaxed) & (1ULL << (slot % 64)))) return 0;
+    return page->balances[slot].load();
+}
+
+bool AccountStore::is_active(uint64_t id) const {
+    Page* page = find_page(id / PAGE_SIZE);
+    size_t slot = id % PAGE_SIZE;
+    return page && (page->active[slot / 64].load() & (1ULL << (slot % 64)));
+}
+
+/**
+ * Runs the interest kernel over a range of pages
+ *
+ * @param first_page First page (in allocation order) to update
+ * @param last_page One past the last page to update
+ * @param rate Multiplier for positive balances (1.01 for 1%)
+ */
+void AccountStore::apply_interest(size_t first_page, size_t last_page, double rate) {
+    for (size_t position = first_page; position < last_page; position++) {
+        interest_kernel(page_at(position)->balances, PAGE_SIZE, rate);
+    }
+}
+
+/**
+ * Copies one page into a snapshot image
+ *
+ * @param position Page in allocation order, below page_count()
+ * @param image PAGE_IMAGE_SIZE bytes to fill
+ *
+ * Each balance is read atomically; callers that need a consistent image
+ * must keep writers out while copying.
+ */
+void AccountStore::copy_page(size_t position, char* image) const {
+    const Page* page = page_at(position);
+    memcpy(image, &page->index, sizeof(uint64_t));
+    image += sizeof(uint64_t);
+    for (size_t i = 0; i < PAGE_SIZE; i++) {
+        int64_t b = page->balances[i].load(memory_order_relaxed);
+        memcpy(image + i * sizeof(int64_t), &b, sizeof(int64_t));
+    }
+    image += PAGE_SIZE * sizeof(int64_t);
+    for (size_t i = 0; i < PAGE_SIZE / 64; i++) {
+        uint64_t bits = page->active[i].load(memory_order_relaxed);
+        memcpy(image + i * sizeof(uint64_t), &bits, sizeof(uint64_t));
+    }
+}
+
+/**
+ * Restores one page from a snapshot image, replacing its accounts
+ *
+ * @param image PAGE_IMAGE_SIZE bytes written by copy_page
+ */
+void AccountStore::load_page(const char* image) {
+    uint64_t index;
+    memcpy(&index, image, sizeof(uint64_t));
+    image += sizeof(uint64_t);
+
+    Page* page = get_page(index);
+    for (size_t i = 0; i < PAGE_SIZE; i++) {
+        int64_t b;
+        memcpy(&b, image + i * sizeof(int64_t), sizeof(int64_t));
+        page->balances[i].store(b, memory_order_relaxed);
+    }
+    image += PAGE_SIZE * sizeof(int64_t);
+    for (size_t i = 0; i < PAGE_SIZE / 64; i++) {
+        uint64_t bits;
+        memcpy(&bits, image + i * sizeof(uint64_t), sizeof(uint64_t));
+        page->active[i].store(bits, memory_order_relaxed);
+    }
+}
+
+uint64_t AccountStore::page_index(size_t position) const {
+    return page_at(position)->index;
+}
+
+bool AccountStore::page_has_accounts(size_t position) const {
+    const Page* page = page_at(position);
+    for (size_t i = 0; i < PAGE_SIZE / 64; i++) {
+        if (page->active[i].load(memory_order_relaxed) != 0) return true;
+    }
+    return false;
+}
+
+void AccountStore::clear_page(uint64_t index) {
+    Page* page = find_page(index);
+    if (!page) return;
+    for (size_t i = 0; i < PAGE_SIZE; i++) {
+        page->balances[i].store(0, memory_order_relaxed);
+    }
+    for (size_t i = 0; i < PAGE_SIZE / 64; i++) {
+        page->active[i].store(0, memory_order_relaxed);
+    }
+}
+
+/**
+ * Locks the stripes covering a set of accounts
+ *
+ * Stripes are taken in ascending order, each at most once, so two callers
+ * can never deadlock. The locks are released when the returned vector goes
+ * out of scope.
+ */
+vector<unique_lock<mutex>> AccountStore::lock_accounts(const vector<uint64_t>& ids) {
+    vector<size_t> order;
+    order.reserve(ids.size());
+    for (uint64_t id : ids) order.push_back(id % LOCK_STRIPES);
+    sort(order.begin(), order.end());
+    order.erase(unique(order.begin(), order.end()), order.end());
+
+    vector<unique_lock<mutex>> held;
+    held.reserve(order.size());
+    for (size_t stripe : order) held.emplace_back(stripes[stripe]);
+    return held;
+}
+
+const char* AccountStore::kernel_name() {
+    return kernel_label;
+}
+
+int64_t AccountStore::to_cents(double amount) {
+    return llround(amount * 100.0);
+}
+
+double AccountStore::to_amount(int64_t cents) {
+    return cents / 100.0;
+}
@@ -0,0 +1,114 @@
+#ifndef _ACCOUNT_STORE_H_
+#define _ACCOUNT_STORE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+/*
+ * AccountStore class
+ *
+ * Account storage for the finance server, addressed by 64-bit user ID.
+ * Accounts live in pages of PAGE_SIZE that are allocated from an mmap-backed
+ * arena the first time one of their accounts is used, so memory follows the
+ * accounts that actually exist rather than the largest possible ID. Pages
+ * are found through a radix tree that readers walk without locks; only the
+ * rare creation of a page takes a mutex.
+ *
+ * Inside a page, balances are fixed-point cents in a cache-line aligned
+ * array of atomics and the active flags are an atomic bitmap, so an account
+ * costs 8 bytes plus one bit and needs no lock:
+ *
+ *   - deposits are a fetch_add, withdrawals a CAS loop that refuses to go
+ *     below zero, and accounts are activated with a single fetch_or;
+ *   - interest is computed many lanes at a time by a SIMD kernel (AVX-512,
+ *     AVX2 or scalar, picked at startup) and each changed balance is
+ *     committed with a CAS, so it never loses a concurrent deposit.
+ *
+ * Operations spanning several accounts take the stripe locks of the accounts
+ * involved (lock_accounts) so they are serialized against each other.
+ */
+class AccountStore {
+public:
+    // Accounts per page (8 KiB of balances)
+    static const size_t PAGE_SIZE = 1024;
+
+    // Stripes in the lock table for multi-account operations
+    static const size_t LOCK_STRIPES = 256;
+
+    // limit: user IDs must be below this, 0 accepts any non-negative ID
+    AccountStore(uint64_t limit = 0);
+    ~AccountStore();
+
+    AccountStore(const AccountStore&) = delete;
+    AccountStore& operator=(const AccountStore&) = delete;
+
+    bool valid_id(int64_t id) const { return id >= 0 && (limit == 0 || (uint64_t)id < limit); }
+
+    // Single account operations in cents; accounts are created on first use
+    int64_t deposit(uint64_t id, int64_t cents);
+    bool withdraw(uint64_t id, int64_t cents, int64_t& balance);
+    int64_t balance(uint64_t id) const;
+    bool is_active(uint64_t id) const;
+
+    // Replaces a balance outright, creating the account (shard handovers)
+    void set_balance(uint64_t id, int64_t cents);
+
+    // Pages allocated so far, in allocation order
+    size_t page_count() const { return pages.load(std::memory_order_acquire); }
+
+    // Applies balance > 0 ? round(balance * rate) : balance to pages [first, last)
+    void apply_interest(size_t first_page, size_t last_page, double rate);
+
+    // Page images for snapshots: page index, balances, then the active bitmap
+    static const size_t PAGE_IMAGE_SIZE = sizeof(uint64_t) + PAGE_SIZE * sizeof(int64_t) + PAGE_SIZE / 8;
+    void copy_page(size_t position, char* image) const;
+    void load_page(const char* image);
+
+    // Pages by allocation position, for handing a shard's accounts over
+    uint64_t page_index(size_t position) const;
+    bool page_has_accounts(size_t position) const;
+
+    // Zeroes and deactivates every account of a page; the memory stays allocated
+    void clear_page(uint64_t page_index);
+
+    // Locks the stripes of every account in ids, in a deadlock-free order
+    std::vector<std::unique_lock<std::mutex>> lock_accounts(const std::vector<uint64_t>& ids);
+
+    // Name of the interest kernel in use ("avx512", "avx2" or "scalar")
+    static const char* kernel_name();
+
+    // Conversions between wire amounts (dollars) and stored cents
+    static int64_t to_cents(double amount);
+    static double to_amount(int64_t cents);
+
+private:
+    struct Page;
+    struct Node;
+
+    Page* find_page(uint64_t page_index) const;
+    Page* get_page(uint64_t page_index);
+    Page* page_at(size_t position) const;
+    void* arena_alloc(size_t bytes);
+    void activate(Page* page, size_t slot);
+
+    uint64_t limit;
+    Node* root;
+
+    // Pages in allocation order for bulk passes. The array is reserved
+    // address space that the kernel backs as it fills up.
+    Page** registry;
+    std::atomic<size_t> pages;
+
+    // Page creation: arena slabs and the bump pointer into the newest one
+    std::mutex grow_mutex;
+    std::vector<std::pair<void*, size_t>> slabs;
+    char* slab_cursor;
+    size_t slab_left;
+
+    std::mutex stripes[LOCK_STRIPES];
+};
+
+#endif
@@ -0,0 +1,492 @@
+#include "async_client.h"
+#include "logger.h"
+#include <algorithm>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+
+using namespace std;
+
+const int AsyncClient::DEFAULT_TIMEOUT_MS;
+const size_t AsyncClient::MAX_IN_FLIGHT;
+const size_t AsyncClient::MAX_IN_FLIGHT_BYTES;
+const int AsyncClient::RECONNECT_INTERVAL_MS;
+
+// Events handled per epoll_wait call
+static const int MAX_EVENTS = 64;
+
+// Stale deadlines kept before the heap is rebuilt without them, on top of
+// twice the entries left by the last rebuild
+static const size_t DEADLINE_SLACK = 1024;
+
+// Approximate bytes a request takes on the wire, for the in-flight window
+static size_t request_bytes(const Request& req) {
+    return BINARY_REQUEST_HEADER_SIZE + req.filename.size() + req.data.size();
+}
+
+/**
+ * Creates the epoll instance and starts the I/O thread
+ *
+ * @throws Exits with error message if the epoll instance or the wakeup
+ *         eventfd cannot be created
+ */
+AsyncClient::AsyncClient() : stop(false), pending(0), deadlines_kept(0) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        LOG_ERROR("Error creating epoll instance " << strerror(errno));
+        throw("Error creating epoll instance");
+    }
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        LOG_ERROR("Error creating eventfd " << strerror(errno));
+        close(epoll_fd);
+        throw("Error creating eventfd");
+    }
+
+    // A null pointer marks the wakeup descriptor, every other event is a Server
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) == -1) {
+        LOG_ERROR("Error watching eventfd " << strerror(errno));
+        close(wake_fd);
+        close(epoll_fd);
+        throw("Error watching eventfd");
+    }
+
+    io_thread = thread([this] { run(); });
+}
+
+/**
+ * Stops the I/O thread, which fails whatever is still outstanding, and
+ * closes every connection
+ */
+AsyncClient::~AsyncClient() {
+    {
+        lock_guard<mutex> lock(submit_mutex);
+        stop = true;
+    }
+    wake();
+    io_thread.join();
+
+    servers.clear();
+    close(wake_fd);
+    close(epoll_fd);
+}
+
+/**
+ * Opens a connection to a server
+ *
+ * @param host Server address
+ * @param port Server port
+ * @param format Wire format to negotiate
+ * @param compression Payload compression to ask for (COMPRESSION_*)
+ * @return Handle for async_send()
+ *
+ * @throws Exits with error message if the server cannot be reached
+ */
+int AsyncClient::connect(const string& host, int port, WireFormat format, int compression) {
+    unique_ptr<Server> server(new Server());
+    server->host = host;
+    server->port = port;
+    server->format = format;
+    server->compression = compression;
+    server->channel.reset(new NetworkRequestChannel(host, port, NetworkRequestChannel::CLIENT_SIDE,
+                                                    format, compression));
+    server->channel->set_nonblocking();
+    server->next_attempt = Clock::now();
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = server.get();
+
+    lock_guard<mutex> lock(submit_mutex);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server->channel->get_socket_fd(), &ev) == -1) {
+        LOG_ERROR("Error watching connection to " << host << ":" << port << " " << strerror(errno));
+        throw("Error watching connection");
+    }
+    server->index = servers.size();
+    servers.push_back(move(server));
+    return servers.back()->index;
+}
+
+/**
+ * Sends a request without waiting for its response
+ *
+ * @param server Handle from connect()
+ * @param req The Request object to send
+ * @param timeout_ms How long the response may take
+ * @return Future for the response, a failure if it timed out or the connection was lost
+ */
+future<Response> AsyncClient::async_send(int server, const Request& req, int timeout_ms) {
+    shared_ptr<promise<Response>> result = make_shared<promise<Response>>();
+    future<Response> response = result->get_future();
+    async_send(server, req, [result](Response& resp) { result->set_value(move(resp)); }, timeout_ms);
+    return response;
+}
+
+/**
+ * Sends a request without waiting for its response
+ *
+ * @param server Handle from connect()
+ * @param req The Request object to send
+ * @param done Called on the I/O thread with the response, or with a failure
+ *             if it timed out or the connection was lost
+ * @param timeout_ms How long the response may take
+ *
+ * Only the first submission since the I/O thread last looked wakes it, so
+ * a burst of requests costs one eventfd write.
+ */
+void AsyncClient::async_send(int server, const Request& req, Callback done, int timeout_ms) {
+    Clock::time_point deadline = Clock::now() + chrono::milliseconds(timeout_ms);
+    bool first;
+    {
+        lock_guard<mutex> lock(submit_mutex);
+        if (server < 0 || server >= static_cast<int>(servers.size()) || stop) {
+            first = false;
+            server = -1;
+        } else {
+            first = submissions.empty();
+            submissions.push_back(Submission{servers[server].get(), req, move(done), deadline});
+            pending++;
+        }
+    }
+
+    if (server == -1) {
+        Response resp(false, 0, "", "Unknown server");
+        done(resp);
+        return;
+    }
+    if (first) wake();
+}
+
+size_t AsyncClient::outstanding() {
+    lock_guard<mutex> lock(submit_mutex);
+    return pending;
+}
+
+void AsyncClient::wake() {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        LOG_ERROR_LIMITED("Error waking I/O thread " << strerror(errno));
+    }
+}
+
+/**
+ * The I/O thread: waits for responses and submissions, writes requests out
+ * and times out the requests whose deadline passed
+ */
+void AsyncClient::run() {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (true) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, expire());
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            LOG_ERROR("epoll_wait failed in AsyncClient " << strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            Server* server = static_cast<Server*>(events[i].data.ptr);
+            if (!server) {
+                uint64_t count;
+                while (read(wake_fd, &count, sizeof(count)) == -1 && errno == EINTR) {}
+                continue;
+            }
+            if (server->channel) receive(*server);
+        }
+
+        if (!take_submissions()) break;
+        for (Submission& s : taken) {
+            accept(s);
+        }
+        taken.clear();
+
+        for (Server* server : flushing) {
+            server->flush_due = false;
+            if (server->channel) send_waiting(*server);
+        }
+        flushing.clear();
+    }
+
+    fail_all("Client closed");
+}
+
+// Moves the queued submissions to taken; false once the client is stopping
+bool AsyncClient::take_submissions() {
+    lock_guard<mutex> lock(submit_mutex);
+    taken.swap(submissions);
+    return !stop;
+}
+
+/**
+ * Registers a submitted request with its server, to be written with the
+ * rest of the burst
+ */
+void AsyncClient::accept(Submission& s) {
+    Server& server = *s.server;
+    if (!open(server)) {
+        Response resp(false, 0, "", "Not connected");
+        finish(s.done, resp);
+        return;
+    }
+
+    uint32_t request_id = server.channel->reserve_request_id();
+    server.calls.emplace(request_id, Call(move(s.req), move(s.done), s.deadline));
+    server.waiting.push_back(request_id);
+    if (!server.flush_due) {
+        server.flush_due = true;
+        flushing.push_back(&server);
+    }
+
+    deadlines.push_back(Deadline{s.deadline, &server, request_id});
+    push_heap(deadlines.begin(), deadlines.end(), greater<Deadline>());
+    if (deadlines.size() > 2 * deadlines_kept + DEADLINE_SLACK) {
+        prune_deadlines();
+    }
+}
+
+/**
+ * Reconnects a server whose connection was lost
+ *
+ * @return false if it is still down; it is tried again after RECONNECT_INTERVAL_MS
+ */
+bool AsyncClient::open(Server& server) {
+    if (server.channel) return true;
+
+    Clock::time_point now = Clock::now();
+    if (now < server.next_attempt) return false;
+    server.next_attempt = now + chrono::milliseconds(RECONNECT_INTERVAL_MS);
+
+    try {
+        server.channel.reset(new NetworkRequestChannel(server.host, server.port, NetworkRequestChannel::CLIENT_SIDE,
+                                                       server.format, server.compression));
+        server.channel->set_nonblocking();
+    } catch (const char* e) {
+        server.channel.reset();
+        return false;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &server;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server.channel->get_socket_fd(), &ev) == -1) {
+        LOG_ERROR_LIMITED("Error watching connection to " << server.host << ":" << server.port << " "
+                          << strerror(errno));
+        server.channel.reset();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Writes the requests held back for a server, as many as its window allows,
+ * with one flush
+ *
+ * A request bigger than the byte window still goes out when nothing else
+ * is in flight.
+ */
+void AsyncClient::send_waiting(Server& server) {
+    bool binary = server.channel->get_wire_format() == BINARY_FORMAT;
+    vector<uint32_t> one_way;
+    bool queued = false;
+
+    while (!server.waiting.empty() && server.in_flight < MAX_IN_FLIGHT &&
+           (server.in_flight == 0 || server.in_flight_bytes < MAX_IN_FLIGHT_BYTES)) {
+        uint32_t request_id = server.waiting.front();
+        server.waiting.pop_front();
+
+        auto it = server.calls.find(request_id);
+        if (it == server.calls.end()) continue;     // Timed out while held back
+        Call& call = it->second;
+
+        // The server sheds the request once the time left for it has passed
+        if (call.req.timeout_ms == 0) {
+            auto left = chrono::duration_cast<chrono::milliseconds>(call.deadline - Clock::now()).count();
+            call.req.timeout_ms = left > 0 ? static_cast<uint32_t>(left) : 1;
+        }
+        server.channel->queue_tagged(call.req, request_id);
+        queued = true;
+        if (call.req.one_way && binary) {
+            one_way.push_back(request_id);
+            continue;
+        }
+
+        call.sent = true;
+        call.bytes = request_bytes(call.req);
+        call.req.reset();
+        server.in_flight++;
+        server.in_flight_bytes += call.bytes;
+        if (!binary) server.answer_order.push_back(request_id);
+    }
+
+    if (queued && !server.channel->flush_requests()) {
+        drop(server, "Connection lost");
+        return;
+    }
+
+    // Nothing comes back for one-way requests, so they are done once written
+    for (uint32_t request_id : one_way) {
+        auto it = server.calls.find(request_id);
+        Callback done = move(it->second.done);
+        server.calls.erase(it);
+        if (done) {
+            Response resp(true);
+            finish(done, resp);
+        }
+    }
+}
+
+/**
+ * Reads every response waiting on a server's connection
+ */
+void AsyncClient::receive(Server& server) {
+    do {
+        if (!server.channel->receive_tagged(received)) {
+            drop(server, "Connection lost");
+            return;
+        }
+
+        uint32_t request_id = received.request_id;
+        if (server.channel->get_wire_format() != BINARY_FORMAT) {
+            if (server.answer_order.empty()) {
+                LOG_ERROR_LIMITED("Unexpected response from " << server.host << ":" << server.port);
+                drop(server, "Connection lost");
+                return;
+            }
+            request_id = server.answer_order.front();
+            server.answer_order.pop_front();
+        }
+        complete(server, request_id, received);
+    } while (server.channel && server.channel->has_pending_input());
+}
+
+/**
+ * Hands a response to its request's callback and frees its window slot
+ *
+ * Responses to requests that timed out only free the slot.
+ */
+void AsyncClient::complete(Server& server, uint32_t request_id, Response& resp) {
+    auto it = server.calls.find(request_id);
+    if (it == server.calls.end() || !it->second.sent) {
+        LOG_ERROR_LIMITED("Response to unknown request " << request_id << " from "
+                          << server.host << ":" << server.port);
+        return;
+    }
+
+    server.in_flight--;
+    server.in_flight_bytes -= it->second.bytes;
+    Callback done = move(it->second.done);
+    server.calls.erase(it);
+
+    if (!server.waiting.empty() && !server.flush_due) {
+        server.flush_due = true;
+        flushing.push_back(&server);
+    }
+    if (done) finish(done, resp);
+}
+
+/**
+ * Closes a server's connection and fails every request sent or held back on it
+ */
+void AsyncClient::drop(Server& server, const char* reason) {
+    if (server.channel) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, server.channel->get_socket_fd(), NULL);
+        server.channel.reset();
+    }
+    server.next_attempt = Clock::now();
+
+    unordered_map<uint32_t, Call> lost;
+    lost.swap(server.calls);
+    server.waiting.clear();
+    server.answer_order.clear();
+    server.in_flight = 0;
+    server.in_flight_bytes = 0;
+
+    for (auto& c : lost) {
+        if (c.second.done) {
+            Response resp(false, 0, "", reason);
+            finish(c.second.done, resp);
+        }
+    }
+}
+
+/**
+ * Fails the requests whose deadline passed
+ *
+ * @return Milliseconds until the next deadline, -1 if there is none
+ *
+ * A request that was already written keeps its window slot until the late
+ * response arrives, since the server is still working on it.
+ */
+int AsyncClient::expire() {
+    Clock::time_point now = Clock::now();
+    while (!deadlines.empty() && deadlines.front().when <= now) {
+        Deadline d = deadlines.front();
+        pop_heap(deadlines.begin(), deadlines.end(), greater<Deadline>());
+        deadlines.pop_back();
+
+        auto it = d.server->calls.find(d.request_id);
+        if (it == d.server->calls.end() || !it->second.done || it->second.deadline != d.when) continue;
+
+        Callback done = move(it->second.done);
+        if (!it->second.sent) d.server->calls.erase(it);
+        Response resp(false, 0, "", "Request timed out");
+        finish(done, resp);
+    }
+    if (deadlines_kept > deadlines.size()) deadlines_kept = deadlines.size();
+
+    if (deadlines.empty()) return -1;
+    return chrono::duration_cast<chrono::milliseconds>(deadlines.front().when - now).count() + 1;
+}
+
+// Rebuilds the deadline heap without the entries of completed requests
+void AsyncClient::prune_deadlines() {
+    auto stale = [](const Deadline& d) {
+        auto it = d.server->calls.find(d.request_id);
+        return it == d.server->calls.end() || !it->second.done || it->second.deadline != d.when;
+    };
+    deadlines.erase(remove_if(deadlines.begin(), deadlines.end(), stale), deadlines.end());
+    make_heap(deadlines.begin(), deadlines.end(), greater<Deadline>());
+    deadlines_kept = deadlines.size();
+}
+
+// Runs a request's callback and stops counting it as outstanding
+void AsyncClient::finish(Callback& done, Response& resp) {
+    try {
+        done(resp);
+    } catch (...) {
+        LOG_ERROR_LIMITED("Exception in an asynchronous request's callback");
+    }
+
+    lock_guard<mutex> lock(submit_mutex);
+    pending--;
+}
+
+// Fails everything submitted or in flight (I/O thread, on the way out)
+void AsyncClient::fail_all(const char* reason) {
+    vector<Server*> all;
+    {
+        lock_guard<mutex> lock(submit_mutex);
+        for (Submission& s : submissions) taken.push_back(move(s));
+        submissions.clear();
+        for (auto& server : servers) all.push_back(server.get());
+    }
+
+    for (Submission& s : taken) {
+        Response resp(false, 0, "", reason);
+        finish(s.done, resp);
+    }
+    taken.clear();
+
+    for (Server* server : all) {
+        drop(*server, reason);
+    }
+}
@@ -0,0 +1,164 @@
+#ifndef _ASYNC_CLIENT_H_
+#define _ASYNC_CLIENT_H_
+
+#include "common.h"
+#include "network_channel.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <future>
+#include <functional>
+#include <chrono>
+
+/*
+ * AsyncClient class
+ *
+ * Non-blocking requests to any number of servers from any number of
+ * threads. async_send() only queues the request and returns; one I/O
+ * thread writes queued requests out in batches, waits for responses on all
+ * connections with one epoll instance and completes each request through
+ * its future or callback. A single caller can so keep hundreds of requests
+ * in flight across the finance, file and logging servers.
+ *
+ * Every request has its own deadline: when it passes before the response
+ * arrives, the request completes with a "Request timed out" failure and
+ * the late response is dropped. The time left is sent along with the
+ * request (Request::timeout_ms) so the server drops it unanswered rather
+ * than doing work nobody waits for. Binary connections match responses by
+ * request ID; text connections are answered in order.
+ *
+ * Each connection keeps at most MAX_IN_FLIGHT requests (and about
+ * MAX_IN_FLIGHT_BYTES of request data) unanswered and holds the rest back,
+ * so the I/O thread never blocks writing to a server that is itself
+ * blocked writing responses nobody reads. A connection that fails
+ * completes its requests with "Connection lost"; the next request sent to
+ * it reconnects, at most once per RECONNECT_INTERVAL_MS.
+ *
+ * Callbacks run on the I/O thread, so they must not block; they may send
+ * further requests.
+ */
+class AsyncClient {
+public:
+    typedef std::function<void(Response&)> Callback;
+    typedef std::chrono::steady_clock Clock;
+
+    AsyncClient();
+
+    // Completes every outstanding request with "Client closed"
+    ~AsyncClient();
+
+    AsyncClient(const AsyncClient&) = delete;
+    AsyncClient& operator=(const AsyncClient&) = delete;
+
+    // Connects to a server (blocking) and returns the handle async_send()
+    // takes. Connect several times for several connections to one server.
+    // @throws Exits with error message if the server cannot be reached
+    int connect(const std::string& host, int port, WireFormat format = BINARY_FORMAT,
+                int compression = COMPRESSION_OFF);
+
+    // Queues req for the server and returns at once; an unknown server
+    // handle fails at once on the calling thread. Streamed responses are
+    // collected into data; request payloads always go inline. One-way
+    // requests complete as soon as they have been written.
+    std::future<Response> async_send(int server, const Request& req, int timeout_ms = DEFAULT_TIMEOUT_MS);
+    void async_send(int server, const Request& req, Callback done, int timeout_ms = DEFAULT_TIMEOUT_MS);
+
+    // Requests sent or queued whose response has not arrived yet
+    size_t outstanding();
+
+    static const int DEFAULT_TIMEOUT_MS = 10000;
+    static const size_t MAX_IN_FLIGHT = 256;
+    static const size_t MAX_IN_FLIGHT_BYTES = 256 * 1024;
+    static const int RECONNECT_INTERVAL_MS = 1000;
+
+private:
+    struct Call {
+        Request req;
+        Callback done;          // Empty once the call timed out
+        Clock::time_point deadline;
+        size_t bytes;           // Counted against the window while sent
+        bool sent;
+
+        Call(Request req, Callback done, Clock::time_point deadline)
+            : req(std::move(req)), done(std::move(done)), deadline(deadline), bytes(0), sent(false) {}
+    };
+
+    struct Server {
+        std::string host;
+        int port;
+        WireFormat format;
+        int compression;
+        int index;
+
+        // Touched by the I/O thread only
+        std::unique_ptr<NetworkRequestChannel> channel;
+        Clock::time_point next_attempt;     // When a lost connection may be reopened
+        std::unordered_map<uint32_t, Call> calls;   // By request ID
+        std::deque<uint32_t> waiting;       // Held back by the window, oldest first
+        std::deque<uint32_t> answer_order;  // Text: sent requests, oldest first
+        size_t in_flight;
+        size_t in_flight_bytes;
+        bool flush_due;                     // Listed in flushing
+
+        Server() : port(0), format(BINARY_FORMAT), compression(COMPRESSION_OFF), index(0),
+                   in_flight(0), in_flight_bytes(0), flush_due(false) {}
+    };
+
+    struct Submission {
+        Server* server;
+        Request req;
+        Callback done;
+        Clock::time_point deadline;
+    };
+
+    // Deadline of a call; entries outlive the calls they were pushed for
+    struct Deadline {
+        Clock::time_point when;
+        Server* server;
+        uint32_t request_id;
+
+        bool operator>(const Deadline& other) const { return when > other.when; }
+    };
+
+    void run();
+    void wake();
+    bool take_submissions();
+    void accept(Submission& s);
+    bool open(Server& server);
+    void send_waiting(Server& server);
+    void receive(Server& server);
+    void complete(Server& server, uint32_t request_id, Response& resp);
+    void drop(Server& server, const char* reason);
+    int expire();
+    void prune_deadlines();
+    void finish(Callback& done, Response& resp);
+    void fail_all(const char* reason);
+
+    int epoll_fd;
+    int wake_fd;
+
+    // Servers are only ever added; the vector is guarded by submit_mutex
+    std::vector<std::unique_ptr<Server>> servers;
+
+    std::mutex submit_mutex;
+    std::vector<Submission> submissions;
+    bool stop;
+    size_t pending;     // Accepted by async_send and not completed yet
+
+    // I/O thread only: a min-heap of deadlines (std::push_heap with
+    // std::greater), the submissions being accepted, the servers with
+    // requests to write and the response being received
+    std::vector<Deadline> deadlines;
+    size_t deadlines_kept;      // Heap size after the last prune
+    std::vector<Submission> taken;
+    std::vector<Server*> flushing;
+    Response received;
+
+    std::thread io_thread;
+};
+
+#endif
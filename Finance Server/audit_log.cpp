@@ -0,0 +1,302 @@
+#include "audit_log.h"
+#include "logger.h"
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// Records summarized by one index entry
+static const uint64_t INDEX_BLOCK = 128;
+
+// Bytes a query reads from a segment at a time
+static const size_t QUERY_READ_SIZE = 256 * 1024;
+
+// The two bloom filter bits (of 512) for a user ID
+static void user_bits(int64_t user_id, unsigned& a, unsigned& b) {
+    uint64_t h = static_cast<uint64_t>(user_id) * 0x9E3779B97F4A7C15ull;
+    a = h >> 55;
+    b = (h >> 46) & 511;
+}
+
+static bool has_bit(const uint64_t* bits, unsigned i) {
+    return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+static string index_path(const string& segment) {
+    return segment.substr(0, segment.size() - 4) + ".idx";
+}
+
+/**
+ * Opens the audit log in a directory, creating the directory if needed
+ *
+ * @param dir Directory holding the audit-*.seg segments and their indexes
+ *
+ * @throws Exits with error message if the directory cannot be used
+ */
+AuditLog::AuditLog(const string& dir) : dir(dir), next_segment(1), index_fd(-1) {
+    if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+        LOG_ERROR("Error creating audit directory " << dir << " " << strerror(errno));
+        throw("Error creating audit directory");
+    }
+
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        LOG_ERROR("Error opening audit directory " << dir << " " << strerror(errno));
+        throw("Error opening audit directory");
+    }
+    vector<pair<uint64_t, string>> found;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        unsigned long long n;
+        char tail[8];
+        if (sscanf(entry->d_name, "audit-%llu.%7s", &n, tail) == 2 && strcmp(tail, "seg") == 0) {
+            found.push_back(make_pair(n, dir + "/" + entry->d_name));
+        }
+    }
+    closedir(d);
+
+    sort(found.begin(), found.end());
+    for (const auto& segment : found) {
+        segments.push_back(segment.second);
+        next_segment = segment.first + 1;
+    }
+    memset(&block, 0, sizeof(block));
+}
+
+AuditLog::~AuditLog() {
+    if (index_fd != -1) {
+        close_block();
+        close(index_fd);
+    }
+}
+
+// Registers a new segment and returns its path
+string AuditLog::add_segment() {
+    char name[64];
+    snprintf(name, sizeof(name), "audit-%020llu.seg", (unsigned long long)next_segment++);
+    string path = dir + "/" + name;
+
+    lock_guard<mutex> lock(segments_mutex);
+    segments.push_back(path);
+    return path;
+}
+
+string AuditLog::first_file() {
+    return add_segment();
+}
+
+string AuditLog::next_file() {
+    return add_segment();
+}
+
+/**
+ * Starts indexing a newly opened segment
+ *
+ * The previous segment's last, partial block is indexed first.
+ */
+void AuditLog::file_opened(const string& path, uint64_t size) {
+    if (index_fd != -1) {
+        close_block();
+        close(index_fd);
+    }
+
+    index_fd = open(index_path(path).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (index_fd == -1) {
+        // Queries still work, they just read the whole segment
+        LOG_ERROR_LIMITED("Error creating audit index for " << path << " " << strerror(errno));
+    }
+
+    memset(&block, 0, sizeof(block));
+    block.offset = size;
+}
+
+/**
+ * Adds the records of one written entry to the current block
+ */
+void AuditLog::entry_written(const string& entry, uint64_t offset) {
+    if (block.count == 0) block.offset = offset;
+
+    AuditRecord rec;
+    size_t pos = 0;
+    while (size_t len = AuditRecord::parse(entry.data() + pos, entry.size() - pos, rec)) {
+        if (block.count == 0) {
+            block.min_ts = block.max_ts = rec.timestamp_us;
+            block.min_user = block.max_user = rec.user_id;
+        } else {
+            block.min_ts = min(block.min_ts, rec.timestamp_us);
+            block.max_ts = max(block.max_ts, rec.timestamp_us);
+            block.min_user = min(block.min_user, rec.user_id);
+            block.max_user = max(block.max_user, rec.user_id);
+        }
+        unsigned a, b;
+        user_bits(rec.user_id, a, b);
+        block.users[a / 64] |= 1ull << (a % 64);
+        block.users[b / 64] |= 1ull << (b % 64);
+        block.count++;
+        pos += len;
+    }
+    block.length = offset + entry.size() - block.offset;
+
+    // Blocks end on entry boundaries so no record is split between two
+    if (block.count >= INDEX_BLOCK) close_block();
+}
+
+// Appends the current block to the index (writer thread only)
+void AuditLog::close_block() {
+    if (block.count > 0 && index_fd != -1) {
+        if (write(index_fd, &block, sizeof(block)) != sizeof(block)) {
+            LOG_ERROR_LIMITED("Error writing audit index " << strerror(errno));
+        }
+    }
+    uint64_t next = block.offset + block.length;
+    memset(&block, 0, sizeof(block));
+    block.offset = next;
+}
+
+/**
+ * Picks the parts of the log a query has to read
+ *
+ * @param user_id User to match, or -1 for every user
+ * @param from_us Earliest timestamp to match
+ * @param to_us Latest timestamp to match
+ * @return Ranges to scan, adjacent ones merged
+ */
+vector<AuditLog::Range> AuditLog::plan(int64_t user_id, int64_t from_us, int64_t to_us) const {
+    vector<string> paths;
+    {
+        lock_guard<mutex> lock(segments_mutex);
+        paths = segments;
+    }
+
+    vector<Range> ranges;
+    auto add = [&ranges](const string& path, uint64_t offset, uint64_t length) {
+        if (length == 0) return;
+        if (!ranges.empty() && ranges.back().path == path &&
+            ranges.back().offset + ranges.back().length == offset) {
+            ranges.back().length += length;
+        } else {
+            ranges.push_back(Range{path, offset, length});
+        }
+    };
+
+    unsigned bit_a, bit_b;
+    user_bits(user_id, bit_a, bit_b);
+    for (const string& path : paths) {
+        struct stat st;
+        if (stat(path.c_str(), &st) == -1) continue;
+        uint64_t size = st.st_size;
+
+        // Entries are appended whole; a partial one at the end is ignored
+        vector<IndexEntry> entries;
+        int in = open(index_path(path).c_str(), O_RDONLY | O_CLOEXEC);
+        if (in != -1) {
+            struct stat ist;
+            if (fstat(in, &ist) == 0) {
+                entries.resize(ist.st_size / sizeof(IndexEntry));
+                ssize_t want = entries.size() * sizeof(IndexEntry);
+                if (pread(in, entries.data(), want, 0) != want) entries.clear();
+            }
+            close(in);
+        }
+
+        uint64_t indexed = 0;
+        for (const IndexEntry& e : entries) {
+            if (e.offset + e.length > size) break;
+            indexed = e.offset + e.length;
+
+            if (e.max_ts < from_us || e.min_ts > to_us) continue;
+            if (user_id != -1 && (user_id < e.min_user || user_id > e.max_user ||
+                                  !has_bit(e.users, bit_a) || !has_bit(e.users, bit_b))) continue;
+            add(path, e.offset, e.length);
+        }
+
+        // Not indexed yet (or the index was lost): read it all
+        add(path, indexed, size - indexed);
+    }
+    return ranges;
+}
+
+AuditQuery::AuditQuery(const AuditLog& log, int64_t user_id, int64_t from_us, int64_t to_us)
+    : user_id(user_id), from_us(from_us), to_us(to_us), ranges(log.plan(user_id, from_us, to_us)),
+      next_range(0), fd(-1), position(0), end(0), parsed(0), match_count(0) {}
+
+AuditQuery::~AuditQuery() {
+    if (fd != -1) close(fd);
+}
+
+// Moves on to the next planned range; false when there is none
+bool AuditQuery::open_range() {
+    while (next_range < ranges.size()) {
+        const AuditLog::Range& range = ranges[next_range++];
+        if (fd != -1) close(fd);
+        fd = open(range.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            LOG_ERROR_LIMITED("Error opening audit segment " << range.path << " " << strerror(errno));
+            continue;
+        }
+        position = range.offset;
+        end = range.offset + range.length;
+        buffer.clear();
+        parsed = 0;
+        return true;
+    }
+    return false;
+}
+
+// Reads more of the current range behind the unparsed bytes
+bool AuditQuery::refill() {
+    if (position >= end) return false;
+
+    buffer.erase(0, parsed);
+    parsed = 0;
+
+    size_t want = end - position < QUERY_READ_SIZE ? end - position : QUERY_READ_SIZE;
+    size_t old = buffer.size();
+    buffer.resize(old + want);
+    ssize_t n = pread(fd, &buffer[old], want, position);
+    if (n <= 0) {
+        buffer.resize(old);
+        position = end;
+        return false;
+    }
+    buffer.resize(old + n);
+    position += n;
+    return true;
+}
+
+/**
+ * Collects the next matching records
+ *
+ * @param out Replaced with whole encoded records, about CHUNK_SIZE bytes
+ * @return false when the query has no more results (out is then empty)
+ */
+bool AuditQuery::next_chunk(string& out) {
+    out.clear();
+    if (fd == -1 && !open_range()) return false;
+
+    AuditRecord rec;
+    while (out.size() < CHUNK_SIZE) {
+        size_t len = AuditRecord::parse(buffer.data() + parsed, buffer.size() - parsed, rec);
+        if (len == 0) {
+            // Either the record continues past the buffer or the rest of the
+            // range is torn; only more data can tell
+            if (refill()) continue;
+            if (!open_range()) break;
+            continue;
+        }
+
+        if (rec.timestamp_us >= from_us && rec.timestamp_us <= to_us &&
+            (user_id == -1 || rec.user_id == user_id)) {
+            out.append(buffer, parsed, len);
+            match_count++;
+        }
+        parsed += len;
+    }
+    return !out.empty();
+}
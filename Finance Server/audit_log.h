@@ -0,0 +1,119 @@
+#ifndef _AUDIT_LOG_H_
+#define _AUDIT_LOG_H_
+
+#include "common.h"
+#include "log_writer.h"
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+
+/*
+ * AuditLog class
+ *
+ * Binary audit log kept as a series of segment files (audit-<n>.seg) in a
+ * directory, each with a sparse index (audit-<n>.idx). The AuditLog is the
+ * LogObserver of the LogWriter that writes the AuditRecords, so segments
+ * are indexed as they are written, on the writer thread.
+ *
+ * Every INDEX_BLOCK records the index gets one entry holding the block's
+ * position, its time and user_id ranges and a 512-bit bloom filter of its
+ * user IDs. plan() uses the index to find the blocks a query has to read;
+ * records written after the last index entry of a segment (the block being
+ * filled, or everything after a crash) are always read.
+ */
+class AuditLog : public LogObserver {
+public:
+    struct Range {
+        std::string path;
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    AuditLog(const std::string& dir);
+    ~AuditLog();
+
+    AuditLog(const AuditLog&) = delete;
+    AuditLog& operator=(const AuditLog&) = delete;
+
+    // Segment the LogWriter should start in
+    std::string first_file();
+
+    // LogObserver
+    void file_opened(const std::string& path, uint64_t size) override;
+    void entry_written(const std::string& entry, uint64_t offset) override;
+    std::string next_file() override;
+
+    // Parts of the segments that may hold records of user_id (-1: anyone)
+    // with timestamps in [from_us, to_us], in log order
+    std::vector<Range> plan(int64_t user_id, int64_t from_us, int64_t to_us) const;
+
+private:
+    struct IndexEntry {
+        uint64_t offset;
+        uint64_t length;
+        uint64_t count;
+        int64_t min_ts;
+        int64_t max_ts;
+        int64_t min_user;
+        int64_t max_user;
+        uint64_t reserved;
+        uint64_t users[8];  // Bloom filter of the block's user IDs
+    };
+
+    std::string add_segment();
+    void close_block();
+
+    std::string dir;
+
+    mutable std::mutex segments_mutex;
+    std::vector<std::string> segments;
+    uint64_t next_segment;
+
+    // Block being filled in the current segment (writer thread only)
+    int index_fd;
+    IndexEntry block;
+};
+
+/*
+ * AuditQuery class
+ *
+ * Reads the ranges an AuditLog planned for a query and returns the matching
+ * records, still encoded, in pieces of about CHUNK_SIZE bytes so a result
+ * of any size can be streamed with bounded memory.
+ */
+class AuditQuery {
+public:
+    AuditQuery(const AuditLog& log, int64_t user_id, int64_t from_us, int64_t to_us);
+    ~AuditQuery();
+
+    AuditQuery(const AuditQuery&) = delete;
+    AuditQuery& operator=(const AuditQuery&) = delete;
+
+    // Replaces out with the next matching records; false once there are none
+    bool next_chunk(std::string& out);
+
+    uint64_t matched() const { return match_count; }
+
+private:
+    bool open_range();
+    bool refill();
+
+    int64_t user_id;
+    int64_t from_us;
+    int64_t to_us;
+
+    std::vector<AuditLog::Range> ranges;
+    size_t next_range;
+
+    // Bytes of the current range read so far but not parsed yet
+    int fd;
+    uint64_t position;
+    uint64_t end;
+    std::string buffer;
+    size_t parsed;
+
+    uint64_t match_count;
+};
+
+#endif
@@ -0,0 +1,125 @@
+#include "audit_sender.h"
+
+using namespace std;
+
+// Largest BATCH sent at once; anything beyond waits for the next one
+static const size_t MAX_AUDIT_BATCH = 256;
+
+// How long the sender lets records accumulate after the first one arrives
+static const chrono::microseconds AUDIT_LINGER(500);
+
+/**
+ * Starts the background sender
+ *
+ * @param channel Connection to the logging server, used only through this object from now on
+ * @param delivery Whether batches are acknowledged by the server
+ */
+AuditSender::AuditSender(NetworkRequestChannel* channel, Delivery delivery)
+    : channel(channel), delivery(delivery), sending(false), waiting(false), stop(false), flushers(0), failures(0) {
+    sender = thread([this] { sender_loop(); });
+}
+
+/**
+ * Sends whatever is still queued and stops the sender
+ */
+AuditSender::~AuditSender() {
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        stop = true;
+    }
+    work.notify_one();
+    sender.join();
+}
+
+void AuditSender::record(const Request& audit) {
+    bool wake;
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        queue.push_back(audit);
+        wake = waiting && (queue.size() == 1 || queue.size() >= MAX_AUDIT_BATCH);
+    }
+    // The sender only needs a wakeup to start lingering or to cut it short
+    if (wake) work.notify_one();
+}
+
+/**
+ * Sends a request and waits for its response, keeping audit order
+ *
+ * @param req The Request object to send
+ * @return Response from the logging server
+ */
+Response AuditSender::call(const Request& req) {
+    flush();
+    lock_guard<mutex> lock(channel_mutex);
+    return channel->send_request(req);
+}
+
+void AuditSender::flush() {
+    unique_lock<mutex> lock(queue_mutex);
+    flushers++;
+    if (waiting) work.notify_one();
+    idle.wait(lock, [this] { return queue.empty() && !sending; });
+    flushers--;
+}
+
+uint64_t AuditSender::take_failures() {
+    return failures.exchange(0);
+}
+
+// Sends one batch; a single record goes out as itself (sender thread only)
+void AuditSender::send_batch(vector<Request>& batch) {
+    lock_guard<mutex> lock(channel_mutex);
+
+    if (delivery == BEST_EFFORT) {
+        bool sent = batch.size() == 1
+            ? channel->send_one_way(batch[0])
+            : channel->send_one_way(Request(BATCH, 0, batch.size(), "", Request::serializeBatch(batch)));
+        if (!sent) failures += batch.size();
+        return;
+    }
+
+    if (batch.size() == 1) {
+        if (!channel->send_request(batch[0]).success) failures++;
+        return;
+    }
+    for (const Response& resp : channel->send_batch(batch)) {
+        if (!resp.success) failures++;
+    }
+}
+
+/**
+ * Sends everything recorded while the previous batch was in flight (or
+ * during a short linger), so bursts of records share a message
+ */
+void AuditSender::sender_loop() {
+    vector<Request> batch;
+    unique_lock<mutex> lock(queue_mutex);
+
+    while (true) {
+        waiting = true;
+        work.wait(lock, [this] { return stop || !queue.empty(); });
+        if (queue.empty()) {
+            waiting = false;
+            break;
+        }
+        work.wait_for(lock, AUDIT_LINGER, [this] { return stop || flushers > 0 || queue.size() >= MAX_AUDIT_BATCH; });
+        waiting = false;
+
+        if (queue.size() <= MAX_AUDIT_BATCH) {
+            batch.swap(queue);
+        } else {
+            batch.assign(queue.begin(), queue.begin() + MAX_AUDIT_BATCH);
+            queue.erase(queue.begin(), queue.begin() + MAX_AUDIT_BATCH);
+        }
+        sending = true;
+        lock.unlock();
+
+        send_batch(batch);
+        batch.clear();
+
+        lock.lock();
+        sending = false;
+        if (queue.empty()) idle.notify_all();
+    }
+    idle.notify_all();
+}
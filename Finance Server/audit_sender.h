@@ -0,0 +1,77 @@
+#ifndef _AUDIT_SENDER_H_
+#define _AUDIT_SENDER_H_
+
+#include "common.h"
+#include "network_channel.h"
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/*
+ * AuditSender class
+ *
+ * Takes audit logging off the client's critical path. record() only queues
+ * the audit request; a background thread sends everything queued since its
+ * last send (waiting up to a short linger for more) to the logging server
+ * in one BATCH, so a burst of operations costs one message.
+ *
+ * Delivery modes:
+ *   BEST_EFFORT   batches go out as one-way requests and are never answered;
+ *                 only a failed send is noticed
+ *   ACKNOWLEDGED  each batch waits for the server's per-record results
+ *                 before the next one is sent
+ *
+ * Records that could not be delivered are counted; take_failures() lets the
+ * client warn about them outside the critical path.
+ */
+class AuditSender {
+public:
+    enum Delivery {BEST_EFFORT, ACKNOWLEDGED};
+
+    AuditSender(NetworkRequestChannel* channel, Delivery delivery);
+    ~AuditSender();
+
+    AuditSender(const AuditSender&) = delete;
+    AuditSender& operator=(const AuditSender&) = delete;
+
+    // Queues an audit record without waiting for the network
+    void record(const Request& audit);
+
+    // Sends a request that needs an answer (e.g. LOGIN) after every record
+    // queued before it
+    Response call(const Request& req);
+
+    // Blocks until every queued record has been sent
+    void flush();
+
+    // Number of records lost since the last call
+    uint64_t take_failures();
+
+private:
+    void send_batch(std::vector<Request>& batch);
+    void sender_loop();
+
+    NetworkRequestChannel* channel;
+    Delivery delivery;
+
+    std::mutex queue_mutex;
+    std::condition_variable work;
+    std::condition_variable idle;
+    std::vector<Request> queue;
+    bool sending;
+    bool waiting;   // The sender is asleep or lingering and wants a wakeup
+    bool stop;
+    int flushers;   // Threads in flush(), which cut the linger short
+
+    // Held while the channel is in use, by the sender or by call()
+    std::mutex channel_mutex;
+
+    std::atomic<uint64_t> failures;
+    std::thread sender;
+};
+
+#endif
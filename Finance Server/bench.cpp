@@ -0,0 +1,524 @@
+#include "bench.h"
+#include "channel_pool.h"
+#include "async_client.h"
+#include "signals.h"
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace std;
+
+// Exact counts below 2^SUB_BUCKET_BITS, then 2^(SUB_BUCKET_BITS-1) buckets per power of two
+static const int SUB_BUCKET_BITS = 7;
+static const uint64_t SUB_BUCKETS = 1ull << SUB_BUCKET_BITS;
+static const uint64_t HALF_BUCKETS = SUB_BUCKETS / 2;
+static const size_t BUCKET_COUNT = SUB_BUCKETS + (64 - SUB_BUCKET_BITS) * HALF_BUCKETS;
+
+// Benchmark accounts start here so they stay clear of real users
+static const int64_t BENCH_FIRST_USER = 900000000;
+
+// Balance every benchmark account starts with, so withdrawals keep succeeding
+static const double BENCH_SEED_BALANCE = 1e9;
+
+static const char* BENCH_SEED_FILE = "bench-seed.bin";
+
+static const char* const OP_NAMES[BENCH_OP_COUNT] = {
+    "deposit", "withdraw", "balance", "upload", "download", "interest"
+};
+
+LatencyHistogram::LatencyHistogram() : counts(BUCKET_COUNT, 0), total(0), max_value(0), sum(0) {}
+
+size_t LatencyHistogram::bucket(uint64_t ns) {
+    if (ns < SUB_BUCKETS) return ns;
+    // Shift that brings ns into [HALF_BUCKETS, SUB_BUCKETS)
+    int shift = 63 - __builtin_clzll(ns) - (SUB_BUCKET_BITS - 1);
+    return SUB_BUCKETS + (shift - 1) * HALF_BUCKETS + ((ns >> shift) - HALF_BUCKETS);
+}
+
+// Middle of the range of values a bucket counts
+uint64_t LatencyHistogram::bucket_value(size_t index) {
+    if (index < SUB_BUCKETS) return index;
+    size_t k = index - SUB_BUCKETS;
+    int shift = k / HALF_BUCKETS + 1;
+    uint64_t low = (k % HALF_BUCKETS + HALF_BUCKETS) << shift;
+    return low + (1ull << shift) / 2;
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+    counts[bucket(ns)]++;
+    total++;
+    sum += ns;
+    if (ns > max_value) max_value = ns;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+    for (size_t i = 0; i < counts.size(); i++) {
+        counts[i] += other.counts[i];
+    }
+    total += other.total;
+    sum += other.sum;
+    if (other.max_value > max_value) max_value = other.max_value;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const {
+    if (total == 0) return 0;
+    uint64_t rank = static_cast<uint64_t>(p * total + 0.5);
+    if (rank < 1) rank = 1;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_value(i);
+            return value < max_value ? value : max_value;
+        }
+    }
+    return max_value;
+}
+
+BenchConfig::BenchConfig()
+    : finance_host("localhost"), finance_port(8000), file_host("localhost"), file_port(8001), format(BINARY_FORMAT),
+      threads(4), connections(0), duration_s(10), rate(0), in_flight(0), users(1000), file_size(64 * 1024) {
+    unsigned defaults[BENCH_OP_COUNT] = {30, 20, 40, 4, 5, 1};
+    memcpy(weights, defaults, sizeof(weights));
+}
+
+bool parse_bench_mix(const string& spec, unsigned weights[BENCH_OP_COUNT]) {
+    unsigned parsed[BENCH_OP_COUNT] = {0};
+    unsigned total = 0;
+
+    stringstream ss(spec);
+    string item;
+    while (getline(ss, item, ',')) {
+        size_t colon = item.find(':');
+        if (colon == string::npos || colon + 1 == item.size()) return false;
+
+        string name = item.substr(0, colon);
+        char* end;
+        unsigned long weight = strtoul(item.c_str() + colon + 1, &end, 10);
+        if (*end != '\0') return false;
+
+        int op = 0;
+        while (op < BENCH_OP_COUNT && name != OP_NAMES[op]) op++;
+        if (op == BENCH_OP_COUNT) return false;
+        parsed[op] = weight;
+        total += weight;
+    }
+    if (total == 0) return false;
+
+    memcpy(weights, parsed, sizeof(parsed));
+    return true;
+}
+
+// Per-thread results, one histogram per operation
+struct BenchResult {
+    LatencyHistogram latency[BENCH_OP_COUNT];
+    uint64_t errors[BENCH_OP_COUNT];
+    uint64_t late;     // Open-loop sends that started behind schedule
+
+    BenchResult() : late(0) {
+        memset(errors, 0, sizeof(errors));
+    }
+};
+
+static bool write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// A file of size bytes, positioned at its start, that is gone once closed; -1 on failure
+static int make_payload(size_t size) {
+    char path[] = "/tmp/bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        cerr << "Error creating benchmark payload " << strerror(errno) << endl;
+        return -1;
+    }
+    unlink(path);
+
+    string block(CHUNK_SIZE, '\0');
+    mt19937_64 rng(size);
+    for (char& c : block) c = static_cast<char>(rng());
+
+    size_t written = 0;
+    while (written < size) {
+        size_t n = size - written < block.size() ? size - written : block.size();
+        if (!write_all(fd, block.data(), n)) {
+            cerr << "Error writing benchmark payload " << strerror(errno) << endl;
+            close(fd);
+            return -1;
+        }
+        written += n;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+// Runs one operation; true if the server reported success
+static bool run_op(BenchOp op, int64_t user, ChannelPool* finance, ChannelPool* file, int payload_fd,
+                   const string& upload_name) {
+    switch (op) {
+        case BENCH_DEPOSIT:
+            return finance->send_request(Request(DEPOSIT, user, 10)).success;
+        case BENCH_WITHDRAW:
+            return finance->send_request(Request(WITHDRAW, user, 5)).success;
+        case BENCH_BALANCE:
+            return finance->send_request(Request(BALANCE, user)).success;
+        case BENCH_INTEREST:
+            return finance->send_request(Request(EARN_INTEREST, user, 1)).success;
+        case BENCH_UPLOAD: {
+            ChannelPool::Lease lease = file->acquire();
+            if (!lease) return false;
+            lseek(payload_fd, 0, SEEK_SET);
+            return lease->send_request_stream(Request(UPLOAD_FILE, user, 0, upload_name), payload_fd).success;
+        }
+        case BENCH_DOWNLOAD: {
+            ChannelPool::Lease lease = file->acquire();
+            if (!lease) return false;
+            Response resp = lease->send_request_stream(Request(DOWNLOAD_FILE, user, 0, BENCH_SEED_FILE), -1);
+            return lease->receive_payload(resp, -1) && resp.success;
+        }
+        default:
+            return false;
+    }
+}
+
+// The request an operation sends through the AsyncClient; uploads carry payload inline
+static Request async_request(BenchOp op, int64_t user, const string& payload, const string& upload_name) {
+    switch (op) {
+        case BENCH_DEPOSIT:
+            return Request(DEPOSIT, user, 10);
+        case BENCH_WITHDRAW:
+            return Request(WITHDRAW, user, 5);
+        case BENCH_BALANCE:
+            return Request(BALANCE, user);
+        case BENCH_INTEREST:
+            return Request(EARN_INTEREST, user, 1);
+        case BENCH_UPLOAD:
+            return Request(UPLOAD_FILE, user, 0, upload_name, payload);
+        default:
+            return Request(DOWNLOAD_FILE, user, 0, BENCH_SEED_FILE);
+    }
+}
+
+// Connections of the AsyncClient to the servers the mix needs
+struct AsyncServers {
+    AsyncClient client;
+    vector<int> finance;
+    vector<int> file;
+};
+
+/**
+ * Like bench_thread, but keeps up to config.in_flight requests outstanding
+ *
+ * Responses are recorded by their callbacks on the AsyncClient's I/O
+ * thread; the thread only waits for a free slot before each send and for
+ * the last responses at the end.
+ */
+static void async_bench_thread(const BenchConfig& config, int index, AsyncServers* servers,
+                               chrono::steady_clock::time_point start, chrono::steady_clock::time_point end,
+                               BenchResult& result) {
+    mt19937 rng(index + 1);
+    unsigned total_weight = 0;
+    for (int op = 0; op < BENCH_OP_COUNT; op++) total_weight += config.weights[op];
+
+    string payload;
+    if (config.weights[BENCH_UPLOAD] > 0) {
+        payload.resize(config.file_size);
+        mt19937_64 bytes(config.file_size);
+        for (char& c : payload) c = static_cast<char>(bytes());
+    }
+    string upload_name = "bench-upload-" + to_string(index) + ".bin";
+
+    mutex m;
+    condition_variable slot_free;
+    int outstanding = 0;
+    auto wait_below = [&](int limit) {
+        unique_lock<mutex> lock(m);
+        slot_free.wait(lock, [&] { return outstanding < limit; });
+    };
+
+    chrono::nanoseconds interval(0);
+    auto due = start;
+    if (config.rate > 0) {
+        interval = chrono::nanoseconds(static_cast<int64_t>(1e9 * config.threads / config.rate));
+        due += interval * index / config.threads;
+    }
+
+    size_t sent = index;
+    while (!SignalHandling::shutdown_requested) {
+        auto now = chrono::steady_clock::now();
+        if (config.rate > 0) {
+            if (due >= end) break;
+            if (due > now) {
+                this_thread::sleep_until(due);
+            } else if (now - due > interval) {
+                result.late++;
+            }
+        } else {
+            if (now >= end) break;
+        }
+        wait_below(config.in_flight);
+        if (config.rate == 0) due = chrono::steady_clock::now();
+
+        unsigned pick = rng() % total_weight;
+        int op = 0;
+        while (pick >= config.weights[op]) pick -= config.weights[op++];
+        int64_t user = BENCH_FIRST_USER + rng() % config.users;
+
+        bool file_op = op == BENCH_UPLOAD || op == BENCH_DOWNLOAD;
+        const vector<int>& handles = file_op ? servers->file : servers->finance;
+        int server = handles[sent++ % handles.size()];
+
+        {
+            lock_guard<mutex> lock(m);
+            outstanding++;
+        }
+        servers->client.async_send(server, async_request(static_cast<BenchOp>(op), user, payload, upload_name),
+                                   [&, op, due](Response& resp) {
+            auto done = chrono::steady_clock::now();
+            lock_guard<mutex> lock(m);
+            result.latency[op].record(chrono::duration_cast<chrono::nanoseconds>(done - due).count());
+            if (!resp.success) result.errors[op]++;
+            outstanding--;
+            slot_free.notify_one();
+        });
+        due += interval;
+    }
+
+    wait_below(1);
+}
+
+static void bench_thread(const BenchConfig& config, int index, ChannelPool* finance, ChannelPool* file,
+                         chrono::steady_clock::time_point start, chrono::steady_clock::time_point end,
+                         BenchResult& result) {
+    mt19937 rng(index + 1);
+    unsigned total_weight = 0;
+    for (int op = 0; op < BENCH_OP_COUNT; op++) total_weight += config.weights[op];
+
+    int payload_fd = -1;
+    if (config.weights[BENCH_UPLOAD] > 0) {
+        payload_fd = make_payload(config.file_size);
+        if (payload_fd == -1) return;
+    }
+    string upload_name = "bench-upload-" + to_string(index) + ".bin";
+
+    // Open-loop threads are staggered so their sends interleave evenly
+    chrono::nanoseconds interval(0);
+    auto due = start;
+    if (config.rate > 0) {
+        interval = chrono::nanoseconds(static_cast<int64_t>(1e9 * config.threads / config.rate));
+        due += interval * index / config.threads;
+    }
+
+    while (!SignalHandling::shutdown_requested) {
+        auto now = chrono::steady_clock::now();
+        if (config.rate > 0) {
+            if (due >= end) break;
+            if (due > now) {
+                this_thread::sleep_until(due);
+            } else if (now - due > interval) {
+                result.late++;
+            }
+        } else {
+            if (now >= end) break;
+            due = now;
+        }
+
+        unsigned pick = rng() % total_weight;
+        int op = 0;
+        while (pick >= config.weights[op]) pick -= config.weights[op++];
+        int64_t user = BENCH_FIRST_USER + rng() % config.users;
+
+        bool ok = run_op(static_cast<BenchOp>(op), user, finance, file, payload_fd, upload_name);
+        auto done = chrono::steady_clock::now();
+
+        result.latency[op].record(chrono::duration_cast<chrono::nanoseconds>(done - due).count());
+        if (!ok) result.errors[op]++;
+        due += interval;
+    }
+
+    if (payload_fd != -1) close(payload_fd);
+}
+
+// Gives every benchmark account a balance and the file server the file to download
+static bool seed(const BenchConfig& config, ChannelPool* finance, ChannelPool* file) {
+    if (finance) {
+        ChannelPool::Lease lease = finance->acquire();
+        if (!lease) return false;
+
+        vector<Request> deposits;
+        for (int i = 0; i < config.users; i++) {
+            deposits.push_back(Request(DEPOSIT, BENCH_FIRST_USER + i, BENCH_SEED_BALANCE));
+            if (deposits.size() == 256 || i + 1 == config.users) {
+                for (const Response& resp : lease->send_batch(deposits)) {
+                    if (!resp.success) {
+                        cerr << "Error seeding benchmark accounts: " << resp.message << endl;
+                        return false;
+                    }
+                }
+                deposits.clear();
+            }
+        }
+    }
+
+    if (file && config.weights[BENCH_DOWNLOAD] > 0) {
+        int fd = make_payload(config.file_size);
+        if (fd == -1) return false;
+        Response resp;
+        {
+            ChannelPool::Lease lease = file->acquire();
+            resp = lease ? lease->send_request_stream(Request(UPLOAD_FILE, BENCH_FIRST_USER, 0, BENCH_SEED_FILE), fd)
+                         : Response(false, 0, "", "No connection available");
+        }
+        close(fd);
+        if (!resp.success) {
+            cerr << "Error uploading benchmark file: " << resp.message << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static void print_row(const string& name, const LatencyHistogram& h, uint64_t errors, double seconds) {
+    auto us = [](uint64_t ns) { return ns / 1000.0; };
+    cout << left << setw(10) << name << right
+         << setw(10) << h.count()
+         << setw(8) << errors
+         << fixed << setprecision(1)
+         << setw(11) << h.count() / seconds
+         << setw(10) << us(h.mean())
+         << setw(10) << us(h.percentile(0.50))
+         << setw(10) << us(h.percentile(0.99))
+         << setw(10) << us(h.percentile(0.999))
+         << setw(10) << us(h.max())
+         << endl;
+}
+
+/**
+ * Runs the configured mix against the finance and file servers
+ *
+ * @param config Servers, concurrency, rate, duration and operation mix
+ * @return 0 if every request succeeded, 1 if some failed or the servers could not be reached
+ *
+ * Only the servers the mix needs are connected. Benchmark accounts are
+ * seeded before the clock starts; their balances are left behind.
+ */
+int run_bench(const BenchConfig& config) {
+    bool needs_finance = config.weights[BENCH_DEPOSIT] || config.weights[BENCH_WITHDRAW] ||
+                         config.weights[BENCH_BALANCE] || config.weights[BENCH_INTEREST];
+    bool needs_file = config.weights[BENCH_UPLOAD] || config.weights[BENCH_DOWNLOAD];
+    int connections = config.connections > 0 ? config.connections : config.threads;
+
+    unique_ptr<ChannelPool> finance, file;
+    try {
+        if (needs_finance) {
+            finance.reset(new ChannelPool(config.finance_host, config.finance_port, connections,
+                                          ChannelPool::EXCLUSIVE, config.format));
+        }
+        if (needs_file) {
+            file.reset(new ChannelPool(config.file_host, config.file_port, connections,
+                                       ChannelPool::EXCLUSIVE, config.format));
+        }
+    } catch (const char* e) {
+        cerr << "Benchmark could not connect: " << e << endl;
+        return 1;
+    }
+
+    if (!seed(config, finance.get(), file.get())) {
+        return 1;
+    }
+
+    unique_ptr<AsyncServers> async;
+    if (config.in_flight > 0) {
+        try {
+            async.reset(new AsyncServers());
+            for (int i = 0; i < connections; i++) {
+                if (needs_finance) {
+                    async->finance.push_back(async->client.connect(config.finance_host, config.finance_port,
+                                                                   config.format));
+                }
+                if (needs_file) {
+                    async->file.push_back(async->client.connect(config.file_host, config.file_port, config.format));
+                }
+            }
+        } catch (const char* e) {
+            cerr << "Benchmark could not connect: " << e << endl;
+            return 1;
+        }
+    }
+
+    cout << "\nBenchmark: " << config.threads << " threads, " << connections << " connections per server, ";
+    if (async) {
+        cout << config.in_flight << " requests in flight per thread, ";
+    }
+    if (config.rate > 0) {
+        cout << "open loop at " << config.rate << " req/s, ";
+    } else {
+        cout << "closed loop, ";
+    }
+    cout << config.duration_s << " s" << endl;
+
+    vector<BenchResult> results(config.threads);
+    vector<thread> threads;
+    auto start = chrono::steady_clock::now();
+    auto end = start + chrono::nanoseconds(static_cast<int64_t>(config.duration_s * 1e9));
+    for (int i = 0; i < config.threads; i++) {
+        if (async) {
+            threads.emplace_back(async_bench_thread, cref(config), i, async.get(), start, end, ref(results[i]));
+        } else {
+            threads.emplace_back(bench_thread, cref(config), i, finance.get(), file.get(), start, end,
+                                 ref(results[i]));
+        }
+    }
+    for (thread& t : threads) {
+        t.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    BenchResult merged;
+    LatencyHistogram all;
+    uint64_t errors = 0;
+    for (const BenchResult& r : results) {
+        for (int op = 0; op < BENCH_OP_COUNT; op++) {
+            merged.latency[op].merge(r.latency[op]);
+            merged.errors[op] += r.errors[op];
+        }
+        merged.late += r.late;
+    }
+
+    cout << left << setw(10) << "operation" << right << setw(10) << "count" << setw(8) << "errors"
+         << setw(11) << "req/s" << setw(10) << "mean us" << setw(10) << "p50 us" << setw(10) << "p99 us"
+         << setw(10) << "p999 us" << setw(10) << "max us" << endl;
+    for (int op = 0; op < BENCH_OP_COUNT; op++) {
+        if (merged.latency[op].count() == 0) continue;
+        print_row(OP_NAMES[op], merged.latency[op], merged.errors[op], seconds);
+        all.merge(merged.latency[op]);
+        errors += merged.errors[op];
+    }
+    print_row("total", all, errors, seconds);
+
+    if (merged.late > 0) {
+        cout << merged.late << " requests were sent more than one interval late; "
+             << "the servers cannot sustain the target rate" << endl;
+    }
+    return errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,84 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include "common.h"
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/*
+ * LatencyHistogram class
+ *
+ * HDR-style log-linear histogram of nanosecond latencies: values below 128
+ * are counted exactly, larger ones in buckets 1/64th of their power of two
+ * wide, so every recorded value (up to 2^63) is kept to within 1.6% at a
+ * fixed 30 KB of counters. Each thread records into its own histogram and
+ * the results are merged afterwards.
+ */
+class LatencyHistogram {
+public:
+    LatencyHistogram();
+
+    void record(uint64_t ns);
+    void merge(const LatencyHistogram& other);
+
+    uint64_t count() const { return total; }
+    uint64_t max() const { return max_value; }
+    double mean() const { return total ? static_cast<double>(sum) / total : 0; }
+
+    // Smallest recorded value that fraction p (0..1) of the values do not exceed
+    uint64_t percentile(double p) const;
+
+private:
+    static size_t bucket(uint64_t ns);
+    static uint64_t bucket_value(size_t index);
+
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t max_value;
+    uint64_t sum;
+};
+
+// Operations the benchmark mixes
+enum BenchOp {BENCH_DEPOSIT, BENCH_WITHDRAW, BENCH_BALANCE, BENCH_UPLOAD, BENCH_DOWNLOAD, BENCH_INTEREST,
+              BENCH_OP_COUNT};
+
+/*
+ * Load generator settings
+ *
+ * With rate == 0 the benchmark is closed-loop: every thread sends its next
+ * request as soon as the previous one is answered. Otherwise it is
+ * open-loop: threads send at fixed intervals adding up to rate requests per
+ * second, and latency is measured from when a request was due, so time spent
+ * queued behind a slow response counts against the server.
+ *
+ * With in_flight > 0 every thread sends through one shared AsyncClient
+ * and keeps up to in_flight requests outstanding instead of one; uploads
+ * then go inline instead of streamed.
+ */
+struct BenchConfig {
+    std::string finance_host;
+    int finance_port;
+    std::string file_host;
+    int file_port;
+    WireFormat format;
+
+    int threads;
+    int connections;        // Per server, shared by the threads
+    double duration_s;
+    double rate;            // Requests per second over all threads, 0 for closed-loop
+    int in_flight;          // Requests outstanding per thread through the AsyncClient, 0 for blocking calls
+    int users;              // Accounts the operations are spread over
+    size_t file_size;       // Bytes per upload and download
+    unsigned weights[BENCH_OP_COUNT];
+
+    BenchConfig();
+};
+
+// Parses a mix such as "deposit:40,balance:60" into weights; false if malformed
+bool parse_bench_mix(const std::string& spec, unsigned weights[BENCH_OP_COUNT]);
+
+// Runs the benchmark and prints its report; returns the process exit status
+int run_bench(const BenchConfig& config);
+
+#endif
@@ -0,0 +1,367 @@
+#include "channel_pool.h"
+#include "logger.h"
+#include <chrono>
+#include <sys/socket.h>
+
+using namespace std;
+
+// Reconnect attempts start this far apart and back off up to the maximum
+static const chrono::milliseconds RECONNECT_MIN(50);
+static const chrono::milliseconds RECONNECT_MAX(2000);
+
+const int ChannelPool::POOL_WAIT_MS;
+
+// True if the server closed an idle connection (e.g. it restarted)
+static bool peer_closed(NetworkRequestChannel* channel) {
+    char c;
+    return recv(channel->get_socket_fd(), &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+ChannelPool::Lease::Lease(Lease&& other) : pool(other.pool), connection(other.connection) {
+    other.pool = nullptr;
+    other.connection = nullptr;
+}
+
+ChannelPool::Lease& ChannelPool::Lease::operator=(Lease&& other) {
+    if (this != &other) {
+        release();
+        pool = other.pool;
+        connection = other.connection;
+        other.pool = nullptr;
+        other.connection = nullptr;
+    }
+    return *this;
+}
+
+NetworkRequestChannel* ChannelPool::Lease::get() const {
+    return connection ? connection->channel : nullptr;
+}
+
+void ChannelPool::Lease::release() {
+    if (pool) {
+        pool->release(connection, true);
+        pool = nullptr;
+        connection = nullptr;
+    }
+}
+
+void ChannelPool::Lease::discard() {
+    if (pool) {
+        pool->release(connection, false);
+        pool = nullptr;
+        connection = nullptr;
+    }
+}
+
+/**
+ * Opens the pool's connections and starts the reconnector
+ *
+ * @param host Server address
+ * @param port Server port
+ * @param connections Number of connections to keep open
+ * @param mode EXCLUSIVE leases or MULTIPLEXED sharing
+ * @param format Wire format every connection tries to negotiate
+ *
+ * Connections that cannot be opened now are retried in the background.
+ *
+ * @throws Exits with error message if not a single connection could be opened
+ */
+ChannelPool::ChannelPool(const string& host, int port, size_t connections, Mode mode, WireFormat format)
+    : host(host), port(port), mode(mode), format(format), stop(false), next_connection(0) {
+    size_t opened = 0;
+    for (size_t i = 0; i < (connections > 0 ? connections : 1); i++) {
+        this->connections.emplace_back(new Connection());
+        Connection& c = *this->connections.back();
+        if (open(c)) {
+            start(c);
+            opened++;
+        } else {
+            dead.push_back(&c);
+        }
+    }
+
+    if (opened == 0) {
+        LOG_ERROR("Error connecting pool to " << host << ":" << port);
+        this->connections.clear();
+        throw("Error connecting pool");
+    }
+    reconnector = thread([this] { reconnect_loop(); });
+}
+
+/**
+ * Stops the reconnector and the readers and closes every connection
+ */
+ChannelPool::~ChannelPool() {
+    {
+        lock_guard<mutex> lock(pool_mutex);
+        stop = true;
+    }
+    broken.notify_all();
+    available.notify_all();
+    reconnector.join();
+
+    for (auto& c : connections) {
+        take_down(*c);
+    }
+}
+
+// Connects c unless it already is; false if the server is unreachable
+bool ChannelPool::open(Connection& c) {
+    try {
+        c.channel = new NetworkRequestChannel(host, port, NetworkRequestChannel::CLIENT_SIDE, format);
+    } catch (const char* e) {
+        c.channel = nullptr;
+        return false;
+    }
+    return true;
+}
+
+// Puts a freshly opened connection into service
+void ChannelPool::start(Connection& c) {
+    bool multiplexed = mode == MULTIPLEXED && c.channel->get_wire_format() == BINARY_FORMAT;
+    {
+        lock_guard<mutex> lock(pool_mutex);
+        c.alive = true;
+        c.leased = false;
+        c.up = true;
+        if (mode == EXCLUSIVE) idle.push_back(&c);
+    }
+    if (multiplexed) {
+        Connection* conn = &c;
+        c.reader = thread([this, conn] { reader_loop(conn); });
+    }
+    available.notify_all();
+}
+
+// Closes c's channel, waiting for its reader; c must be out of service
+void ChannelPool::take_down(Connection& c) {
+    if (c.reader.joinable()) {
+        // Wakes the reader out of its blocking receive
+        shutdown(c.channel->get_socket_fd(), SHUT_RDWR);
+        c.reader.join();
+    }
+    delete c.channel;
+    c.channel = nullptr;
+}
+
+// Hands c to the reconnector (pool_mutex held)
+void ChannelPool::mark_dead(Connection& c) {
+    if (!c.alive) return;
+    c.alive = false;
+    dead.push_back(&c);
+    broken.notify_one();
+}
+
+void ChannelPool::release(Connection* c, bool keep) {
+    keep = keep && c->channel->is_connected();
+    {
+        lock_guard<mutex> lock(pool_mutex);
+        c->leased = false;
+        if (!keep) {
+            mark_dead(*c);
+            return;
+        }
+        idle.push_back(c);
+    }
+    available.notify_one();
+}
+
+size_t ChannelPool::connected_count() {
+    lock_guard<mutex> lock(pool_mutex);
+    size_t count = 0;
+    for (const auto& c : connections) {
+        if (c->alive) count++;
+    }
+    return count;
+}
+
+// Waits until the pool may have a live connection to offer (pool_mutex held)
+bool ChannelPool::wait_available(unique_lock<mutex>& lock, int timeout_ms) {
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+    return available.wait_until(lock, deadline, [this] {
+        if (stop) return true;
+        if (mode == EXCLUSIVE) return !idle.empty();
+        for (const auto& c : connections) {
+            if (c->up) return true;
+        }
+        return false;
+    }) && !stop;
+}
+
+/**
+ * Leases a live connection
+ *
+ * @param timeout_ms Longest to wait while every connection is leased or down
+ * @return The Lease, empty on timeout or in MULTIPLEXED mode
+ */
+ChannelPool::Lease ChannelPool::acquire(int timeout_ms) {
+    if (mode != EXCLUSIVE) return Lease();
+
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeout_ms);
+    unique_lock<mutex> lock(pool_mutex);
+    while (true) {
+        int left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+        if (!wait_available(lock, left > 0 ? left : 0)) return Lease();
+
+        Connection* c = idle.back();
+        idle.pop_back();
+        if (peer_closed(c->channel)) {
+            mark_dead(*c);
+            continue;
+        }
+        c->leased = true;
+        return Lease(this, c);
+    }
+}
+
+/**
+ * Sends a request and waits for its response
+ *
+ * @param req The Request object to send
+ * @return Response from the server, or a failure if no connection was live
+ */
+Response ChannelPool::send_request(const Request& req) {
+    if (mode == MULTIPLEXED) {
+        return send_async(req).get();
+    }
+
+    Lease lease = acquire();
+    if (!lease) {
+        return Response(false, 0, "", "No connection available");
+    }
+    return lease->send_request(req);
+}
+
+/**
+ * Sends a request on the next live connection without waiting for the response
+ *
+ * @param req The Request object to send; its data goes inline
+ * @return Future for the response; it fails if the connection is lost first
+ *
+ * The promise is registered under the request ID before the request is
+ * sent, so the reader always knows where the response goes.
+ */
+future<Response> ChannelPool::send_async(const Request& req) {
+    promise<Response> result;
+    future<Response> response = result.get_future();
+
+    if (mode == EXCLUSIVE) {
+        result.set_value(send_request(req));
+        return response;
+    }
+
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(POOL_WAIT_MS);
+    while (true) {
+        size_t start = next_connection++;
+        for (size_t i = 0; i < connections.size(); i++) {
+            Connection& c = *connections[(start + i) % connections.size()];
+            if (!c.up) continue;
+
+            unique_lock<mutex> send_lock(c.send_mutex);
+            if (!c.up) continue;
+
+            if (!c.reader.joinable()) {
+                // Text connection: no request IDs to match, so one round trip at a time
+                result.set_value(c.channel->send_request(req));
+                if (!c.channel->is_connected()) {
+                    c.up = false;
+                    lock_guard<mutex> lock(pool_mutex);
+                    mark_dead(c);
+                }
+                return response;
+            }
+
+            uint32_t request_id = c.channel->reserve_request_id();
+            {
+                lock_guard<mutex> lock(c.pending_mutex);
+                c.pending.emplace(request_id, move(result));
+            }
+            if (!c.channel->send_tagged(req, request_id)) {
+                // The reader fails everything pending, this request included
+                shutdown(c.channel->get_socket_fd(), SHUT_RDWR);
+            }
+            return response;
+        }
+
+        // Nothing live right now: give the reconnector a chance
+        int left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+        unique_lock<mutex> lock(pool_mutex);
+        if (left <= 0 || !wait_available(lock, left)) break;
+    }
+
+    result.set_value(Response(false, 0, "", "No connection available"));
+    return response;
+}
+
+/**
+ * Hands every response on a multiplexed connection to its sender
+ *
+ * When the connection fails, senders are locked out first so none can
+ * register a request after the pending ones are failed.
+ */
+void ChannelPool::reader_loop(Connection* c) {
+    Response resp;
+    while (c->channel->receive_tagged(resp)) {
+        promise<Response> waiter;
+        {
+            lock_guard<mutex> lock(c->pending_mutex);
+            auto it = c->pending.find(resp.request_id);
+            if (it == c->pending.end()) {
+                LOG_ERROR_LIMITED("Response to unknown request " << resp.request_id << " from "
+                                  << c->channel->get_peer_address());
+                continue;
+            }
+            waiter = move(it->second);
+            c->pending.erase(it);
+        }
+        waiter.set_value(move(resp));
+    }
+
+    {
+        lock_guard<mutex> lock(c->send_mutex);
+        c->up = false;
+    }
+
+    unordered_map<uint32_t, promise<Response>> lost;
+    {
+        lock_guard<mutex> lock(c->pending_mutex);
+        lost.swap(c->pending);
+    }
+    for (auto& p : lost) {
+        p.second.set_value(Response(false, 0, "", "Connection lost"));
+    }
+
+    lock_guard<mutex> lock(pool_mutex);
+    mark_dead(*c);
+}
+
+/**
+ * Reopens dead connections, backing off while the server stays unreachable
+ */
+void ChannelPool::reconnect_loop() {
+    chrono::milliseconds backoff = RECONNECT_MIN;
+    unique_lock<mutex> lock(pool_mutex);
+
+    while (true) {
+        broken.wait(lock, [this] { return stop || !dead.empty(); });
+        if (stop) break;
+
+        Connection* c = dead.back();
+        dead.pop_back();
+        lock.unlock();
+
+        take_down(*c);
+        bool ok = open(*c);
+        if (ok) {
+            start(*c);
+            backoff = RECONNECT_MIN;
+        }
+
+        lock.lock();
+        if (!ok) {
+            dead.push_back(c);
+            broken.wait_for(lock, backoff, [this] { return stop; });
+            backoff = min(backoff * 2, RECONNECT_MAX);
+        }
+    }
+}
@@ -0,0 +1,146 @@
+#ifndef _CHANNEL_POOL_H_
+#define _CHANNEL_POOL_H_
+
+#include "common.h"
+#include "network_channel.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+
+/*
+ * ChannelPool class
+ *
+ * Keeps a fixed number of persistent connections to one server so several
+ * threads can use it at once. Connections that die are handed to a
+ * background thread that reconnects them with backoff, so callers only ever
+ * see live ones.
+ *
+ * Modes:
+ *   EXCLUSIVE    acquire() leases a whole connection to one thread, which may
+ *                use any NetworkRequestChannel method (streams, pipelining)
+ *                until the Lease is released
+ *   MULTIPLEXED  threads share the connections through send_request() and
+ *                send_async(); each connection carries requests from many
+ *                threads at once and a reader thread per connection hands
+ *                every response to its sender by request ID. A connection
+ *                that negotiated the text format cannot be multiplexed and
+ *                serves one request at a time instead.
+ */
+class ChannelPool {
+    struct Connection;
+
+public:
+    enum Mode {EXCLUSIVE, MULTIPLEXED};
+
+    /*
+     * Exclusive use of one pooled connection, returned to the pool when the
+     * Lease is destroyed or released. A connection found disconnected on
+     * return is reconnected before it is leased again.
+     */
+    class Lease {
+    public:
+        Lease() : pool(nullptr), connection(nullptr) {}
+        Lease(Lease&& other);
+        Lease& operator=(Lease&& other);
+        ~Lease() { release(); }
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        NetworkRequestChannel* operator->() const { return get(); }
+        NetworkRequestChannel& operator*() const { return *get(); }
+        NetworkRequestChannel* get() const;
+        explicit operator bool() const { return pool != nullptr; }
+
+        // Gives the connection back before the Lease goes away
+        void release();
+
+        // Gives the connection back to be reconnected, e.g. after a response
+        // was only partly read and the connection can no longer be trusted
+        void discard();
+
+    private:
+        friend class ChannelPool;
+        Lease(ChannelPool* pool, Connection* connection) : pool(pool), connection(connection) {}
+
+        ChannelPool* pool;
+        Connection* connection;
+    };
+
+    ChannelPool(const std::string& host, int port, size_t connections, Mode mode = EXCLUSIVE,
+                WireFormat format = BINARY_FORMAT);
+
+    // Every Lease must have been released
+    ~ChannelPool();
+
+    ChannelPool(const ChannelPool&) = delete;
+    ChannelPool& operator=(const ChannelPool&) = delete;
+
+    // EXCLUSIVE only: waits up to timeout_ms for a free live connection; the
+    // Lease is empty if none became free
+    Lease acquire(int timeout_ms = POOL_WAIT_MS);
+
+    // One round trip on any live connection
+    Response send_request(const Request& req);
+
+    // MULTIPLEXED: sends the request and returns at once; the future gets the
+    // response. In EXCLUSIVE mode the round trip happens before it returns.
+    std::future<Response> send_async(const Request& req);
+
+    size_t size() const { return connections.size(); }
+    size_t connected_count();
+
+    // How long acquire() and send_async() wait for a live connection by default
+    static const int POOL_WAIT_MS = 5000;
+
+private:
+    struct Connection {
+        NetworkRequestChannel* channel;
+        bool leased;
+        bool alive;
+
+        // MULTIPLEXED: senders take send_mutex; responses go to pending
+        std::mutex send_mutex;
+        std::atomic<bool> up;
+        std::mutex pending_mutex;
+        std::unordered_map<uint32_t, std::promise<Response>> pending;
+        std::thread reader;
+
+        Connection() : channel(nullptr), leased(false), alive(false), up(false) {}
+    };
+
+    bool open(Connection& c);
+    void start(Connection& c);
+    void release(Connection* c, bool keep);
+    void mark_dead(Connection& c);
+    void take_down(Connection& c);
+    bool wait_available(std::unique_lock<std::mutex>& lock, int timeout_ms);
+    void reader_loop(Connection* c);
+    void reconnect_loop();
+
+    std::string host;
+    int port;
+    Mode mode;
+    WireFormat format;
+
+    std::vector<std::unique_ptr<Connection>> connections;
+
+    // Guards leased, alive and the lists below
+    std::mutex pool_mutex;
+    std::condition_variable available;
+    std::condition_variable broken;
+    std::vector<Connection*> idle;   // EXCLUSIVE: alive and not leased
+    std::vector<Connection*> dead;   // Waiting for the reconnector
+    bool stop;
+
+    std::atomic<size_t> next_connection;  // MULTIPLEXED round robin
+    std::thread reconnector;
+};
+
+#endif
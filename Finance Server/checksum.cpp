@@ -0,0 +1,56 @@
+#include "checksum.h"
+#include "logger.h"
+#include <openssl/evp.h>
+#include <unistd.h>
+#include <vector>
+#include <cerrno>
+
+using namespace std;
+
+// Bytes read per pread when hashing a file
+static const size_t READ_SIZE = 1024 * 1024;
+
+/**
+ * Starts a new hash
+ *
+ * @throws Exits with error message if libcrypto cannot set up SHA-256
+ */
+Sha256::Sha256() : ctx(EVP_MD_CTX_new()) {
+    if (!ctx || EVP_DigestInit_ex(static_cast<EVP_MD_CTX*>(ctx), EVP_sha256(), NULL) != 1) {
+        LOG_ERROR("Error initializing SHA-256");
+        EVP_MD_CTX_free(static_cast<EVP_MD_CTX*>(ctx));
+        throw("Error initializing SHA-256");
+    }
+}
+
+Sha256::~Sha256() {
+    EVP_MD_CTX_free(static_cast<EVP_MD_CTX*>(ctx));
+}
+
+void Sha256::update(const char* data, size_t len) {
+    EVP_DigestUpdate(static_cast<EVP_MD_CTX*>(ctx), data, len);
+}
+
+string Sha256::digest() {
+    unsigned char out[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    EVP_DigestFinal_ex(static_cast<EVP_MD_CTX*>(ctx), out, &len);
+    return string(reinterpret_cast<const char*>(out), len);
+}
+
+bool Sha256::file(int fd, off_t length, string& digest, function<bool()> cancelled) {
+    Sha256 hash;
+    vector<char> buf(READ_SIZE);
+    off_t offset = 0;
+    while (offset < length) {
+        if (cancelled && cancelled()) return false;
+        size_t want = length - offset < static_cast<off_t>(buf.size()) ? length - offset : buf.size();
+        ssize_t n = pread(fd, buf.data(), want, offset);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        hash.update(buf.data(), n);
+        offset += n;
+    }
+    digest = hash.digest();
+    return true;
+}
@@ -0,0 +1,39 @@
+#ifndef _CHECKSUM_H_
+#define _CHECKSUM_H_
+
+#include <string>
+#include <functional>
+#include <cstddef>
+#include <sys/types.h>
+
+/*
+ * Sha256 class
+ *
+ * Incremental SHA-256 (libcrypto) for end-to-end checks of whole files,
+ * which are hashed piece by piece instead of being held in memory.
+ * Digests are the raw 32 bytes, like Chunker::hash.
+ */
+class Sha256 {
+public:
+    Sha256();
+    ~Sha256();
+
+    Sha256(const Sha256&) = delete;
+    Sha256& operator=(const Sha256&) = delete;
+
+    void update(const char* data, size_t len);
+
+    // Finishes the hash; the object must not be updated afterwards
+    std::string digest();
+
+    // Digest of the first length bytes of the file at fd, read with pread so
+    // its offset is left alone; false if it could not be read or if
+    // cancelled (checked between reads) returned true
+    static bool file(int fd, off_t length, std::string& digest,
+                     std::function<bool()> cancelled = nullptr);
+
+private:
+    void* ctx;  // EVP_MD_CTX
+};
+
+#endif
@@ -0,0 +1,166 @@
+#include "chunk_store.h"
+#include "logger.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+
+using namespace std;
+
+static bool write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void make_directory(const string& path) {
+    if (mkdir(path.c_str(), 0755) == -1 && errno != EEXIST) {
+        LOG_ERROR("Error creating chunk store directory " << path << " " << strerror(errno));
+        throw("Error creating chunk store directory");
+    }
+}
+
+/**
+ * Opens (creating if needed) a chunk store
+ *
+ * @param root Directory holding the chunks and manifests
+ *
+ * @throws Exits with error message if the directories cannot be created
+ */
+ChunkStore::ChunkStore(const string& root) : root(root), next_temp(0) {
+    make_directory(root);
+    make_directory(root + "/chunks");
+    make_directory(root + "/manifests");
+
+    // One directory per leading byte keeps directories small
+    static const char DIGITS[] = "0123456789abcdef";
+    for (int i = 0; i < 256; i++) {
+        make_directory(root + "/chunks/" + DIGITS[i >> 4] + DIGITS[i & 0xf]);
+    }
+}
+
+string ChunkStore::chunk_path(const string& hash) const {
+    string hex = Chunker::hex(hash);
+    return root + "/chunks/" + hex.substr(0, 2) + "/" + hex;
+}
+
+string ChunkStore::manifest_path(const string& filename) const {
+    return root + "/manifests/" + filename;
+}
+
+/**
+ * Replaces path with data atomically
+ */
+bool ChunkStore::write_file(const string& path, const string& data) {
+    string temp = path + ".tmp." + to_string(getpid()) + "." + to_string(next_temp.fetch_add(1));
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd == -1) return false;
+
+    bool ok = write_all(fd, data.data(), data.size());
+    ok = close(fd) == 0 && ok;
+    if (ok && rename(temp.c_str(), path.c_str()) == 0) return true;
+
+    unlink(temp.c_str());
+    return false;
+}
+
+/**
+ * Stores one chunk
+ *
+ * @param data The chunk's bytes
+ * @param hash Receives its SHA-256
+ * @return False if it was not stored and could not be written
+ */
+bool ChunkStore::put(const string& data, string& hash) {
+    hash = Chunker::hash(data.data(), data.size());
+    if (contains(hash)) return true;
+    return write_file(chunk_path(hash), data);
+}
+
+bool ChunkStore::contains(const string& hash) const {
+    return access(chunk_path(hash).c_str(), F_OK) == 0;
+}
+
+/**
+ * Commits a manifest once all of its chunks are stored
+ *
+ * @param filename Name the file is stored under
+ * @param chunks Content of the file
+ * @param missing Receives the indices of chunks not stored yet
+ * @return True if the manifest was written
+ */
+bool ChunkStore::commit(const string& filename, const vector<ChunkRef>& chunks, vector<uint32_t>& missing) {
+    missing.clear();
+    for (size_t i = 0; i < chunks.size(); i++) {
+        if (!contains(chunks[i].hash)) missing.push_back(i);
+    }
+    if (!missing.empty()) return false;
+
+    return write_file(manifest_path(filename), Chunker::encode_manifest(chunks));
+}
+
+/**
+ * Stores a whole file sent the ordinary way (UPLOAD_FILE)
+ *
+ * @param filename Name the file is stored under
+ * @param fd File read from its current offset to the end
+ */
+bool ChunkStore::store_file(const string& filename, int fd) {
+    vector<ChunkRef> chunks;
+    string data;
+    bool ok = Chunker::split(fd, [this, &chunks, &data](const char* chunk, size_t len) {
+        data.assign(chunk, len);
+        ChunkRef ref;
+        ref.length = len;
+        if (!put(data, ref.hash)) return false;
+        chunks.push_back(ref);
+        return true;
+    });
+
+    vector<uint32_t> missing;
+    return ok && commit(filename, chunks, missing);
+}
+
+bool ChunkStore::manifest(const string& filename, vector<ChunkRef>& chunks) const {
+    int fd = open(manifest_path(filename).c_str(), O_RDONLY);
+    if (fd == -1) return false;
+
+    struct stat st;
+    string data;
+    bool ok = fstat(fd, &st) == 0;
+    if (ok) {
+        data.resize(st.st_size);
+        ok = read_all(fd, &data[0], data.size());
+    }
+    close(fd);
+    return ok && Chunker::decode_manifest(data, chunks);
+}
+
+bool ChunkStore::read_chunk(const ChunkRef& chunk, string& data) const {
+    int fd = open(chunk_path(chunk.hash).c_str(), O_RDONLY);
+    if (fd == -1) return false;
+
+    data.resize(chunk.length);
+    bool ok = read_all(fd, &data[0], chunk.length);
+    close(fd);
+    return ok;
+}
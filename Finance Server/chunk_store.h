@@ -0,0 +1,56 @@
+#ifndef _CHUNK_STORE_H_
+#define _CHUNK_STORE_H_
+
+#include "chunker.h"
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+
+/*
+ * ChunkStore class
+ *
+ * Deduplicating storage for the file server. Every unique chunk is stored
+ * once, under its hash, and a file is only its manifest:
+ *
+ *   <root>/chunks/<first 2 hex digits>/<hex hash>
+ *   <root>/manifests/<filename>
+ *
+ * Chunk and manifest files are written under a temporary name and renamed
+ * into place, so concurrent uploads of the same chunk or file never expose
+ * a partial one. Re-uploading a file replaces its manifest. Chunks are
+ * never deleted, even when no manifest refers to them any more.
+ */
+class ChunkStore {
+public:
+    ChunkStore(const std::string& root);
+
+    // Stores data under its hash unless a chunk with that hash exists;
+    // hash receives the hash either way
+    bool put(const std::string& data, std::string& hash);
+    bool contains(const std::string& hash) const;
+
+    // Makes chunks the content of filename if every one of them is stored.
+    // Otherwise nothing changes and missing lists the indices of the absent ones.
+    bool commit(const std::string& filename, const std::vector<ChunkRef>& chunks,
+                std::vector<uint32_t>& missing);
+
+    // Splits the rest of the file at fd into chunks and commits them as filename
+    bool store_file(const std::string& filename, int fd);
+
+    // The chunks of filename; false if it has no manifest
+    bool manifest(const std::string& filename, std::vector<ChunkRef>& chunks) const;
+
+    // Reads a whole chunk into data
+    bool read_chunk(const ChunkRef& chunk, std::string& data) const;
+
+private:
+    std::string chunk_path(const std::string& hash) const;
+    std::string manifest_path(const std::string& filename) const;
+    bool write_file(const std::string& path, const std::string& data);
+
+    std::string root;
+    std::atomic<uint64_t> next_temp;
+};
+
+#endif
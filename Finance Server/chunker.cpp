@@ -0,0 +1,245 @@
+#include "chunker.h"
+#include "transfer.h"
+#include <openssl/sha.h>
+#include <unistd.h>
+#include <endian.h>
+#include <cstring>
+#include <cerrno>
+
+using namespace std;
+
+const size_t Chunker::MIN_SIZE;
+const size_t Chunker::AVG_SIZE;
+const size_t Chunker::MAX_SIZE;
+const size_t Chunker::HASH_SIZE;
+const size_t Chunker::MANIFEST_ENTRY_SIZE;
+
+// A boundary is where the top bits of the rolling hash are all zero: 1 in
+// 2^18 positions below the average size, 1 in 2^14 above it
+static const uint64_t MASK_HARD = ~0ull << (64 - 18);
+static const uint64_t MASK_EASY = ~0ull << (64 - 14);
+
+// Chunks sent per pipelined burst of PUT_CHUNK requests
+static const size_t UPLOAD_BURST = 64;
+
+// Random value per byte, the same in every process (split-mix sequence)
+struct GearTable {
+    uint64_t values[256];
+
+    GearTable() {
+        uint64_t state = 0x46696e616e636521ull;
+        for (int i = 0; i < 256; i++) {
+            uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            values[i] = z ^ (z >> 31);
+        }
+    }
+};
+
+static const GearTable GEAR;
+
+/**
+ * Finds the end of the chunk that starts at data
+ *
+ * @param data Input from the start of the chunk
+ * @param len Bytes available; fewer than MAX_SIZE only at the end of the input
+ * @return Chunk length, between 1 and MAX_SIZE
+ */
+size_t Chunker::boundary(const unsigned char* data, size_t len) {
+    if (len <= MIN_SIZE) return len;
+
+    size_t end = len < MAX_SIZE ? len : MAX_SIZE;
+    size_t normal = end < AVG_SIZE ? end : AVG_SIZE;
+    uint64_t h = 0;
+
+    // No chunk ends before MIN_SIZE, so those bytes are not even hashed
+    size_t i = MIN_SIZE;
+    for (; i < normal; i++) {
+        h = (h << 1) + GEAR.values[data[i]];
+        if (!(h & MASK_HARD)) return i + 1;
+    }
+    for (; i < end; i++) {
+        h = (h << 1) + GEAR.values[data[i]];
+        if (!(h & MASK_EASY)) return i + 1;
+    }
+    return end;
+}
+
+/**
+ * Splits the rest of a file into chunks
+ *
+ * @param fd File read sequentially from its current offset
+ * @param chunk Called with every chunk in order
+ * @return False on a read error or when chunk returned false
+ */
+bool Chunker::split(int fd, function<bool(const char*, size_t)> chunk) {
+    vector<unsigned char> buf(4 * MAX_SIZE);
+    size_t start = 0, filled = 0;
+    bool eof = false;
+
+    while (true) {
+        // Keep at least MAX_SIZE bytes ahead so boundary() sees the whole window
+        while (!eof && filled - start < MAX_SIZE) {
+            if (start > 0) {
+                memmove(buf.data(), buf.data() + start, filled - start);
+                filled -= start;
+                start = 0;
+            }
+            ssize_t n = read(fd, buf.data() + filled, buf.size() - filled);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            if (n == 0) eof = true;
+            filled += n;
+        }
+        if (start == filled) return true;
+
+        size_t len = boundary(buf.data() + start, filled - start);
+        if (!chunk(reinterpret_cast<const char*>(buf.data() + start), len)) return false;
+        start += len;
+    }
+}
+
+string Chunker::hash(const char* data, size_t len) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(data), len, digest);
+    return string(reinterpret_cast<const char*>(digest), sizeof(digest));
+}
+
+string Chunker::hex(const string& hash) {
+    static const char DIGITS[] = "0123456789abcdef";
+    string out;
+    out.reserve(hash.size() * 2);
+    for (unsigned char c : hash) {
+        out += DIGITS[c >> 4];
+        out += DIGITS[c & 0xf];
+    }
+    return out;
+}
+
+string Chunker::encode_manifest(const vector<ChunkRef>& chunks) {
+    string out;
+    out.reserve(chunks.size() * MANIFEST_ENTRY_SIZE);
+    for (const ChunkRef& c : chunks) {
+        out.append(c.hash);
+        uint32_t len = htobe32(c.length);
+        out.append(reinterpret_cast<const char*>(&len), 4);
+    }
+    return out;
+}
+
+/**
+ * Parses a manifest
+ *
+ * @return False if data is not a whole number of entries or a chunk length
+ *         is outside 1..MAX_SIZE
+ */
+bool Chunker::decode_manifest(const string& data, vector<ChunkRef>& chunks) {
+    chunks.clear();
+    if (data.size() % MANIFEST_ENTRY_SIZE != 0) return false;
+
+    chunks.reserve(data.size() / MANIFEST_ENTRY_SIZE);
+    for (size_t pos = 0; pos < data.size(); pos += MANIFEST_ENTRY_SIZE) {
+        ChunkRef c;
+        c.hash = data.substr(pos, HASH_SIZE);
+        uint32_t len;
+        memcpy(&len, data.data() + pos + HASH_SIZE, 4);
+        c.length = be32toh(len);
+        if (c.length == 0 || c.length > MAX_SIZE) return false;
+        chunks.push_back(c);
+    }
+    return true;
+}
+
+static bool read_at(int fd, char* buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, offset + done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+/**
+ * Uploads a file through the server's chunk store
+ *
+ * The client splits the file and offers its manifest (UPLOAD_MANIFEST). The
+ * server commits it if it already has every chunk, or answers with the
+ * indices of the missing ones; those are sent as pipelined PUT_CHUNK
+ * requests and the manifest is offered again.
+ *
+ * @param channel Connection to the file server
+ * @param upload UPLOAD_FILE request naming the file
+ * @param fd File to upload, read from its current offset
+ * @return The server's response; on success the message says how many chunks were sent
+ */
+Response upload_deduplicated(NetworkRequestChannel& channel, const Request& upload, int fd) {
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    if (channel.get_wire_format() != BINARY_FORMAT || start == -1) {
+        return channel.send_request_stream(upload, fd);
+    }
+
+    vector<ChunkRef> chunks;
+    vector<off_t> offsets;
+    off_t offset = start;
+    bool ok = Chunker::split(fd, [&](const char* data, size_t len) {
+        chunks.push_back(ChunkRef{Chunker::hash(data, len), static_cast<uint32_t>(len)});
+        offsets.push_back(offset);
+        offset += len;
+        return true;
+    });
+    if (!ok) {
+        return Response(false, 0, "", "Failed to read file");
+    }
+
+    Request manifest(UPLOAD_MANIFEST, upload.user_id, 0, upload.filename, Chunker::encode_manifest(chunks));
+    size_t sent = 0;
+    uint64_t sent_bytes = 0;
+
+    // The second offer only fails if chunks vanished in between
+    for (int attempt = 0; attempt < 2; attempt++) {
+        Response resp = channel.send_request(manifest);
+        if (resp.success) {
+            resp.message = "File uploaded successfully (" + to_string(sent) + " of " + to_string(chunks.size()) +
+                           " chunks sent, " + to_string(sent_bytes) + " bytes)";
+            return resp;
+        }
+        if (resp.data.empty() || resp.data.size() % 4 != 0) {
+            if (attempt > 0 || !channel.is_connected()) return resp;
+
+            // No chunk store on this server
+            lseek(fd, start, SEEK_SET);
+            return upload_resumable(channel, upload, fd);
+        }
+
+        vector<uint32_t> missing(resp.data.size() / 4);
+        for (size_t i = 0; i < missing.size(); i++) {
+            uint32_t index;
+            memcpy(&index, resp.data.data() + i * 4, 4);
+            missing[i] = be32toh(index);
+            if (missing[i] >= chunks.size()) return Response(false, 0, "", "Invalid missing chunk list");
+        }
+
+        for (size_t i = 0; i < missing.size(); i += UPLOAD_BURST) {
+            vector<Request> puts;
+            for (size_t j = i; j < missing.size() && j < i + UPLOAD_BURST; j++) {
+                const ChunkRef& c = chunks[missing[j]];
+                string data(c.length, '\0');
+                if (!read_at(fd, &data[0], c.length, offsets[missing[j]])) {
+                    return Response(false, 0, "", "Failed to read file");
+                }
+                puts.push_back(Request(PUT_CHUNK, upload.user_id, 0, "", data));
+                sent_bytes += c.length;
+            }
+            for (const Response& r : channel.send_pipelined(puts)) {
+                if (!r.success) return r;
+            }
+            sent += puts.size();
+        }
+    }
+    return Response(false, 0, "", "Chunks missing after upload");
+}
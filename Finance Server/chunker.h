@@ -0,0 +1,62 @@
+#ifndef _CHUNKER_H_
+#define _CHUNKER_H_
+
+#include "common.h"
+#include "network_channel.h"
+#include <string>
+#include <vector>
+#include <functional>
+#include <cstdint>
+
+// One chunk of a file, as listed in its manifest
+struct ChunkRef {
+    std::string hash;   // Raw SHA-256 of the chunk's bytes
+    uint32_t length;
+};
+
+/*
+ * Chunker class
+ *
+ * Content-defined chunking for the file server's deduplicating store.
+ * Files are cut where a gear rolling hash of the preceding bytes matches a
+ * mask, so every boundary depends only on the content right before it: an
+ * edit shifts the boundaries around it and leaves all other chunks (and
+ * their hashes) unchanged, no matter how the following bytes moved.
+ *
+ * Chunks are MIN_SIZE to MAX_SIZE bytes and about AVG_SIZE on average. A
+ * harder mask is used below AVG_SIZE and an easier one above it
+ * (normalized chunking), which keeps most chunks close to the average.
+ *
+ * A file is described by its manifest: the chunks in order, each encoded as
+ * hash(32) length(4), with the length big-endian like the wire format.
+ */
+class Chunker {
+public:
+    static const size_t MIN_SIZE = 16 * 1024;
+    static const size_t AVG_SIZE = 64 * 1024;
+    static const size_t MAX_SIZE = 256 * 1024;
+    static const size_t HASH_SIZE = 32;
+    static const size_t MANIFEST_ENTRY_SIZE = HASH_SIZE + 4;
+
+    // Length of the chunk at the start of data. Passing fewer than MAX_SIZE
+    // bytes means the input ends there.
+    static size_t boundary(const unsigned char* data, size_t len);
+
+    // Reads fd from its current offset to the end and calls chunk(data, len)
+    // for every chunk; false on a read error or when chunk returns false
+    static bool split(int fd, std::function<bool(const char*, size_t)> chunk);
+
+    static std::string hash(const char* data, size_t len);
+    static std::string hex(const std::string& hash);
+
+    static std::string encode_manifest(const std::vector<ChunkRef>& chunks);
+    static bool decode_manifest(const std::string& data, std::vector<ChunkRef>& chunks);
+};
+
+// Uploads the file at fd (from its current offset) with the same result as
+// send_request_stream(upload, fd), sending only the chunks the server does
+// not have yet. Falls back to a plain upload on text connections and to a
+// resumable one when the server does not keep a chunk store.
+Response upload_deduplicated(NetworkRequestChannel& channel, const Request& upload, int fd);
+
+#endif
@@ -1,6 +1,11 @@
 #include "common.h"
 #include "network_channel.h"
 #include "signals.h"
+#include "audit_sender.h"
+#include "finance_cluster.h"
+#include "bench.h"
+#include "chunker.h"
+#include "transfer.h"
 #include <iostream>
 #include <unistd.h>
 #include <fstream>
@@ -9,6 +14,10 @@
 #include <getopt.h>
 #include <memory>
 #include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <ctime>
 
 using namespace std;
 using namespace SignalHandling;
@@ -24,6 +33,8 @@ void print_menu() {
          << "7. Logout\n"
          << "8. Server Status\n"
          << "9. Update Interest for All Accounts\n"
+         << "10. View Activity Log\n"
+         << "11. Server Metrics\n"
          << "0. Exit\n"
          << "Enter choice: ";
 }
@@ -70,37 +81,107 @@ void retry_operation(const string& operation_name, Func operation, int max_retri
     }
 }
 
+// Warns about audit records the background sender could not deliver
+void report_audit_failures(AuditSender* audit_log) {
+    uint64_t lost = audit_log ? audit_log->take_failures() : 0;
+    if (lost > 0) {
+        cout << "Warning: Failed to log " << lost << " transaction(s)" << endl;
+    }
+}
+
+// Replaces a channel whose connection dropped, so a retried transfer can
+// resume on a fresh one. Returns false if the server cannot be reached.
+bool reconnect(NetworkRequestChannel*& channel, const string& host, int port, WireFormat format, int compression) {
+    if (!channel) return false;
+    if (channel->is_connected()) return true;
+    
+    try {
+        NetworkRequestChannel* fresh = new NetworkRequestChannel(host, port, NetworkRequestChannel::Side::CLIENT_SIDE,
+                                                                 format, compression);
+        delete channel;
+        channel = fresh;
+        cout << "Reconnected to " << host << ":" << port << endl;
+        return true;
+    } catch (const char* e) {
+        cerr << "Failed to reconnect to " << host << ":" << port << ": " << e << endl;
+        return false;
+    }
+}
+
 void print_usage() {
     cout << "Usage: ./network_client [OPTIONS]" << endl;
     cout << "  -h, --help                      Show this help message" << endl;
     cout << "  --finance-host=HOST             Finance server hostname/IP (default: localhost)" << endl;
     cout << "  --finance-port=PORT             Finance server port (default: 8000)" << endl;
+    cout << "  --finance-shards=HOST:PORT,...  Finance shards to route requests between, instead of one server" << endl;
+    cout << "  --rebalance=HOST:PORT,...       Move the finance shards' accounts onto these nodes while they serve, then exit" << endl;
     cout << "  --logging-host=HOST             Logging server hostname/IP (default: localhost)" << endl;
     cout << "  --logging-port=PORT             Logging server port (default: 8002)" << endl;
     cout << "  --file-host=HOST                File server hostname/IP (default: localhost)" << endl;
     cout << "  --file-port=PORT                File server port (default: 8001)" << endl;
     cout << "  -r, --retries=N                 Max connection retries (default: 3)" << endl;
+    cout << "  --text-protocol                 Use the text wire format instead of negotiating binary" << endl;
+    cout << "  --audit=MODE                    Audit delivery: acked (server confirms each batch) or best-effort (default: acked)" << endl;
+    cout << "  --stripes=N                     Parallel connections for uploads and downloads larger than one stripe (default: 1)" << endl;
+    cout << "  --stripe-size=BYTES             Bytes per stripe range, at most " << MAX_STRIPE_SIZE << " (default: 8388608)" << endl;
+    cout << "  --compression=MODE              Compress file transfers: off, fast or ratio (default: off)" << endl;
+    cout << "Benchmark mode (no menu; uses the finance and file servers only):" << endl;
+    cout << "  --bench                         Run a load test and print throughput and latency percentiles" << endl;
+    cout << "  --threads=M                     Threads sending requests (default: 4)" << endl;
+    cout << "  --connections=K                 Connections per server shared by the threads (default: M)" << endl;
+    cout << "  --in-flight=N                   Requests each thread keeps outstanding on the async client (default: 0, one at a time)" << endl;
+    cout << "  --duration=SECONDS              How long to run (default: 10)" << endl;
+    cout << "  --rate=N                        Open loop at N requests/s in total (default: 0, closed loop)" << endl;
+    cout << "  --mix=OP:W,...                  Operation weights, OP one of deposit, withdraw, balance, upload," << endl;
+    cout << "                                  download, interest (default: deposit:30,withdraw:20,balance:40," << endl;
+    cout << "                                  upload:4,download:5,interest:1)" << endl;
+    cout << "  --users=N                       Accounts to spread the operations over (default: 1000)" << endl;
+    cout << "  --file-size=BYTES               Size of each upload and download (default: 65536)" << endl;
 }
 
 int main(int argc, char* argv[]) {
     string finance_host = "localhost";
     int finance_port = 8000;
+    string finance_shards;
+    string rebalance_nodes;
     string logging_host = "localhost";
     int logging_port = 8002;
     string file_host = "localhost";
     int file_port = 8001;
     int max_retries = 3;
+    WireFormat wire_format = BINARY_FORMAT;
+    AuditSender::Delivery audit_delivery = AuditSender::ACKNOWLEDGED;
+    StripeOptions stripe_options;
+    int compression = COMPRESSION_OFF;
+    bool bench = false;
+    BenchConfig bench_config;
     
     // Parse command line arguments
     static struct option long_options[] = {
         {"help", no_argument, 0, 'h'},
         {"finance-host", required_argument, 0, 0},
         {"finance-port", required_argument, 0, 0},
+        {"finance-shards", required_argument, 0, 0},
+        {"rebalance", required_argument, 0, 0},
         {"logging-host", required_argument, 0, 0},
         {"logging-port", required_argument, 0, 0},
         {"file-host", required_argument, 0, 0},
         {"file-port", required_argument, 0, 0},
         {"retries", required_argument, 0, 'r'},
+        {"text-protocol", no_argument, 0, 0},
+        {"audit", required_argument, 0, 0},
+        {"stripes", required_argument, 0, 0},
+        {"stripe-size", required_argument, 0, 0},
+        {"compression", required_argument, 0, 0},
+        {"bench", no_argument, 0, 0},
+        {"threads", required_argument, 0, 0},
+        {"connections", required_argument, 0, 0},
+        {"in-flight", required_argument, 0, 0},
+        {"duration", required_argument, 0, 0},
+        {"rate", required_argument, 0, 0},
+        {"mix", required_argument, 0, 0},
+        {"users", required_argument, 0, 0},
+        {"file-size", required_argument, 0, 0},
         {0, 0, 0, 0}
     };
     
@@ -114,6 +195,10 @@ int main(int argc, char* argv[]) {
                     finance_host = optarg;
                 } else if (string(long_options[option_index].name) == "finance-port") {
                     finance_port = atoi(optarg);
+                } else if (string(long_options[option_index].name) == "finance-shards") {
+                    finance_shards = optarg;
+                } else if (string(long_options[option_index].name) == "rebalance") {
+                    rebalance_nodes = optarg;
                 } else if (string(long_options[option_index].name) == "logging-host") {
                     logging_host = optarg;
                 } else if (string(long_options[option_index].name) == "logging-port") {
@@ -122,6 +207,53 @@ int main(int argc, char* argv[]) {
                     file_host = optarg;
                 } else if (string(long_options[option_index].name) == "file-port") {
                     file_port = atoi(optarg);
+                } else if (string(long_options[option_index].name) == "text-protocol") {
+                    wire_format = TEXT_FORMAT;
+                } else if (string(long_options[option_index].name) == "audit") {
+                    if (string(optarg) == "best-effort") {
+                        audit_delivery = AuditSender::BEST_EFFORT;
+                    } else if (string(optarg) == "acked") {
+                        audit_delivery = AuditSender::ACKNOWLEDGED;
+                    } else {
+                        print_usage();
+                        return 1;
+                    }
+                } else if (string(long_options[option_index].name) == "stripes") {
+                    stripe_options.stripes = atoi(optarg);
+                } else if (string(long_options[option_index].name) == "stripe-size") {
+                    stripe_options.stripe_size = strtoull(optarg, NULL, 10);
+                } else if (string(long_options[option_index].name) == "compression") {
+                    if (string(optarg) == "off") {
+                        compression = COMPRESSION_OFF;
+                    } else if (string(optarg) == "fast") {
+                        compression = COMPRESSION_FAST;
+                    } else if (string(optarg) == "ratio") {
+                        compression = COMPRESSION_RATIO;
+                    } else {
+                        print_usage();
+                        return 1;
+                    }
+                } else if (string(long_options[option_index].name) == "bench") {
+                    bench = true;
+                } else if (string(long_options[option_index].name) == "threads") {
+                    bench_config.threads = atoi(optarg);
+                } else if (string(long_options[option_index].name) == "connections") {
+                    bench_config.connections = atoi(optarg);
+                } else if (string(long_options[option_index].name) == "in-flight") {
+                    bench_config.in_flight = atoi(optarg);
+                } else if (string(long_options[option_index].name) == "duration") {
+                    bench_config.duration_s = atof(optarg);
+                } else if (string(long_options[option_index].name) == "rate") {
+                    bench_config.rate = atof(optarg);
+                } else if (string(long_options[option_index].name) == "mix") {
+                    if (!parse_bench_mix(optarg, bench_config.weights)) {
+                        print_usage();
+                        return 1;
+                    }
+                } else if (string(long_options[option_index].name) == "users") {
+                    bench_config.users = atoi(optarg);
+                } else if (string(long_options[option_index].name) == "file-size") {
+                    bench_config.file_size = strtoull(optarg, NULL, 10);
                 }
                 break;
             case 'r':
@@ -142,42 +274,99 @@ int main(int argc, char* argv[]) {
     SignalHandling::setup_handlers();
     SignalHandling::log_signal_event("Network client started");
     
+    if (bench) {
+        if (bench_config.threads < 1 || bench_config.users < 1 || bench_config.duration_s <= 0 ||
+            bench_config.in_flight < 0) {
+            print_usage();
+            return 1;
+        }
+        bench_config.finance_host = finance_host;
+        bench_config.finance_port = finance_port;
+        bench_config.file_host = file_host;
+        bench_config.file_port = file_port;
+        bench_config.format = wire_format;
+        return run_bench(bench_config);
+    }
+    
+    // Shards to start from; the epoch 0 map gives way to the one they serve by
+    ShardMap finance_map;
+    if (!ShardMap::parse(finance_shards.empty() ? finance_host + ":" + to_string(finance_port) : finance_shards,
+                         finance_map) || finance_map.empty()) {
+        print_usage();
+        return 1;
+    }
+    finance_map = ShardMap(finance_map.node_names(), 0);
+
+    if (!rebalance_nodes.empty()) {
+        ShardMap target;
+        if (!ShardMap::parse(rebalance_nodes, target) || target.empty()) {
+            print_usage();
+            return 1;
+        }
+        try {
+            FinanceCluster cluster(finance_map, wire_format);
+            string error;
+            if (!cluster.rebalance(target.node_names(), error)) {
+                cerr << "Rebalance failed: " << error << endl;
+                return 1;
+            }
+            cout << "Finance shards rebalanced to " << cluster.current_map().serialize() << endl;
+            return 0;
+        } catch (const char* e) {
+            cerr << "Failed to connect to the finance shards: " << e << endl;
+            return 1;
+        }
+    }
+
     cout << "Connecting to servers..." << endl;
     
     // Connection pointers - using raw pointers instead of unique_ptr with make_unique
-    NetworkRequestChannel* finance_channel = nullptr;
+    FinanceCluster* finance_cluster = nullptr;
     NetworkRequestChannel* logging_channel = nullptr;
     NetworkRequestChannel* file_channel = nullptr;
     
     // Try to connect to servers
     try {
-        // TODO: Create a NetworkRequestChannel for the finance server
-        finance_channel = new NetworkRequestChannel(finance_host, finance_port, NetworkRequestChannel::Side::CLIENT_SIDE);
-        cout << "Connected to finance server at " << finance_host << ":" << finance_port << endl;
-    } catch (const exception& e) {
-        cerr << "Failed to connect to finance server: " << e.what() << endl;
+        // Requests go straight to the shard owning their account
+        finance_cluster = new FinanceCluster(finance_map, wire_format);
+        finance_cluster->refresh_map();
+        if (finance_map.size() == 1) {
+            cout << "Connected to finance server at " << finance_map.node(0) << endl;
+        } else {
+            cout << "Connected to " << finance_map.size() << " finance shards" << endl;
+        }
+    } catch (const char* e) {
+        cerr << "Failed to connect to finance server: " << e << endl;
     }
     
     try {
         // TODO: Create a NetworkRequestChannel for the logging server
-        logging_channel = new NetworkRequestChannel(logging_host, logging_port, NetworkRequestChannel::Side::CLIENT_SIDE);
+        logging_channel = new NetworkRequestChannel(logging_host, logging_port, NetworkRequestChannel::Side::CLIENT_SIDE, wire_format);
         cout << "Connected to logging server at " << logging_host << ":" << logging_port << endl;
     } catch (const exception& e) {
         cerr << "Failed to connect to logging server: " << e.what() << endl;
     }
     
+    // Audit records are sent in the background so they never delay an operation
+    AuditSender* audit_log = nullptr;
+    if (logging_channel) {
+        audit_log = new AuditSender(logging_channel, audit_delivery);
+    }
+    
     try {
         // TODO: Create a NetworkRequestChannel for the file server
-        file_channel = new NetworkRequestChannel(file_host, file_port, NetworkRequestChannel::Side::CLIENT_SIDE);
+        file_channel = new NetworkRequestChannel(file_host, file_port, NetworkRequestChannel::Side::CLIENT_SIDE,
+                                                 wire_format, compression);
         cout << "Connected to file server at " << file_host << ":" << file_port << endl;
     } catch (const exception& e) {
         cerr << "Failed to connect to file server: " << e.what() << endl;
     }
     
-    int current_user = -1;  // -1 means no user logged in
+    int64_t current_user = -1;  // -1 means no user logged in
     bool running = true;
     
     while (running && !shutdown_requested) {
+        report_audit_failures(audit_log);
         print_menu();
         
         int choice;
@@ -216,7 +405,7 @@ int main(int argc, char* argv[]) {
                     
                     // Login operation
                     auto login_operation = [&]() {
-                        if (!logging_channel) {
+                        if (!audit_log) {
                             cout << "Not connected to logging server!" << endl;
                             return false;
                         }
@@ -225,7 +414,7 @@ int main(int argc, char* argv[]) {
                         Response resp;
                         
                         try {
-                            resp = logging_channel->send_request(login);
+                            resp = audit_log->call(login);
                         } catch (const exception& e) {
                             cout << "Login failed: " << e.what() << endl;
                             return false;
@@ -265,7 +454,7 @@ int main(int argc, char* argv[]) {
                     
                     // Deposit operation
                     auto deposit_operation = [&]() {
-                        if (!finance_channel) {
+                        if (!finance_cluster) {
                             cout << "Not connected to finance server!" << endl;
                             return false;
                         }
@@ -274,7 +463,7 @@ int main(int argc, char* argv[]) {
                         Response resp;
                         
                         try {
-                            resp = finance_channel->send_request(txn);
+                            resp = finance_cluster->send_request(txn);
                         } catch (const exception& e) {
                             cout << "Deposit failed: " << e.what() << endl;
                             return false;
@@ -284,12 +473,8 @@ int main(int argc, char* argv[]) {
                             cout << "Deposit successful. New balance: " << resp.balance << endl;
                             
                             // Log the deposit
-                            if (logging_channel) {
-                                Request audit(DEPOSIT, current_user, amount);
-                                Response log_resp = logging_channel->send_request(audit);
-                                if (!log_resp.success) {
-                                    cout << "Warning: Failed to log transaction" << endl;
-                                }
+                            if (audit_log) {
+                                audit_log->record(Request(DEPOSIT, current_user, amount));
                             } else {
                                 cout << "Warning: Not connected to logging server" << endl;
                             }
@@ -324,7 +509,7 @@ int main(int argc, char* argv[]) {
                     
                     // Withdraw operation
                     auto withdraw_operation = [&]() {
-                        if (!finance_channel) {
+                        if (!finance_cluster) {
                             cout << "Not connected to finance server!" << endl;
                             return false;
                         }
@@ -333,7 +518,7 @@ int main(int argc, char* argv[]) {
                         Response resp;
                         
                         try {
-                            resp = finance_channel->send_request(txn);
+                            resp = finance_cluster->send_request(txn);
                         } catch (const exception& e) {
                             cout << "Withdrawal failed: " << e.what() << endl;
                             return false;
@@ -343,12 +528,8 @@ int main(int argc, char* argv[]) {
                             cout << "Withdrawal successful. New balance: " << resp.balance << endl;
                             
                             // Log the withdrawal
-                            if (logging_channel) {
-                                Request audit(WITHDRAW, current_user, amount);
-                                Response log_resp = logging_channel->send_request(audit);
-                                if (!log_resp.success) {
-                                    cout << "Warning: Failed to log transaction" << endl;
-                                }
+                            if (audit_log) {
+                                audit_log->record(Request(WITHDRAW, current_user, amount));
                             } else {
                                 cout << "Warning: Not connected to logging server" << endl;
                             }
@@ -378,7 +559,7 @@ int main(int argc, char* argv[]) {
                     
                     // View balance operation
                     auto balance_operation = [&]() {
-                        if (!finance_channel) {
+                        if (!finance_cluster) {
                             cout << "Not connected to finance server!" << endl;
                             return false;
                         }
@@ -387,7 +568,7 @@ int main(int argc, char* argv[]) {
                         Response resp;
 
                         try {
-                            resp = finance_channel->send_request(txn);
+                            resp = finance_cluster->send_request(txn);
                         } catch (const exception& e) {
                             cout << "Balance request failed: " << e.what() << endl;
                             return false;
@@ -397,12 +578,8 @@ int main(int argc, char* argv[]) {
                             cout << "Current balance: " << resp.balance << endl;
                             
                             // Log the balance view
-                            if (logging_channel) {
-                                Request audit(BALANCE, current_user, resp.balance);
-                                Response log_resp = logging_channel->send_request(audit);
-                                if (!log_resp.success) {
-                                    cout << "Warning: Failed to log transaction" << endl;
-                                }
+                            if (audit_log) {
+                                audit_log->record(Request(BALANCE, current_user, resp.balance));
                             } else {
                                 cout << "Warning: Not connected to logging server" << endl;
                             }
@@ -434,42 +611,44 @@ int main(int argc, char* argv[]) {
                     cout << "Enter filename to upload: ";
                     getline(cin, filename);
                     
-                    ifstream infile(filename);
-                    if (!infile) {
+                    // The file is streamed from disk rather than loaded into memory
+                    int infd = open(filename.c_str(), O_RDONLY);
+                    if (infd == -1) {
                         cout << "Error: Could not open file\n";
                         break;
                     }
-                    
-                    string content((istreambuf_iterator<char>(infile)), {});
-                    infile.close();
 
                     // Upload file operation
                     auto upload_operation = [&]() {
-                        if (!file_channel) {
+                        if (!reconnect(file_channel, file_host, file_port, wire_format, compression)) {
                             cout << "Not connected to file server!" << endl;
                             return false;
                         }
                         
-                        Request upload(UPLOAD_FILE, current_user, 0, filename, content);
+                        Request upload(UPLOAD_FILE, current_user, 0, filename);
+                        upload.compressible = !is_precompressed(filename);
                         Response resp;
                         
                         try {
-                            resp = file_channel->send_request(upload);
+                            // Each attempt starts from the beginning; chunks the server
+                            // already stores, or bytes an interrupted upload left there, are skipped
+                            lseek(infd, 0, SEEK_SET);
+                            if (stripe_options.stripes > 1) {
+                                resp = upload_striped(*file_channel, file_host, file_port, upload, infd, stripe_options);
+                            } else {
+                                resp = upload_deduplicated(*file_channel, upload, infd);
+                            }
                         } catch (const exception& e) {
                             cout << "File upload failed: " << e.what() << endl;
                             return false;
                         }
                         
                         if (resp.success) {
-                            cout << "File upload successful\n";
+                            cout << resp.message << "\n";
                             
                             // Log the file upload
-                            if (logging_channel) {
-                                Request audit(UPLOAD_FILE, current_user, 0, filename);
-                                Response log_resp = logging_channel->send_request(audit);
-                                if (!log_resp.success) {
-                                    cout << "Warning: Failed to log file upload" << endl;
-                                }
+                            if (audit_log) {
+                                audit_log->record(Request(UPLOAD_FILE, current_user, 0, filename));
                             } else {
                                 cout << "Warning: Not connected to logging server" << endl;
                             }
@@ -484,6 +663,7 @@ int main(int argc, char* argv[]) {
                     block_signals();
 
                     retry_operation("file upload", upload_operation, max_retries);
+                    close(infd);
 
                     // Unblock signals after transaction
                     unblock_signals();
@@ -501,40 +681,50 @@ int main(int argc, char* argv[]) {
                     cout << "Enter filename to download: ";
                     getline(cin, filename);
                     
+                    // The payload is written to disk as it arrives. An interrupted
+                    // download stays in the .part file and later attempts continue it
+                    // (striped downloads start over instead).
+                    string partname = filename + ".part";
+                    
                     // Download file operation
                     auto download_operation = [&]() {
-                        if (!file_channel) {
+                        if (!reconnect(file_channel, file_host, file_port, wire_format, compression)) {
                             cout << "Not connected to file server!" << endl;
                             return false;
                         }
                         
+                        int outfd = open(partname.c_str(), O_WRONLY | O_CREAT, 0644);
+                        if (outfd == -1) {
+                            cout << "Error: Could not create output file\n";
+                            return false;
+                        }
+                        
                         Request download(DOWNLOAD_FILE, current_user, 0, filename);
                         Response resp;
                         
                         try {
-                            resp = file_channel->send_request(download);
+                            resp = download_striped(*file_channel, file_host, file_port, download, outfd, stripe_options);
                         } catch (const exception& e) {
-                            cout << "File download failed: " << e.what() << endl;
-                            return false;
+                            resp = Response(false, 0, "", e.what());
+                        }
+                        
+                        // Nothing worth resuming
+                        struct stat st;
+                        if (!resp.success && fstat(outfd, &st) == 0 && st.st_size == 0) {
+                            unlink(partname.c_str());
                         }
+                        close(outfd);
                         
                         if (resp.success) {
-                            ofstream outfile(filename);
-                            if (!outfile) {
-                                cout << "Error: Could not create output file\n";
+                            if (rename(partname.c_str(), filename.c_str()) == -1) {
+                                cout << "Error: Could not write output file\n";
                                 return false;
                             }
-                            outfile << resp.data;
-                            outfile.close();
-                            cout << "File downloaded successfully\n";
+                            cout << resp.message << "\n";
                             
                             // Log the file download
-                            if (logging_channel) {
-                                Request audit(DOWNLOAD_FILE, current_user, 0, filename);
-                                Response log_resp = logging_channel->send_request(audit);
-                                if (!log_resp.success) {
-                                    cout << "Warning: Failed to log file download" << endl;
-                                }
+                            if (audit_log) {
+                                audit_log->record(Request(DOWNLOAD_FILE, current_user, 0, filename));
                             } else {
                                 cout << "Warning: Not connected to logging server" << endl;
                             }
@@ -564,7 +754,7 @@ int main(int argc, char* argv[]) {
 
                     // Logout operation
                     auto logout_operation = [&]() {
-                        if (!logging_channel) {
+                        if (!audit_log) {
                             cout << "Not connected to logging server!" << endl;
                             // Still allow logout even if logging server is down
                             current_user = -1;
@@ -576,7 +766,7 @@ int main(int argc, char* argv[]) {
                         Response resp;
                         
                         try {
-                            resp = logging_channel->send_request(logout);
+                            resp = audit_log->call(logout);
                         } catch (const exception& e) {
                             cout << "Logout from server failed: " << e.what() << endl;
                             // Still logout locally
@@ -618,7 +808,7 @@ int main(int argc, char* argv[]) {
                     clear_input();
 
                     auto interest_operation = [&]() {
-                        if (!finance_channel) {
+                        if (!finance_cluster) {
                             cout << "Not connected to finance server!" << endl;
                             return false;
                         }
@@ -627,7 +817,7 @@ int main(int argc, char* argv[]) {
                         Response resp;
                         
                         try {
-                            resp = finance_channel->send_request(request);
+                            resp = finance_cluster->send_request(request);
                         } catch (const exception& e) {
                             cout << "Interest update failed: " << e.what() << endl;
                             return false;
@@ -639,11 +829,8 @@ int main(int argc, char* argv[]) {
                         } else {
                             cout << "Interest update successful!" << endl;
                                 
-                            if (logging_channel) {
-                                Response log_resp = logging_channel->send_request(request);
-                                if (!log_resp.success) {
-                                    cout << "Warning: Failed to log transaction" << endl;
-                                }
+                            if (audit_log) {
+                                audit_log->record(request);
                             } else {
                                 cout << "Warning: Not connected to logging server" << endl;
                             }
@@ -662,6 +849,61 @@ int main(int argc, char* argv[]) {
                     break;
                 }
                 
+                case 10: {  // Activity log
+                    if (current_user == -1) {
+                        cout << "Please login first!\n";
+                        break;
+                    }
+                    if (!audit_log) {
+                        cout << "Not connected to logging server!" << endl;
+                        break;
+                    }
+
+                    int days = 7;
+                    cout << "Show how many days of activity: ";
+                    cin >> days;
+                    clear_input();
+
+                    int64_t now_us = chrono::duration_cast<chrono::microseconds>(
+                        chrono::system_clock::now().time_since_epoch()).count();
+                    // No upper bound: queued audit records are stamped when the server gets them
+                    Request query = AuditRecord::makeQuery(current_user, now_us - days * 86400000000LL,
+                                                           numeric_limits<int64_t>::max());
+                    Response resp = audit_log->call(query);
+                    if (!resp.success) {
+                        cout << "Query failed: " << resp.message << endl;
+                        break;
+                    }
+
+                    // The results are AuditRecords back to back
+                    AuditRecord rec;
+                    size_t pos = 0, shown = 0;
+                    while (size_t len = AuditRecord::parse(resp.data.data() + pos, resp.data.size() - pos, rec)) {
+                        time_t seconds = rec.timestamp_us / 1000000;
+                        char when[32];
+                        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+                        cout << when << "  " << rec.describe() << endl;
+                        pos += len;
+                        shown++;
+                    }
+                    cout << shown << " record(s)" << endl;
+                    break;
+                }
+                
+                case 11: {  // Server metrics
+                    Request stats(STATS);
+                    if (finance_cluster) {
+                        cout << finance_cluster->send_request(stats).data;
+                    }
+                    if (file_channel) {
+                        cout << file_channel->send_request(stats).data;
+                    }
+                    if (audit_log) {
+                        cout << audit_log->call(stats).data;
+                    }
+                    break;
+                }
+                
                 default:
                     cout << "Invalid choice. Please try again.\n";
             }
@@ -685,9 +927,9 @@ int main(int argc, char* argv[]) {
     
     Request quit(QUIT);
     
-    if (finance_channel) {
+    if (finance_cluster) {
         try {
-            finance_channel->send_request(quit);
+            finance_cluster->send_request(quit);
             cout << "QUIT sent to finance server" << endl;
         } catch (const exception& e) {
             cerr << "Failed to send QUIT to finance server: " << e.what() << endl;
@@ -703,9 +945,9 @@ int main(int argc, char* argv[]) {
         }
     }
     
-    if (logging_channel) {
+    if (audit_log) {
         try {
-            logging_channel->send_request(quit);
+            audit_log->call(quit);
             cout << "QUIT sent to logging server" << endl;
         } catch (const exception& e) {
             cerr << "Failed to send QUIT to logging server: " << e.what() << endl;
@@ -713,7 +955,8 @@ int main(int argc, char* argv[]) {
     }
     
     // Clean up resources
-    delete finance_channel;
+    delete finance_cluster;
+    delete audit_log;
     delete logging_channel;
     delete file_channel;
     
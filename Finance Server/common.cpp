@@ -1,31 +1,437 @@
 #include "common.h"
 #include <vector>
 #include <string>
+#include <sstream>
+#include <cstring>
+#include <charconv>
+#include <endian.h>
 
-Request Request::parseRequest(const std::string& buffer) {
-    std::vector<std::string> parts;
+// Big-endian field helpers for the binary wire format
+static void put_u32(std::string& out, uint32_t v) {
+    v = htobe32(v);
+    out.append(reinterpret_cast<const char*>(&v), 4);
+}
+
+static void put_u64(std::string& out, uint64_t v) {
+    v = htobe64(v);
+    out.append(reinterpret_cast<const char*>(&v), 8);
+}
+
+static void put_double(std::string& out, double d) {
+    uint64_t bits;
+    memcpy(&bits, &d, 8);
+    put_u64(out, bits);
+}
+
+static uint32_t get_u32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return be32toh(v);
+}
+
+static uint64_t get_u64(const char* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return be64toh(v);
+}
+
+static double get_double(const char* p) {
+    uint64_t bits = get_u64(p);
+    double d;
+    memcpy(&d, &bits, 8);
+    return d;
+}
+
+// Text format numbers, printed like an ostream with default settings would
+static void put_text(std::string& out, int64_t v) {
+    char buf[24];
+    char* end = std::to_chars(buf, buf + sizeof(buf), v).ptr;
+    out.append(buf, end - buf);
+}
+
+static void put_text(std::string& out, double d) {
+    char buf[32];
+    char* end = std::to_chars(buf, buf + sizeof(buf), d, std::chars_format::general, 6).ptr;
+    out.append(buf, end - buf);
+}
+
+// Splits the next '|'-delimited text field off rest; false if there is no delimiter left
+static bool next_field(std::string_view& rest, std::string_view& field) {
+    size_t pos = rest.find('|');
+    if (pos == std::string_view::npos) return false;
+    field = rest.substr(0, pos);
+    rest.remove_prefix(pos + 1);
+    return true;
+}
+
+// Text fields up to the next delimiter, or the rest if there is none
+static std::string_view last_field(std::string_view rest) {
+    return rest.substr(0, rest.find('|'));
+}
+
+template <typename T>
+static bool parse_number(std::string_view field, T& value) {
+    return std::from_chars(field.data(), field.data() + field.size(), value).ec == std::errc();
+}
+
+static bool parse_binary(const char* buf, size_t len, Request& out) {
+    if (len < BINARY_REQUEST_HEADER_SIZE ||
+        static_cast<uint8_t>(buf[0]) != BINARY_MAGIC ||
+        static_cast<uint8_t>(buf[1]) != BINARY_PROTOCOL_VERSION) {
+        return false; // A default QUIT request if parsing fails
+    }
+
+    int type = static_cast<uint8_t>(buf[2]);
+    if (type >= NUM_REQUEST_TYPES) {
+        return false;
+    }
+
+    uint32_t filename_len = get_u32(buf + 24);
+    uint32_t data_len = get_u32(buf + 28);
+
+    bool ranged = (buf[3] & FLAG_RANGE) != 0;
+    bool deadline = (buf[3] & FLAG_DEADLINE) != 0;
+    size_t header = BINARY_REQUEST_HEADER_SIZE + (ranged ? BINARY_RANGE_SIZE : 0) +
+                    (deadline ? BINARY_DEADLINE_SIZE : 0);
+
+    if (len < header || len - header < static_cast<uint64_t>(filename_len) + data_len) {
+        return false;
+    }
+
+    const char* p = buf + header;
+    out.type = static_cast<RequestType>(type);
+    out.user_id = static_cast<int64_t>(get_u64(buf + 8));
+    out.amount = get_double(buf + 16);
+    out.filename.assign(p, filename_len);
+    out.data.assign(p + filename_len, data_len);
+    out.streamed = (buf[3] & FLAG_STREAMED) != 0;
+    out.one_way = (buf[3] & FLAG_ONE_WAY) != 0;
+    out.compressible = out.streamed && (buf[3] & FLAG_COMPRESSED) != 0;
+    out.request_id = get_u32(buf + 4);
+    if (ranged) {
+        out.offset = get_u64(buf + BINARY_REQUEST_HEADER_SIZE);
+        out.length = get_u64(buf + BINARY_REQUEST_HEADER_SIZE + 8);
+    }
+    if (deadline) {
+        out.timeout_ms = get_u32(p - BINARY_DEADLINE_SIZE);
+    }
+    return true;
+}
+
+static bool parse_binary(const char* buf, size_t len, Response& out) {
+    if (len < BINARY_RESPONSE_HEADER_SIZE ||
+        static_cast<uint8_t>(buf[0]) != BINARY_MAGIC ||
+        static_cast<uint8_t>(buf[1]) != BINARY_PROTOCOL_VERSION) {
+        return false;
+    }
+
+    uint32_t data_len = get_u32(buf + 16);
+    uint32_t message_len = get_u32(buf + 20);
+
+    if (len - BINARY_RESPONSE_HEADER_SIZE < static_cast<uint64_t>(data_len) + message_len) {
+        return false;
+    }
+
+    const char* p = buf + BINARY_RESPONSE_HEADER_SIZE;
+    out.success = buf[2] != 0;
+    out.balance = get_double(buf + 8);
+    out.data.assign(p, data_len);
+    out.message.assign(p + data_len, message_len);
+    out.streamed = (buf[3] & FLAG_STREAMED) != 0;
+    out.compressible = out.streamed && (buf[3] & FLAG_COMPRESSED) != 0;
+    out.request_id = get_u32(buf + 4);
+    return true;
+}
+
+void Request::reset(RequestType t) {
+    type = t;
+    user_id = 0;
+    amount = 0;
+    filename.clear();
+    data.clear();
+    streamed = one_way = compressible = false;
+    request_id = 0;
+    offset = length = 0;
+    timeout_ms = 0;
+}
+
+std::string Request::serialize(WireFormat format) const {
+    std::string out;
+    serialize(format, out);
+    return out;
+}
+
+void Request::serialize(WireFormat format, std::string& out) const {
+    if (format == TEXT_FORMAT) {
+        // Format: TYPE|USER_ID|AMOUNT|FILENAME|DATA
+        put_text(out, static_cast<int64_t>(type));
+        out.push_back('|');
+        put_text(out, user_id);
+        out.push_back('|');
+        put_text(out, amount);
+        out.push_back('|');
+        out.append(filename);
+        out.push_back('|');
+        out.append(data);
+        return;
+    }
+
+    out.reserve(out.size() + BINARY_REQUEST_HEADER_SIZE + BINARY_RANGE_SIZE + BINARY_DEADLINE_SIZE +
+                filename.size() + data.size());
+    out.push_back(static_cast<char>(BINARY_MAGIC));
+    out.push_back(static_cast<char>(BINARY_PROTOCOL_VERSION));
+    out.push_back(static_cast<char>(type));
+    out.push_back((streamed ? FLAG_STREAMED : 0) | (one_way ? FLAG_ONE_WAY : 0) |
+                  (has_range() ? FLAG_RANGE : 0) | (streamed && compressible ? FLAG_COMPRESSED : 0) |
+                  (timeout_ms != 0 ? FLAG_DEADLINE : 0));
+    put_u32(out, request_id);
+    put_u64(out, static_cast<uint64_t>(user_id));
+    put_double(out, amount);
+    put_u32(out, filename.size());
+    put_u32(out, data.size());
+    if (has_range()) {
+        put_u64(out, offset);
+        put_u64(out, length);
+    }
+    if (timeout_ms != 0) {
+        put_u32(out, timeout_ms);
+    }
+    out.append(filename);
+    out.append(data);
+}
+
+Request Request::parseRequest(std::string_view buffer) {
+    Request r(QUIT);
+    parse(buffer, r);
+    return r;
+}
+
+Request Request::parseBinary(const char* buf, size_t len) {
+    Request r(QUIT);
+    parse(std::string_view(buf, len), r);
+    return r;
+}
+
+bool Request::parse(std::string_view buffer, Request& out) {
+    out.reset();
+    if (!buffer.empty() && static_cast<uint8_t>(buffer[0]) == BINARY_MAGIC) {
+        return parse_binary(buffer.data(), buffer.size(), out);
+    }
+
+    // Format: TYPE|USER_ID|AMOUNT|FILENAME|DATA; data ends at a further delimiter
+    std::string_view rest = buffer, type_field, user_field, amount_field, filename_field;
+    if (!next_field(rest, type_field) || !next_field(rest, user_field) ||
+        !next_field(rest, amount_field) || !next_field(rest, filename_field)) {
+        return false; // A default QUIT request if parsing fails
+    }
+
+    int type;
+    int64_t user_id;
+    double amount;
+    if (!parse_number(type_field, type) || type < 0 || type >= NUM_REQUEST_TYPES ||
+        !parse_number(user_field, user_id) || !parse_number(amount_field, amount)) {
+        return false;
+    }
+
+    out.type = static_cast<RequestType>(type);
+    out.user_id = user_id;
+    out.amount = amount;
+    out.filename.assign(filename_field);
+    out.data.assign(last_field(rest));
+    return true;
+}
+
+void Response::reset() {
+    success = false;
+    balance = 0;
+    data.clear();
+    message.clear();
+    streamed = compressible = false;
+    request_id = 0;
+}
+
+std::string Response::serialize(WireFormat format) const {
+    std::string out;
+    serialize(format, out);
+    return out;
+}
+
+void Response::serialize(WireFormat format, std::string& out) const {
+    if (format == TEXT_FORMAT) {
+        // Format: SUCCESS|BALANCE|DATA|MESSAGE
+        out.push_back(success ? '1' : '0');
+        out.push_back('|');
+        put_text(out, balance);
+        out.push_back('|');
+        out.append(data);
+        out.push_back('|');
+        out.append(message);
+        return;
+    }
+
+    out.reserve(out.size() + BINARY_RESPONSE_HEADER_SIZE + data.size() + message.size());
+    out.push_back(static_cast<char>(BINARY_MAGIC));
+    out.push_back(static_cast<char>(BINARY_PROTOCOL_VERSION));
+    out.push_back(success ? 1 : 0);
+    out.push_back((streamed ? FLAG_STREAMED : 0) | (streamed && compressible ? FLAG_COMPRESSED : 0));
+    put_u32(out, request_id);
+    put_double(out, balance);
+    put_u32(out, data.size());
+    put_u32(out, message.size());
+    out.append(data);
+    out.append(message);
+}
+
+Response Response::parseResponse(std::string_view buffer) {
+    Response resp;
+    parse(buffer, resp);
+    return resp;
+}
+
+Response Response::parseBinary(const char* buf, size_t len) {
+    Response resp;
+    parse(std::string_view(buf, len), resp);
+    return resp;
+}
+
+bool Response::parse(std::string_view buffer, Response& out) {
+    out.reset();
+    if (!buffer.empty() && static_cast<uint8_t>(buffer[0]) == BINARY_MAGIC) {
+        if (parse_binary(buffer.data(), buffer.size(), out)) return true;
+        out.message.assign("Malformed response");
+        return false;
+    }
+
+    // Format: SUCCESS|BALANCE|DATA|MESSAGE; fields after a missing delimiter stay empty
+    std::string_view rest = buffer, field;
+    if (next_field(rest, field)) {
+        out.success = (field == "1");
+        if (next_field(rest, field)) {
+            parse_number(field, out.balance);
+            if (next_field(rest, field)) {
+                out.data.assign(field);
+                out.message.assign(rest);
+            }
+        }
+    }
+    return true;
+}
+
+// Splits a BATCH payload into its length-prefixed entries
+static std::vector<std::string> split_batch(const std::string& buffer) {
+    std::vector<std::string> entries;
     size_t pos = 0;
-    std::string str = buffer;
-    const std::string delimiter = "|";
-    
-    while ((pos = str.find(delimiter)) != std::string::npos) {
-        parts.push_back(str.substr(0, pos));
-        str.erase(0, pos + delimiter.length());
+    while (buffer.size() - pos >= 4) {
+        uint32_t len = get_u32(buffer.data() + pos);
+        pos += 4;
+        if (buffer.size() - pos < len) break;
+        entries.push_back(buffer.substr(pos, len));
+        pos += len;
+    }
+    return entries;
+}
+
+std::string Request::serializeBatch(const std::vector<Request>& requests) {
+    std::string out;
+    for (const Request& r : requests) {
+        std::string entry = r.serialize(BINARY_FORMAT);
+        put_u32(out, entry.size());
+        out.append(entry);
+    }
+    return out;
+}
+
+std::vector<Request> Request::parseBatch(const std::string& buffer) {
+    std::vector<Request> requests;
+    for (const std::string& entry : split_batch(buffer)) {
+        requests.push_back(parseBinary(entry.data(), entry.size()));
+    }
+    return requests;
+}
+
+std::string Response::serializeBatch(const std::vector<Response>& responses) {
+    std::string out;
+    for (const Response& r : responses) {
+        std::string entry = r.serialize(BINARY_FORMAT);
+        put_u32(out, entry.size());
+        out.append(entry);
     }
-    parts.push_back(str);
+    return out;
+}
 
-    if (parts.size() < 5) {
-        return Request(QUIT); // Return a default QUIT request if parsing fails
+std::vector<Response> Response::parseBatch(const std::string& buffer) {
+    std::vector<Response> responses;
+    for (const std::string& entry : split_batch(buffer)) {
+        responses.push_back(parseBinary(entry.data(), entry.size()));
     }
+    return responses;
+}
+
+void AuditRecord::serialize(std::string& out) const {
+    put_u32(out, HEADER_SIZE + filename.size());
+    out.push_back(static_cast<char>(type));
+    out.append(3, '\0');
+    put_u64(out, static_cast<uint64_t>(timestamp_us));
+    put_u64(out, static_cast<uint64_t>(user_id));
+    put_double(out, amount);
+    out.append(filename);
+}
 
-    int type = std::stoi(parts[0]);
+size_t AuditRecord::parse(const char* buf, size_t len, AuditRecord& out) {
+    if (len < HEADER_SIZE) return 0;
 
-    if (type < 0 || type > 8) {
-        return Request(QUIT); // Return a default QUIT request if parsing fails
+    uint32_t length = get_u32(buf);
+    int type = static_cast<uint8_t>(buf[4]);
+    if (length < HEADER_SIZE || length > len || type >= NUM_REQUEST_TYPES) return 0;
+
+    out.type = static_cast<RequestType>(type);
+    out.timestamp_us = static_cast<int64_t>(get_u64(buf + 8));
+    out.user_id = static_cast<int64_t>(get_u64(buf + 16));
+    out.amount = get_double(buf + 24);
+    out.filename.assign(buf + HEADER_SIZE, length - HEADER_SIZE);
+    return length;
+}
+
+std::string AuditRecord::describe() const {
+    std::stringstream ss;
+    ss << "[" << user_id << "]: ";
+    switch (type) {
+        case LOGIN:
+            ss << "logged in from " << filename;
+            break;
+        case LOGOUT:
+            ss << "logged out from " << filename;
+            break;
+        case DEPOSIT:
+            ss << "deposited " << amount;
+            break;
+        case WITHDRAW:
+            ss << "withdrew " << amount;
+            break;
+        case BALANCE:
+            ss << "viewed balance: " << amount;
+            break;
+        case EARN_INTEREST:
+            ss << "accrued interest in all accounts";
+            break;
+        case UPLOAD_FILE:
+            ss << "uploaded file: " << filename;
+            break;
+        case DOWNLOAD_FILE:
+            ss << "downloaded file: " << filename;
+            break;
+        default:
+            ss << "unknown action (type=" << type << ")";
     }
-    
-    int user_id = std::stoi(parts[1]);
-    double amount = std::stod(parts[2]);
-    
-    return Request(static_cast<RequestType>(type), user_id, amount, parts[3], parts[4]);
-}
\ No newline at end of file
+    return ss.str();
+}
+
+// The time range travels in data as "FROM TO" so text connections can query too
+Request AuditRecord::makeQuery(int64_t user_id, int64_t from_us, int64_t to_us) {
+    return Request(QUERY_LOG, user_id, 0, "", std::to_string(from_us) + " " + std::to_string(to_us));
+}
+
+bool AuditRecord::parseQuery(const Request& r, int64_t& from_us, int64_t& to_us) {
+    std::stringstream ss(r.data);
+    return static_cast<bool>(ss >> from_us >> to_us) && from_us <= to_us;
+}
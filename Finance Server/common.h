@@ -2,7 +2,12 @@
 #define _COMMON_H_
 
 #include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
 #include <chrono>
+#include <cstdint>
+#include <cstddef>
 
 enum RequestType {
     QUIT,
@@ -13,22 +18,191 @@ enum RequestType {
     DOWNLOAD_FILE,
     LOGIN,
     LOGOUT,
-    EARN_INTEREST
+    EARN_INTEREST,
+    HELLO,              // Wire format negotiation, handled by NetworkRequestChannel
+    BATCH,              // data holds several binary requests applied in one pass
+    QUERY_LOG,          // Streams back logged activity (see AuditRecord::makeQuery)
+    STATS,              // Server metrics in the Prometheus text format, answered by the EventLoop
+    PUT_CHUNK,          // data holds one file chunk for the file server's chunk store
+    UPLOAD_MANIFEST,    // Commits filename as a list of stored chunks (see chunker.h), or
+                        // fails with the indices of the missing ones in data
+    UPLOAD_STATUS,      // Bytes of an interrupted resumable upload of filename the file
+                        // server holds, answered in balance (0 if none)
+    UPLOAD_STRIPE,      // One range of a striped upload: the payload goes at offset of a
+                        // file whose complete size is length; ranges may arrive in any order
+    UPLOAD_COMMIT,      // Publishes a striped upload of length bytes whose SHA-256 is in data
+    FILE_CHECKSUM,      // SHA-256 of a stored file in data, its size in balance
+    SHARD_MAP,          // A finance shard's map (see shard_map.h) in data; with data set, installs
+                        // that map to rebalance to, filename holding the one it replaces;
+                        // amount 1 then ends the rebalance
+    MIGRATE_OUT,        // Page images of the accounts a shard hands over in the rebalance, from
+                        // page position user_id on; balance is where to continue, -1 at the end
+    MIGRATE_IN,         // Page images in data handed over by node filename; amount 1 marks
+                        // the last batch from it
+    MIGRATE_DONE,       // Drops the accounts a shard has handed over
+    NUM_REQUEST_TYPES
 };
 
+/*
+ * Wire formats
+ *
+ * Every message is a 4-byte length header followed by the serialized body.
+ * Connections start out in TEXT_FORMAT (pipe-delimited fields). A client
+ * that sends a HELLO request carrying BINARY_PROTOCOL_VERSION switches both
+ * directions of the connection to BINARY_FORMAT:
+ *
+ * Request:  magic(1) version(1) type(1) flags(1) request_id(4) user_id(8)
+ *           amount(8) filename_len(4) data_len(4) filename data
+ * Response: magic(1) version(1) success(1) flags(1) request_id(4) balance(8)
+ *           data_len(4) message_len(4) data message
+ *
+ * A response echoes the request_id of the request it answers, which lets a
+ * client pipeline several requests and match the responses up in order.
+ *
+ * Integers are big-endian, doubles are IEEE 754 bit patterns in big-endian
+ * order, and strings are copied as-is without escaping.
+ *
+ * When FLAG_STREAMED is set the data field is empty and the payload follows
+ * the message as a sequence of chunks, each a 4-byte length and that many
+ * bytes, terminated by a zero-length chunk. Text connections never stream.
+ *
+ * When FLAG_ONE_WAY is set on a request the sender will not read a response
+ * and the server sends none. Text connections cannot carry the flag.
+ *
+ * When FLAG_RANGE is set on a request, offset(8) length(8) follow the header
+ * before the filename. File requests use them for byte ranges and resumable
+ * uploads; text connections cannot carry them either.
+ *
+ * When FLAG_DEADLINE is set on a request, timeout_ms(4) follows the header
+ * (and the range, if any) before the filename: how long the sender will
+ * wait for the response. Servers shed requests that have waited longer
+ * than that. Text connections cannot carry it.
+ *
+ * When FLAG_COMPRESSED is set on a streamed message, every chunk of its
+ * payload is codec(1) raw_length(4) data, decoding to at most CHUNK_SIZE
+ * bytes on its own (see compression.h). Peers only send it after agreeing
+ * on a codec in HELLO: the client puts "<codec>:<level>" in the request's
+ * data and the server echoes it back if it accepts.
+ */
+enum WireFormat {
+    TEXT_FORMAT,
+    BINARY_FORMAT
+};
+
+const uint8_t BINARY_MAGIC = 0xFB;
+const uint8_t BINARY_PROTOCOL_VERSION = 2;
+const size_t BINARY_REQUEST_HEADER_SIZE = 32;
+const size_t BINARY_RESPONSE_HEADER_SIZE = 24;
+
+// Binary header flags
+const uint8_t FLAG_STREAMED = 0x01;
+const uint8_t FLAG_ONE_WAY = 0x02;
+const uint8_t FLAG_RANGE = 0x04;
+const uint8_t FLAG_COMPRESSED = 0x08;
+const uint8_t FLAG_DEADLINE = 0x10;
+
+const size_t BINARY_RANGE_SIZE = 16;
+const size_t BINARY_DEADLINE_SIZE = 4;
+
+// Chunk size used when streaming from a descriptor. Receivers accept chunks
+// of any length but never buffer more than this at a time.
+const size_t CHUNK_SIZE = 64 * 1024;
+
+// Codecs of compressed payload chunks
+enum Codec {
+    CODEC_NONE,         // Stored as-is, e.g. because compressing did not shrink it
+    CODEC_DEFLATE       // zlib stream
+};
+
+// Compression levels a client can ask for in HELLO
+const int COMPRESSION_OFF = 0;
+const int COMPRESSION_FAST = 1;
+const int COMPRESSION_RATIO = 6;
+
 struct Request {
     RequestType type;
-    int user_id;
+    int64_t user_id;
     double amount;
     std::string filename;
     std::string data;
+    bool streamed;      // Payload follows as chunks instead of in data
+    bool one_way;       // No response is sent (binary format only)
+    uint32_t request_id; // Assigned by the sending channel (binary format only)
+    bool compressible;  // File data worth compressing: a streamed payload goes out compressed
+                        // if the connection negotiated it (FLAG_COMPRESSED)
+    
+    // DOWNLOAD_FILE: the bytes to send, length 0 meaning up to the end.
+    // UPLOAD_FILE: the payload goes at offset of a resumable upload whose
+    // complete file is length bytes. Sent only when set (FLAG_RANGE).
+    uint64_t offset;
+    uint64_t length;
+
+    // How long the sender waits for the response in milliseconds, 0 for no
+    // limit. Sent only when set (FLAG_DEADLINE).
+    uint32_t timeout_ms;
 
-    Request(RequestType t, int uid = 0, double amt = 0.0, 
+    Request(RequestType t, int64_t uid = 0, double amt = 0.0, 
             std::string fname = "", std::string d = "") : 
             type(t), user_id(uid), amount(amt), 
-            filename(fname), data(d) {}
+            filename(std::move(fname)), data(std::move(d)), streamed(false), one_way(false), request_id(0),
+            compressible(false), offset(0), length(0), timeout_ms(0) {}
+
+    bool has_range() const { return offset != 0 || length != 0; }
+
+    // Turns this into an empty request of type t, keeping the strings' capacity
+    void reset(RequestType t = QUIT);
+
+    std::string serialize(WireFormat format) const;
+    // Appends the serialized request to out
+    void serialize(WireFormat format, std::string& out) const;
+
+    // Parses either wire format; binary bodies are recognized by BINARY_MAGIC
+    static Request parseRequest(std::string_view buffer);
+    static Request parseBinary(const char* buf, size_t len);
+
+    // Parses a borrowed buffer into out, overwriting every field but reusing
+    // the buffers of its strings, so a request parsed into the same object
+    // each time allocates nothing once they are large enough. Returns false
+    // (leaving out a QUIT request) if buffer is malformed.
+    static bool parse(std::string_view buffer, Request& out);
 
-    static Request parseRequest(const std::string& buffer);
+    // BATCH payloads: length-prefixed binary requests back to back
+    static std::string serializeBatch(const std::vector<Request>& requests);
+    static std::vector<Request> parseBatch(const std::string& buffer);
+};
+
+/*
+ * One record of the logging server's binary log. The same encoding is used
+ * in its segment files and in QUERY_LOG results, so matches are sent without
+ * re-encoding:
+ *
+ * length(4) type(1) reserved(3) timestamp_us(8) user_id(8) amount(8) filename
+ *
+ * length covers the whole record. Integers are big-endian like the binary
+ * wire format. For LOGIN and LOGOUT filename holds the client's address.
+ */
+struct AuditRecord {
+    static const size_t HEADER_SIZE = 32;
+
+    int64_t timestamp_us;   // Microseconds since the Unix epoch
+    int64_t user_id;
+    RequestType type;
+    double amount;
+    std::string filename;
+
+    void serialize(std::string& out) const;
+
+    // Parses the record at buf; returns its length, or 0 if buf does not
+    // start with a complete, well-formed record
+    static size_t parse(const char* buf, size_t len, AuditRecord& out);
+
+    // Same wording as the text log, e.g. "[42]: deposited 10"
+    std::string describe() const;
+
+    // QUERY_LOG request for a user's records (user_id -1: everyone) with
+    // timestamps in [from_us, to_us]
+    static Request makeQuery(int64_t user_id, int64_t from_us, int64_t to_us);
+    static bool parseQuery(const Request& r, int64_t& from_us, int64_t& to_us);
 };
 
 struct Response {
@@ -36,10 +210,30 @@ struct Response {
     double balance;
     std::string data;
     std::string message;
+    bool streamed;      // Payload follows as chunks instead of in data
+    uint32_t request_id; // Copied from the request being answered
+    bool compressible;  // Like Request::compressible
 
     Response(bool s = false, double b = 0.0, 
             std::string d = "", std::string m = "") :
-            success(s), balance(b), data(d), message(m) {}
+            success(s), balance(b), data(std::move(d)), message(std::move(m)), streamed(false), request_id(0),
+            compressible(false) {}
+
+    // Like Request::reset; the result is a default-constructed response
+    void reset();
+
+    std::string serialize(WireFormat format) const;
+    void serialize(WireFormat format, std::string& out) const;
+
+    static Response parseResponse(std::string_view buffer);
+    static Response parseBinary(const char* buf, size_t len);
+
+    // Like Request::parse; a malformed buffer leaves out a failure
+    static bool parse(std::string_view buffer, Response& out);
+
+    // Responses to a BATCH, in the same order as its requests
+    static std::string serializeBatch(const std::vector<Response>& responses);
+    static std::vector<Response> parseBatch(const std::string& buffer);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,182 @@
+#include "compression.h"
+#include "logger.h"
+#include <zlib.h>
+#include <endian.h>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+
+using namespace std;
+
+const size_t PayloadCodec::HEADER_SIZE;
+
+// Extensions of formats that are compressed already
+static const char* const PRECOMPRESSED_EXTENSIONS[] = {
+    ".gz", ".tgz", ".zip", ".bz2", ".xz", ".zst", ".lz4", ".7z", ".rar",
+    ".png", ".jpg", ".jpeg", ".gif", ".webp",
+    ".mp3", ".mp4", ".mkv", ".mov", ".avi", ".webm",
+    ".docx", ".xlsx", ".pptx", ".jar"
+};
+
+PayloadCodec::PayloadCodec() : deflater(NULL), inflater(NULL), deflater_level(0) {}
+
+PayloadCodec::~PayloadCodec() {
+    if (deflater) {
+        deflateEnd(static_cast<z_stream*>(deflater));
+        delete static_cast<z_stream*>(deflater);
+    }
+    if (inflater) {
+        inflateEnd(static_cast<z_stream*>(inflater));
+        delete static_cast<z_stream*>(inflater);
+    }
+}
+
+static void store_raw(const char* data, size_t len, string& out) {
+    out.resize(PayloadCodec::HEADER_SIZE + len);
+    out[0] = CODEC_NONE;
+    uint32_t raw_length = htobe32(len);
+    memcpy(&out[1], &raw_length, 4);
+    memcpy(&out[PayloadCodec::HEADER_SIZE], data, len);
+}
+
+/**
+ * Encodes one chunk of a compressed payload
+ *
+ * @param codec Codec to try; CODEC_NONE stores the chunk as-is
+ * @param level Compression level (1 fastest, 9 smallest)
+ * @param data Chunk to encode
+ * @param len Its length, at most CHUNK_SIZE
+ * @param out Receives the encoded chunk, never more than HEADER_SIZE + len bytes
+ */
+void PayloadCodec::encode(Codec codec, int level, const char* data, size_t len, string& out) {
+    if (codec != CODEC_DEFLATE || len == 0) {
+        store_raw(data, len, out);
+        return;
+    }
+
+    z_stream* zs = static_cast<z_stream*>(deflater);
+    if (zs && deflater_level != level) {
+        deflateEnd(zs);
+        delete zs;
+        deflater = zs = NULL;
+    }
+    if (!zs) {
+        zs = new z_stream();
+        if (deflateInit(zs, level) != Z_OK) {
+            LOG_ERROR_LIMITED("Error initializing deflate: " << (zs->msg ? zs->msg : "unknown"));
+            delete zs;
+            store_raw(data, len, out);
+            return;
+        }
+        deflater = zs;
+        deflater_level = level;
+    } else {
+        deflateReset(zs);
+    }
+
+    // Only room for a result smaller than the input: anything else is stored raw
+    out.resize(HEADER_SIZE + len - 1);
+    zs->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    zs->avail_in = len;
+    zs->next_out = reinterpret_cast<Bytef*>(&out[HEADER_SIZE]);
+    zs->avail_out = len - 1;
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+        store_raw(data, len, out);
+        return;
+    }
+
+    out.resize(HEADER_SIZE + zs->total_out);
+    out[0] = CODEC_DEFLATE;
+    uint32_t raw_length = htobe32(len);
+    memcpy(&out[1], &raw_length, 4);
+}
+
+/**
+ * Decodes one chunk of a compressed payload
+ *
+ * @param chunk Encoded chunk as received
+ * @param len Its length
+ * @param out Buffer for the decoded bytes
+ * @param capacity Size of out
+ * @param decoded Receives the number of bytes decoded
+ * @return False if the chunk is malformed, uses an unknown codec or does
+ *         not fit in out
+ */
+bool PayloadCodec::decode(const char* chunk, size_t len, char* out, size_t capacity, size_t& decoded) {
+    if (len < HEADER_SIZE) return false;
+
+    uint32_t raw_length;
+    memcpy(&raw_length, chunk + 1, 4);
+    raw_length = be32toh(raw_length);
+    if (raw_length > capacity) return false;
+
+    const char* data = chunk + HEADER_SIZE;
+    size_t data_len = len - HEADER_SIZE;
+    decoded = raw_length;
+
+    switch (chunk[0]) {
+    case CODEC_NONE:
+        if (data_len != raw_length) return false;
+        memcpy(out, data, raw_length);
+        return true;
+
+    case CODEC_DEFLATE: {
+        z_stream* zs = static_cast<z_stream*>(inflater);
+        if (!zs) {
+            zs = new z_stream();
+            if (inflateInit(zs) != Z_OK) {
+                LOG_ERROR_LIMITED("Error initializing inflate: " << (zs->msg ? zs->msg : "unknown"));
+                delete zs;
+                return false;
+            }
+            inflater = zs;
+        } else {
+            inflateReset(zs);
+        }
+
+        zs->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        zs->avail_in = data_len;
+        zs->next_out = reinterpret_cast<Bytef*>(out);
+        zs->avail_out = raw_length;
+        return inflate(zs, Z_FINISH) == Z_STREAM_END && zs->total_out == raw_length && zs->avail_in == 0;
+    }
+
+    default:
+        return false;
+    }
+}
+
+string PayloadCodec::describe(Codec codec, int level) {
+    if (codec != CODEC_DEFLATE) return "";
+    return "deflate:" + to_string(level);
+}
+
+/**
+ * Parses a codec description from HELLO
+ *
+ * @return False unless it names a supported codec with a valid level
+ */
+bool PayloadCodec::parse(const string& description, Codec& codec, int& level) {
+    const string prefix = "deflate:";
+    if (description.compare(0, prefix.size(), prefix) != 0 || description.size() != prefix.size() + 1) {
+        return false;
+    }
+    char digit = description[prefix.size()];
+    if (digit < '1' || digit > '9') return false;
+
+    codec = CODEC_DEFLATE;
+    level = digit - '0';
+    return true;
+}
+
+bool is_precompressed(const string& filename) {
+    size_t dot_pos = filename.find_last_of(".");
+    if (dot_pos == string::npos) return false;
+
+    string ext = filename.substr(dot_pos);
+    transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return tolower(c); });
+    for (const char* known : PRECOMPRESSED_EXTENSIONS) {
+        if (ext == known) return true;
+    }
+    return false;
+}
@@ -0,0 +1,53 @@
+#ifndef _COMPRESSION_H_
+#define _COMPRESSION_H_
+
+#include "common.h"
+#include <string>
+#include <cstddef>
+
+/*
+ * PayloadCodec class
+ *
+ * Compresses and decompresses the chunks of FLAG_COMPRESSED payloads, one
+ * chunk at a time so nothing has to be buffered beyond CHUNK_SIZE. Each
+ * encoded chunk is self-contained:
+ *
+ *   codec(1) raw_length(4) data
+ *
+ * A chunk that would not get smaller is stored as CODEC_NONE, so data that
+ * turns out to be incompressible costs a few bytes per chunk, not a blow-up.
+ * The zlib streams are kept between chunks and reset, not reallocated.
+ */
+class PayloadCodec {
+public:
+    // Header in front of every encoded chunk
+    static const size_t HEADER_SIZE = 5;
+
+    PayloadCodec();
+    ~PayloadCodec();
+
+    PayloadCodec(const PayloadCodec&) = delete;
+    PayloadCodec& operator=(const PayloadCodec&) = delete;
+
+    // Encodes len (at most CHUNK_SIZE) bytes of data into out
+    void encode(Codec codec, int level, const char* data, size_t len, std::string& out);
+
+    // Decodes one encoded chunk into out, which holds capacity bytes;
+    // false if the chunk is malformed or decodes to more than capacity
+    bool decode(const char* chunk, size_t len, char* out, size_t capacity, size_t& decoded);
+
+    // HELLO data naming a codec and level ("deflate:1"), and its inverse
+    static std::string describe(Codec codec, int level);
+    static bool parse(const std::string& description, Codec& codec, int& level);
+
+private:
+    void* deflater;     // z_stream, created on first use
+    void* inflater;
+    int deflater_level;
+};
+
+// True for files whose content is compressed already (archives, images,
+// video...), judged by extension; compressing them again only costs CPU
+bool is_precompressed(const std::string& filename);
+
+#endif
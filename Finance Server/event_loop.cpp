@@ -0,0 +1,680 @@
+#include "event_loop.h"
+#include "signals.h"
+#include "logger.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <thread>
+#include <chrono>
+#include <cctype>
+#include <cstring>
+#include <cerrno>
+
+using namespace std;
+
+static const int MAX_EVENTS = 64;
+
+// epoll_wait timeout so the loop notices shutdown_requested promptly
+static const int POLL_INTERVAL_MS = 500;
+
+// Pipelined requests answered per dispatch before the connection yields
+static const int MAX_REQUESTS_PER_DISPATCH = 64;
+
+// How often a reactor blocked by admission control fires deadlines and
+// checks for shutdown
+static const int BLOCKED_CHECK_MS = 10;
+
+const size_t EventLoop::DEFAULT_MAX_QUEUED;
+
+static const char* PRIORITY_NAMES[EventLoop::NUM_PRIORITIES] = {"high", "normal", "low"};
+
+// Reads and session requests go first, bulk and scanning work last
+static EventLoop::Priority default_priority(int type) {
+    switch (type) {
+        case BALANCE: case LOGIN: case LOGOUT: case HELLO: case STATS: case UPLOAD_STATUS: case QUIT:
+            return EventLoop::HIGH_PRIORITY;
+        case EARN_INTEREST: case BATCH: case QUERY_LOG: case FILE_CHECKSUM:
+            return EventLoop::LOW_PRIORITY;
+        default:
+            return EventLoop::NORMAL_PRIORITY;
+    }
+}
+
+static uint64_t elapsed_ns(chrono::steady_clock::time_point since) {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - since).count();
+}
+
+// "Finance server" -> "finance"
+static string metrics_name(const string& server_name) {
+    string name;
+    for (char c : server_name) {
+        if (!isalnum(static_cast<unsigned char>(c))) break;
+        name += tolower(static_cast<unsigned char>(c));
+    }
+    return name.empty() ? "server" : name;
+}
+
+/**
+ * Creates an EventLoop around a listening channel
+ *
+ * @param listener SERVER_SIDE channel that accepts new clients
+ * @param pool Worker pool that runs the request handler
+ * @param handler Called for every request received on any connection
+ * @param server_name Prefix for connection log lines (e.g. "Finance server")
+ *
+ * @throws Exits with error message if the epoll instance cannot be created
+ */
+EventLoop::EventLoop(NetworkRequestChannel& listener, ThreadPool& pool,
+                     RequestHandler handler, const string& server_name)
+    : pool(pool), handler(handler), server_name(server_name),
+      metrics(metrics_name(server_name)), max_queued(DEFAULT_MAX_QUEUED), policy(BLOCK), lane_count(0),
+      blocked_reactors(0), in_flight(0) {
+    for (int t = 0; t < NUM_REQUEST_TYPES; t++) {
+        priorities[t] = default_priority(t);
+    }
+    add_reactor(listener);
+}
+
+/**
+ * Creates an EventLoop with one reactor per listening channel
+ *
+ * @param listeners SERVER_SIDE channels, usually SO_REUSEPORT listeners of one port
+ * @param pool Worker pool that runs the request handler
+ * @param handler Called for every request received on any connection
+ * @param server_name Prefix for connection log lines (e.g. "Finance server")
+ *
+ * @throws Exits with error message if an epoll instance cannot be created
+ */
+EventLoop::EventLoop(const vector<unique_ptr<NetworkRequestChannel>>& listeners, ThreadPool& pool,
+                     RequestHandler handler, const string& server_name)
+    : pool(pool), handler(handler), server_name(server_name),
+      metrics(metrics_name(server_name)), max_queued(DEFAULT_MAX_QUEUED), policy(BLOCK), lane_count(0),
+      blocked_reactors(0), in_flight(0) {
+    for (int t = 0; t < NUM_REQUEST_TYPES; t++) {
+        priorities[t] = default_priority(t);
+    }
+    for (const auto& listener : listeners) {
+        add_reactor(*listener);
+    }
+}
+
+/**
+ * Creates the epoll instance that accepts and polls for one listener
+ *
+ * @throws Exits with error message if the epoll instance cannot be created
+ */
+void EventLoop::add_reactor(NetworkRequestChannel& listener) {
+    unique_ptr<Reactor> reactor(new Reactor());
+    reactor->listener = &listener;
+    reactor->epoll_fd = epoll_create1(0);
+    if (reactor->epoll_fd == -1) {
+        LOG_ERROR("Error creating epoll instance " << strerror(errno));
+        throw("Error creating epoll instance");
+    }
+
+    listener.set_nonblocking();
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = listener.get_socket_fd();
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev) == -1) {
+        LOG_ERROR("Error registering listener " << strerror(errno));
+        throw("Error registering listener");
+    }
+
+    reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor->wake_fd == -1) {
+        LOG_ERROR("Error creating deadline eventfd " << strerror(errno));
+        throw("Error creating deadline eventfd");
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = reactor->wake_fd;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, ev.data.fd, &ev) == -1) {
+        LOG_ERROR("Error registering deadline eventfd " << strerror(errno));
+        throw("Error registering deadline eventfd");
+    }
+    reactor->wake_at = chrono::steady_clock::time_point::max();
+    reactors.push_back(move(reactor));
+}
+
+/**
+ * Destructor
+ *
+ * Waits for connections that are still being served by a worker, then
+ * closes every remaining connection.
+ */
+EventLoop::~EventLoop() {
+    {
+        unique_lock<mutex> lock(idle_mutex);
+        idle.wait(lock, [this] { return in_flight.load() == 0; });
+    }
+
+    for (auto& reactor : reactors) {
+        lock_guard<mutex> lock(reactor->connections_mutex);
+        reactor->connections.clear();
+        close(reactor->wake_fd);
+        close(reactor->epoll_fd);
+    }
+}
+
+/**
+ * Installs a hook that runs after the handler has answered a run of requests
+ *
+ * @param flush Sends queued responses, then resumes the connection
+ */
+void EventLoop::set_flush_handler(FlushHandler flush) {
+    this->flush = flush;
+}
+
+/**
+ * Installs a hook that adds server-specific metrics to every STATS report
+ *
+ * @param source Returns the extra samples; called on the worker answering STATS
+ */
+void EventLoop::set_stats_source(StatsSource source) {
+    stats_source = source;
+}
+
+/**
+ * Bounds the connections waiting for a worker
+ *
+ * @param max_queued Connections that may wait, 0 for no limit
+ * @param policy What happens to readable connections beyond that
+ */
+void EventLoop::set_admission(size_t max_queued, OverloadPolicy policy) {
+    this->max_queued = max_queued;
+    this->policy = policy;
+}
+
+/**
+ * Moves a request type to another lane
+ */
+void EventLoop::set_priority(RequestType type, Priority priority) {
+    if (type < 0 || type >= NUM_REQUEST_TYPES || priority < 0 || priority >= NUM_PRIORITIES) return;
+    priorities[type] = priority;
+}
+
+bool EventLoop::parse_overload_policy(const string& name, OverloadPolicy& out) {
+    if (name == "block") out = BLOCK;
+    else if (name == "reject") out = REJECT;
+    else if (name == "drop-oldest") out = DROP_OLDEST;
+    else return false;
+    return true;
+}
+
+/**
+ * Reports the server's metrics in the Prometheus text format
+ */
+string EventLoop::stats() {
+    ServerMetrics::Gauges gauges;
+    gauges.pool_threads = pool.size();
+    gauges.busy_connections = in_flight.load();
+    gauges.queue_limit = max_queued;
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        for (int p = 0; p < NUM_PRIORITIES; p++) {
+            gauges.lane_depths.push_back(make_pair(PRIORITY_NAMES[p], lanes[p].size()));
+        }
+        gauges.lane_depths.push_back(make_pair("rejected", rejected.size()));
+    }
+    for (auto& reactor : reactors) {
+        gauges.listener_fds.push_back(reactor->listener->get_socket_fd());
+    }
+    string report = metrics.report(gauges);
+    if (stats_source) report += stats_source(metrics_name(server_name));
+    return report;
+}
+
+// CPUs this process may run on, in order
+static vector<int> allowed_cpus() {
+    vector<int> cpus;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+static void pin_to_cpu(thread& t, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+    if (err != 0) {
+        LOG_WARN("Error pinning event loop to CPU " << cpu << " " << strerror(err));
+    }
+}
+
+/**
+ * Waits for events until shutdown is requested
+ *
+ * New connections are accepted on the reactor thread. Readable connections
+ * are handed to the thread pool one request at a time. With several
+ * listeners every reactor runs on its own thread, pinned to one of the
+ * CPUs the process may use, and run() returns once all of them have stopped.
+ */
+void EventLoop::run() {
+    if (reactors.size() == 1) {
+        poll(*reactors[0]);
+        return;
+    }
+
+    vector<int> cpus = allowed_cpus();
+    vector<thread> threads;
+    for (size_t i = 0; i < reactors.size(); i++) {
+        threads.emplace_back(&EventLoop::poll, this, ref(*reactors[i]));
+        if (!cpus.empty()) pin_to_cpu(threads.back(), cpus[i % cpus.size()]);
+    }
+    for (thread& t : threads) {
+        t.join();
+    }
+}
+
+/**
+ * Runs one reactor until shutdown is requested
+ */
+void EventLoop::poll(Reactor& reactor) {
+    struct epoll_event events[MAX_EVENTS];
+    vector<Task> ready;
+    ready.reserve(MAX_EVENTS);
+    int listener_fd = reactor.listener->get_socket_fd();
+
+    while (!SignalHandling::shutdown_requested) {
+        fire_deadlines(reactor);
+
+        int timeout;
+        {
+            lock_guard<mutex> lock(reactor.wheel_mutex);
+            int next = reactor.wheel.next_timeout_ms(chrono::steady_clock::now());
+            timeout = next >= 0 && next < POLL_INTERVAL_MS ? next : POLL_INTERVAL_MS;
+            reactor.wake_at = chrono::steady_clock::now() + chrono::milliseconds(timeout);
+        }
+
+        int n = epoll_wait(reactor.epoll_fd, events, MAX_EVENTS, timeout);
+        if (n == -1) {
+            // Interrupted by a signal, check for shutdown
+            if (errno == EINTR) continue;
+            LOG_ERROR("Error waiting for events " << strerror(errno));
+            break;
+        }
+
+        // Every readable connection of this wakeup goes to the pool at once
+        ready.clear();
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == listener_fd) {
+                accept_clients(reactor);
+            } else if (events[i].data.fd == reactor.wake_fd) {
+                // A worker scheduled a deadline before the timeout; the next iteration fires it
+                uint64_t count;
+                if (read(reactor.wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                    LOG_ERROR_LIMITED("Error reading deadline eventfd " << strerror(errno));
+                }
+            } else {
+                dispatch(reactor, events[i].data.fd, ready);
+            }
+        }
+        pool.enqueue_bulk(ready.begin(), ready.end());
+    }
+}
+
+/**
+ * Flags the channels whose request is still being handled past its deadline
+ *
+ * Runs on the reactor thread. Timers are cancelled under the same lock
+ * before their connection goes away, so every expired owner is alive.
+ */
+void EventLoop::fire_deadlines(Reactor& reactor) {
+    reactor.expired.clear();
+    lock_guard<mutex> lock(reactor.wheel_mutex);
+    reactor.wheel.advance(chrono::steady_clock::now(), reactor.expired);
+    for (TimerWheel::Timer* timer : reactor.expired) {
+        static_cast<Connection*>(timer->owner)->channel->expire_deadline();
+        metrics.deadline_missed();
+    }
+}
+
+/**
+ * Accepts every pending connection (the listener is edge-triggered)
+ *
+ * Accepted sockets are already non-blocking (see accept_connection()).
+ */
+void EventLoop::accept_clients(Reactor& reactor) {
+    while (true) {
+        int client_fd = reactor.listener->accept_connection();
+        if (client_fd == -1) {
+            if (errno == EINTR) continue;
+            return;
+        }
+
+        unique_ptr<Connection> conn(new Connection());
+        try {
+            conn->channel.reset(new NetworkRequestChannel(client_fd));
+        } catch (const char* e) {
+            close(client_fd);
+            continue;
+        }
+        conn->address = conn->channel->get_peer_address();
+        conn->reactor = &reactor;
+        conn->deadline_timer.owner = conn.get();
+        LOG_DEBUG(server_name << ": new client connection from " << conn->address);
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+        ev.data.fd = client_fd;
+
+        lock_guard<mutex> lock(reactor.connections_mutex);
+        if (epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+            LOG_ERROR_LIMITED("Error registering client " << strerror(errno));
+            continue;
+        }
+        reactor.connections[client_fd] = move(conn);
+        metrics.connection_opened();
+    }
+}
+
+/**
+ * Queues a readable connection in its lane and prepares the task that serves it
+ *
+ * EPOLLONESHOT guarantees no further events for this fd until the worker
+ * re-arms it, so the connection is never served by two workers at once,
+ * and no connection waits in more than one place.
+ *
+ * @param fd Readable connection
+ * @param ready Tasks submitted to the thread pool after the event batch
+ */
+void EventLoop::dispatch(Reactor& reactor, int fd, vector<Task>& ready) {
+    Connection* conn;
+    {
+        lock_guard<mutex> lock(reactor.connections_mutex);
+        auto it = reactor.connections.find(fd);
+        if (it == reactor.connections.end()) return;
+        conn = it->second.get();
+        in_flight++;
+    }
+
+    Priority priority = classify(conn);
+    Waiting entry = {fd, conn, chrono::steady_clock::now()};
+    metrics.task_queued();
+
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        if (max_queued > 0 && lane_count >= max_queued) {
+            if (policy == BLOCK) {
+                wait_for_space(reactor, lock, ready);
+            } else if (policy == REJECT || !evict(priority)) {
+                rejected.push_back(entry);
+                priority = NUM_PRIORITIES;
+            }
+        }
+        if (priority != NUM_PRIORITIES) {
+            lanes[priority].push_back(entry);
+            lane_count++;
+        }
+    }
+    ready.emplace_back([this]() { serve_next(); });
+}
+
+// Lane for the first request waiting on a connection, NORMAL_PRIORITY if it
+// has not fully arrived
+EventLoop::Priority EventLoop::classify(Connection* conn) {
+    RequestType type;
+    if (!conn->channel->peek_request_type(type)) return NORMAL_PRIORITY;
+    return priorities[type];
+}
+
+// DROP_OLDEST: moves the oldest connection of the lowest lane with any, but
+// no higher than priority, to the rejected ones. Called with queue_mutex held.
+bool EventLoop::evict(Priority priority) {
+    for (int p = NUM_PRIORITIES - 1; p >= priority; p--) {
+        if (lanes[p].empty()) continue;
+        rejected.push_back(lanes[p].front());
+        lanes[p].pop_front();
+        lane_count--;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * BLOCK: stops the reactor until a worker takes a connection off the lanes
+ *
+ * The connections this wakeup already queued are handed to the pool first,
+ * or nothing might ever free a slot. Deadlines keep firing meanwhile.
+ * Called with queue_mutex held through lock.
+ */
+void EventLoop::wait_for_space(Reactor& reactor, unique_lock<mutex>& lock, vector<Task>& ready) {
+    metrics.admission_blocked();
+    lock.unlock();
+    pool.enqueue_bulk(ready.begin(), ready.end());
+    ready.clear();
+    lock.lock();
+
+    blocked_reactors++;
+    while (lane_count >= max_queued && !SignalHandling::shutdown_requested) {
+        if (queue_space.wait_for(lock, chrono::milliseconds(BLOCKED_CHECK_MS)) == cv_status::timeout) {
+            lock.unlock();
+            fire_deadlines(reactor);
+            lock.lock();
+        }
+    }
+    blocked_reactors--;
+}
+
+/**
+ * Serves the next waiting connection on a worker thread
+ */
+void EventLoop::serve_next() {
+    Waiting next;
+    bool admitted = true;
+    bool notify = false;
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        if (!rejected.empty()) {
+            next = rejected.front();
+            rejected.pop_front();
+            admitted = false;
+        } else {
+            for (int p = 0; p < NUM_PRIORITIES; p++) {
+                if (lanes[p].empty()) continue;
+                next = lanes[p].front();
+                lanes[p].pop_front();
+                break;
+            }
+            lane_count--;
+            notify = blocked_reactors > 0;
+        }
+    }
+    if (notify) queue_space.notify_all();
+
+    metrics.task_started(elapsed_ns(next.since));
+    serve(next.fd, next.conn, next.since, admitted);
+}
+
+// Answers the current request without handling it, queued behind the
+// responses a flush handler holds back if there is one
+void EventLoop::refuse(NetworkRequestChannel& channel, const char* reason) {
+    Response resp(false, 0, "", reason);
+    if (flush) {
+        channel.queue_response(resp);
+    } else {
+        channel.send_response(resp);
+    }
+}
+
+/**
+ * Starts the deadline of a request about to be handled
+ *
+ * @param arrived When the request reached the server
+ * @return False if the deadline has already passed and the request should be shed
+ */
+bool EventLoop::start_deadline(Connection* conn, const Request& r, chrono::steady_clock::time_point arrived) {
+    NetworkRequestChannel& channel = *conn->channel;
+    if (r.timeout_ms == 0) {
+        channel.set_deadline(chrono::steady_clock::time_point::max());
+        return true;
+    }
+
+    auto deadline = arrived + chrono::milliseconds(r.timeout_ms);
+    if (chrono::steady_clock::now() >= deadline) return false;
+    channel.set_deadline(deadline);
+    conn->deadline_armed = true;
+
+    Reactor& reactor = *conn->reactor;
+    bool wake;
+    {
+        lock_guard<mutex> lock(reactor.wheel_mutex);
+        reactor.wheel.schedule(&conn->deadline_timer, deadline);
+        wake = deadline < reactor.wake_at;
+    }
+    if (wake) {
+        uint64_t one = 1;
+        if (write(reactor.wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            LOG_ERROR_LIMITED("Error writing deadline eventfd " << strerror(errno));
+        }
+    }
+    return true;
+}
+
+void EventLoop::stop_deadline(Connection* conn) {
+    if (!conn->deadline_armed) return;
+    conn->deadline_armed = false;
+    lock_guard<mutex> lock(conn->reactor->wheel_mutex);
+    conn->reactor->wheel.cancel(&conn->deadline_timer);
+}
+
+/**
+ * Receives and handles requests on a worker thread
+ *
+ * Requests a client pipelined are answered back to back while they are
+ * already buffered, up to MAX_REQUESTS_PER_DISPATCH so one busy client
+ * cannot monopolize a worker. The first request's deadline counts from
+ * when the loop saw it arrive (queued), so time spent in the pool's queue
+ * is charged to it; later ones count from when they were read.
+ *
+ * @param admitted False for a connection rejected by admission control,
+ *                 whose requests are all answered "Server busy"
+ */
+void EventLoop::serve(int fd, Connection* conn, chrono::steady_clock::time_point queued, bool admitted) {
+    NetworkRequestChannel& channel = *conn->channel;
+    bool keep_open = true;
+    bool quit = false;
+
+    try {
+        for (int served = 0; keep_open && served < MAX_REQUESTS_PER_DISPATCH; served++) {
+            const Request& r = channel.receive_request();
+            auto received = chrono::steady_clock::now();
+
+            if (r.type == QUIT) {
+                // Either an explicit QUIT or the client hung up
+                quit = true;
+                break;
+            } else if (r.type == HELLO) {
+                // Already answered by the channel
+                keep_open = channel.is_connected();
+            } else if (r.type == STATS) {
+                channel.send_response(Response(true, 0, stats(), "Server statistics"));
+                keep_open = channel.is_connected();
+            } else if (!admitted) {
+                refuse(channel, "Server busy");
+                keep_open = channel.is_connected();
+                metrics.request_rejected(r.type);
+                if (!channel.has_pending_input()) break;
+                continue;
+            } else if (!start_deadline(conn, r, served == 0 ? queued : received)) {
+                refuse(channel, "Deadline exceeded");
+                keep_open = channel.is_connected();
+                metrics.request_shed(r.type);
+                if (!channel.has_pending_input()) break;
+                continue;
+            } else {
+                handler(channel, r);
+                stop_deadline(conn);
+                keep_open = channel.is_connected();
+            }
+            metrics.request_handled(r.type, elapsed_ns(received));
+
+            if (!channel.has_pending_input()) break;
+        }
+    } catch (const exception& e) {
+        LOG_ERROR_LIMITED("Error handling client " << conn->address << ": " << e.what());
+        keep_open = false;
+    }
+    stop_deadline(conn);
+
+    if (!flush) {
+        finish(fd, conn, keep_open, quit);
+        return;
+    }
+    flush(channel, [this, fd, conn, keep_open, quit](bool ok) {
+        finish(fd, conn, keep_open && ok, quit && ok);
+    });
+}
+
+/**
+ * Acknowledges a QUIT and hands the connection back to the loop or closes it
+ *
+ * @param keep_open Whether the connection is still usable
+ * @param quit Whether the client asked to disconnect
+ */
+void EventLoop::finish(int fd, Connection* conn, bool keep_open, bool quit) {
+    NetworkRequestChannel& channel = *conn->channel;
+
+    if (quit) {
+        if (channel.is_connected()) {
+            Response resp(true, 0, "", "Server acknowledged disconnect");
+            channel.send_response(resp);
+        }
+        keep_open = false;
+    }
+
+    uint64_t received, sent;
+    channel.take_byte_counts(received, sent);
+    metrics.bytes_transferred(received, sent);
+
+    if (keep_open) {
+        rearm(fd, conn);
+    } else {
+        LOG_DEBUG(server_name << ": client " << conn->address << " disconnected");
+        close_connection(*conn->reactor, fd);
+    }
+
+    if (in_flight.fetch_sub(1) == 1) {
+        lock_guard<mutex> lock(idle_mutex);
+        idle.notify_all();
+    }
+}
+
+/**
+ * Re-enables events for a connection once its request has been answered
+ *
+ * If another request is already waiting in the socket buffer, epoll reports
+ * it immediately after the modification.
+ */
+void EventLoop::rearm(int fd, Connection* conn) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(conn->reactor->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+        LOG_ERROR_LIMITED("Error re-arming client " << strerror(errno));
+        close_connection(*conn->reactor, fd);
+    }
+}
+
+/**
+ * Removes a connection from its reactor and closes its socket
+ */
+void EventLoop::close_connection(Reactor& reactor, int fd) {
+    lock_guard<mutex> lock(reactor.connections_mutex);
+    epoll_ctl(reactor.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    reactor.connections.erase(fd);
+    metrics.connection_closed();
+}
@@ -0,0 +1,193 @@
+#ifndef _EVENT_LOOP_H_
+#define _EVENT_LOOP_H_
+
+#include "common.h"
+#include "network_channel.h"
+#include "thread_pool.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/*
+ * EventLoop class
+ *
+ * Multiplexes all client connections of a server over one epoll instance
+ * (edge-triggered, non-blocking sockets). Idle connections only cost a file
+ * descriptor: a connection is handed to the ThreadPool when a request has
+ * arrived on it and is given back to the loop as soon as that request has
+ * been answered, so a small pool can serve thousands of connected clients.
+ *
+ * A loop can also serve several listeners, typically SO_REUSEPORT sockets
+ * bound to the same port. Each gets its own reactor: an epoll instance, the
+ * connections it accepted and a thread pinned to its own core, so accepting
+ * and polling scale across cores while the kernel spreads new connections
+ * over the listeners. All reactors share the worker pool and the metrics.
+ *
+ * The loop also keeps the server's ServerMetrics and answers STATS requests
+ * itself, so every server built on it reports the same metrics.
+ *
+ * Requests that carry a deadline (Request::timeout_ms, counted from when the
+ * loop saw them arrive) are answered "Deadline exceeded" without running the
+ * handler if it has already passed by the time a worker reads them, e.g.
+ * after waiting in the pool's queue under overload. While the handler runs,
+ * the reactor's timer wheel flags the channel once the deadline passes
+ * (NetworkRequestChannel::deadline_exceeded()). FILE_CHECKSUM stops hashing
+ * as soon as it is flagged. EARN_INTEREST and QUERY_LOG check it once,
+ * before the interest sweep and before the results stream out: a sweep
+ * cannot be half applied and a streamed answer cannot turn into a failure.
+ *
+ * Readable connections wait for a worker in priority lanes, picked by the
+ * type of the first request waiting on them (peeked, not read), so reads
+ * like BALANCE overtake queued bulk work like EARN_INTEREST. At most
+ * max_queued connections wait; what happens to the next one is set by the
+ * OverloadPolicy. Rejected connections still get a worker, but only to
+ * answer their requests "Server busy", which costs far less than handling
+ * them.
+ */
+class EventLoop {
+public:
+    // Called on a worker thread for every request except QUIT.
+    // The handler is responsible for sending the response on the channel.
+    typedef std::function<void(NetworkRequestChannel&, const Request&)> RequestHandler;
+
+    // Called on the worker after each run of requests from one connection,
+    // on the thread that ran the handler, to send responses the handler
+    // queued. It must call the Resume it is given exactly once, from any
+    // thread, possibly later: the connection stays parked (no further
+    // requests are read from it) until then. Resume(false) drops it.
+    typedef std::function<void(bool keep_open)> Resume;
+    typedef std::function<void(NetworkRequestChannel&, Resume)> FlushHandler;
+
+    // Adds a server's own samples to STATS reports, in the same text format,
+    // with every metric name starting with prefix (e.g. "file")
+    typedef std::function<std::string(const std::string& prefix)> StatsSource;
+
+    // What happens to a readable connection while max_queued others wait for a worker
+    enum OverloadPolicy {
+        BLOCK,          // The reactor stops reading events until a slot frees up, so
+                        // clients back up into their socket buffers
+        REJECT,         // Its requests are answered "Server busy"
+        DROP_OLDEST     // The longest waiting connection of the lowest lane with any
+                        // (no higher than the new one's) is rejected instead
+    };
+
+    // Lanes in the order workers serve them
+    enum Priority {HIGH_PRIORITY, NORMAL_PRIORITY, LOW_PRIORITY, NUM_PRIORITIES};
+
+    static const size_t DEFAULT_MAX_QUEUED = 4096;
+
+    EventLoop(NetworkRequestChannel& listener, ThreadPool& pool,
+              RequestHandler handler, const std::string& server_name);
+    EventLoop(const std::vector<std::unique_ptr<NetworkRequestChannel>>& listeners, ThreadPool& pool,
+              RequestHandler handler, const std::string& server_name);
+    ~EventLoop();
+
+    void set_flush_handler(FlushHandler flush);
+    void set_stats_source(StatsSource source);
+
+    // Admission limits and lanes; call before run(). max_queued 0 means no limit.
+    void set_admission(size_t max_queued, OverloadPolicy policy);
+    void set_priority(RequestType type, Priority priority);
+
+    static bool parse_overload_policy(const std::string& name, OverloadPolicy& policy);
+
+    // Runs until SignalHandling::shutdown_requested is set
+    void run();
+
+    std::string stats();
+
+private:
+    struct Reactor;
+
+    struct Connection {
+        std::unique_ptr<NetworkRequestChannel> channel;
+        std::string address;
+        Reactor* reactor;       // The one that accepted it
+        TimerWheel::Timer deadline_timer;   // Scheduled while a request with a deadline runs
+        bool deadline_armed;                // Worker's view of the above, read without the lock
+
+        Connection() : reactor(nullptr), deadline_armed(false) {}
+    };
+
+    // One listener with its own epoll instance and connections
+    struct Reactor {
+        NetworkRequestChannel* listener;
+        int epoll_fd;
+
+        // Connections keyed by socket fd. A connection is owned by at most one
+        // worker at a time because every fd is registered with EPOLLONESHOT.
+        std::map<int, std::unique_ptr<Connection>> connections;
+        std::mutex connections_mutex;
+
+        // Deadlines of the requests being handled. Workers schedule them; the
+        // reactor thread fires them and sleeps no longer than the next one,
+        // or until a worker writes wake_fd (an eventfd) because it scheduled
+        // one earlier than wake_at.
+        TimerWheel wheel;
+        std::mutex wheel_mutex;
+        int wake_fd;
+        std::chrono::steady_clock::time_point wake_at;
+        std::vector<TimerWheel::Timer*> expired;    // Reactor thread only
+    };
+
+    // A readable connection waiting for a worker
+    struct Waiting {
+        int fd;
+        Connection* conn;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    void add_reactor(NetworkRequestChannel& listener);
+    void poll(Reactor& reactor);
+    void accept_clients(Reactor& reactor);
+    void dispatch(Reactor& reactor, int fd, std::vector<Task>& ready);
+    Priority classify(Connection* conn);
+    bool evict(Priority priority);
+    void wait_for_space(Reactor& reactor, std::unique_lock<std::mutex>& lock, std::vector<Task>& ready);
+    void serve_next();
+    void serve(int fd, Connection* conn, std::chrono::steady_clock::time_point queued, bool admitted);
+    void refuse(NetworkRequestChannel& channel, const char* reason);
+    bool start_deadline(Connection* conn, const Request& r, std::chrono::steady_clock::time_point arrived);
+    void stop_deadline(Connection* conn);
+    void fire_deadlines(Reactor& reactor);
+    void finish(int fd, Connection* conn, bool keep_open, bool quit);
+    void rearm(int fd, Connection* conn);
+    void close_connection(Reactor& reactor, int fd);
+
+    ThreadPool& pool;
+    RequestHandler handler;
+    FlushHandler flush;
+    StatsSource stats_source;
+    std::string server_name;
+    ServerMetrics metrics;
+    std::vector<std::unique_ptr<Reactor>> reactors;
+
+    // Admission: every waiting or rejected connection has one serve_next()
+    // task in the pool, which takes the oldest rejected connection if any,
+    // else the oldest one of the highest non-empty lane
+    size_t max_queued;
+    OverloadPolicy policy;
+    Priority priorities[NUM_REQUEST_TYPES];
+    std::mutex queue_mutex;
+    std::condition_variable queue_space;    // For reactors blocked by BLOCK
+    std::deque<Waiting> lanes[NUM_PRIORITIES];
+    std::deque<Waiting> rejected;
+    size_t lane_count;                      // Connections in all lanes
+    int blocked_reactors;
+
+    // Number of connections currently being served by a worker (or parked
+    // by the flush handler)
+    std::atomic<int> in_flight;
+    std::mutex idle_mutex;
+    std::condition_variable idle;
+};
+
+#endif
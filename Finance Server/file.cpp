@@ -1,117 +1,478 @@
 #include "common.h"
 #include "network_channel.h"
 #include "thread_pool.h"
+#include "event_loop.h"
 #include "signals.h"
+#include "logger.h"
+#include "chunk_store.h"
+#include "checksum.h"
+#include "file_cache.h"
 #include <iostream>
-#include <fstream>
-#include <sstream>
+#include <memory>
 #include <vector>
 #include <unistd.h>
 #include <getopt.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
 #include <cstring>
+#include <endian.h>
 
 using namespace std;
 
-// Function to handle client connection
-void handle_client(int client_sockfd, const vector<string>& allowed_extensions, int thread_count) {
-    // Create a network channel from the socket
-    NetworkRequestChannel channel(client_sockfd);
-    string client_address = channel.get_peer_address();
-    cout << "File server: new client connection from " << client_address << endl;
+// Interrupted resumable uploads wait here, one file per upload, until the rest arrives
+static const string PARTIAL_DIR = "storage/.partial";
+
+// Striped uploads are assembled here, each range written in place as it arrives
+static const string STRIPE_DIR = "storage/.stripes";
+
+// Checks filename against the extensions given on the command line
+static bool extension_allowed(const string& filename, const vector<string>& allowed_extensions, Response& resp) {
+    if (allowed_extensions.empty()) return true;
+
+    size_t dot_pos = filename.find_last_of(".");
+    if (dot_pos == string::npos) {
+        resp.success = false;
+        resp.message = "File has no extension";
+        return false;
+    }
+
+    string ext = filename.substr(dot_pos);
+    for (const string& allowed_ext : allowed_extensions) {
+        if (ext == allowed_ext) return true;
+    }
+    resp.success = false;
+    resp.message = "File extension not allowed";
+    return false;
+}
+
+// Moves a completely received upload into storage/ (or the chunk store) in one step,
+// so a file is never seen half-written
+static bool publish_upload(const string& temp, int fd, const string& filename, ChunkStore* store) {
+    if (!store) {
+        return rename(temp.c_str(), ("storage/" + filename).c_str()) == 0;
+    }
+    bool ok = lseek(fd, 0, SEEK_SET) == 0 && store->store_file(filename, fd);
+    unlink(temp.c_str());
+    return ok;
+}
+
+// Receives a whole upload into a temporary file, then publishes it
+static bool receive_upload(NetworkRequestChannel& channel, const Request& r, ChunkStore* store) {
+    string temp = PARTIAL_DIR + "/.upload-XXXXXX";
+    int fd = mkstemp(&temp[0]);
+    if (fd == -1) return false;
+
+    bool ok = channel.receive_payload(r, fd) && publish_upload(temp, fd, r.filename, store);
+    if (!ok) unlink(temp.c_str());
+    close(fd);
+    return ok;
+}
+
+/**
+ * Handles one piece of a resumable upload (UPLOAD_FILE with a range)
+ *
+ * The payload is written at r.offset of PARTIAL_DIR/<filename>. Whatever
+ * arrived before a connection dropped stays there, and the client resumes
+ * at the size reported by UPLOAD_STATUS. Once r.length bytes are present
+ * the file is published. An upload may restart at any offset it has
+ * already reached, but not skip ahead.
+ */
+static void resume_upload(NetworkRequestChannel& channel, const Request& r, ChunkStore* store, Response& resp) {
+    string temp = PARTIAL_DIR + "/" + r.filename;
+    int fd = open(temp.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        resp.success = false;
+        resp.message = "Failed to create file";
+        return;
+    }
+
+    // Only one connection may append at a time. The file must also still be
+    // the partial one, not one just published by the previous holder.
+    struct stat held, current;
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1 || fstat(fd, &held) == -1 || stat(temp.c_str(), &current) == -1 ||
+        held.st_ino != current.st_ino || held.st_dev != current.st_dev) {
+        close(fd);
+        resp.success = false;
+        resp.message = "Upload of this file already in progress";
+        return;
+    }
+
+    if (r.offset > static_cast<uint64_t>(held.st_size)) {
+        close(fd);
+        resp.success = false;
+        resp.balance = held.st_size;
+        resp.message = "Upload must resume at byte " + to_string(held.st_size);
+        return;
+    }
+
+    bool ok = ftruncate(fd, r.offset) == 0 && lseek(fd, r.offset, SEEK_SET) != -1 &&
+              channel.receive_payload(r, fd);
+    uint64_t size = lseek(fd, 0, SEEK_CUR);
+    resp.balance = size;
+
+    if (!ok) {
+        resp.success = false;
+        resp.message = "Failed to write file";
+    } else if (size > r.length) {
+        unlink(temp.c_str());
+        resp.success = false;
+        resp.balance = 0;
+        resp.message = "Upload longer than announced";
+    } else if (size < r.length) {
+        resp.success = false;
+        resp.message = "Upload incomplete, resume at byte " + to_string(size);
+    } else if (!publish_upload(temp, fd, r.filename, store)) {
+        resp.success = false;
+        resp.message = "Failed to write file";
+    } else {
+        resp.message = "File uploaded successfully";
+    }
+    close(fd);
+}
+
+// Writes one range of a striped upload (UPLOAD_STRIPE) at its offset. Ranges
+// arrive over several connections at once, each through its own descriptor.
+static void write_stripe(NetworkRequestChannel& channel, const Request& r, Response& resp) {
+    if (r.offset >= r.length) {
+        resp.success = false;
+        resp.message = "Stripe outside the file";
+        return;
+    }
+
+    int fd = open((STRIPE_DIR + "/" + r.filename).c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd == -1) {
+        resp.success = false;
+        resp.message = "Failed to create file";
+        return;
+    }
+    if (channel.receive_payload_at(r, fd, r.offset)) {
+        resp.message = "Stripe stored";
+    } else {
+        resp.success = false;
+        resp.message = "Failed to write file";
+    }
+    close(fd);
+}
+
+/**
+ * Publishes a striped upload once all of its ranges are in (UPLOAD_COMMIT)
+ *
+ * The assembled file is cut to r.length, which drops anything an earlier
+ * upload of the same name left behind it, and its SHA-256 must match the
+ * client's. A mismatch discards the upload.
+ */
+static void commit_stripes(const Request& r, ChunkStore* store, Response& resp) {
+    string temp = STRIPE_DIR + "/" + r.filename;
+    int fd = open(temp.c_str(), O_RDWR);
+    if (fd == -1) {
+        resp.success = false;
+        resp.message = "No striped upload of this file";
+        return;
+    }
+
+    string digest;
+    if (ftruncate(fd, r.length) == -1 || !Sha256::file(fd, r.length, digest)) {
+        resp.success = false;
+        resp.message = "Failed to write file";
+    } else if (digest != r.data) {
+        unlink(temp.c_str());
+        resp.success = false;
+        resp.message = "Checksum mismatch, upload discarded";
+    } else if (!publish_upload(temp, fd, r.filename, store)) {
+        resp.success = false;
+        resp.message = "Failed to write file";
+    } else {
+        resp.message = "File uploaded successfully";
+    }
+    close(fd);
+}
+
+// SHA-256 and size of a stored file (FILE_CHECKSUM). Hashing a large file
+// stops early once the request's deadline has passed, nobody waits for it.
+static void file_checksum(NetworkRequestChannel& channel, const Request& r, ChunkStore* store, Response& resp) {
+    vector<ChunkRef> chunks;
+    if (store && store->manifest(r.filename, chunks)) {
+        Sha256 hash;
+        string chunk;
+        uint64_t size = 0;
+        for (const ChunkRef& c : chunks) {
+            if (channel.deadline_exceeded()) {
+                resp.success = false;
+                resp.message = "Deadline exceeded";
+                return;
+            }
+            if (!store->read_chunk(c, chunk)) {
+                resp.success = false;
+                resp.message = "Failed to read file";
+                return;
+            }
+            hash.update(chunk.data(), chunk.size());
+            size += chunk.size();
+        }
+        resp.data = hash.digest();
+        resp.balance = size;
+        resp.message = "Checksum computed";
+        return;
+    }
+
+    int fd = open(("storage/" + r.filename).c_str(), O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        resp.success = false;
+        resp.message = "File not found";
+    } else if (!Sha256::file(fd, st.st_size, resp.data, [&channel] { return channel.deadline_exceeded(); })) {
+        resp.success = false;
+        resp.message = channel.deadline_exceeded() ? "Deadline exceeded" : "Failed to read file";
+    } else {
+        resp.balance = st.st_size;
+        resp.message = "Checksum computed";
+    }
+    if (fd != -1) close(fd);
+}
+
+/**
+ * Reads a whole file into a response ready for the cache
+ *
+ * @return Null if the file does not exist, cannot be read or is larger than max_size;
+ *         the download is then served the usual way
+ */
+static FileCache::Entry load_download(const string& filename, ChunkStore* store, size_t max_size) {
+    Response resp(true, 0, "", "File downloaded successfully");
+    vector<ChunkRef> chunks;
+    if (store && store->manifest(filename, chunks)) {
+        uint64_t size = 0;
+        for (const ChunkRef& c : chunks) size += c.length;
+        if (size > max_size) return FileCache::Entry();
+        
+        resp.balance = size;
+        shared_ptr<PreparedResponse> prepared(new PreparedResponse(resp, size));
+        string chunk;
+        char* out = prepared->payload();
+        for (const ChunkRef& c : chunks) {
+            if (!store->read_chunk(c, chunk)) return FileCache::Entry();
+            memcpy(out, chunk.data(), chunk.size());
+            out += chunk.size();
+        }
+        return prepared;
+    }
     
-    bool running = true;
+    int fd = open(("storage/" + filename).c_str(), O_RDONLY);
+    if (fd == -1) return FileCache::Entry();
     
-    while (running && !SignalHandling::shutdown_requested) {
-        try {
-            // Receive request
-            Request r = channel.receive_request();
-            
-            if (r.type == QUIT) {
-                Response resp(true, 0, "", "Server acknowledged disconnect");
+    struct stat st;
+    shared_ptr<PreparedResponse> prepared;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && static_cast<uint64_t>(st.st_size) <= max_size) {
+        resp.balance = st.st_size;
+        prepared.reset(new PreparedResponse(resp, st.st_size));
+        size_t done = 0;
+        while (done < prepared->payload_size()) {
+            ssize_t n = pread(fd, prepared->payload() + done, prepared->payload_size() - done, done);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) {
+                prepared.reset();
+                break;
+            }
+            done += n;
+        }
+    }
+    close(fd);
+    return prepared;
+}
+
+// Works out which bytes of a size-byte file a download asks for
+static bool download_range(const Request& r, uint64_t size, uint64_t& offset, uint64_t& length, Response& resp) {
+    resp.balance = size;
+    offset = r.offset;
+    if (offset > size) {
+        resp.success = false;
+        resp.message = "Range not satisfiable";
+        return false;
+    }
+    length = size - offset;
+    if (r.length != 0 && r.length < length) length = r.length;
+    return true;
+}
+
+// Function to handle a single client request
+void handle_request(NetworkRequestChannel& channel, const Request& r, const vector<string>& allowed_extensions,
+                    ChunkStore* store, FileCache* cache) {
+    Response resp;
+    resp.success = true;
+    
+    if (r.type == UPLOAD_FILE) {
+        // Check file extension if extensions were provided
+        if (!extension_allowed(r.filename, allowed_extensions, resp)) {
+            channel.send_response(resp);
+            return;
+        }
+        
+        if (r.has_range()) {
+            resume_upload(channel, r, store, resp);
+        } else if (receive_upload(channel, r, store)) {
+            // Streamed straight into a temporary file instead of being buffered
+            resp.message = "File uploaded successfully";
+        } else {
+            resp.success = false;
+            resp.message = "Failed to write file";
+        }
+    }
+    else if (r.type == UPLOAD_STRIPE || r.type == UPLOAD_COMMIT) {
+        if (!extension_allowed(r.filename, allowed_extensions, resp)) {
+            // Message already set
+        } else if (r.type == UPLOAD_STRIPE) {
+            write_stripe(channel, r, resp);
+        } else {
+            commit_stripes(r, store, resp);
+        }
+    }
+    else if (r.type == FILE_CHECKSUM) {
+        file_checksum(channel, r, store, resp);
+    }
+    else if (r.type == UPLOAD_STATUS) {
+        struct stat st;
+        resp.balance = stat((PARTIAL_DIR + "/" + r.filename).c_str(), &st) == 0 ? st.st_size : 0;
+        resp.message = to_string(static_cast<uint64_t>(resp.balance)) + " bytes received";
+    }
+    else if (r.type == DOWNLOAD_FILE) {
+        // Sent compressed if the connection negotiated it and the content is not compressed already
+        resp.compressible = !is_precompressed(r.filename);
+        
+        // Hot files are answered from memory; ranges always come from disk, and
+        // so do downloads to be compressed since cached responses are raw
+        if (cache && !r.has_range() && !(resp.compressible && channel.compresses_payloads())) {
+            uint64_t generation;
+            FileCache::Entry entry = cache->lookup(r.filename, generation);
+            if (!entry) {
+                entry = load_download(r.filename, store, cache->max_entry());
+                if (entry) cache->insert(r.filename, entry, generation);
+            }
+            if (entry) {
+                channel.send_prepared(*entry);
+                return;
+            }
+        }
+        
+        // Files stored before the chunk store was enabled are still served whole
+        // The response's balance is the size of the whole file
+        uint64_t offset, length;
+        vector<ChunkRef> chunks;
+        if (store && store->manifest(r.filename, chunks)) {
+            uint64_t size = 0;
+            for (const ChunkRef& c : chunks) size += c.length;
+            if (!download_range(r, size, offset, length, resp)) {
                 channel.send_response(resp);
-                running = false;
-                continue;
+                return;
             }
             
-            Response resp;
-            resp.success = true;
+            // Chunks before the range are skipped without being read
+            size_t next = 0;
+            uint64_t start = 0;
+            while (next < chunks.size() && start + chunks[next].length <= offset) {
+                start += chunks[next++].length;
+            }
+            uint64_t skip = offset - start;
             
-            if (r.type == UPLOAD_FILE) {
-                // Check file extension if extensions were provided
-                if (!allowed_extensions.empty()) {
-                    size_t dot_pos = r.filename.find_last_of(".");
-                    if (dot_pos == string::npos) {
-                        resp.success = false;
-                        resp.message = "File has no extension";
-                        channel.send_response(resp);
-                        continue;
-                    }
-
-                    string ext = r.filename.substr(dot_pos);
-                    bool allowed = false;
-                    for (const string& allowed_ext : allowed_extensions) {
-                        if (ext == allowed_ext) {
-                            allowed = true;
-                            break;
-                        }
-                    }
-                    
-                    if (!allowed) {
-                        resp.success = false;
-                        resp.message = "File extension not allowed";
-                        channel.send_response(resp);
-                        continue;
-                    }
+            resp.message = "File downloaded successfully";
+            channel.send_response_chunks(resp, [store, &chunks, &next, &skip, &length, &r](string& chunk) {
+                if (next == chunks.size() || length == 0) return false;
+                if (!store->read_chunk(chunks[next], chunk)) {
+                    LOG_ERROR_LIMITED("Error reading chunk " << next << " of " << r.filename);
+                    return false;
                 }
-                
-                string filepath = "storage/" + r.filename;
-                ofstream outfile(filepath);
-                
-                if (!outfile) {
-                    resp.success = false;
-                    resp.message = "Failed to create file";
-                } else {
-                    outfile << r.data;
-                    outfile.close();
-                    resp.message = "File uploaded successfully";
+                next++;
+                if (skip > 0) {
+                    chunk.erase(0, skip);
+                    skip = 0;
                 }
+                if (chunk.size() > length) chunk.resize(length);
+                length -= chunk.size();
+                return true;
+            });
+            return;
+        }
+        
+        string filepath = "storage/" + r.filename;
+        int fd = open(filepath.c_str(), O_RDONLY);
+        struct stat st;
+        
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            resp.success = false;
+            resp.message = "File not found";
+        } else if (download_range(r, st.st_size, offset, length, resp)) {
+            resp.message = "File downloaded successfully";
+            if (r.has_range()) {
+                channel.send_response_range(resp, fd, offset, length);
+            } else {
+                // The whole file goes from the page cache to the socket with sendfile
+                channel.send_response_file(resp, fd);
             }
-            else if (r.type == DOWNLOAD_FILE) {
-                string filepath = "storage/" + r.filename;
-                ifstream infile(filepath);
-                
-                if (!infile) {
-                    resp.success = false;
-                    resp.message = "File not found";
-                } else {
-                    stringstream buffer;
-                    buffer << infile.rdbuf();
-                    resp.data = buffer.str();
-                    resp.message = "File downloaded successfully";
-                    infile.close();
-                }
+            close(fd);
+            return;
+        }
+        if (fd != -1) close(fd);
+    }
+    else if (r.type == PUT_CHUNK || r.type == UPLOAD_MANIFEST) {
+        if (!store) {
+            resp.success = false;
+            resp.message = "Chunked storage not enabled";
+        } else if (r.type == PUT_CHUNK) {
+            if (r.data.empty() || r.data.size() > Chunker::MAX_SIZE) {
+                resp.success = false;
+                resp.message = "Invalid chunk size";
+            } else if (!store->put(r.data, resp.data)) {
+                resp.success = false;
+                resp.message = "Failed to write chunk";
+            } else {
+                resp.message = "Chunk stored";
             }
-            else {
+        } else {
+            vector<ChunkRef> chunks;
+            vector<uint32_t> missing;
+            if (!extension_allowed(r.filename, allowed_extensions, resp)) {
+                // Message already set
+            } else if (!Chunker::decode_manifest(r.data, chunks)) {
+                resp.success = false;
+                resp.message = "Invalid manifest";
+            } else if (store->commit(r.filename, chunks, missing)) {
+                resp.message = "File uploaded successfully";
+            } else {
+                // The client sends these and offers the manifest again
                 resp.success = false;
-                resp.message = "Unknown RequestType";
+                resp.message = to_string(missing.size()) + " chunks missing";
+                for (uint32_t index : missing) {
+                    uint32_t be = htobe32(index);
+                    resp.data.append(reinterpret_cast<const char*>(&be), 4);
+                }
+                if (missing.empty()) resp.message = "Failed to write manifest";
             }
-
-            channel.send_response(resp);
-        }
-        catch (const exception& e) {
-            cerr << "Error handling client " << client_address << ": " << e.what() << endl;
-            running = false;
         }
     }
+    else {
+        resp.success = false;
+        resp.message = "Unknown RequestType";
+    }
     
-    cout << "File server: client " << client_address << " disconnected" << endl;
+    // The replaced file must not be served from the cache any more
+    if (cache && resp.success && (r.type == UPLOAD_FILE || r.type == UPLOAD_COMMIT || r.type == UPLOAD_MANIFEST)) {
+        cache->invalidate(r.filename);
+    }
+
+    channel.send_response(resp);
 }
 
 void print_usage() {
-    cout << "Usage: ./file_server [-p PORT] [-t THREAD_COUNT] [ALLOWED_EXTENSIONS...]" << endl;
+    cout << "Usage: ./file_server [-p PORT] [-t THREAD_COUNT] [-C] [-M CACHE_MB] [-L LISTENERS] [ALLOWED_EXTENSIONS...]" << endl;
     cout << "  -p, --port         Port number to listen on (default: 8001)" << endl;
     cout << "  -t, --threads      Number of threads in the thread pool (default: 4)" << endl;
+    cout << "  -C, --chunked      Store uploads as deduplicated content-defined chunks" << endl;
+    cout << "  -M, --cache-mb     Memory for caching whole downloads of hot files in MB, 0 to disable (default: 256)" << endl;
+    cout << "  -L, --listeners    SO_REUSEPORT listeners, each with an event loop on its own core (default: 1)" << endl;
+    cout << "  -b, --backlog      Connections the kernel queues for each listener (default: " << SOMAXCONN << ")" << endl;
+    cout << "  -Q, --max-queued   Connections that may wait for a worker, 0 for no limit (default: " << EventLoop::DEFAULT_MAX_QUEUED << ")" << endl;
+    cout << "  -O, --overload     block, reject (answer \"Server busy\") or drop-oldest once that many wait (default: block)" << endl;
+    cout << "  -v, --verbose      Also log every client connect and disconnect" << endl;
+    cout << "  -q, --quiet        Only log warnings and errors" << endl;
     cout << "  -h, --help         Show this help message" << endl;
     cout << "  ALLOWED_EXTENSIONS List of allowed file extensions (e.g., .txt .pdf)" << endl;
 }
@@ -119,20 +480,35 @@ void print_usage() {
 int main(int argc, char* argv[]) {
     int port = 8001;
     int thread_count = 4;
+    int listener_count = 1;
+    int backlog = SOMAXCONN;
+    size_t max_queued = EventLoop::DEFAULT_MAX_QUEUED;
+    EventLoop::OverloadPolicy overload = EventLoop::BLOCK;
+    bool chunked = false;
+    size_t cache_mb = 256;
     vector<string> allowed_extensions;
     
     // Parse command line arguments
     static struct option long_options[] = {
         {"port", required_argument, 0, 'p'},
         {"threads", required_argument, 0, 't'},
+        {"chunked", no_argument, 0, 'C'},
+        {"cache-mb", required_argument, 0, 'M'},
+        {"listeners", required_argument, 0, 'L'},
+        {"backlog", required_argument, 0, 'b'},
+        {"max-queued", required_argument, 0, 'Q'},
+        {"overload", required_argument, 0, 'O'},
+        {"verbose", no_argument, 0, 'v'},
+        {"quiet", no_argument, 0, 'q'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
     
+    int log_level = LOG_LEVEL_INFO;
     int option_index = 0;
     int c;
     
-    while ((c = getopt_long(argc, argv, "p:t:h", long_options, &option_index)) != -1) {
+    while ((c = getopt_long(argc, argv, "p:t:CM:L:b:Q:O:vqh", long_options, &option_index)) != -1) {
         switch (c) {
             case 'p':
                 port = atoi(optarg);
@@ -140,6 +516,33 @@ int main(int argc, char* argv[]) {
             case 't':
                 thread_count = atoi(optarg);
                 break;
+            case 'C':
+                chunked = true;
+                break;
+            case 'M':
+                cache_mb = strtoull(optarg, NULL, 10);
+                break;
+            case 'L':
+                listener_count = atoi(optarg);
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                break;
+            case 'Q':
+                max_queued = strtoull(optarg, NULL, 10);
+                break;
+            case 'O':
+                if (!EventLoop::parse_overload_policy(optarg, overload)) {
+                    print_usage();
+                    return 1;
+                }
+                break;
+            case 'v':
+                log_level = LOG_LEVEL_DEBUG;
+                break;
+            case 'q':
+                log_level = LOG_LEVEL_WARN;
+                break;
             case 'h':
                 print_usage();
                 return 0;
@@ -156,69 +559,79 @@ int main(int argc, char* argv[]) {
         allowed_extensions.push_back(argv[i]);
     }
     
+    if (listener_count < 1) listener_count = 1;
+
+    // Diagnostics are written by a background thread from here on
+    Logger::instance().set_level(log_level);
+    Logger::instance().start_async();
+    
     // Setup signal handlers
     SignalHandling::setup_handlers();
     SignalHandling::log_signal_event("File server started on port " + to_string(port));
     
     // Create storage directory if it doesn't exist
     if (mkdir("storage", 0755) != 0 && errno != EEXIST) {
-        cerr << "Error creating storage directory: " << strerror(errno) << endl;
+        LOG_ERROR("Error creating storage directory: " << strerror(errno));
         return 1;
     }
+    for (const string& dir : {PARTIAL_DIR, STRIPE_DIR}) {
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            LOG_ERROR("Error creating " << dir << " directory: " << strerror(errno));
+            return 1;
+        }
+    }
     
     try {
         // TODO: Create a TCP server socket and a thread pool for handling connections
-        NetworkRequestChannel sock("", port, NetworkRequestChannel::Side::SERVER_SIDE);
+        // With several listeners the kernel spreads new connections over them
+        NetworkRequestChannel::ListenOptions listen_options;
+        listen_options.backlog = backlog;
+        listen_options.reuse_port = listener_count > 1;
+        vector<unique_ptr<NetworkRequestChannel>> listeners;
+        for (int i = 0; i < listener_count; i++) {
+            listeners.emplace_back(new NetworkRequestChannel("", port, listen_options));
+        }
         ThreadPool Pool(thread_count);
+        
+        unique_ptr<ChunkStore> store;
+        if (chunked) store.reset(new ChunkStore("storage"));
+        ChunkStore* chunks = store.get();
+        
+        unique_ptr<FileCache> file_cache;
+        if (cache_mb > 0) file_cache.reset(new FileCache(cache_mb * 1024 * 1024));
+        FileCache* cache = file_cache.get();
+        
+        // Connections are multiplexed by the event loop; workers only run individual requests
+        EventLoop loop(listeners, Pool, [&allowed_extensions, chunks, cache](NetworkRequestChannel& channel, const Request& r) {
+            handle_request(channel, r, allowed_extensions, chunks, cache);
+        }, "File server");
+        loop.set_admission(max_queued, overload);
+        if (cache) {
+            loop.set_stats_source([cache](const string& prefix) { return cache->report(prefix); });
+        }
 
-        cout << "File server listening on port " << port << endl;
+        LOG_INFO("File server listening on port " << port);
+        if (chunks) LOG_INFO("Storing uploads as deduplicated chunks");
+        if (cache) LOG_INFO("Caching hot files in " << cache_mb << " MB");
         
         // Print allowed extensions
         if (allowed_extensions.empty()) {
-            cout << "All file extensions are allowed" << endl;
+            LOG_INFO("All file extensions are allowed");
         } else {
-            cout << "Allowed file extensions:";
+            string list;
             for (const string& ext : allowed_extensions) {
-                cout << " " << ext;
+                list += " " + ext;
             }
-            cout << endl;
+            LOG_INFO("Allowed file extensions:" << list);
         }
         
-        // Accept client connections until shutdown is requested
-        while (!SignalHandling::shutdown_requested) {
-            try {
-                // TODO: Accept a new client connection and add a task that runs handle_client to the thread pool.
-                int accepted = sock.accept_connection();
-                Pool.enqueue([accepted, allowed_extensions, thread_count]() { 
-                    handle_client(accepted, allowed_extensions, thread_count);
-                });
-
-                // TODO: Check if accept was interrupted by a signal (EINTR)
-                // If so, continue to the next iteration to check for shutdown
-                if (accepted == -1) {
-                    if (errno == EINTR) {
-                    continue;
-                    }
-                    
-                }
-            }
-            catch (const exception& e) {
-                cerr << "Error accepting connection: " << e.what() << endl;
-                
-                // Check if we need to exit
-                if (SignalHandling::shutdown_requested) {
-                    break;
-                }
-                
-                // Short delay before retry
-                sleep(1);
-            }
-        }
+        // Accept and serve client connections until shutdown is requested
+        loop.run();
         
-        cout << "File server shutting down..." << endl;
+        LOG_INFO("File server shutting down...");
     }
     catch (const exception& e) {
-        cerr << "Error starting file server: " << e.what() << endl;
+        LOG_ERROR("Error starting file server: " << e.what());
     }
     
     SignalHandling::log_signal_event("File server shutdown complete");
@@ -0,0 +1,128 @@
+#include "file_cache.h"
+#include <sstream>
+#include <iomanip>
+#include <functional>
+
+using namespace std;
+
+const size_t FileCache::SHARDS;
+
+// Bytes an entry is charged for: its response and its key
+static size_t entry_cost(const string& filename, const FileCache::Entry& entry) {
+    return filename.size() + entry->size();
+}
+
+/**
+ * Creates an empty cache
+ *
+ * @param capacity_bytes Memory budget over all shards
+ */
+FileCache::FileCache(size_t capacity_bytes) : shard_capacity(capacity_bytes / SHARDS) {}
+
+FileCache::Shard& FileCache::shard_for(const string& filename) {
+    return shards[hash<string>()(filename) % SHARDS];
+}
+
+void FileCache::erase(Shard& shard, LruList::iterator it) {
+    shard.bytes -= entry_cost(it->first, it->second);
+    shard.index.erase(it->first);
+    shard.lru.erase(it);
+}
+
+FileCache::Entry FileCache::lookup(const string& filename, uint64_t& generation) {
+    Shard& shard = shard_for(filename);
+    lock_guard<mutex> lock(shard.mutex);
+
+    auto found = shard.index.find(filename);
+    if (found == shard.index.end()) {
+        shard.misses++;
+        generation = shard.generation;
+        return Entry();
+    }
+    shard.hits++;
+    shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+    return found->second->second;
+}
+
+/**
+ * Caches the response for filename, evicting least recently used entries
+ *
+ * @param filename File the response is the contents of
+ * @param entry Response read after lookup() missed
+ * @param generation What that lookup() returned; the entry is dropped if the
+ *                   shard has been invalidated since
+ */
+void FileCache::insert(const string& filename, Entry entry, uint64_t generation) {
+    size_t cost = entry_cost(filename, entry);
+    if (cost > shard_capacity) return;
+
+    Shard& shard = shard_for(filename);
+    lock_guard<mutex> lock(shard.mutex);
+    if (shard.generation != generation) return;
+
+    // Another miss on the same file may have got here first
+    auto found = shard.index.find(filename);
+    if (found != shard.index.end()) erase(shard, found->second);
+
+    while (shard.bytes + cost > shard_capacity && !shard.lru.empty()) {
+        erase(shard, prev(shard.lru.end()));
+        shard.evictions++;
+    }
+    shard.lru.emplace_front(filename, entry);
+    shard.index[filename] = shard.lru.begin();
+    shard.bytes += cost;
+}
+
+void FileCache::invalidate(const string& filename) {
+    Shard& shard = shard_for(filename);
+    lock_guard<mutex> lock(shard.mutex);
+
+    shard.generation++;
+    auto found = shard.index.find(filename);
+    if (found != shard.index.end()) {
+        erase(shard, found->second);
+        shard.invalidations++;
+    }
+}
+
+/**
+ * Builds the cache's samples in the Prometheus text format
+ *
+ * @param prefix Start of every metric name, e.g. "file"
+ */
+string FileCache::report(const string& prefix) {
+    uint64_t hits = 0, misses = 0, evictions = 0, invalidations = 0, bytes = 0, entries = 0;
+    for (Shard& shard : shards) {
+        lock_guard<mutex> lock(shard.mutex);
+        hits += shard.hits;
+        misses += shard.misses;
+        evictions += shard.evictions;
+        invalidations += shard.invalidations;
+        bytes += shard.bytes;
+        entries += shard.lru.size();
+    }
+
+    ostringstream out;
+    out << setprecision(9);
+    auto header = [&out, &prefix](const string& metric, const char* type, const char* help) {
+        out << "# HELP " << prefix << "_" << metric << " " << help << "\n"
+            << "# TYPE " << prefix << "_" << metric << " " << type << "\n";
+    };
+
+    header("cache_lookups_total", "counter", "Whole-file downloads looked up in the file cache");
+    out << prefix << "_cache_lookups_total{result=\"hit\"} " << hits << "\n";
+    out << prefix << "_cache_lookups_total{result=\"miss\"} " << misses << "\n";
+    header("cache_hit_ratio", "gauge", "Share of file cache lookups that hit since startup");
+    out << prefix << "_cache_hit_ratio " << (hits + misses > 0 ? static_cast<double>(hits) / (hits + misses) : 0) << "\n";
+    header("cache_evictions_total", "counter", "Entries evicted to make room");
+    out << prefix << "_cache_evictions_total " << evictions << "\n";
+    header("cache_invalidations_total", "counter", "Entries dropped because their file was replaced");
+    out << prefix << "_cache_invalidations_total " << invalidations << "\n";
+    header("cache_entries", "gauge", "Files in the file cache");
+    out << prefix << "_cache_entries " << entries << "\n";
+    header("cache_bytes", "gauge", "Memory held by the file cache");
+    out << prefix << "_cache_bytes " << bytes << "\n";
+    header("cache_capacity_bytes", "gauge", "Memory budget of the file cache");
+    out << prefix << "_cache_capacity_bytes " << shard_capacity * SHARDS << "\n";
+    return out.str();
+}
@@ -0,0 +1,73 @@
+#ifndef _FILE_CACHE_H_
+#define _FILE_CACHE_H_
+
+#include "network_channel.h"
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+/*
+ * FileCache class
+ *
+ * Keeps the responses to whole-file downloads of recently read files in
+ * memory, already serialized as PreparedResponses, so a hit is a single
+ * write to the socket that never touches the file system.
+ *
+ * Files are spread over SHARDS shards by the hash of their name. Each shard
+ * has its own lock, LRU list and an equal part of the byte budget, and
+ * evicts its least recently used entries to make room. A file larger than
+ * a shard's budget is never cached.
+ *
+ * invalidate() must be called whenever a file is replaced. A miss reads the
+ * file without holding any lock, so it can race with an upload. lookup()
+ * therefore hands out a generation, and insert() ignores entries read
+ * before the shard's last invalidation.
+ */
+class FileCache {
+public:
+    typedef std::shared_ptr<const PreparedResponse> Entry;
+    
+    static const size_t SHARDS = 16;
+    
+    FileCache(size_t capacity_bytes);
+    
+    FileCache(const FileCache&) = delete;
+    FileCache& operator=(const FileCache&) = delete;
+    
+    // The cached response for filename, or null. generation receives what to
+    // pass to insert() after a miss.
+    Entry lookup(const std::string& filename, uint64_t& generation);
+    void insert(const std::string& filename, Entry entry, uint64_t generation);
+    void invalidate(const std::string& filename);
+    
+    // Largest payload worth loading on a miss
+    size_t max_entry() const { return shard_capacity; }
+    
+    // Prometheus samples for EventLoop::set_stats_source
+    std::string report(const std::string& prefix);
+    
+private:
+    typedef std::list<std::pair<std::string, Entry>> LruList;
+    
+    struct Shard {
+        std::mutex mutex;
+        LruList lru;            // Most recently used first
+        std::unordered_map<std::string, LruList::iterator> index;
+        size_t bytes;
+        uint64_t generation;    // Bumped by every invalidation
+        uint64_t hits, misses, evictions, invalidations;
+        
+        Shard() : bytes(0), generation(0), hits(0), misses(0), evictions(0), invalidations(0) {}
+    };
+    
+    Shard& shard_for(const std::string& filename);
+    void erase(Shard& shard, LruList::iterator it);
+    
+    size_t shard_capacity;
+    Shard shards[SHARDS];
+};
+
+#endif
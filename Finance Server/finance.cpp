@@ -1,182 +1,691 @@
 #include "common.h"
 #include "network_channel.h"
 #include "thread_pool.h"
+#include "event_loop.h"
+#include "account_store.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "shard_map.h"
 #include "signals.h"
+#include "logger.h"
 #include <iostream>
+#include <sstream>
 #include <mutex>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <chrono>
 #include <unistd.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <cstring>
 
 using namespace std;
 
-class Account {
+// Interest multiplier applied by EARN_INTEREST
+static const double INTEREST_RATE = 1.01;
+
+// Pages one MIGRATE_OUT response carries at most (about 9 MiB)
+static const size_t MIGRATE_BATCH_PAGES = 1024;
+
+static_assert(ShardMap::BLOCK_SIZE == AccountStore::PAGE_SIZE, "shard blocks must be whole account pages");
+
+// Account storage and workers shared by every request handler
+struct FinanceState {
+    AccountStore* store;
+    ThreadPool* compute;
+
+    // Durability (only with --data-dir). Single-account changes hold
+    // order_lock shared while they apply and log, interest and snapshots hold
+    // it exclusively, so the log order of interest records matches the order
+    // in which it was applied relative to every deposit and withdrawal.
+    WriteAheadLog* wal;
+    pthread_rwlock_t order_lock;
+
+    // Sharding (only with --shard-name). Requests hold shard_lock shared
+    // while they run and changes to the assignment hold it exclusively, so
+    // no request is ever half applied across a change of ownership.
+    ShardAssignment* shards;
+    pthread_rwlock_t shard_lock;
+    string shard_path;      // State file in the data directory, empty without one
+};
+
+// Highest log record this worker has appended whose response is still queued
+static thread_local uint64_t unsynced_seq = 0;
+
+// Holds order_lock for one logged change; does nothing without a log
+class LogGuard {
 public:
-    int id;
-    double balance;
-    bool active;
-    mutex account_mutex; // Add mutex for thread safety
-    
-    Account() : id(-1), balance(0.0), active(false) {}
-    Account(int _id) : id(_id), balance(0.0), active(true) {}
-    
-    // Explicitly delete copy constructor and assignment operator
-    Account(const Account&) = delete;
-    Account& operator=(const Account&) = delete;
-    
-    // Also delete move operations since mutex is not movable
-    Account(Account&&) = delete;
-    Account& operator=(Account&&) = delete;
-    
-    // Method to initialize an account with an ID
-    void initialize(int _id) {
-        lock_guard<mutex> lock(account_mutex);
-        id = _id;
-        balance = 0.0;
-        active = true;
+    LogGuard(FinanceState& state, bool exclusive) : state(state) {
+        if (!state.wal) return;
+        if (exclusive) {
+            pthread_rwlock_wrlock(&state.order_lock);
+        } else {
+            pthread_rwlock_rdlock(&state.order_lock);
+        }
+    }
+
+    ~LogGuard() {
+        if (state.wal) pthread_rwlock_unlock(&state.order_lock);
+    }
+
+    void append(uint8_t type, int64_t user_id, int64_t value) {
+        if (state.wal) unsynced_seq = state.wal->append(type, user_id, value);
+    }
+
+    // For reads: the response waits until every change logged so far is durable
+    void cover_logged() {
+        if (state.wal) unsynced_seq = max(unsynced_seq, state.wal->last_seq());
+    }
+
+private:
+    FinanceState& state;
+};
+
+// Refuses requests once the log has failed: a change could never be made
+// durable, so its client would see no answer and retry it, and a read could
+// see such changes
+static bool log_failed(FinanceState& state, Response& resp) {
+    if (!state.wal || state.wal->healthy()) return false;
+    resp.success = false;
+    resp.message = "Failed to write log";
+    return true;
+}
+
+// Holds shard_lock for one request; does nothing on an unsharded server
+class ShardGuard {
+public:
+    ShardGuard(FinanceState& state, bool exclusive) : state(state) {
+        if (!state.shards) return;
+        if (exclusive) {
+            pthread_rwlock_wrlock(&state.shard_lock);
+        } else {
+            pthread_rwlock_rdlock(&state.shard_lock);
+        }
+    }
+
+    ~ShardGuard() {
+        if (state.shards) pthread_rwlock_unlock(&state.shard_lock);
     }
+
+private:
+    FinanceState& state;
 };
 
-void applyInterest(Account& account) {
-    lock_guard<mutex> lock(account.account_mutex);
-    if (!account.active) {
+// process_request() without its error handling
+static void apply_request(const NetworkRequestChannel& channel, const Request& r, FinanceState& state, Response& resp) {
+    resp.success = true;
+    AccountStore& store = *state.store;
+
+    if (!store.valid_id(r.user_id)) {
+        resp.success = false;
+        resp.message = "Invalid account ID";
+        return;
+    }
+
+    // Accounts of other shards are refused with our map, so the client can reroute
+    if (state.shards && r.type != EARN_INTEREST && !state.shards->serves(r.user_id)) {
+        resp.success = false;
+        resp.message = ShardMap::WRONG_SHARD;
+        resp.data = state.shards->map.serialize();
         return;
     }
 
-    if (account.balance > 0) account.balance *= 1.01;
+    // Balances may hold changes that never became durable
+    if (log_failed(state, resp)) return;
+
+    if (r.type == DEPOSIT) {
+        // Logged before it is applied, so any read that sees it waits for it
+        LogGuard guard(state, false);
+        int64_t cents = AccountStore::to_cents(r.amount);
+        guard.append(WalRecord::DEPOSIT, r.user_id, cents);
+        resp.balance = AccountStore::to_amount(store.deposit(r.user_id, cents));
+        resp.message = "Deposit successful";
+    }
+    else if (r.type == WITHDRAW) {
+        LogGuard guard(state, false);
+        int64_t cents = AccountStore::to_cents(r.amount);
+        int64_t balance;
+        if (store.withdraw(r.user_id, cents, balance)) {
+            guard.append(WalRecord::WITHDRAW, r.user_id, cents);
+            resp.balance = AccountStore::to_amount(balance);
+            resp.message = "Withdrawal successful";
+        } else {
+            resp.success = false;
+            resp.message = "Insufficient funds";
+        }
+    }
+    else if (r.type == BALANCE) {
+        // Read committed: the balance is only reported once the changes it
+        // reflects are durable, so a crash cannot take it back. The exception
+        // is a withdrawal applied but not yet logged at the moment of the read
+        // (only successful ones are logged, so they are logged after).
+        LogGuard guard(state, false);
+        resp.balance = AccountStore::to_amount(store.balance(r.user_id));
+        guard.cover_logged();
+        resp.message = "View balance successful";
+    }
+    else if (r.type == EARN_INTEREST) {
+        // The requested thread count caps how much of the compute pool is used
+        size_t numThreads = 0;
+        if (r.amount > 0) numThreads = r.amount;
+
+        // Pages in transit would earn it twice or not at all
+        if (state.shards && state.shards->rebalancing()) {
+            resp.success = false;
+            resp.message = "Rebalance in progress";
+            return;
+        }
+
+        LogGuard guard(state, true);
+
+        // Waiting for the other writers may have used up the deadline; once
+        // started the sweep runs to the end, as its log record covers all of it
+        if (channel.deadline_exceeded()) {
+            resp.success = false;
+            resp.message = "Deadline exceeded";
+            return;
+        }
+
+        // Balances are 8 bytes, so a chunk of blocks covers 256 KiB and stays in L2
+        size_t grain = (256 * 1024) / (AccountStore::PAGE_SIZE * sizeof(int64_t));
+        state.compute->parallel_for(0, store.page_count(), grain, [&store](size_t lo, size_t hi) {
+            store.apply_interest(lo, hi, INTEREST_RATE);
+        }, numThreads);
+
+        int64_t rate_bits;
+        memcpy(&rate_bits, &INTEREST_RATE, sizeof(rate_bits));
+        guard.append(WalRecord::INTEREST, 0, rate_bits);
+        resp.message = "Interest accrual successful";
+    }
+    else {
+        resp.success = false;
+        resp.message = "Unknown RequestType";
+    }
 }
 
-// Function to handle client connection
-void handle_client(int client_sockfd, Account* accounts, int max_accounts, int thread_count) {
-    // Create a network channel from the socket
-    NetworkRequestChannel channel(client_sockfd);
-    string client_address = channel.get_peer_address();
-    cout << "Finance server: new client connection from " << client_address << endl;
-    
-    bool running = true;
-    
-    while (running && !SignalHandling::shutdown_requested) {
-        try {
-            // Receive request
-            Request r = channel.receive_request();
-            
-            if (r.type == QUIT) {
-                Response resp(true, 0, "", "Server acknowledged disconnect");
-                channel.send_response(resp);
-                running = false;
-                continue;
-            }
-            
-            Response resp;
-            resp.success = true;
+// Applies a single request to the account store, filling in the empty resp.
+// The caller holds a ShardGuard.
+void process_request(const NetworkRequestChannel& channel, const Request& r, FinanceState& state, Response& resp) {
+    try {
+        apply_request(channel, r, state, resp);
+    } catch (const char* e) {
+        // The store could not grow for a new account; nothing was changed
+        resp.success = false;
+        resp.message = e;
+    }
+}
+
+// Sends a response, or queues it until its log records are durable
+static void respond(NetworkRequestChannel& channel, const Response& resp, FinanceState& state) {
+    if (state.wal) {
+        channel.queue_response(resp);
+    } else {
+        channel.send_response(resp);
+    }
+}
 
-            if (r.user_id < 0 || r.user_id >= max_accounts) {
+// Persists a changed assignment; the caller holds shard_lock exclusively
+static bool save_shards(FinanceState& state, Response& resp) {
+    state.shards->update();
+    if (state.shard_path.empty() || state.shards->save(state.shard_path)) return true;
+    resp.success = false;
+    resp.message = "Could not save the shard state";
+    return false;
+}
+
+/**
+ * Installs the map a rebalance moves to (SHARD_MAP with data), or ends the
+ * rebalance once the blocks have moved (the same request with amount 1)
+ *
+ * From the moment it is installed this node stops serving the blocks it
+ * hands over and waits for the ones it takes over (see ShardAssignment).
+ * Both steps may be repeated.
+ */
+static void install_shard_map(const Request& r, FinanceState& state, Response& resp) {
+    ShardMap next, replaced;
+    if (!ShardMap::parse(r.data, next) || !ShardMap::parse(r.filename, replaced)) {
+        resp.success = false;
+        resp.message = "Malformed shard map";
+        return;
+    }
+
+    ShardGuard guard(state, true);
+    ShardAssignment& shards = *state.shards;
+    bool installed = next == shards.map && (!shards.rebalancing() || shards.previous == replaced);
+    if (r.amount != 0) {
+        if (next != shards.map) {
+            resp.success = false;
+            resp.message = "Shard map not installed";
+            return;
+        }
+        if (shards.rebalancing() && !shards.imports_complete()) {
+            resp.success = false;
+            resp.message = "Handover incomplete";
+            return;
+        }
+        shards.previous = ShardMap();
+        shards.imported.clear();
+        resp.message = "Rebalance complete";
+    } else if (installed) {
+        resp.data = shards.map.serialize();
+        resp.message = "Shard map installed";
+        return;
+    } else if (shards.rebalancing()) {
+        resp.success = false;
+        resp.message = "Rebalance in progress";
+        return;
+    } else if (next.epoch() <= shards.map.epoch() || (!shards.map.empty() && shards.map != replaced)) {
+        resp.success = false;
+        resp.message = "Stale shard map";
+        return;
+    } else {
+        shards.previous = replaced;
+        shards.map = next;
+        shards.imported.clear();
+        resp.message = "Shard map installed";
+    }
+    if (!save_shards(state, resp)) return;
+    resp.data = shards.map.serialize();
+    LOG_INFO("Shard " << shards.self << ": " << resp.message << " (" << resp.data << ")");
+}
+
+// Whether this node had block before the rebalance and gives it away
+static bool hands_over(const ShardAssignment& shards, uint64_t block) {
+    int before = shards.previous.owner_of_block(block);
+    int after = shards.map.owner_of_block(block);
+    return before >= 0 && shards.previous.node(before) == shards.self &&
+           (after < 0 || shards.map.node(after) != shards.self);
+}
+
+// Page images of the accounts handed over, in batches (MIGRATE_OUT)
+static void export_pages(const Request& r, FinanceState& state, Response& resp) {
+    ShardGuard guard(state, false);
+    AccountStore& store = *state.store;
+    size_t count = store.page_count();
+    size_t position = r.user_id > 0 ? r.user_id : 0;
+    size_t pages = 0;
+
+    vector<char> image(AccountStore::PAGE_IMAGE_SIZE);
+    for (; position < count && pages < MIGRATE_BATCH_PAGES; position++) {
+        if (!hands_over(*state.shards, store.page_index(position)) || !store.page_has_accounts(position)) continue;
+        store.copy_page(position, image.data());
+        resp.data.append(image.data(), image.size());
+        pages++;
+    }
+    resp.balance = position < count ? position : -1;
+    resp.message = to_string(pages) + " pages exported";
+}
+
+// Loads page images handed over by another node (MIGRATE_IN)
+static void import_pages(const Request& r, FinanceState& state, Response& resp) {
+    const size_t image_size = AccountStore::PAGE_IMAGE_SIZE;
+    if (r.data.size() % image_size != 0) {
+        resp.success = false;
+        resp.message = "Malformed page images";
+        return;
+    }
+
+    {
+        ShardGuard guard(state, false);
+        const ShardAssignment& shards = *state.shards;
+        int source = shards.previous.find(r.filename);
+        if (source < 0) {
+            resp.success = false;
+            resp.message = "Unknown source shard";
+            return;
+        }
+
+        // Repeated by a rebalance run again: the blocks may have changed here since
+        if (shards.imported.count(r.filename)) {
+            resp.message = "Already imported";
+            return;
+        }
+
+        // Check every page first so a bad batch changes nothing
+        for (size_t at = 0; at < r.data.size(); at += image_size) {
+            uint64_t index;
+            memcpy(&index, r.data.data() + at, sizeof(index));
+            int after = shards.map.owner_of_block(index);
+            if (shards.previous.owner_of_block(index) != source || after < 0 || shards.map.node(after) != shards.self) {
                 resp.success = false;
-                resp.message = "Invalid account ID";
-                channel.send_response(resp);
-                continue;
+                resp.message = "Page not handed over to this shard";
+                return;
             }
+        }
 
-            // Create account if it doesn't exist
-            if (!accounts[r.user_id].active) {
-                // Use the initialize method instead of assignment
-                accounts[r.user_id].initialize(r.user_id);
+        LogGuard log(state, false);
+        if (log_failed(state, resp)) return;
+        const size_t bitmap_offset = sizeof(uint64_t) + AccountStore::PAGE_SIZE * sizeof(int64_t);
+        for (size_t at = 0; at < r.data.size(); at += image_size) {
+            const char* image = r.data.data() + at;
+            try {
+                state.store->load_page(image);
+            } catch (const char* e) {
+                // The pages loaded so far are logged; a retried import loads them again
+                resp.success = false;
+                resp.message = e;
+                return;
             }
+            if (!state.wal) continue;
 
-            Account& acc = accounts[r.user_id];
-            
-            if (r.type == DEPOSIT) {
-                lock_guard<mutex> lock(acc.account_mutex);
-                acc.balance += r.amount;
-                resp.balance = acc.balance;
-                resp.message = "Deposit successful";
-            } 
-            else if (r.type == WITHDRAW) {
-                lock_guard<mutex> lock(acc.account_mutex);
-                if (acc.balance >= r.amount) {
-                    acc.balance -= r.amount;
-                    resp.balance = acc.balance;
-                    resp.message = "Withdrawal successful";
-                } else {
-                    resp.success = false;
-                    resp.message = "Insufficient funds";
-                }
-            }
-            else if (r.type == BALANCE) {
-                lock_guard<mutex> lock(acc.account_mutex);
-                resp.balance = acc.balance;
-                resp.message = "View balance successful";
-            }
-            else if (r.type == EARN_INTEREST) {
-                try {
-                    int numThreads = thread_count;
-                    if (r.amount > 0) numThreads = r.amount;
-                    
-                    ThreadPool pool(numThreads);
-                    for (int id = 0; id < max_accounts; id++) {
-                        pool.enqueue([accounts, id]() {
-                            applyInterest(accounts[id]);
-                        });
-                    }
-                    resp.message = "Interest accrual successful";
-                } catch (const std::exception& e) {
-                    std::cerr << "Exception in EARN_INTEREST: " << e.what() << std::endl;
-                    resp.success = false;
-                    resp.message = std::string("Interest accrual failed: ") + e.what();
-                }
-            }
-            else {
-                resp.success = false;
-                resp.message = "Unknown RequestType";
+            uint64_t index;
+            memcpy(&index, image, sizeof(index));
+            for (size_t slot = 0; slot < AccountStore::PAGE_SIZE; slot++) {
+                uint64_t bits;
+                memcpy(&bits, image + bitmap_offset + (slot / 64) * sizeof(uint64_t), sizeof(bits));
+                if (!(bits & (1ULL << (slot % 64)))) continue;
+                int64_t cents;
+                memcpy(&cents, image + sizeof(uint64_t) + slot * sizeof(int64_t), sizeof(cents));
+                log.append(WalRecord::SET_BALANCE, index * AccountStore::PAGE_SIZE + slot, cents);
             }
+        }
+    }
+    resp.message = to_string(r.data.size() / image_size) + " pages imported";
+    if (r.amount == 0) return;
+
+    // The last batch: its blocks are served from now on, so they must be on disk first
+    if (state.wal && unsynced_seq != 0 && !state.wal->wait_durable(unsynced_seq)) {
+        resp.success = false;
+        resp.message = "Could not log the imported pages";
+        return;
+    }
+    ShardGuard guard(state, true);
+    state.shards->imported.insert(r.filename);
+    if (!save_shards(state, resp)) return;
+    LOG_INFO("Shard " << state.shards->self << ": accounts from " << r.filename << " arrived");
+}
+
+// Drops the accounts handed over once their new owners have them (MIGRATE_DONE)
+static void drop_pages(FinanceState& state, Response& resp) {
+    ShardGuard guard(state, false);
+    AccountStore& store = *state.store;
+    LogGuard log(state, false);
+    if (log_failed(state, resp)) return;
+    size_t dropped = 0;
+    for (size_t position = 0; position < store.page_count(); position++) {
+        uint64_t index = store.page_index(position);
+        if (!hands_over(*state.shards, index) || !store.page_has_accounts(position)) continue;
+        store.clear_page(index);
+        log.append(WalRecord::DROP_PAGE, index * AccountStore::PAGE_SIZE, 0);
+        dropped++;
+    }
+    resp.message = to_string(dropped) + " pages dropped";
+}
+
+// Rebalancing requests (SHARD_MAP, MIGRATE_*), sent by FinanceCluster::rebalance()
+static void process_shard_request(const Request& r, FinanceState& state, Response& resp) {
+    resp.success = true;
+    if (!state.shards) {
+        resp.success = false;
+        resp.message = "Not a shard (start with --shard-name)";
+        return;
+    }
+
+    if (r.type == SHARD_MAP && r.data.empty()) {
+        ShardGuard guard(state, false);
+        // While rebalancing, the map it replaces follows on a second line
+        const ShardAssignment& shards = *state.shards;
+        resp.data = shards.map.serialize();
+        if (shards.rebalancing()) resp.data += "\n" + shards.previous.serialize();
+        resp.balance = shards.map.epoch();
+        resp.message = shards.rebalancing() ? "Rebalance in progress" : "Shard map";
+    } else if (r.type == SHARD_MAP) {
+        install_shard_map(r, state, resp);
+    } else if (!state.shards->rebalancing()) {
+        resp.success = false;
+        resp.message = "No rebalance in progress";
+    } else if (r.type == MIGRATE_OUT) {
+        export_pages(r, state, resp);
+    } else if (r.type == MIGRATE_IN) {
+        import_pages(r, state, resp);
+    } else {
+        drop_pages(state, resp);
+    }
+}
+
+// Function to handle a single client request
+void handle_request(NetworkRequestChannel& channel, const Request& r, FinanceState& state) {
+    if (r.type == SHARD_MAP || r.type == MIGRATE_OUT || r.type == MIGRATE_IN || r.type == MIGRATE_DONE) {
+        Response resp;
+        process_shard_request(r, state, resp);
+        respond(channel, resp, state);
+        return;
+    }
+
+    ShardGuard guard(state, false);
+    if (r.type != BATCH) {
+        // Answered from the connection's reused response, so nothing is allocated
+        Response& resp = channel.scratch_response();
+        process_request(channel, r, state, resp);
+        respond(channel, resp, state);
+        return;
+    }
 
-            channel.send_response(resp);
+    // Apply every request of the batch in one pass and answer them together
+    vector<Request> batch = Request::parseBatch(r.data);
+
+    // Hold the stripes of every account involved so concurrent batches
+    // touching the same accounts are applied one after the other
+    vector<uint64_t> ids;
+    ids.reserve(batch.size());
+    for (const Request& sub : batch) {
+        if (state.store->valid_id(sub.user_id)) ids.push_back(sub.user_id);
+    }
+    vector<unique_lock<mutex>> held = state.store->lock_accounts(ids);
+
+    vector<Response> results;
+    results.reserve(batch.size());
+    for (const Request& sub : batch) {
+        if (sub.type == BATCH) {
+            results.push_back(Response(false, 0, "", "Nested batches are not allowed"));
+        } else {
+            results.emplace_back();
+            process_request(channel, sub, state, results.back());
+        }
+    }
+    held.clear();
+
+    Response resp(true, 0, Response::serializeBatch(results), "Batch applied");
+    respond(channel, resp, state);
+}
+
+/**
+ * Sends the responses a worker queued once their changes are on disk
+ *
+ * Runs after each run of requests from a connection. The worker does not
+ * wait for the disk: the connection is parked and the responses go out from
+ * the pool when the group commit holding its records completes, so every
+ * client with changes in flight shares the same fdatasync.
+ */
+void flush_responses(NetworkRequestChannel& channel, EventLoop::Resume resume,
+                     FinanceState& state, ThreadPool& pool) {
+    uint64_t seq = unsynced_seq;
+    unsynced_seq = 0;
+    if (seq == 0) {
+        resume(channel.flush_responses());
+        return;
+    }
+
+    NetworkRequestChannel* ch = &channel;
+    state.wal->when_durable(seq, [ch, resume, &pool](bool durable) {
+        pool.enqueue([ch, resume, durable] {
+            // Changes that could not be logged are never acknowledged
+            resume(durable && ch->flush_responses());
+        });
+    });
+}
+
+// Re-applies one logged change during recovery
+void replay_record(const WalRecord& rec, AccountStore& store) {
+    if (rec.type == WalRecord::DEPOSIT) {
+        store.deposit(rec.user_id, rec.value);
+    } else if (rec.type == WalRecord::WITHDRAW) {
+        // Only successful withdrawals are logged
+        store.deposit(rec.user_id, -rec.value);
+    } else if (rec.type == WalRecord::INTEREST) {
+        double rate;
+        memcpy(&rate, &rec.value, sizeof(rate));
+        store.apply_interest(0, store.page_count(), rate);
+    } else if (rec.type == WalRecord::SET_BALANCE) {
+        store.set_balance(rec.user_id, rec.value);
+    } else if (rec.type == WalRecord::DROP_PAGE) {
+        store.clear_page(rec.user_id / AccountStore::PAGE_SIZE);
+    }
+}
+
+/**
+ * Writes a snapshot and drops the log segments it makes redundant
+ *
+ * Changes are paused only while the pages are copied into the mapped file.
+ *
+ * @param last_seq Sequence number of the previous snapshot, updated on success
+ */
+bool take_snapshot(FinanceState& state, const string& path, uint64_t& last_seq) {
+    unique_ptr<Snapshot> snap;
+    uint64_t seq;
+    {
+        LogGuard guard(state, true);
+        seq = state.wal->last_seq();
+        if (seq == last_seq) return true;
+
+        // A failed log holds changes that never became durable; a snapshot
+        // would keep them and let the segments after it be deleted
+        state.wal->rotate();
+        if (!state.wal->healthy()) {
+            LOG_ERROR("Not taking a snapshot: the write-ahead log has failed");
+            return false;
         }
-        catch (const exception& e) {
-            cerr << "Error handling client " << client_address << ": " << e.what() << endl;
-            running = false;
+        try {
+            snap.reset(new Snapshot(*state.store, seq, path));
+        } catch (const char* e) {
+            return false;
         }
     }
-    
-    cout << "Finance server: client " << client_address << " disconnected" << endl;
+
+    if (!snap->commit()) return false;
+    state.wal->remove_segments_through(seq);
+    last_seq = seq;
+    return true;
+}
+
+// Takes a snapshot every interval seconds until shutdown is requested
+void snapshot_loop(FinanceState& state, string path, int interval, uint64_t& last_seq) {
+    auto next = chrono::steady_clock::now() + chrono::seconds(interval);
+    while (!SignalHandling::shutdown_requested) {
+        this_thread::sleep_for(chrono::milliseconds(200));
+        if (chrono::steady_clock::now() < next) continue;
+
+        take_snapshot(state, path, last_seq);
+        next = chrono::steady_clock::now() + chrono::seconds(interval);
+    }
 }
 
 void print_usage() {
-    cout << "Usage: ./finance_server [-p PORT] [-m MAX_ACCOUNTS] [-t THREAD_COUNT]" << endl;
+    cout << "Usage: ./finance_server [-p PORT] [-m MAX_ACCOUNTS] [-t THREAD_COUNT] [-c COMPUTE_THREADS] [-d DATA_DIR] [-L LISTENERS]" << endl;
     cout << "  -p, --port         Port number to listen on (default: 8000)" << endl;
-    cout << "  -m, --max-accounts Maximum number of accounts (default: 100)" << endl;
+    cout << "  -m, --max-accounts Highest account ID accepted (default: no limit)" << endl;
     cout << "  -t, --threads      Number of threads in the thread pool (default: 4)" << endl;
+    cout << "  -c, --compute-threads Threads for bulk operations like interest (default: CPU count)" << endl;
+    cout << "  -d, --data-dir     Log changes and keep snapshots in this directory (default: in memory only)" << endl;
+    cout << "  -S, --snapshot-interval Seconds between snapshots with --data-dir (default: 300)" << endl;
+    cout << "  -n, --shard-name   Run as a shard of a cluster under this node name (its host:port)" << endl;
+    cout << "  -s, --shards       Initial shard map, a comma-separated host:port list (default: none, or the one" << endl;
+    cout << "                     in the data directory); a shard serves only the accounts the map gives it" << endl;
+    cout << "  -L, --listeners    SO_REUSEPORT listeners, each with an event loop on its own core (default: 1)" << endl;
+    cout << "  -b, --backlog      Connections the kernel queues for each listener (default: " << SOMAXCONN << ")" << endl;
+    cout << "  -Q, --max-queued   Connections that may wait for a worker, 0 for no limit (default: " << EventLoop::DEFAULT_MAX_QUEUED << ")" << endl;
+    cout << "  -O, --overload     block, reject (answer \"Server busy\") or drop-oldest once that many wait (default: block)" << endl;
+    cout << "  -v, --verbose      Also log every client connect and disconnect" << endl;
+    cout << "  -q, --quiet        Only log warnings and errors" << endl;
     cout << "  -h, --help         Show this help message" << endl;
 }
 
 int main(int argc, char* argv[]) {
     int port = 8000;
-    int max_accounts = 100;
+    uint64_t max_accounts = 0;  // No limit
     int thread_count = 4;
+    int listener_count = 1;
+    int backlog = SOMAXCONN;
+    size_t max_queued = EventLoop::DEFAULT_MAX_QUEUED;
+    EventLoop::OverloadPolicy overload = EventLoop::BLOCK;
+    int compute_threads = thread::hardware_concurrency();
+    string data_dir;
+    int snapshot_interval = 300;
+    string shard_name;
+    string shard_list;
     
     // Parse command line arguments
     static struct option long_options[] = {
         {"port", required_argument, 0, 'p'},
         {"max-accounts", required_argument, 0, 'm'},
         {"threads", required_argument, 0, 't'},
+        {"compute-threads", required_argument, 0, 'c'},
+        {"data-dir", required_argument, 0, 'd'},
+        {"snapshot-interval", required_argument, 0, 'S'},
+        {"shard-name", required_argument, 0, 'n'},
+        {"shards", required_argument, 0, 's'},
+        {"listeners", required_argument, 0, 'L'},
+        {"backlog", required_argument, 0, 'b'},
+        {"max-queued", required_argument, 0, 'Q'},
+        {"overload", required_argument, 0, 'O'},
+        {"verbose", no_argument, 0, 'v'},
+        {"quiet", no_argument, 0, 'q'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
     
+    int log_level = LOG_LEVEL_INFO;
     int option_index = 0;
     int c;
     
-    while ((c = getopt_long(argc, argv, "p:m:t:h", long_options, &option_index)) != -1) {
+    while ((c = getopt_long(argc, argv, "p:m:t:c:d:S:n:s:L:b:Q:O:vqh", long_options, &option_index)) != -1) {
         switch (c) {
             case 'p':
                 port = atoi(optarg);
                 break;
             case 'm':
-                max_accounts = atoi(optarg) + 1;
+                max_accounts = strtoull(optarg, NULL, 10) + 1;
                 break;
             case 't':
                 thread_count = atoi(optarg);
                 break;
+            case 'c':
+                compute_threads = atoi(optarg);
+                break;
+            case 'd':
+                data_dir = optarg;
+                break;
+            case 'S':
+                snapshot_interval = atoi(optarg);
+                break;
+            case 'n':
+                shard_name = optarg;
+                break;
+            case 's':
+                shard_list = optarg;
+                break;
+            case 'L':
+                listener_count = atoi(optarg);
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                break;
+            case 'Q':
+                max_queued = strtoull(optarg, NULL, 10);
+                break;
+            case 'O':
+                if (!EventLoop::parse_overload_policy(optarg, overload)) {
+                    print_usage();
+                    return 1;
+                }
+                break;
+            case 'v':
+                log_level = LOG_LEVEL_DEBUG;
+                break;
+            case 'q':
+                log_level = LOG_LEVEL_WARN;
+                break;
             case 'h':
                 print_usage();
                 return 0;
@@ -188,59 +697,139 @@ int main(int argc, char* argv[]) {
         }
     }
     
+    if (listener_count < 1) listener_count = 1;
+
+    // Diagnostics are written by a background thread from here on
+    Logger::instance().set_level(log_level);
+    Logger::instance().start_async();
+    
     // Setup signal handlers
     SignalHandling::setup_handlers();
     SignalHandling::log_signal_event("Finance server started on port " + to_string(port));
     
-    // Allocate account array
-    Account* accounts = new Account[max_accounts];
+    // Allocate account store
+    FinanceState state;
+    state.store = new AccountStore(max_accounts);
+    state.wal = nullptr;
+    state.shards = nullptr;
+    LOG_INFO("Finance server using " << AccountStore::kernel_name() << " interest kernel");
+
+    // A shard resumes from its saved assignment, e.g. in the middle of a rebalance
+    if (!shard_name.empty()) {
+        state.shards = new ShardAssignment();
+        if (!data_dir.empty()) state.shard_path = data_dir + "/shards";
+        if (!state.shard_path.empty() && state.shards->load(state.shard_path)) {
+            if (state.shards->self != shard_name) {
+                LOG_ERROR("Shard state in " << data_dir << " belongs to " << state.shards->self);
+                return 1;
+            }
+        } else {
+            if (!ShardMap::parse(shard_list, state.shards->map)) {
+                LOG_ERROR("Malformed shard map: " << shard_list);
+                return 1;
+            }
+            state.shards->self = shard_name;
+            state.shards->update();
+        }
+        pthread_rwlock_init(&state.shard_lock, NULL);
+        LOG_INFO("Finance server is shard " << shard_name << " of " << state.shards->map.serialize()
+                 << (state.shards->rebalancing() ? " (rebalancing)" : ""));
+    }
+
+    string snapshot_path = data_dir + "/snapshot.bin";
+    uint64_t snapshot_seq = 0;
+    thread snapshotter;
     
     try {
-        // TODO: Create a TCP server socket and a thread pool for handling connections
-        NetworkRequestChannel sock("", port, NetworkRequestChannel::Side::SERVER_SIDE);
-        ThreadPool Pool(thread_count);
-        
-        cout << "Finance server listening on port " << port << endl;
-        
-        // Accept client connections until shutdown is requested
-        while (!SignalHandling::shutdown_requested) {
+        // Recover from the last snapshot plus the log written after it
+        if (!data_dir.empty()) {
+            pthread_rwlockattr_t attr;
+            pthread_rwlockattr_init(&attr);
+            pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+            pthread_rwlock_init(&state.order_lock, &attr);
+            pthread_rwlockattr_destroy(&attr);
+
+            state.wal = new WriteAheadLog(data_dir);
             try {
-                // TODO: Accept a new client connection and add a task that runs handle_client to the thread pool.
-                int accepted = sock.accept_connection();
-                Pool.enqueue([accepted, accounts, max_accounts, thread_count]() { 
-                    handle_client(accepted, accounts, max_accounts, thread_count);
-                });
-
-                // TODO: Check if accept was interrupted by a signal (EINTR)
-                // If so, continue to the next iteration to check for shutdown
-                if (accepted == -1) {
-                    if (errno == EINTR) {
-                    continue;
-                    }
-                    
-                }
+                snapshot_seq = Snapshot::load(*state.store, snapshot_path);
+            } catch (const char* e) {
+                LOG_ERROR("Cannot recover from " << data_dir << ": " << e);
+                return 1;
             }
-            catch (const exception& e) {
-                cerr << "Error accepting connection: " << e.what() << endl;
-                
-                // Check if we need to exit
-                if (SignalHandling::shutdown_requested) {
-                    break;
-                }
-                
-                // Short delay before retry
-                sleep(1);
+            uint64_t last = state.wal->replay(snapshot_seq, [&state](const WalRecord& rec) {
+                replay_record(rec, *state.store);
+            });
+            LOG_INFO("Recovered " << state.store->page_count() << " account pages from " << data_dir
+                     << " (snapshot at " << snapshot_seq << ", " << (last - snapshot_seq) << " log records replayed)");
+            state.wal->start();
+
+            if (snapshot_interval > 0) {
+                snapshotter = thread(snapshot_loop, ref(state), snapshot_path, snapshot_interval, ref(snapshot_seq));
             }
         }
+
+        // TODO: Create a TCP server socket and a thread pool for handling connections
+        // With several listeners the kernel spreads new connections over them
+        NetworkRequestChannel::ListenOptions listen_options;
+        listen_options.backlog = backlog;
+        listen_options.reuse_port = listener_count > 1;
+        vector<unique_ptr<NetworkRequestChannel>> listeners;
+        for (int i = 0; i < listener_count; i++) {
+            listeners.emplace_back(new NetworkRequestChannel("", port, listen_options));
+        }
+        ThreadPool Pool(thread_count);
+
+        // Long-lived pool for data-parallel work, shared by all requests
+        ThreadPool Compute(compute_threads > 0 ? compute_threads : 1);
+        state.compute = &Compute;
         
-        cout << "Finance server shutting down..." << endl;
+        // Connections are multiplexed by the event loop; workers only run individual requests
+        EventLoop loop(listeners, Pool, [&state](NetworkRequestChannel& channel, const Request& r) {
+            handle_request(channel, r, state);
+        }, "Finance server");
+        loop.set_admission(max_queued, overload);
+        if (state.wal) {
+            loop.set_flush_handler([&state, &Pool](NetworkRequestChannel& channel, EventLoop::Resume resume) {
+                flush_responses(channel, resume, state, Pool);
+            });
+        }
+        if (state.shards) {
+            loop.set_stats_source([&state](const string& prefix) {
+                ShardGuard guard(state, false);
+                ostringstream out;
+                out << "# HELP " << prefix << "_shard_epoch Epoch of the shard map this node serves by\n"
+                    << "# TYPE " << prefix << "_shard_epoch gauge\n"
+                    << prefix << "_shard_epoch " << state.shards->map.epoch() << "\n"
+                    << "# HELP " << prefix << "_shard_rebalancing Whether a rebalance is in progress\n"
+                    << "# TYPE " << prefix << "_shard_rebalancing gauge\n"
+                    << prefix << "_shard_rebalancing " << state.shards->rebalancing() << "\n";
+                return out.str();
+            });
+        }
+        
+        LOG_INFO("Finance server listening on port " << port);
+        
+        // Accept and serve client connections until shutdown is requested
+        loop.run();
+        
+        LOG_INFO("Finance server shutting down...");
     }
     catch (const exception& e) {
-        cerr << "Error starting finance server: " << e.what() << endl;
+        LOG_ERROR("Error starting finance server: " << e.what());
     }
     
-    // Cleanup
-    delete[] accounts;
+    // Cleanup: a final snapshot makes the next start replay nothing
+    if (snapshotter.joinable()) snapshotter.join();
+    if (state.wal) {
+        take_snapshot(state, snapshot_path, snapshot_seq);
+        delete state.wal;
+        pthread_rwlock_destroy(&state.order_lock);
+    }
+    if (state.shards) {
+        delete state.shards;
+        pthread_rwlock_destroy(&state.shard_lock);
+    }
+    delete state.store;
     
     SignalHandling::log_signal_event("Finance server shutdown complete");
     return 0;
@@ -0,0 +1,371 @@
+#include "finance_cluster.h"
+#include "account_store.h"
+#include "logger.h"
+#include <thread>
+#include <future>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+const int FinanceCluster::REROUTE_TIMEOUT_MS;
+const int FinanceCluster::ADMIN_TIMEOUT_MS;
+
+// Requests each shard applies to its own accounts
+static bool fans_out(RequestType type) {
+    return type == EARN_INTEREST || type == STATS || type == QUIT;
+}
+
+FinanceCluster::FinanceCluster(const ShardMap& map, WireFormat format) : format(format), map(map) {
+    for (const string& node : map.node_names()) {
+        if (handle(node) < 0) {
+            LOG_ERROR("Error connecting to finance shard " << node);
+            throw("Error connecting to finance shard");
+        }
+    }
+}
+
+// Connection to node, opened on first use; -1 if it cannot be reached. Connects
+// outside map_mutex so one unreachable node does not stall every other request,
+// and fails fast for RECONNECT_INTERVAL_MS after a failed attempt.
+int FinanceCluster::handle(const string& node) {
+    {
+        lock_guard<mutex> lock(map_mutex);
+        auto it = handles.find(node);
+        if (it != handles.end()) return it->second;
+        auto failed = unreachable.find(node);
+        if (failed != unreachable.end() && AsyncClient::Clock::now() < failed->second) return -1;
+    }
+
+    string host;
+    int port;
+    if (!ShardMap::split_node(node, host, port)) return -1;
+    int server = -1;
+    try {
+        server = client.connect(host, port, format);
+    } catch (const char*) {
+    }
+
+    lock_guard<mutex> lock(map_mutex);
+    auto it = handles.find(node);
+    if (it != handles.end()) return it->second;  // Connected by another thread meanwhile
+    if (server < 0) {
+        unreachable[node] = AsyncClient::Clock::now() + chrono::milliseconds(AsyncClient::RECONNECT_INTERVAL_MS);
+        return -1;
+    }
+    unreachable.erase(node);
+    handles[node] = server;
+    return server;
+}
+
+Response FinanceCluster::call(const string& node, const Request& req, int timeout_ms) {
+    return client.async_send(handle(node), req, timeout_ms).get();
+}
+
+// Sends req to every node in parallel; false with the failures in error
+bool FinanceCluster::broadcast(const vector<string>& nodes, const Request& req, string& error) {
+    vector<future<Response>> answers;
+    for (const string& node : nodes) {
+        answers.push_back(client.async_send(handle(node), req, ADMIN_TIMEOUT_MS));
+    }
+    error.clear();
+    for (size_t i = 0; i < nodes.size(); i++) {
+        Response resp = answers[i].get();
+        if (resp.success) continue;
+        if (!error.empty()) error += "; ";
+        error += nodes[i] + ": " + resp.message;
+    }
+    return error.empty();
+}
+
+// Switches to a map a shard sent if it is newer than ours
+void FinanceCluster::adopt(const string& serialized) {
+    ShardMap next;
+    if (!ShardMap::parse(serialized, next)) return;
+    lock_guard<mutex> lock(map_mutex);
+    if (next.epoch() <= map.epoch()) return;
+    LOG_INFO("Finance shard map is now " << next.serialize());
+    map = next;
+}
+
+ShardMap FinanceCluster::current_map() {
+    lock_guard<mutex> lock(map_mutex);
+    return map;
+}
+
+bool FinanceCluster::refresh_map() {
+    vector<string> nodes = current_map().node_names();
+    for (const string& node : nodes) {
+        Response resp = call(node, Request(SHARD_MAP));
+        if (!resp.success) continue;
+        adopt(resp.data.substr(0, resp.data.find('\n')));
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Sends a request to the shards it concerns
+ *
+ * @param req Request for any finance server
+ * @return The response, or the combined one of a request applied by several shards
+ */
+Response FinanceCluster::send_request(const Request& req) {
+    if (fans_out(req.type)) return fan_out(req);
+    if (req.type == BATCH) return route_batch(req);
+    return route(req);
+}
+
+// Sends req to the owner of its account, following the shards while it moves
+Response FinanceCluster::route(const Request& req) {
+    AsyncClient::Clock::time_point deadline = AsyncClient::Clock::now() + chrono::milliseconds(REROUTE_TIMEOUT_MS);
+    int backoff_ms = 1;
+    while (true) {
+        string node;
+        {
+            lock_guard<mutex> lock(map_mutex);
+            int owner = map.owner(req.user_id);
+            if (owner < 0) return Response(false, 0, "", "No finance shards");
+            node = map.node(owner);
+        }
+
+        Response resp = call(node, req);
+        if (resp.success || resp.message != ShardMap::WRONG_SHARD) return resp;
+
+        // Moved under a newer map, or still in transit between two shards
+        adopt(resp.data);
+        if (AsyncClient::Clock::now() >= deadline) return resp;
+        this_thread::sleep_for(chrono::milliseconds(backoff_ms));
+        backoff_ms = min(backoff_ms * 2, 100);
+    }
+}
+
+// Splits a batch into one batch per shard and puts the answers back in order
+Response FinanceCluster::route_batch(const Request& req) {
+    vector<Request> subs = Request::parseBatch(req.data);
+    vector<Response> results(subs.size());
+    ShardMap routing = current_map();
+    if (routing.empty()) return Response(false, 0, "", "No finance shards");
+
+    std::map<int, vector<size_t>> by_owner;
+    vector<size_t> alone;
+    for (size_t i = 0; i < subs.size(); i++) {
+        if (fans_out(subs[i].type) || subs[i].type == BATCH) {
+            alone.push_back(i);
+        } else {
+            by_owner[routing.owner(subs[i].user_id)].push_back(i);
+        }
+    }
+
+    vector<pair<const vector<size_t>*, future<Response>>> parts;
+    for (const auto& group : by_owner) {
+        vector<Request> part;
+        part.reserve(group.second.size());
+        for (size_t i : group.second) part.push_back(subs[i]);
+        Request batch(BATCH, 0, 0.0, "", Request::serializeBatch(part));
+        parts.emplace_back(&group.second, client.async_send(handle(routing.node(group.first)), batch));
+    }
+
+    for (auto& part : parts) {
+        Response resp = part.second.get();
+        vector<Response> answers;
+        if (resp.success) answers = Response::parseBatch(resp.data);
+        const vector<size_t>& indices = *part.first;
+        for (size_t k = 0; k < indices.size(); k++) {
+            size_t i = indices[k];
+            results[i] = k < answers.size() ? answers[k] : Response(false, 0, "", resp.message);
+            // Moved since the batch was split
+            if (!results[i].success && results[i].message == ShardMap::WRONG_SHARD) results[i] = route(subs[i]);
+        }
+    }
+
+    for (size_t i : alone) {
+        results[i] = subs[i].type == BATCH ? Response(false, 0, "", "Nested batches are not allowed")
+                                           : fan_out(subs[i]);
+    }
+    return Response(true, 0, Response::serializeBatch(results), "Batch applied");
+}
+
+// Sends req to every shard at once and combines the answers
+Response FinanceCluster::fan_out(const Request& req) {
+    vector<string> nodes = current_map().node_names();
+    if (nodes.empty()) return Response(false, 0, "", "No finance shards");
+
+    vector<future<Response>> answers;
+    for (const string& node : nodes) {
+        answers.push_back(client.async_send(handle(node), req));
+    }
+
+    Response combined(true);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        Response resp = answers[i].get();
+        if (req.type == STATS && nodes.size() > 1) combined.data += "# node " + nodes[i] + "\n";
+        combined.data += resp.data;
+        if (!resp.success && combined.success) {
+            combined.success = false;
+            combined.message = nodes[i] + ": " + resp.message;
+        } else if (combined.message.empty()) {
+            combined.message = resp.message;
+        }
+    }
+    return combined;
+}
+
+/**
+ * Moves the cluster to a map over nodes, serving requests all along
+ *
+ * Starts by asking every node where it is, so a rebalance that failed half
+ * way is finished rather than started over.
+ *
+ * @param nodes Node names ("host:port") of the new map; new nodes must be
+ *              running with --shard-name
+ * @param error Reason when false is returned
+ * @return true once every node serves by the new map
+ */
+bool FinanceCluster::rebalance(const vector<string>& nodes, string& error) {
+    for (const string& node : nodes) {
+        string host;
+        int port;
+        if (!ShardMap::split_node(node, host, port) || count(nodes.begin(), nodes.end(), node) > 1) {
+            error = "Bad node list";
+            return false;
+        }
+    }
+    refresh_map();
+
+    vector<string> members = current_map().node_names();
+    for (const string& node : nodes) {
+        if (find(members.begin(), members.end(), node) == members.end()) members.push_back(node);
+    }
+
+    vector<future<Response>> answers;
+    for (const string& node : members) {
+        answers.push_back(client.async_send(handle(node), Request(SHARD_MAP), ADMIN_TIMEOUT_MS));
+    }
+    vector<ShardMap> maps(members.size());
+    vector<bool> rebalancing(members.size(), false);
+    ShardMap newest, old, next;
+    for (size_t i = 0; i < members.size(); i++) {
+        Response resp = answers[i].get();
+        size_t newline = resp.data.find('\n');
+        ShardMap previous;
+        if (!resp.success || !ShardMap::parse(string_view(resp.data).substr(0, newline), maps[i]) ||
+            (newline != string::npos && !ShardMap::parse(string_view(resp.data).substr(newline + 1), previous))) {
+            error = members[i] + ": " + (resp.success ? "Malformed shard map" : resp.message);
+            return false;
+        }
+        if (maps[i].epoch() > newest.epoch() || (newest.empty() && !maps[i].empty())) newest = maps[i];
+        if (!previous.empty()) {
+            rebalancing[i] = true;
+            old = previous;
+            next = maps[i];
+        }
+    }
+
+    if (!next.empty()) {
+        if (next.node_names() != nodes) {
+            error = "A rebalance to " + next.serialize() + " is in progress";
+            return false;
+        }
+        LOG_INFO("Resuming the rebalance from " << old.serialize() << " to " << next.serialize());
+    } else if (newest.node_names() == nodes) {
+        adopt(newest.serialize());
+        return true;
+    } else {
+        old = newest;
+        next = ShardMap(nodes, old.epoch() + 1);
+        LOG_INFO("Rebalancing from " << old.serialize() << " to " << next.serialize());
+    }
+
+    vector<string> everyone = old.node_names();
+    for (const string& node : nodes) {
+        if (old.find(node) < 0) everyone.push_back(node);
+    }
+
+    // A node only ends the rebalance once every block has moved
+    bool moved = false;
+    for (size_t i = 0; i < members.size(); i++) {
+        moved = moved || (maps[i] == next && !rebalancing[i]);
+    }
+
+    if (!moved) {
+        // 1. Every node stops serving what it gives away and waits for what it takes over
+        if (!broadcast(everyone, Request(SHARD_MAP, 0, 0.0, old.serialize(), next.serialize()), error)) return false;
+        adopt(next.serialize());
+
+        // 2. The old nodes hand their blocks over, all at once
+        vector<string> errors(old.size());
+        vector<thread> movers;
+        for (size_t i = 0; i < old.size(); i++) {
+            movers.emplace_back([this, &next, &old, &everyone, &errors, i]() {
+                hand_over(next, old.node(i), everyone, errors[i]);
+            });
+        }
+        for (thread& mover : movers) mover.join();
+        for (const string& e : errors) {
+            if (e.empty()) continue;
+            error = e;
+            return false;
+        }
+    }
+
+    // 3. Every node serves by the new map alone
+    if (!broadcast(everyone, Request(SHARD_MAP, 0, 1.0, old.serialize(), next.serialize()), error)) return false;
+    adopt(next.serialize());
+    LOG_INFO("Rebalance to " << next.serialize() << " complete");
+    return true;
+}
+
+// Moves the blocks source gives away under next to their new owners
+bool FinanceCluster::hand_over(const ShardMap& next, const string& source,
+                               const vector<string>& everyone, string& error) {
+    const size_t image_size = AccountStore::PAGE_IMAGE_SIZE;
+    int64_t position = 0;
+    size_t pages = 0;
+    while (position >= 0) {
+        Response out = call(source, Request(MIGRATE_OUT, position), ADMIN_TIMEOUT_MS);
+        if (!out.success || out.data.size() % image_size != 0) {
+            error = source + ": " + (out.success ? "Malformed page images" : out.message);
+            return false;
+        }
+
+        // Images start with their page index
+        std::map<int, string> by_owner;
+        for (size_t at = 0; at < out.data.size(); at += image_size) {
+            uint64_t index;
+            memcpy(&index, out.data.data() + at, sizeof(index));
+            by_owner[next.owner_of_block(index)].append(out.data, at, image_size);
+        }
+
+        vector<pair<int, future<Response>>> imports;
+        for (auto& batch : by_owner) {
+            Request in(MIGRATE_IN, 0, 0.0, source, move(batch.second));
+            imports.emplace_back(batch.first, client.async_send(handle(next.node(batch.first)), in, ADMIN_TIMEOUT_MS));
+        }
+        for (auto& import : imports) {
+            Response resp = import.second.get();
+            if (!resp.success) {
+                error = next.node(import.first) + ": " + resp.message;
+                return false;
+            }
+        }
+        pages += out.data.size() / image_size;
+        position = static_cast<int64_t>(out.balance);
+    }
+
+    // The new owners may serve what they got from source from now on
+    vector<string> others;
+    for (const string& node : everyone) {
+        if (node != source) others.push_back(node);
+    }
+    if (!broadcast(others, Request(MIGRATE_IN, 0, 1.0, source), error)) return false;
+
+    Response done = call(source, Request(MIGRATE_DONE), ADMIN_TIMEOUT_MS);
+    if (!done.success) {
+        error = source + ": " + done.message;
+        return false;
+    }
+    LOG_INFO("Moved " << pages << " pages from " << source << " (" << done.message << ")");
+    return true;
+}
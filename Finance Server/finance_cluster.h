@@ -0,0 +1,84 @@
+#ifndef _FINANCE_CLUSTER_H_
+#define _FINANCE_CLUSTER_H_
+
+#include "common.h"
+#include "async_client.h"
+#include "shard_map.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+/*
+ * FinanceCluster class
+ *
+ * Client-side router for finance servers sharded by a ShardMap. Requests
+ * go straight to the shard owning their account, over one AsyncClient
+ * connection per node. A single unsharded server is a cluster of one.
+ *
+ *   - EARN_INTEREST, STATS and QUIT go to every shard in parallel and are
+ *     answered with one combined response. Interest fails if any shard
+ *     fails it; the shards that applied it keep it.
+ *   - BATCH requests are split by shard, sent in parallel and their
+ *     responses put back into the original order.
+ *   - A shard that no longer owns an account answers ShardMap::WRONG_SHARD
+ *     with its map. The cluster adopts it when it is newer, connects to any
+ *     new nodes and retries with backoff, for at most REROUTE_TIMEOUT_MS, so
+ *     requests ride through a rebalance.
+ *
+ * rebalance() moves the cluster to a new set of nodes while it keeps
+ * serving. Accounts are only unavailable while their own block is in
+ * transit:
+ *
+ *   1. every old and new node installs the new map; each one stops serving
+ *      the blocks it gives away and waits for the ones it takes over
+ *   2. each old node (all of them in parallel) exports the pages it gives
+ *      away, which are imported by their new owners, then drops them
+ *   3. every node ends the rebalance
+ *
+ * Each step can be repeated, so a rebalance that failed half way is
+ * finished by running it again with the same nodes. Thread-safe.
+ */
+class FinanceCluster {
+public:
+    // Connects to every node of the map
+    // @throws Exits with error message if a node cannot be reached
+    FinanceCluster(const ShardMap& map, WireFormat format = BINARY_FORMAT);
+
+    FinanceCluster(const FinanceCluster&) = delete;
+    FinanceCluster& operator=(const FinanceCluster&) = delete;
+
+    Response send_request(const Request& req);
+
+    // Asks the first node that answers for the map it serves by
+    bool refresh_map();
+    ShardMap current_map();
+
+    // Moves every account to its owner under a map of nodes; false with the
+    // reason in error if a step failed (run it again to finish)
+    bool rebalance(const std::vector<std::string>& nodes, std::string& error);
+
+    static const int REROUTE_TIMEOUT_MS = 10000;
+    static const int ADMIN_TIMEOUT_MS = 60000;
+
+private:
+    Response call(const std::string& node, const Request& req, int timeout_ms = AsyncClient::DEFAULT_TIMEOUT_MS);
+    bool broadcast(const std::vector<std::string>& nodes, const Request& req, std::string& error);
+    int handle(const std::string& node);
+    void adopt(const std::string& serialized);
+    Response route(const Request& req);
+    Response route_batch(const Request& req);
+    Response fan_out(const Request& req);
+    bool hand_over(const ShardMap& next, const std::string& source,
+                   const std::vector<std::string>& everyone, std::string& error);
+
+    AsyncClient client;
+    WireFormat format;
+
+    std::mutex map_mutex;   // Guards map, handles and unreachable
+    ShardMap map;
+    std::map<std::string, int> handles;     // AsyncClient server handle by node
+    std::map<std::string, AsyncClient::Clock::time_point> unreachable;  // Failed nodes by next connect attempt
+};
+
+#endif
@@ -0,0 +1,321 @@
+#include "log_writer.h"
+#include "logger.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+using namespace std;
+
+// Ring slots; producers wait for the writer only when all of them are full
+static const size_t RING_CAPACITY = 1 << 14;
+
+// Lines per writev() (the kernel's iovec limit)
+static const size_t BATCH_LIMIT = IOV_MAX;
+
+// Rotated files kept as <file>.1 ... <file>.ROTATE_KEEP
+static const int ROTATE_KEEP = 5;
+
+/**
+ * Opens the log file for appending and starts the writer thread
+ *
+ * @param path Log file
+ * @param flush_interval_ms Longest a line waits in memory (NONE/INTERVAL)
+ * @param durability When lines are synced to disk
+ * @param rotate_size Rotate once the file reaches this many bytes, 0 to never
+ * @param observer Told about every file and entry written, or nullptr
+ *
+ * @throws Exits with error message if the file cannot be opened
+ */
+LogWriter::LogWriter(const string& path, int flush_interval_ms, Durability durability, uint64_t rotate_size,
+                     LogObserver* observer)
+    : path(path), flush_interval(flush_interval_ms > 0 ? flush_interval_ms : 1), level(durability),
+      rotate_size(rotate_size), observer(observer), fd(-1), file_size(0), slots(RING_CAPACITY), mask(RING_CAPACITY - 1),
+      tail(0), head(0), sleeping(false), flush_waiters(0), written_seq(0), stop(false), failed(false), durable_seq(0) {
+    for (size_t i = 0; i < slots.size(); i++) {
+        slots[i].sequence.store(i, memory_order_relaxed);
+    }
+    open_file();
+    writer = thread([this] { writer_loop(); });
+}
+
+/**
+ * Writes everything still queued, syncs it and stops the writer
+ */
+LogWriter::~LogWriter() {
+    {
+        lock_guard<mutex> lock(wake_mutex);
+        stop.store(true);
+    }
+    wake.notify_one();
+    writer.join();
+    close(fd);
+}
+
+bool LogWriter::parse_durability(const string& name, Durability& out) {
+    if (name == "none") out = NONE;
+    else if (name == "interval") out = INTERVAL;
+    else if (name == "sync") out = SYNC;
+    else return false;
+    return true;
+}
+
+void LogWriter::open_file() {
+    int out = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (out == -1) {
+        LOG_ERROR("Error opening log file " << path << " " << strerror(errno));
+        throw("Error opening log file");
+    }
+
+    struct stat st;
+    file_size = fstat(out, &st) == 0 ? st.st_size : 0;
+    fd = out;
+    if (observer) observer->file_opened(path, file_size);
+}
+
+/**
+ * Moves the full file aside and continues in a new one (writer thread only)
+ */
+void LogWriter::rotate() {
+    if (level != NONE) fdatasync(fd);
+    close(fd);
+    fd = -1;
+
+    string next = observer ? observer->next_file() : "";
+    if (!next.empty()) {
+        path = next;
+    } else {
+        for (int i = ROTATE_KEEP - 1; i >= 1; i--) {
+            string from = path + "." + to_string(i);
+            string to = path + "." + to_string(i + 1);
+            rename(from.c_str(), to.c_str());
+        }
+        if (rename(path.c_str(), (path + ".1").c_str()) == -1) {
+            LOG_ERROR_LIMITED("Error rotating log file " << strerror(errno));
+        }
+    }
+
+    try {
+        open_file();
+    } catch (const char* e) {
+        failed.store(true);
+    }
+}
+
+/**
+ * Adds a line to the ring
+ *
+ * Lock-free: producers claim a slot by advancing tail and publish it with
+ * the slot's sequence number. Only a full ring makes a producer wait.
+ */
+uint64_t LogWriter::append(string line) {
+    uint64_t pos = tail.load(memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+        slot = &slots[pos & mask];
+        uint64_t seq = slot->sequence.load(memory_order_acquire);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            // Full: make sure the writer is draining, then wait for it
+            if (sleeping.load()) {
+                lock_guard<mutex> lock(wake_mutex);
+                wake.notify_one();
+            }
+            sched_yield();
+            pos = tail.load(memory_order_relaxed);
+        } else {
+            pos = tail.load(memory_order_relaxed);
+        }
+    }
+
+    slot->line = move(line);
+    slot->sequence.store(pos + 1, memory_order_release);
+
+    // Pairs with the store to sleeping in writer_loop so a sleeping writer is not missed
+    atomic_thread_fence(memory_order_seq_cst);
+    if (sleeping.load(memory_order_relaxed) &&
+        (level == SYNC || pos + 1 - head.load(memory_order_relaxed) >= RING_CAPACITY / 2)) {
+        lock_guard<mutex> lock(wake_mutex);
+        wake.notify_one();
+    }
+    return pos + 1;
+}
+
+void LogWriter::flush() {
+    uint64_t target = tail.load();
+    unique_lock<mutex> lock(wake_mutex);
+    flush_waiters++;
+    wake.notify_one();
+    written.wait(lock, [this, target] { return written_seq.load() >= target || !healthy(); });
+    flush_waiters--;
+}
+
+void LogWriter::when_durable(uint64_t seq, function<void(bool)> done) {
+    if (level == SYNC) {
+        lock_guard<mutex> lock(waiter_mutex);
+        if (durable_seq < seq && healthy()) {
+            waiters.push_back(Waiter{seq, move(done)});
+            return;
+        }
+    }
+    done(healthy());
+}
+
+// Moves up to BATCH_LIMIT published lines out of the ring (writer thread only)
+size_t LogWriter::drain(vector<string>& batch) {
+    uint64_t pos = head.load(memory_order_relaxed);
+    while (batch.size() < BATCH_LIMIT) {
+        Slot& slot = slots[pos & mask];
+        if (slot.sequence.load(memory_order_acquire) != pos + 1) break;
+        batch.push_back(move(slot.line));
+        slot.line.clear();
+        slot.sequence.store(pos + RING_CAPACITY, memory_order_release);
+        pos++;
+    }
+    head.store(pos, memory_order_relaxed);
+    return batch.size();
+}
+
+// Hands a batch to the kernel with as few writev() calls as it allows
+bool LogWriter::write_batch(vector<string>& batch) {
+    vector<struct iovec> iov(batch.size());
+    size_t total = 0;
+    for (size_t i = 0; i < batch.size(); i++) {
+        iov[i].iov_base = &batch[i][0];
+        iov[i].iov_len = batch[i].size();
+        total += batch[i].size();
+    }
+
+    struct iovec* next = iov.data();
+    int remaining = iov.size();
+    while (remaining > 0) {
+        ssize_t n = writev(fd, next, remaining);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            LOG_ERROR_LIMITED("Error writing log file " << strerror(errno));
+            return false;
+        }
+        while (remaining > 0 && (size_t)n >= next->iov_len) {
+            n -= next->iov_len;
+            next++;
+            remaining--;
+        }
+        if (remaining > 0) {
+            next->iov_base = static_cast<char*>(next->iov_base) + n;
+            next->iov_len -= n;
+        }
+    }
+    if (observer) {
+        uint64_t offset = file_size;
+        for (const string& entry : batch) {
+            observer->entry_written(entry, offset);
+            offset += entry.size();
+        }
+    }
+    file_size += total;
+    return true;
+}
+
+bool LogWriter::has_pending() const {
+    uint64_t pos = head.load(memory_order_relaxed);
+    return slots[pos & mask].sequence.load(memory_order_acquire) == pos + 1;
+}
+
+bool LogWriter::ready_to_write() const {
+    if (level == SYNC || flush_waiters.load() > 0) return has_pending();
+    return tail.load(memory_order_relaxed) - head.load(memory_order_relaxed) >= RING_CAPACITY / 2;
+}
+
+void LogWriter::publish_durable(uint64_t seq, bool ok) {
+    vector<Waiter> ready;
+    {
+        lock_guard<mutex> lock(waiter_mutex);
+        if (ok) durable_seq = seq;
+        for (size_t i = 0; i < waiters.size();) {
+            if (!ok || waiters[i].seq <= durable_seq) {
+                ready.push_back(move(waiters[i]));
+                waiters[i] = move(waiters.back());
+                waiters.pop_back();
+            } else {
+                i++;
+            }
+        }
+    }
+    for (Waiter& w : ready) w.done(ok);
+}
+
+/**
+ * Drains the ring into the file
+ *
+ * SYNC writes and syncs whatever has arrived as soon as it can, so lines
+ * that arrive during one fdatasync share the next. The other levels let
+ * lines accumulate for a flush interval (or until the ring is half full)
+ * so each writev() carries as many as possible.
+ */
+void LogWriter::writer_loop() {
+    vector<string> batch;
+    batch.reserve(BATCH_LIMIT);
+    auto last_sync = chrono::steady_clock::now();
+    bool dirty = false;
+
+    while (true) {
+        bool stopping = stop.load();
+
+        if (drain(batch) > 0) {
+            bool full = batch.size() == BATCH_LIMIT;
+            bool ok = !failed.load() && write_batch(batch);
+            batch.clear();
+
+            if (level == SYNC) {
+                if (ok && fdatasync(fd) == -1) {
+                    LOG_ERROR_LIMITED("Error syncing log file " << strerror(errno));
+                    ok = false;
+                }
+                if (!ok) failed.store(true);
+                publish_durable(head.load(memory_order_relaxed), ok);
+            } else {
+                if (!ok) failed.store(true);
+                dirty = true;
+            }
+
+            written_seq.store(head.load(memory_order_relaxed));
+            if (flush_waiters.load() > 0) {
+                lock_guard<mutex> lock(wake_mutex);
+                written.notify_all();
+            }
+            if (ok && rotate_size > 0 && file_size >= rotate_size) rotate();
+
+            // More is already waiting
+            if (full) continue;
+        }
+
+        auto now = chrono::steady_clock::now();
+        if (level == INTERVAL && dirty && now - last_sync >= flush_interval) {
+            if (fdatasync(fd) == -1) LOG_ERROR_LIMITED("Error syncing log file " << strerror(errno));
+            dirty = false;
+            last_sync = now;
+        }
+
+        if (stopping) {
+            if (has_pending()) continue;
+            break;
+        }
+
+        unique_lock<mutex> lock(wake_mutex);
+        sleeping.store(true);
+        if (!stop.load() && !ready_to_write()) {
+            wake.wait_for(lock, flush_interval);
+        }
+        sleeping.store(false, memory_order_relaxed);
+    }
+
+    if (dirty && level != NONE) fdatasync(fd);
+}
@@ -0,0 +1,132 @@
+#ifndef _LOG_WRITER_H_
+#define _LOG_WRITER_H_
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/*
+ * Optional observer of a LogWriter's output, called on its writer thread
+ * (e.g. to index the file while it is written)
+ */
+class LogObserver {
+public:
+    virtual ~LogObserver() {}
+
+    // path was opened for appending and already holds size bytes
+    virtual void file_opened(const std::string& path, uint64_t size) = 0;
+
+    // One appended entry has been written at offset
+    virtual void entry_written(const std::string& entry, uint64_t offset) = 0;
+
+    // Where to continue after the current file is full. The default, an
+    // empty path, renames the full file aside instead.
+    virtual std::string next_file() { return ""; }
+};
+
+/*
+ * LogWriter class
+ *
+ * Appends lines to a log file from any number of threads. append() only
+ * moves the line into a lock-free multi-producer ring; one writer thread
+ * keeps the file open and drains the ring in batches, handing each batch
+ * to the kernel with a single writev().
+ *
+ * Durability levels:
+ *   NONE      lines are written at least every flush interval, never synced
+ *   INTERVAL  as NONE, plus an fdatasync every flush interval
+ *   SYNC      lines are written and synced as soon as they arrive (group
+ *             commit); when_durable() reports when a line is on disk
+ *
+ * When the file grows past the rotation size it is renamed to <file>.1
+ * (older rotations shift up to <file>.ROTATE_KEEP) and a new one started,
+ * unless an observer names the next file itself.
+ */
+class LogWriter {
+public:
+    enum Durability {NONE, INTERVAL, SYNC};
+
+    LogWriter(const std::string& path, int flush_interval_ms, Durability durability, uint64_t rotate_size,
+              LogObserver* observer = nullptr);
+    ~LogWriter();
+
+    LogWriter(const LogWriter&) = delete;
+    LogWriter& operator=(const LogWriter&) = delete;
+
+    // Queues one line (including its newline); returns its sequence number
+    uint64_t append(std::string line);
+
+    // Calls done(ok) once line seq is on disk. Only SYNC waits; other levels
+    // call back immediately. May run on the writer thread, so done must be quick.
+    void when_durable(uint64_t seq, std::function<void(bool)> done);
+
+    // Blocks until every line appended before the call has been written
+    // (not necessarily synced), e.g. before reading the file back
+    void flush();
+
+    // False once a write to the file has failed
+    bool healthy() const { return !failed.load(std::memory_order_relaxed); }
+
+    Durability durability() const { return level; }
+
+    static bool parse_durability(const std::string& name, Durability& level);
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> sequence;
+        std::string line;
+    };
+
+    struct Waiter {
+        uint64_t seq;
+        std::function<void(bool)> done;
+    };
+
+    void open_file();
+    void rotate();
+    size_t drain(std::vector<std::string>& batch);
+    bool write_batch(std::vector<std::string>& batch);
+    bool has_pending() const;
+    bool ready_to_write() const;
+    void publish_durable(uint64_t seq, bool ok);
+    void writer_loop();
+
+    std::string path;
+    std::chrono::milliseconds flush_interval;
+    Durability level;
+    uint64_t rotate_size;
+    LogObserver* observer;
+    int fd;
+    uint64_t file_size;
+
+    // Ring: producers claim positions from tail, the writer consumes at head
+    std::vector<Slot> slots;
+    uint64_t mask;
+    std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> head;
+
+    // Writer sleep/wake
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    std::condition_variable written;
+    std::atomic<bool> sleeping;
+    std::atomic<int> flush_waiters;
+    std::atomic<uint64_t> written_seq;
+    std::atomic<bool> stop;
+    std::atomic<bool> failed;
+
+    // SYNC completions
+    std::mutex waiter_mutex;
+    std::vector<Waiter> waiters;
+    uint64_t durable_seq;
+
+    std::thread writer;
+};
+
+#endif
@@ -0,0 +1,161 @@
+#include "logger.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+
+using namespace std;
+
+static void write_all(int fd, const string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return;     // Nowhere left to report it
+        }
+        done += n;
+    }
+}
+
+Logger::Logger()
+    : threshold(LOG_LEVEL_INFO), async(false), queued_seq(0), written_seq(0), dropped(0) {
+}
+
+/**
+ * The process-wide logger
+ *
+ * Never destroyed, so threads that are still running while static objects
+ * are torn down can keep logging.
+ */
+Logger& Logger::instance() {
+    static Logger* logger = new Logger();
+    return *logger;
+}
+
+/**
+ * Logs one line to stdout (DEBUG, INFO) or stderr (WARN, ERROR)
+ *
+ * @param level Severity; callers have already checked enabled(level)
+ * @param line Message without its newline
+ */
+void Logger::write(int level, string line) {
+    int fd = level >= LOG_LEVEL_WARN ? STDERR_FILENO : STDOUT_FILENO;
+
+    if (!async.load(memory_order_acquire)) {
+        // Anything cout has buffered was printed first
+        fflush(stdout);
+        line += '\n';
+        write_all(fd, line);
+        return;
+    }
+
+    bool was_empty;
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        if (queue.size() >= MAX_QUEUED) {
+            dropped++;
+            return;
+        }
+        was_empty = queue.empty();
+        queue.push_back(Entry{fd, move(line)});
+        queued_seq++;
+    }
+    // The writer only sleeps once it has emptied the queue
+    if (was_empty) wake.notify_one();
+}
+
+/**
+ * Starts the writer thread; later calls do nothing
+ */
+void Logger::start_async() {
+    lock_guard<mutex> lock(queue_mutex);
+    if (async.load(memory_order_relaxed)) return;
+
+    writer = thread(&Logger::writer_loop, this);
+    atexit(flush_at_exit);
+    async.store(true, memory_order_release);
+}
+
+void Logger::flush() {
+    if (!async.load(memory_order_acquire)) return;
+
+    unique_lock<mutex> lock(queue_mutex);
+    uint64_t target = queued_seq;
+    written.wait(lock, [this, target] { return written_seq >= target; });
+}
+
+void Logger::flush_at_exit() {
+    instance().flush();
+}
+
+/**
+ * Writes queued lines until the process exits
+ *
+ * Consecutive lines for the same descriptor go out with one write(2).
+ */
+void Logger::writer_loop() {
+    vector<Entry> batch;
+    while (true) {
+        uint64_t seq;
+        uint64_t lost;
+        {
+            unique_lock<mutex> lock(queue_mutex);
+            wake.wait(lock, [this] { return !queue.empty() || dropped > 0; });
+            batch.swap(queue);
+            seq = queued_seq;
+            lost = dropped;
+            dropped = 0;
+        }
+
+        if (lost > 0) {
+            batch.push_back(Entry{STDERR_FILENO, to_string(lost) + " log lines dropped, the log writer fell behind"});
+        }
+
+        string out;
+        int fd = -1;
+        for (Entry& e : batch) {
+            if (e.fd != fd && !out.empty()) {
+                write_all(fd, out);
+                out.clear();
+            }
+            fd = e.fd;
+            out += e.line;
+            out += '\n';
+        }
+        if (!out.empty()) write_all(fd, out);
+        batch.clear();
+
+        {
+            lock_guard<mutex> lock(queue_mutex);
+            written_seq = seq;
+        }
+        written.notify_all();
+    }
+}
+
+LogRateLimit::LogRateLimit(unsigned per_second)
+    : per_second(per_second), window(-1), used(0), skipped(0) {
+}
+
+/**
+ * Takes one message from the current second's budget
+ *
+ * Relaxed and slightly approximate when several threads hit the same call
+ * site as a new second starts, which only matters by a message or two.
+ */
+bool LogRateLimit::allow(uint64_t& suppressed) {
+    int64_t now = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t current = window.load(memory_order_relaxed);
+    if (now != current && window.compare_exchange_strong(current, now, memory_order_relaxed)) {
+        used.store(0, memory_order_relaxed);
+    }
+
+    if (used.fetch_add(1, memory_order_relaxed) < per_second) {
+        suppressed = skipped.exchange(0, memory_order_relaxed);
+        return true;
+    }
+    skipped.fetch_add(1, memory_order_relaxed);
+    return false;
+}
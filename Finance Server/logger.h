@@ -0,0 +1,144 @@
+#ifndef _LOGGER_H_
+#define _LOGGER_H_
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+
+// Severity levels, lowest first
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_ERROR 3
+
+// Messages below this level are compiled out entirely (make LOG_MIN_LEVEL=2)
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// Messages each LOG_ERROR_LIMITED call site may log per second
+#define LOG_LIMIT_PER_SECOND 5
+
+/*
+ * Logger class
+ *
+ * Diagnostic output shared by the servers and the client: DEBUG and INFO
+ * lines go to stdout, WARN and ERROR lines to stderr.
+ *
+ * Until start_async() is called every line is written by the caller with a
+ * single write(2), so it still comes out in order with the program's own
+ * cout output (the client's menus). Servers call start_async() at startup;
+ * from then on a line is only moved into a queue and a background thread
+ * writes queued lines in batches, so logging on a connection's path costs
+ * one short critical section instead of a flush under the iostream lock.
+ * If the writer falls MAX_QUEUED lines behind, further lines are dropped
+ * and counted rather than blocking the caller.
+ *
+ * Use the LOG_* macros rather than calling write() directly: they skip
+ * formatting for disabled levels and compile away below LOG_MIN_LEVEL.
+ */
+class Logger {
+public:
+    static const size_t MAX_QUEUED = 16384;
+
+    static Logger& instance();
+
+    bool enabled(int level) const { return level >= threshold.load(std::memory_order_relaxed); }
+    void set_level(int level) { threshold.store(level, std::memory_order_relaxed); }
+
+    // Logs one line (without its newline)
+    void write(int level, std::string line);
+
+    // Hands lines to the writer thread from now on; pending lines are
+    // flushed when the program exits
+    void start_async();
+
+    // Blocks until every line logged before the call has been written
+    void flush();
+
+private:
+    struct Entry {
+        int fd;
+        std::string line;
+    };
+
+    Logger();
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    void writer_loop();
+    static void flush_at_exit();
+
+    std::atomic<int> threshold;
+    std::atomic<bool> async;
+
+    std::mutex queue_mutex;
+    std::condition_variable wake;
+    std::condition_variable written;
+    std::vector<Entry> queue;
+    uint64_t queued_seq;
+    uint64_t written_seq;
+    uint64_t dropped;
+
+    std::thread writer;
+};
+
+/*
+ * LogRateLimit class
+ *
+ * Per call site budget behind LOG_ERROR_LIMITED: at most per_second messages
+ * in each one-second window. Errors such as failed sends repeat once per
+ * request when a peer misbehaves; the limit keeps one bad peer from flooding
+ * the log while the count of skipped messages still shows how often it happened.
+ */
+class LogRateLimit {
+public:
+    explicit LogRateLimit(unsigned per_second);
+
+    // True if a message may be logged now; suppressed is set to the number
+    // skipped since the last one that was allowed
+    bool allow(uint64_t& suppressed);
+
+private:
+    unsigned per_second;
+    std::atomic<int64_t> window;
+    std::atomic<unsigned> used;
+    std::atomic<uint64_t> skipped;
+};
+
+#define LOG_AT(level, message)                                                   \
+    do {                                                                         \
+        if ((level) >= LOG_MIN_LEVEL && Logger::instance().enabled(level)) {     \
+            std::ostringstream log_stream_;                                      \
+            log_stream_ << message;                                              \
+            Logger::instance().write(level, log_stream_.str());                  \
+        }                                                                        \
+    } while (0)
+
+#define LOG_DEBUG(message) LOG_AT(LOG_LEVEL_DEBUG, message)
+#define LOG_INFO(message)  LOG_AT(LOG_LEVEL_INFO, message)
+#define LOG_WARN(message)  LOG_AT(LOG_LEVEL_WARN, message)
+#define LOG_ERROR(message) LOG_AT(LOG_LEVEL_ERROR, message)
+
+// LOG_ERROR for errors a client can trigger on every request
+#define LOG_ERROR_LIMITED(message)                                               \
+    do {                                                                         \
+        static LogRateLimit log_limit_(LOG_LIMIT_PER_SECOND);                    \
+        uint64_t log_suppressed_;                                                \
+        if (LOG_LEVEL_ERROR >= LOG_MIN_LEVEL && Logger::instance().enabled(LOG_LEVEL_ERROR) && \
+            log_limit_.allow(log_suppressed_)) {                                 \
+            std::ostringstream log_stream_;                                      \
+            log_stream_ << message;                                              \
+            if (log_suppressed_ > 0) {                                           \
+                log_stream_ << " (" << log_suppressed_ << " similar messages suppressed)"; \
+            }                                                                    \
+            Logger::instance().write(LOG_LEVEL_ERROR, log_stream_.str());        \
+        }                                                                        \
+    } while (0)
+
+#endif
@@ -1,103 +1,158 @@
 #include "common.h"
 #include "network_channel.h"
 #include "thread_pool.h"
+#include "event_loop.h"
 #include "signals.h"
+#include "logger.h"
+#include "log_writer.h"
+#include "audit_log.h"
 #include <iostream>
-#include <fstream>
-#include <mutex>
+#include <memory>
+#include <chrono>
 #include <unistd.h>
 #include <getopt.h>
 #include <cstring>
 
 using namespace std;
 
-// Mutex for log file access
-mutex log_mutex;
+// Highest log line queued by this worker whose response is still held back
+static thread_local uint64_t unsynced_seq = 0;
+
+// Appends the log entry for one audit record, as text or as an AuditRecord
+void add_entry(string& out, const Request& r, const string& client_address, int64_t now_us, bool binary) {
+    AuditRecord rec;
+    rec.timestamp_us = now_us;
+    rec.user_id = r.user_id;
+    rec.type = r.type;
+    rec.amount = r.amount;
+    rec.filename = (r.type == LOGIN || r.type == LOGOUT) ? client_address : r.filename;
+
+    if (binary) {
+        rec.serialize(out);
+    } else {
+        out += rec.describe();
+        out += '\n';
+    }
+}
+
+/**
+ * Streams back the logged records matching a QUERY_LOG request
+ *
+ * Only the index blocks that can match are read, and the results go out
+ * in chunks as they are found.
+ */
+void answer_query(NetworkRequestChannel& channel, const Request& r, LogWriter& log, AuditLog* audit) {
+    int64_t from_us, to_us;
+    if (!audit) {
+        channel.send_response(Response(false, 0, "", "Queries need the binary log (--binary-dir)"));
+        return;
+    }
+    if (!AuditRecord::parseQuery(r, from_us, to_us)) {
+        channel.send_response(Response(false, 0, "", "Malformed query"));
+        return;
+    }
+
+    // Records logged before the query must be in the files it reads
+    log.flush();
+
+    // Last chance to give up: once the results stream out they cannot fail
+    if (channel.deadline_exceeded()) {
+        channel.send_response(Response(false, 0, "", "Deadline exceeded"));
+        return;
+    }
+    AuditQuery query(*audit, r.user_id, from_us, to_us);
+    channel.send_response_chunks(Response(true, 0, "", "Query results"), [&query](string& chunk) {
+        return query.next_chunk(chunk);
+    });
+}
+
+// Function to handle a single client request
+void handle_request(NetworkRequestChannel& channel, const Request& r, LogWriter& log, AuditLog* audit) {
+    if (r.type == QUERY_LOG) {
+        answer_query(channel, r, log, audit);
+        return;
+    }
+
+    if (!log.healthy()) {
+        Response resp(false, 0, "", "Failed to write log file");
+        channel.send_response(resp);
+        return;
+    }
 
-// Function to handle client connection
-void handle_client(int client_sockfd, const string& log_file, int thread_count) {
-    // Create a network channel from the socket
-    NetworkRequestChannel channel(client_sockfd);
     string client_address = channel.get_peer_address();
-    cout << "Logging server: new client connection from " << client_address << endl;
-    
-    bool running = true;
-    
-    while (running && !SignalHandling::shutdown_requested) {
-        try {
-            // Receive request
-            Request r = channel.receive_request();
-            
-            if (r.type == QUIT) {
-                Response resp(true, 0, "", "Server acknowledged disconnect");
-                channel.send_response(resp);
-                running = false;
-                continue;
-            }
-            
-            // Lock the log file for writing
-            lock_guard<mutex> lock(log_mutex);
-            ofstream logfile(log_file, ios::app);
-            
-            if (!logfile) {
-                Response resp(false, 0, "", "Failed to open log file");
-                channel.send_response(resp);
-                continue;
-            }
+    int64_t now_us = chrono::duration_cast<chrono::microseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    string entry;
+    Response resp;
 
-            logfile << "[" << r.user_id << "]: ";
-            
-            switch(r.type) {
-                case LOGIN:
-                    logfile << "logged in from " << client_address;
-                    break;
-                case LOGOUT:
-                    logfile << "logged out from " << client_address;
-                    break;
-                case DEPOSIT:
-                    logfile << "deposited " << r.amount;
-                    break;
-                case WITHDRAW:
-                    logfile << "withdrew " << r.amount;
-                    break;
-                case BALANCE:
-                    logfile << "viewed balance: " << r.amount;
-                    break;
-                case EARN_INTEREST:
-                    logfile << "accrued interest in all accounts";
-                    break;
-                case UPLOAD_FILE:
-                    logfile << "uploaded file: " << r.filename;
-                    break;
-                case DOWNLOAD_FILE:
-                    logfile << "downloaded file: " << r.filename;
-                    break;
-                default:
-                    logfile << "unknown action (type=" << r.type << ")";
+    if (r.type == BATCH) {
+        // A client's batched audit records go into the log as one write
+        vector<Request> batch = Request::parseBatch(r.data);
+        vector<Response> results;
+        results.reserve(batch.size());
+        for (const Request& sub : batch) {
+            if (sub.type == BATCH || sub.type == QUERY_LOG) {
+                results.push_back(Response(false, 0, "", "Not an audit record"));
+                continue;
             }
-            logfile << endl;
-            logfile.close();
-
-            Response resp;
-            resp.success = true;
-            resp.message = "Logged successfully";
-            
-            channel.send_response(resp);
-        }
-        catch (const exception& e) {
-            cerr << "Error handling client " << client_address << ": " << e.what() << endl;
-            running = false;
+            add_entry(entry, sub, client_address, now_us, audit != nullptr);
+            results.push_back(Response(true, 0, "", "Logged successfully"));
         }
+        resp = Response(true, 0, Response::serializeBatch(results), "Batch logged");
+    } else {
+        add_entry(entry, r, client_address, now_us, audit != nullptr);
+        resp.success = true;
+        resp.message = "Logged successfully";
     }
+    uint64_t seq = log.append(move(entry));
     
-    cout << "Logging server: client " << client_address << " disconnected" << endl;
+    // With --durability sync the client hears back once the line is on disk
+    if (log.durability() == LogWriter::SYNC) {
+        unsynced_seq = seq;
+        channel.queue_response(resp);
+    } else {
+        channel.send_response(resp);
+    }
+}
+
+/**
+ * Sends the responses a worker held back once their lines are on disk
+ *
+ * The connection stays parked meanwhile, so the worker moves on and every
+ * line that arrives during one fdatasync shares the next.
+ */
+void flush_responses(NetworkRequestChannel& channel, EventLoop::Resume resume,
+                     LogWriter& log, ThreadPool& pool) {
+    uint64_t seq = unsynced_seq;
+    unsynced_seq = 0;
+    if (seq == 0) {
+        resume(channel.flush_responses());
+        return;
+    }
+
+    NetworkRequestChannel* ch = &channel;
+    log.when_durable(seq, [ch, resume, &pool](bool durable) {
+        pool.enqueue([ch, resume, durable] {
+            resume(durable && ch->flush_responses());
+        });
+    });
 }
 
 void print_usage() {
-    cout << "Usage: ./logging_server [-p PORT] [-f LOG_FILE] [-t THREAD_COUNT]" << endl;
+    cout << "Usage: ./logging_server [-p PORT] [-f LOG_FILE] [-t THREAD_COUNT] [-i MS] [-D LEVEL] [-r MIB] [-B DIR] [-L LISTENERS]" << endl;
     cout << "  -p, --port         Port number to listen on (default: 8002)" << endl;
     cout << "  -f, --file         Log file to write to (default: system.log)" << endl;
     cout << "  -t, --threads      Number of threads in the thread pool (default: 4)" << endl;
+    cout << "  -i, --flush-interval Milliseconds a log line may wait before it is written (default: 100)" << endl;
+    cout << "  -D, --durability   none, interval (fdatasync every flush interval) or sync (before responding) (default: interval)" << endl;
+    cout << "  -r, --rotate-size  Rotate the log file after this many MiB, 0 to never (default: 0, 64 with -B)" << endl;
+    cout << "  -B, --binary-dir   Write indexed binary segments to this directory instead of the text log" << endl;
+    cout << "  -L, --listeners    SO_REUSEPORT listeners, each with an event loop on its own core (default: 1)" << endl;
+    cout << "  -b, --backlog      Connections the kernel queues for each listener (default: " << SOMAXCONN << ")" << endl;
+    cout << "  -Q, --max-queued   Connections that may wait for a worker, 0 for no limit (default: " << EventLoop::DEFAULT_MAX_QUEUED << ")" << endl;
+    cout << "  -O, --overload     block, reject (answer \"Server busy\") or drop-oldest once that many wait (default: block)" << endl;
+    cout << "  -v, --verbose      Also log every client connect and disconnect" << endl;
+    cout << "  -q, --quiet        Only log warnings and errors" << endl;
     cout << "  -h, --help         Show this help message" << endl;
 }
 
@@ -105,20 +160,39 @@ int main(int argc, char* argv[]) {
     int port = 8002;
     string log_file = "system.log";
     int thread_count = 4;
+    int listener_count = 1;
+    int backlog = SOMAXCONN;
+    size_t max_queued = EventLoop::DEFAULT_MAX_QUEUED;
+    EventLoop::OverloadPolicy overload = EventLoop::BLOCK;
+    int flush_interval = 100;
+    LogWriter::Durability durability = LogWriter::INTERVAL;
+    int64_t rotate_mib = -1;
+    string binary_dir;
     
     // Parse command line arguments
     static struct option long_options[] = {
         {"port", required_argument, 0, 'p'},
         {"file", required_argument, 0, 'f'},
         {"threads", required_argument, 0, 't'},
+        {"flush-interval", required_argument, 0, 'i'},
+        {"durability", required_argument, 0, 'D'},
+        {"rotate-size", required_argument, 0, 'r'},
+        {"binary-dir", required_argument, 0, 'B'},
+        {"listeners", required_argument, 0, 'L'},
+        {"backlog", required_argument, 0, 'b'},
+        {"max-queued", required_argument, 0, 'Q'},
+        {"overload", required_argument, 0, 'O'},
+        {"verbose", no_argument, 0, 'v'},
+        {"quiet", no_argument, 0, 'q'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
     
+    int log_level = LOG_LEVEL_INFO;
     int option_index = 0;
     int c;
     
-    while ((c = getopt_long(argc, argv, "p:f:t:h", long_options, &option_index)) != -1) {
+    while ((c = getopt_long(argc, argv, "p:f:t:i:D:r:B:L:b:Q:O:vqh", long_options, &option_index)) != -1) {
         switch (c) {
             case 'p':
                 port = atoi(optarg);
@@ -129,6 +203,42 @@ int main(int argc, char* argv[]) {
             case 't':
                 thread_count = atoi(optarg);
                 break;
+            case 'i':
+                flush_interval = atoi(optarg);
+                break;
+            case 'D':
+                if (!LogWriter::parse_durability(optarg, durability)) {
+                    print_usage();
+                    return 1;
+                }
+                break;
+            case 'r':
+                rotate_mib = strtoll(optarg, NULL, 10);
+                break;
+            case 'B':
+                binary_dir = optarg;
+                break;
+            case 'L':
+                listener_count = atoi(optarg);
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                break;
+            case 'Q':
+                max_queued = strtoull(optarg, NULL, 10);
+                break;
+            case 'O':
+                if (!EventLoop::parse_overload_policy(optarg, overload)) {
+                    print_usage();
+                    return 1;
+                }
+                break;
+            case 'v':
+                log_level = LOG_LEVEL_DEBUG;
+                break;
+            case 'q':
+                log_level = LOG_LEVEL_WARN;
+                break;
             case 'h':
                 print_usage();
                 return 0;
@@ -140,78 +250,78 @@ int main(int argc, char* argv[]) {
         }
     }
     
+    if (listener_count < 1) listener_count = 1;
+
+    // Diagnostics are written by a background thread from here on
+    Logger::instance().set_level(log_level);
+    Logger::instance().start_async();
+    
     // Setup signal handlers
     SignalHandling::setup_handlers();
     SignalHandling::log_signal_event("Logging server started on port " + to_string(port));
     
-    // Create initial log file entry
-    {
-        lock_guard<mutex> lock(log_mutex);
-        ofstream logfile(log_file, ios::app);
-        if (logfile) {
-            logfile << "=== Logging server started on port " << port << " ===" << endl;
-            logfile.close();
-        } else {
-            cerr << "Error: Could not open log file " << log_file << endl;
-            return 1;
+    // Open the log file; a writer thread owns it from here on. The binary
+    // log is a directory of segments indexed as they are written.
+    AuditLog* audit = nullptr;
+    LogWriter* log;
+    try {
+        string first_file = log_file;
+        if (!binary_dir.empty()) {
+            audit = new AuditLog(binary_dir);
+            first_file = audit->first_file();
+            if (rotate_mib < 0) rotate_mib = 64;
         }
+        log = new LogWriter(first_file, flush_interval, durability,
+                            rotate_mib > 0 ? (uint64_t)rotate_mib << 20 : 0, audit);
+    } catch (const char* e) {
+        LOG_ERROR("Error: Could not open log file " << (binary_dir.empty() ? log_file : binary_dir));
+        delete audit;
+        return 1;
     }
+    if (!audit) log->append("=== Logging server started on port " + to_string(port) + " ===\n");
     
     try {
         // TODO: Create a TCP server socket and a thread pool for handling connections
-        NetworkRequestChannel sock("", port, NetworkRequestChannel::Side::SERVER_SIDE);
+        // With several listeners the kernel spreads new connections over them
+        NetworkRequestChannel::ListenOptions listen_options;
+        listen_options.backlog = backlog;
+        listen_options.reuse_port = listener_count > 1;
+        vector<unique_ptr<NetworkRequestChannel>> listeners;
+        for (int i = 0; i < listener_count; i++) {
+            listeners.emplace_back(new NetworkRequestChannel("", port, listen_options));
+        }
         ThreadPool Pool(thread_count);
         
-        cout << "Logging server listening on port " << port << endl;
-        cout << "Writing logs to " << log_file << endl;
-        
-        // Accept client connections until shutdown is requested
-        while (!SignalHandling::shutdown_requested) {
-            try {
-                // TODO: Accept a new client connection and add a task that runs handle_client to the thread pool.
-                int accepted = sock.accept_connection();
-                Pool.enqueue([accepted, log_file, thread_count]() { 
-                    handle_client(accepted, log_file, thread_count);
-                });
-
-                // TODO: Check if accept was interrupted by a signal (EINTR)
-                // If so, continue to the next iteration to check for shutdown
-                if (accepted == -1) {
-                    if (errno == EINTR) {
-                    continue;
-                    }
-                    
-                }
-            }
-            catch (const exception& e) {
-                cerr << "Error accepting connection: " << e.what() << endl;
-                
-                // Check if we need to exit
-                if (SignalHandling::shutdown_requested) {
-                    break;
-                }
-                
-                // Short delay before retry
-                sleep(1);
-            }
+        // Connections are multiplexed by the event loop; workers only run individual requests
+        EventLoop loop(listeners, Pool, [log, audit](NetworkRequestChannel& channel, const Request& r) {
+            handle_request(channel, r, *log, audit);
+        }, "Logging server");
+        loop.set_admission(max_queued, overload);
+        if (durability == LogWriter::SYNC) {
+            loop.set_flush_handler([log, &Pool](NetworkRequestChannel& channel, EventLoop::Resume resume) {
+                flush_responses(channel, resume, *log, Pool);
+            });
         }
         
-        cout << "Logging server shutting down..." << endl;
+        LOG_INFO("Logging server listening on port " << port);
+        LOG_INFO("Writing logs to " << (audit ? binary_dir + " (binary)" : log_file));
+        
+        // Accept and serve client connections until shutdown is requested
+        loop.run();
+        
+        LOG_INFO("Logging server shutting down...");
         
         // Add shutdown entry to log
-        {
-            lock_guard<mutex> lock(log_mutex);
-            ofstream logfile(log_file, ios::app);
-            if (logfile) {
-                logfile << "=== Logging server shutdown ===" << endl;
-                logfile.close();
-            }
-        }
+        if (!audit) log->append("=== Logging server shutdown ===\n");
     }
     catch (const exception& e) {
-        cerr << "Error starting logging server: " << e.what() << endl;
+        LOG_ERROR("Error starting logging server: " << e.what());
     }
     
+    // Writes out and syncs whatever is still queued
+    delete log;
+    delete audit;
+    
     SignalHandling::log_signal_event("Logging server shutdown complete");
     return 0;
 }
\ No newline at end of file
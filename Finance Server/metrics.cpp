@@ -0,0 +1,285 @@
+#include "metrics.h"
+#include "logger.h"
+#include <sstream>
+#include <iomanip>
+#include <thread>
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+using namespace std;
+
+// More shards than this stop paying for their memory
+static const size_t MAX_SHARDS = 64;
+
+static const char* const TYPE_NAMES[NUM_REQUEST_TYPES] = {
+    "QUIT", "DEPOSIT", "WITHDRAW", "BALANCE", "UPLOAD_FILE", "DOWNLOAD_FILE", "LOGIN", "LOGOUT",
+    "EARN_INTEREST", "HELLO", "BATCH", "QUERY_LOG", "STATS", "PUT_CHUNK", "UPLOAD_MANIFEST",
+    "UPLOAD_STATUS", "UPLOAD_STRIPE", "UPLOAD_COMMIT", "FILE_CHECKSUM",
+    "SHARD_MAP", "MIGRATE_OUT", "MIGRATE_IN", "MIGRATE_DONE"
+};
+
+/**
+ * Allocates one zeroed shard per CPU
+ *
+ * @param name Prefix of every metric name
+ *
+ * @throws Exits with error message if the shards cannot be allocated
+ */
+ServerMetrics::ServerMetrics(const string& name) : name(name), shards(nullptr) {
+    shard_count = thread::hardware_concurrency();
+    if (shard_count == 0) shard_count = 1;
+    if (shard_count > MAX_SHARDS) shard_count = MAX_SHARDS;
+
+    void* memory;
+    if (posix_memalign(&memory, alignof(Shard), shard_count * sizeof(Shard)) != 0) {
+        LOG_ERROR("Error allocating metrics " << strerror(ENOMEM));
+        throw("Error allocating metrics");
+    }
+    // Zero bytes are zero-valued atomics
+    memset(memory, 0, shard_count * sizeof(Shard));
+    shards = static_cast<Shard*>(memory);
+}
+
+ServerMetrics::~ServerMetrics() {
+    free(shards);
+}
+
+// The shard of the CPU the caller is running on
+ServerMetrics::Shard& ServerMetrics::local() {
+    int cpu = sched_getcpu();
+    return shards[cpu < 0 ? 0 : cpu % shard_count];
+}
+
+void ServerMetrics::record(Histogram& h, uint64_t ns) {
+    uint64_t us = (ns + 999) / 1000;
+    int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+    h.buckets[bucket].fetch_add(1, memory_order_relaxed);
+    h.sum_ns.fetch_add(ns, memory_order_relaxed);
+}
+
+void ServerMetrics::request_handled(RequestType type, uint64_t ns) {
+    if (type < 0 || type >= NUM_REQUEST_TYPES) return;
+    Shard& s = local();
+    s.requests[type].fetch_add(1, memory_order_relaxed);
+    record(s.latency[type], ns);
+}
+
+void ServerMetrics::request_shed(RequestType type) {
+    if (type < 0 || type >= NUM_REQUEST_TYPES) return;
+    local().shed[type].fetch_add(1, memory_order_relaxed);
+}
+
+void ServerMetrics::deadline_missed() {
+    local().deadlines_missed.fetch_add(1, memory_order_relaxed);
+}
+
+void ServerMetrics::request_rejected(RequestType type) {
+    if (type < 0 || type >= NUM_REQUEST_TYPES) return;
+    local().rejected[type].fetch_add(1, memory_order_relaxed);
+}
+
+void ServerMetrics::admission_blocked() {
+    local().admission_blocks.fetch_add(1, memory_order_relaxed);
+}
+
+void ServerMetrics::bytes_transferred(uint64_t received, uint64_t sent) {
+    if (received == 0 && sent == 0) return;
+    Shard& s = local();
+    s.bytes_received.fetch_add(received, memory_order_relaxed);
+    s.bytes_sent.fetch_add(sent, memory_order_relaxed);
+}
+
+void ServerMetrics::connection_opened() {
+    local().connections_opened.fetch_add(1, memory_order_relaxed);
+}
+
+void ServerMetrics::connection_closed() {
+    local().connections_closed.fetch_add(1, memory_order_relaxed);
+}
+
+void ServerMetrics::task_queued() {
+    local().tasks_queued.fetch_add(1, memory_order_relaxed);
+}
+
+void ServerMetrics::task_started(uint64_t wait_ns) {
+    Shard& s = local();
+    s.tasks_started.fetch_add(1, memory_order_relaxed);
+    record(s.task_wait, wait_ns);
+}
+
+// Sums of one histogram over every shard
+struct HistogramTotals {
+    uint64_t buckets[ServerMetrics::LATENCY_BUCKETS];
+    uint64_t sum_ns;
+    uint64_t count;
+};
+
+static void write_histogram(ostringstream& out, const string& metric, const string& labels,
+                            const HistogramTotals& h) {
+    string sep = labels.empty() ? "" : ",";
+    uint64_t cumulative = 0;
+    for (int i = 0; i < ServerMetrics::LATENCY_BUCKETS; i++) {
+        cumulative += h.buckets[i];
+        out << metric << "_bucket{" << labels << sep << "le=\"";
+        if (i == ServerMetrics::LATENCY_BUCKETS - 1) {
+            out << "+Inf";
+        } else {
+            out << (1ull << i) / 1e6;
+        }
+        out << "\"} " << cumulative << "\n";
+    }
+    string braces = labels.empty() ? "" : "{" + labels + "}";
+    out << metric << "_sum" << braces << " " << h.sum_ns / 1e9 << "\n";
+    out << metric << "_count" << braces << " " << h.count << "\n";
+}
+
+/**
+ * Builds the Prometheus text exposition of every metric
+ *
+ * @param gauges Current values the caller sampled
+ * @return One metric sample per line, with HELP and TYPE comments
+ */
+string ServerMetrics::report(const Gauges& gauges) const {
+    uint64_t requests[NUM_REQUEST_TYPES] = {0};
+    uint64_t shed[NUM_REQUEST_TYPES] = {0};
+    uint64_t missed = 0;
+    uint64_t rejected[NUM_REQUEST_TYPES] = {0};
+    uint64_t blocks = 0;
+    HistogramTotals latency[NUM_REQUEST_TYPES];
+    HistogramTotals wait;
+    memset(latency, 0, sizeof(latency));
+    memset(&wait, 0, sizeof(wait));
+    uint64_t queued = 0, started = 0, received = 0, sent = 0, opened = 0, closed = 0;
+
+    auto add = [](HistogramTotals& to, const Histogram& from) {
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            uint64_t n = from.buckets[b].load(memory_order_relaxed);
+            to.buckets[b] += n;
+            to.count += n;
+        }
+        to.sum_ns += from.sum_ns.load(memory_order_relaxed);
+    };
+
+    for (size_t i = 0; i < shard_count; i++) {
+        const Shard& s = shards[i];
+        for (int t = 0; t < NUM_REQUEST_TYPES; t++) {
+            requests[t] += s.requests[t].load(memory_order_relaxed);
+            shed[t] += s.shed[t].load(memory_order_relaxed);
+            rejected[t] += s.rejected[t].load(memory_order_relaxed);
+            add(latency[t], s.latency[t]);
+        }
+        add(wait, s.task_wait);
+        missed += s.deadlines_missed.load(memory_order_relaxed);
+        blocks += s.admission_blocks.load(memory_order_relaxed);
+        queued += s.tasks_queued.load(memory_order_relaxed);
+        started += s.tasks_started.load(memory_order_relaxed);
+        received += s.bytes_received.load(memory_order_relaxed);
+        sent += s.bytes_sent.load(memory_order_relaxed);
+        opened += s.connections_opened.load(memory_order_relaxed);
+        closed += s.connections_closed.load(memory_order_relaxed);
+    }
+
+    ostringstream out;
+    out << setprecision(9);
+    auto header = [&out, this](const string& metric, const char* type, const char* help) {
+        out << "# HELP " << name << "_" << metric << " " << help << "\n"
+            << "# TYPE " << name << "_" << metric << " " << type << "\n";
+    };
+
+    header("requests_total", "counter", "Requests handled, by type");
+    for (int t = 0; t < NUM_REQUEST_TYPES; t++) {
+        if (requests[t] == 0) continue;
+        out << name << "_requests_total{type=\"" << TYPE_NAMES[t] << "\"} " << requests[t] << "\n";
+    }
+
+    header("request_duration_seconds", "histogram", "Time from receiving a request to its handler returning");
+    for (int t = 0; t < NUM_REQUEST_TYPES; t++) {
+        if (latency[t].count == 0) continue;
+        write_histogram(out, name + "_request_duration_seconds", string("type=\"") + TYPE_NAMES[t] + "\"",
+                        latency[t]);
+    }
+
+    header("requests_shed_total", "counter", "Requests answered without being handled because their "
+           "deadline had passed, by type");
+    for (int t = 0; t < NUM_REQUEST_TYPES; t++) {
+        if (shed[t] == 0) continue;
+        out << name << "_requests_shed_total{type=\"" << TYPE_NAMES[t] << "\"} " << shed[t] << "\n";
+    }
+    header("deadlines_missed_total", "counter", "Requests whose deadline passed while they were being handled");
+    out << name << "_deadlines_missed_total " << missed << "\n";
+    header("requests_rejected_total", "counter", "Requests answered \"Server busy\" because the lanes were full, "
+           "by type");
+    for (int t = 0; t < NUM_REQUEST_TYPES; t++) {
+        if (rejected[t] == 0) continue;
+        out << name << "_requests_rejected_total{type=\"" << TYPE_NAMES[t] << "\"} " << rejected[t] << "\n";
+    }
+
+    header("bytes_received_total", "counter", "Bytes read from client sockets");
+    out << name << "_bytes_received_total " << received << "\n";
+    header("bytes_sent_total", "counter", "Bytes written to client sockets");
+    out << name << "_bytes_sent_total " << sent << "\n";
+
+    header("connections_total", "counter", "Client connections accepted");
+    out << name << "_connections_total " << opened << "\n";
+    header("connections_active", "gauge", "Client connections open");
+    out << name << "_connections_active " << (opened > closed ? opened - closed : 0) << "\n";
+    header("connections_busy", "gauge", "Connections being served by a worker or waiting to be flushed");
+    out << name << "_connections_busy " << gauges.busy_connections << "\n";
+
+    header("pool_threads", "gauge", "Worker threads serving requests");
+    out << name << "_pool_threads " << gauges.pool_threads << "\n";
+    header("pool_queue_depth", "gauge", "Connection tasks waiting for a worker");
+    out << name << "_pool_queue_depth " << (queued > started ? queued - started : 0) << "\n";
+    header("task_wait_seconds", "histogram", "Time connection tasks waited for a worker");
+    write_histogram(out, name + "_task_wait_seconds", "", wait);
+
+    header("lane_depth", "gauge", "Connections waiting for a worker, by priority lane");
+    for (const auto& lane : gauges.lane_depths) {
+        out << name << "_lane_depth{lane=\"" << lane.first << "\"} " << lane.second << "\n";
+    }
+    header("lane_limit", "gauge", "Most connections the lanes hold together, 0 if unbounded");
+    out << name << "_lane_limit " << gauges.queue_limit << "\n";
+    header("admission_blocks_total", "counter", "Times a reactor stopped reading events because the lanes were full");
+    out << name << "_admission_blocks_total " << blocks << "\n";
+
+    // Linux reports a listener's accept queue through TCP_INFO; with several
+    // listeners on one port these are the totals over all of them
+    uint64_t waiting = 0, backlog = 0;
+    bool sampled = false;
+    for (int fd : gauges.listener_fds) {
+        struct tcp_info info;
+        socklen_t len = sizeof(info);
+        if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+            waiting += info.tcpi_unacked;
+            backlog += info.tcpi_sacked;
+            sampled = true;
+        }
+    }
+    if (sampled) {
+        header("accept_queue", "gauge", "Connections waiting to be accepted");
+        out << name << "_accept_queue " << waiting << "\n";
+        header("accept_backlog", "gauge", "Most connections the accept queues hold");
+        out << name << "_accept_backlog " << backlog << "\n";
+    }
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                     usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+        header("cpu_seconds_total", "counter", "User and system CPU time of the process");
+        out << name << "_cpu_seconds_total " << cpu << "\n";
+        header("context_switches_total", "counter", "Context switches; involuntary ones mean CPU contention, "
+               "voluntary ones blocking (I/O or locks)");
+        out << name << "_context_switches_total{kind=\"voluntary\"} " << usage.ru_nvcsw << "\n";
+        out << name << "_context_switches_total{kind=\"involuntary\"} " << usage.ru_nivcsw << "\n";
+    }
+    return out.str();
+}
@@ -0,0 +1,94 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "common.h"
+#include <string>
+#include <vector>
+#include <utility>
+#include <atomic>
+#include <cstdint>
+
+/*
+ * ServerMetrics class
+ *
+ * Counters and latency histograms every server keeps about itself, exposed
+ * through the STATS request in the Prometheus text format.
+ *
+ * Recording is lock-free and nearly contention-free: the counters are split
+ * into one shard per CPU (each on its own cache lines) and a thread adds to
+ * the shard of the CPU it is running on with relaxed atomics. Shards are
+ * only summed when a report is built, so a report is approximate while
+ * requests are being recorded.
+ *
+ * Histograms have power-of-two buckets from 1 us to 2^25 us (about 34 s),
+ * plus one for anything slower.
+ */
+class ServerMetrics {
+public:
+    static const int LATENCY_BUCKETS = 27;
+
+    // name prefixes every metric, e.g. "finance"
+    ServerMetrics(const std::string& name);
+    ~ServerMetrics();
+
+    ServerMetrics(const ServerMetrics&) = delete;
+    ServerMetrics& operator=(const ServerMetrics&) = delete;
+
+    void request_handled(RequestType type, uint64_t ns);
+    void request_shed(RequestType type);        // Dropped unhandled, past its deadline
+    void deadline_missed();                     // Deadline passed while its handler ran
+    void request_rejected(RequestType type);    // Answered "Server busy" by admission control
+    void admission_blocked();                   // A reactor stopped reading until a slot freed up
+    void bytes_transferred(uint64_t received, uint64_t sent);
+    void connection_opened();
+    void connection_closed();
+    void task_queued();
+    void task_started(uint64_t wait_ns);
+
+    /*
+     * Values only the caller can sample, added to the report as gauges
+     */
+    struct Gauges {
+        size_t pool_threads;
+        size_t busy_connections;    // Being served by a worker or parked
+        std::vector<int> listener_fds;  // For the accept queue, empty to leave it out
+        std::vector<std::pair<const char*, size_t>> lane_depths;   // Connections waiting, by lane
+        size_t queue_limit;         // Most connections the lanes hold, 0 if unbounded
+
+        Gauges() : pool_threads(0), busy_connections(0), queue_limit(0) {}
+    };
+
+    std::string report(const Gauges& gauges) const;
+
+private:
+    struct Histogram {
+        std::atomic<uint64_t> buckets[LATENCY_BUCKETS];
+        std::atomic<uint64_t> sum_ns;
+    };
+
+    // Cache line aligned so CPUs never write to each other's lines
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> requests[NUM_REQUEST_TYPES];
+        std::atomic<uint64_t> shed[NUM_REQUEST_TYPES];
+        std::atomic<uint64_t> deadlines_missed;
+        std::atomic<uint64_t> rejected[NUM_REQUEST_TYPES];
+        std::atomic<uint64_t> admission_blocks;
+        Histogram latency[NUM_REQUEST_TYPES];
+        Histogram task_wait;
+        std::atomic<uint64_t> tasks_queued;
+        std::atomic<uint64_t> tasks_started;
+        std::atomic<uint64_t> bytes_received;
+        std::atomic<uint64_t> bytes_sent;
+        std::atomic<uint64_t> connections_opened;
+        std::atomic<uint64_t> connections_closed;
+    };
+
+    Shard& local();
+    static void record(Histogram& h, uint64_t ns);
+
+    std::string name;
+    Shard* shards;
+    size_t shard_count;
+};
+
+#endif
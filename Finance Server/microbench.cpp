@@ -0,0 +1,375 @@
+#include "common.h"
+#include "network_channel.h"
+#include "thread_pool.h"
+#include "account_store.h"
+#include "bench.h"
+#include "logger.h"
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+using namespace std;
+
+/*
+ * Microbenchmarks for the protocol, thread pool and interest hot paths
+ *
+ * Every result is printed as one JSON object per line so runs can be
+ * collected and compared across commits:
+ *
+ *   {"benchmark":"parse_request","variant":"binary/deposit","iterations":...,"ns_per_op":...}
+ *
+ * Usage: ./microbench [FILTER]   (only benchmarks whose name contains FILTER)
+ *
+ * Protocol benchmarks also report "allocs_per_op", heap allocations per
+ * operation counted by the replaced operator new below.
+ */
+
+// Every operator new in the process, including the echo server thread's
+static atomic<uint64_t> allocations(0);
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1)) return p;
+    throw bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+// Each measurement runs for at least this long
+static const chrono::milliseconds MIN_TIME(200);
+
+// Keeps measured results alive so the compiler cannot drop the work
+static volatile uint64_t sink;
+
+static string filter;
+
+static bool selected(const string& name) {
+    return filter.empty() || name.find(filter) != string::npos;
+}
+
+static string json_escape(const string& s) {
+    string out;
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+// One result line; extra is a list of further "key":value pairs
+static void report(const string& name, const string& variant, uint64_t iterations, double ns_per_op,
+                   const string& extra = "") {
+    ostringstream line;
+    line << fixed << setprecision(2)
+         << "{\"benchmark\":\"" << json_escape(name) << "\",\"variant\":\"" << json_escape(variant)
+         << "\",\"iterations\":" << iterations << ",\"ns_per_op\":" << ns_per_op;
+    if (!extra.empty()) line << "," << extra;
+    line << "}";
+    cout << line.str() << endl;
+}
+
+/**
+ * Times body(iterations), growing iterations until one run takes MIN_TIME
+ *
+ * @return Nanoseconds per iteration of the last run
+ */
+static double measure(function<void(uint64_t)> body, uint64_t& iterations) {
+    iterations = 1;
+    while (true) {
+        auto start = chrono::steady_clock::now();
+        body(iterations);
+        auto elapsed = chrono::steady_clock::now() - start;
+        if (elapsed >= MIN_TIME || iterations >= (1ull << 40)) {
+            return chrono::duration<double, nano>(elapsed).count() / iterations;
+        }
+        // Jump close to the target instead of doubling all the way
+        double ratio = MIN_TIME / chrono::duration<double>(elapsed > chrono::nanoseconds(0) ? elapsed : chrono::nanoseconds(1));
+        iterations = ratio > 10 ? iterations * 10 : (uint64_t)(iterations * ratio * 1.2) + 1;
+    }
+}
+
+/**
+ * Heap allocations per iteration of body, counted over a short extra run
+ * after it has been measured (so buffers it reuses have already grown)
+ */
+static string allocs_per_op(function<void(uint64_t)> body) {
+    const uint64_t n = 1000;
+    uint64_t before = allocations.load();
+    body(n);
+    ostringstream out;
+    out << fixed << setprecision(2) << "\"allocs_per_op\":" << double(allocations.load() - before) / n;
+    return out.str();
+}
+
+static vector<pair<string, Request>> sample_requests() {
+    vector<pair<string, Request>> samples;
+    samples.push_back(make_pair("deposit", Request(DEPOSIT, 123456, 250.75)));
+    samples.push_back(make_pair("upload_4k", Request(UPLOAD_FILE, 123456, 0, "report.pdf", string(4096, 'x'))));
+    return samples;
+}
+
+static const char* format_name(WireFormat format) {
+    return format == BINARY_FORMAT ? "binary" : "text";
+}
+
+static void bench_parsing() {
+    for (const auto& sample : sample_requests()) {
+        for (WireFormat format : {TEXT_FORMAT, BINARY_FORMAT}) {
+            string variant = string(format_name(format)) + "/" + sample.first;
+            const Request& req = sample.second;
+            string wire = req.serialize(format);
+            string bytes = "\"bytes\":" + to_string(wire.size());
+            uint64_t iterations;
+
+            if (selected("serialize_request")) {
+                auto body = [&](uint64_t n) {
+                    for (uint64_t i = 0; i < n; i++) sink = sink + req.serialize(format).size();
+                };
+                double ns = measure(body, iterations);
+                report("serialize_request", variant, iterations, ns, bytes + "," + allocs_per_op(body));
+
+                // Into a reused buffer, as the channels do
+                string out;
+                auto reused = [&](uint64_t n) {
+                    for (uint64_t i = 0; i < n; i++) {
+                        out.clear();
+                        req.serialize(format, out);
+                        sink = sink + out.size();
+                    }
+                };
+                ns = measure(reused, iterations);
+                report("serialize_request", variant + "/reused", iterations, ns, bytes + "," + allocs_per_op(reused));
+            }
+            if (selected("parse_request")) {
+                auto body = [&](uint64_t n) {
+                    for (uint64_t i = 0; i < n; i++) sink = sink + Request::parseRequest(wire).user_id;
+                };
+                double ns = measure(body, iterations);
+                report("parse_request", variant, iterations, ns, bytes + "," + allocs_per_op(body));
+
+                // Into a reused request, as receive_request() does
+                Request parsed(QUIT);
+                auto reused = [&](uint64_t n) {
+                    for (uint64_t i = 0; i < n; i++) {
+                        Request::parse(wire, parsed);
+                        sink = sink + parsed.user_id;
+                    }
+                };
+                ns = measure(reused, iterations);
+                report("parse_request", variant + "/reused", iterations, ns, bytes + "," + allocs_per_op(reused));
+            }
+        }
+    }
+
+    Response resp(true, 1024.5, "", "Deposit successful");
+    for (WireFormat format : {TEXT_FORMAT, BINARY_FORMAT}) {
+        string wire = resp.serialize(format);
+        uint64_t iterations;
+        string bytes = "\"bytes\":" + to_string(wire.size());
+        if (selected("serialize_response")) {
+            auto body = [&](uint64_t n) {
+                for (uint64_t i = 0; i < n; i++) sink = sink + resp.serialize(format).size();
+            };
+            double ns = measure(body, iterations);
+            report("serialize_response", format_name(format), iterations, ns, bytes + "," + allocs_per_op(body));
+        }
+        if (selected("parse_response")) {
+            auto body = [&](uint64_t n) {
+                for (uint64_t i = 0; i < n; i++) sink = sink + Response::parseResponse(wire).success;
+            };
+            double ns = measure(body, iterations);
+            report("parse_response", format_name(format), iterations, ns, bytes + "," + allocs_per_op(body));
+
+            Response parsed;
+            auto reused = [&](uint64_t n) {
+                for (uint64_t i = 0; i < n; i++) {
+                    Response::parse(wire, parsed);
+                    sink = sink + parsed.success;
+                }
+            };
+            ns = measure(reused, iterations);
+            report("parse_response", string(format_name(format)) + "/reused", iterations, ns,
+                   bytes + "," + allocs_per_op(reused));
+        }
+    }
+}
+
+/**
+ * send_request()/receive_request()/send_response() over loopback TCP
+ *
+ * Measures the whole per-request path of both channels (serialization,
+ * framing, syscalls) against an echo server thread.
+ */
+static void bench_round_trip() {
+    if (!selected("round_trip")) return;
+
+    for (WireFormat format : {TEXT_FORMAT, BINARY_FORMAT}) {
+        NetworkRequestChannel listener("127.0.0.1", 0, NetworkRequestChannel::SERVER_SIDE);
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        getsockname(listener.get_socket_fd(), (struct sockaddr*)&addr, &len);
+
+        thread server([&listener] {
+            int fd = listener.accept_connection();
+            if (fd == -1) return;
+            NetworkRequestChannel channel(fd);
+            while (true) {
+                const Request& r = channel.receive_request();
+                if (r.type == QUIT) break;
+                if (r.type == HELLO) continue;
+                Response& resp = channel.scratch_response();
+                resp.success = true;
+                resp.balance = r.amount;
+                resp.message = "Deposit successful";
+                channel.send_response(resp);
+            }
+        });
+
+        uint64_t iterations;
+        double ns;
+        string allocs;
+        {
+            NetworkRequestChannel client("127.0.0.1", ntohs(addr.sin_port), NetworkRequestChannel::CLIENT_SIDE, format);
+            Request req(DEPOSIT, 123456, 250.75);
+            auto body = [&](uint64_t n) {
+                for (uint64_t i = 0; i < n; i++) sink = sink + client.send_request(req).success;
+            };
+            ns = measure(body, iterations);
+            allocs = allocs_per_op(body);
+        }
+        server.join();
+        report("round_trip", format_name(format), iterations, ns, allocs);
+    }
+}
+
+/**
+ * Tasks per second through enqueue() and enqueue_bulk() from one producer
+ */
+static void bench_pool_throughput(size_t threads) {
+    ThreadPool pool(threads);
+    atomic<uint64_t> done(0);
+    string extra = "\"threads\":" + to_string(threads);
+
+    if (selected("pool_enqueue")) {
+        uint64_t iterations;
+        double ns = measure([&](uint64_t n) {
+            done.store(0);
+            for (uint64_t i = 0; i < n; i++) {
+                pool.enqueue([&done] { done.fetch_add(1, memory_order_relaxed); });
+            }
+            while (done.load() < n) this_thread::yield();
+        }, iterations);
+        report("pool_enqueue", "single", iterations, ns, extra);
+    }
+
+    if (selected("pool_enqueue")) {
+        const size_t BULK = 64;
+        uint64_t iterations;
+        double ns = measure([&](uint64_t n) {
+            done.store(0);
+            vector<function<void()>> tasks;
+            for (uint64_t i = 0; i < n; i += BULK) {
+                tasks.clear();
+                for (size_t j = 0; j < BULK && i + j < n; j++) {
+                    tasks.push_back([&done] { done.fetch_add(1, memory_order_relaxed); });
+                }
+                pool.enqueue_bulk(tasks.begin(), tasks.end());
+            }
+            while (done.load() < n) this_thread::yield();
+        }, iterations);
+        report("pool_enqueue", "bulk64", iterations, ns, extra);
+    }
+}
+
+/**
+ * Time from enqueue() to the task starting, with every worker asleep first
+ */
+static void bench_pool_wakeup(size_t threads) {
+    if (!selected("pool_wakeup")) return;
+
+    const int SAMPLES = 2000;
+    ThreadPool pool(threads);
+    LatencyHistogram latency;
+
+    for (int i = 0; i < SAMPLES; i++) {
+        // Long enough for the workers to give up spinning and sleep
+        this_thread::sleep_for(chrono::microseconds(200));
+
+        atomic<bool> ran(false);
+        chrono::steady_clock::time_point started;
+        auto submitted = chrono::steady_clock::now();
+        pool.enqueue([&ran, &started] {
+            started = chrono::steady_clock::now();
+            ran.store(true, memory_order_release);
+        });
+        while (!ran.load(memory_order_acquire)) this_thread::yield();
+        latency.record(chrono::duration_cast<chrono::nanoseconds>(started - submitted).count());
+    }
+
+    report("pool_wakeup", "idle", SAMPLES, latency.mean(),
+           "\"threads\":" + to_string(threads) +
+           ",\"p50_ns\":" + to_string(latency.percentile(0.50)) +
+           ",\"p99_ns\":" + to_string(latency.percentile(0.99)) +
+           ",\"max_ns\":" + to_string(latency.max()));
+}
+
+/**
+ * One AccountStore::apply_interest() pass over every account
+ */
+static void bench_interest(size_t accounts) {
+    if (!selected("apply_interest")) return;
+
+    AccountStore store;
+    for (size_t id = 0; id < accounts; id++) {
+        store.deposit(id, 100000);
+    }
+
+    // Alternating rates keep balances (and so the work per pass) from drifting
+    uint64_t iterations;
+    double ns = measure([&](uint64_t n) {
+        for (uint64_t i = 0; i < n; i++) store.apply_interest(0, store.page_count(), i % 2 ? 1 / 1.01 : 1.01);
+    }, iterations);
+
+    double bytes = store.page_count() * AccountStore::PAGE_SIZE * sizeof(int64_t);
+    ostringstream extra;
+    extra << fixed << setprecision(3) << "\"accounts\":" << accounts << ",\"kernel\":\"" << AccountStore::kernel_name()
+          << "\",\"ns_per_account\":" << ns / accounts << ",\"gb_per_s\":" << bytes / ns;
+    report("apply_interest", "pass", iterations, ns, extra.str());
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1) filter = argv[1];
+
+    // The channels log connections on stdout, which carries the results
+    Logger::instance().set_level(LOG_LEVEL_WARN);
+
+    bench_parsing();
+    bench_round_trip();
+    for (size_t threads : {1, 2, 4, 8}) {
+        bench_pool_throughput(threads);
+    }
+    for (size_t threads : {1, 4}) {
+        bench_pool_wakeup(threads);
+    }
+    for (size_t accounts : {1024, 65536, 1048576}) {
+        bench_interest(accounts);
+    }
+    return 0;
+}
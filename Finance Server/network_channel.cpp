@@ -1,14 +1,101 @@
 #include "network_channel.h"
+#include "logger.h"
 #include <unistd.h>
 #include <sys/socket.h>
-#include <iostream>
-#include <sstream>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <cstring>
 #include <cerrno>
 #include <vector>
 
 using namespace std;
 
+// How long a non-blocking transfer may stall in the middle of a message
+static const int IO_TIMEOUT_MS = 30000;
+
+// Largest message accepted inline; bigger payloads must be streamed
+static const uint32_t MAX_MESSAGE_SIZE = 64 * 1024 * 1024;
+
+// Largest chunk written by one sendfile(2) call when serving a file
+static const uint32_t MAX_SENDFILE_CHUNK = 1024 * 1024 * 1024;
+
+// Bytes of a file mapped at a time when serving a range
+static const size_t MAP_WINDOW = 64 * 1024 * 1024;
+
+// Requests send_pipelined keeps in flight before reading their responses
+static const size_t PIPELINE_WINDOW = 1024;
+
+// Capacity a connection's reused buffers keep between requests; the rare
+// bigger message is not worth holding on to for the connection's lifetime
+static const size_t ARENA_RETAIN = 256 * 1024;
+
+static bool write_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// write_all at *offset (if given) without moving the descriptor's own offset
+static bool write_out(int fd, const char* buf, size_t len, off_t* offset) {
+    if (!offset) return write_all(fd, buf, len);
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, *offset);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buf += n;
+        len -= n;
+        *offset += n;
+    }
+    return true;
+}
+
+// Writes request_id into a binary request or response serialized at start of buf
+static void stamp_request_id(string& buf, uint32_t request_id, size_t start = 0) {
+    if (buf.size() >= start + 8 && static_cast<uint8_t>(buf[start]) == BINARY_MAGIC) {
+        uint32_t id = htonl(request_id);
+        memcpy(&buf[start + 4], &id, 4);
+    }
+}
+
+// Serializes message as one more frame (length header and body) at the end of buf
+template <typename Message>
+static void append_frame(string& buf, const Message& message, WireFormat format, uint32_t request_id) {
+    size_t start = buf.size();
+    buf.append(4, '\0');
+    message.serialize(format, buf);
+    uint32_t length = htonl(buf.size() - start - 4);
+    memcpy(&buf[start], &length, 4);
+    stamp_request_id(buf, request_id, start + 4);
+}
+
+// Drops a reused buffer that grew past what is worth keeping around
+static void trim(string& buf) {
+    if (buf.capacity() > ARENA_RETAIN) string().swap(buf);
+}
+
+static bool read_all(int fd, string& out) {
+    char buf[CHUNK_SIZE];
+    while (true) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return n == 0;
+        out.append(buf, n);
+    }
+}
 
 /**
  * Creates a NetworkRequestChannel
@@ -17,6 +104,9 @@ using namespace std;
  *           Empty string for server side means bind to all interfaces
  * @param port Port number to use
  * @param side SERVER_SIDE to create a listening socket, CLIENT_SIDE to connect to a server
+ * @param preferred Wire format the client tries to negotiate (ignored on the server side)
+ * @param compression Level of payload compression the client asks for on a
+ *                    binary connection, COMPRESSION_OFF for none (ignored on the server side)
  * 
  * SERVER_SIDE behavior:
  * - Creates a socket and configures it for listening on the specified port
@@ -25,67 +115,28 @@ using namespace std;
  * CLIENT_SIDE behavior:
  * - Creates a socket and connects to the specified server address
  * - If the ip parameter is not a valid IP address, attempts to resolve it as a hostname
+ * - Negotiates the binary wire format unless TEXT_FORMAT is preferred
  * 
  * @throws Exits with error message if socket operations fail
  */
 
 // Constructor for setting up a connection (server listening or client connecting)
-NetworkRequestChannel::NetworkRequestChannel(const std::string& ip, int port, Side side) 
-    : my_side(side), client_addr_len(sizeof(client_addr)) {
+NetworkRequestChannel::NetworkRequestChannel(const std::string& ip, int port, Side side, WireFormat preferred,
+                                             int compression) 
+    : my_side(side), client_addr_len(sizeof(client_addr)), connected(true), format(preferred),
+      payload_pending(false), payload_compressed(false), codec(CODEC_NONE), compression_level(compression),
+      next_request_id(1), reply_to(0), bytes_received(0), bytes_sent(0), reply_suppressed(false),
+      deadline(chrono::steady_clock::time_point::max()), deadline_passed(false), received(QUIT) {
+    pipe_fds[0] = pipe_fds[1] = -1;
     
     // Initialize address structures to zero
     memset(&server_addr, 0, sizeof(server_addr));
     memset(&client_addr, 0, sizeof(client_addr));
     
     if (side == SERVER_SIDE) {
-        // TODO: Implement server-side socket creation and setup
-        sockfd = socket(AF_INET, SOCK_STREAM, 0);
-        if (sockfd == -1) {
-            cerr << "Error creating socket server side " << strerror(errno) << endl;
-            throw("Error creating socket server side");
-        } 
-        int allow = 1;
-        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &allow, sizeof(allow)) == -1) {
-            cerr << "Error allowing address reuse server side " << strerror(errno) << endl;
-            throw("Error allowing address reuse server side");
-        }
-
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(port); // CHECK THIS IF SOMETHING IS WRONG
-
-        // Needed to convert ip string to machine usable ip
-        if (ip.empty()) {
-            server_addr.sin_addr.s_addr = INADDR_ANY;
-        }
-        else {
-            if (inet_pton(AF_INET, ip.c_str(), &server_addr.sin_addr) <= 0) {
-                cerr << "Error setting address server side " << strerror(errno) << endl;
-                throw("Error setting address server side");
-            }
-        }
-
-        if (bind(sockfd, (const struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
-            cerr << "Error binding " << strerror(errno) << endl;
-            throw("Error binding");
-        }
-
-        if (listen(sockfd, 10) == -1) {
-            cerr << "Error listening " << strerror(errno) << endl;
-            throw("Error listening");
-        }
-
-        // Set peer information for logging purposes
-        peer_ip = "0.0.0.0";
-        peer_port = port;
-        cout << "Server listening on port " << port << endl;
+        listen_socket(ip, port, ListenOptions());
     } else {
         // TODO: Implement client-side socket creation and connection
-        sockfd = socket(AF_INET, SOCK_STREAM, 0);
-        if (sockfd == -1) {
-            cerr << "Error creating socket client side " << strerror(errno) << endl;
-            throw("Error creating socket client side");
-        } 
-
         server_addr.sin_family = AF_INET;
         server_addr.sin_port = htons(port); // CHECK THIS IF SOMETHING IS WRONG
 
@@ -93,27 +144,179 @@ NetworkRequestChannel::NetworkRequestChannel(const std::string& ip, int port, Si
         if (ip == "localhost") {
             const char* new_ip = "127.0.0.1";
             if (inet_pton(AF_INET, new_ip, &server_addr.sin_addr) <= 0) {
-                cerr << "Error setting address client side " << strerror(errno) << endl;
+                LOG_ERROR("Error setting address client side " << strerror(errno));
                 throw("Error setting address client side");
             }
         }
         else {
             if (inet_pton(AF_INET, ip.c_str(), &server_addr.sin_addr) <= 0) {
-                cerr << "Error setting address client side " << strerror(errno) << endl;
+                LOG_ERROR("Error setting address client side " << strerror(errno));
                 throw("Error setting address client side");
             }
         }
         
-        if (connect(sockfd, (const sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
-            cerr << "Error connecting " << strerror(errno) << endl;
-            throw("Error connecting");
-        }
+        connect_socket();
         
         // Store peer information for logging
         peer_ip = ip;
         peer_port = port;
-        cout << "Connected to server at " << ip << ":" << port << endl;
+        LOG_INFO("Connected to server at " << ip << ":" << port);
+
+        if (format == BINARY_FORMAT) {
+            negotiate();
+        }
+    }
+}
+
+/**
+ * Creates a listening NetworkRequestChannel
+ *
+ * @param ip Interface to bind to, empty for all interfaces
+ * @param port Port number to listen on
+ * @param options Backlog and socket options, e.g. reuse_port so several
+ *                listeners (one per event loop) can accept on the same port
+ *
+ * @throws Exits with error message if socket operations fail
+ */
+NetworkRequestChannel::NetworkRequestChannel(const std::string& ip, int port, const ListenOptions& options)
+    : my_side(SERVER_SIDE), client_addr_len(sizeof(client_addr)), connected(true), format(TEXT_FORMAT),
+      payload_pending(false), payload_compressed(false), codec(CODEC_NONE), compression_level(COMPRESSION_OFF),
+      next_request_id(1), reply_to(0), bytes_received(0), bytes_sent(0), reply_suppressed(false),
+      deadline(chrono::steady_clock::time_point::max()), deadline_passed(false), received(QUIT) {
+    pipe_fds[0] = pipe_fds[1] = -1;
+    memset(&server_addr, 0, sizeof(server_addr));
+    memset(&client_addr, 0, sizeof(client_addr));
+    listen_socket(ip, port, options);
+}
+
+/**
+ * Creates the listening socket of a SERVER_SIDE channel
+ *
+ * @param ip Interface to bind to, empty for all interfaces
+ * @param port Port number to listen on
+ * @param options Backlog and socket options
+ *
+ * @throws Exits with error message if socket operations fail
+ */
+void NetworkRequestChannel::listen_socket(const std::string& ip, int port, const ListenOptions& options) {
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd == -1) {
+        LOG_ERROR("Error creating socket server side " << strerror(errno));
+        throw("Error creating socket server side");
+    } 
+    int allow = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &allow, sizeof(allow)) == -1) {
+        LOG_ERROR("Error allowing address reuse server side " << strerror(errno));
+        throw("Error allowing address reuse server side");
+    }
+    if (options.reuse_port && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &allow, sizeof(allow)) == -1) {
+        LOG_ERROR("Error allowing port reuse server side " << strerror(errno));
+        throw("Error allowing port reuse server side");
+    }
+
+    // Accepted sockets inherit TCP_NODELAY, saving a setsockopt per connection
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &allow, sizeof(allow)) == -1) {
+        LOG_WARN("Error setting TCP_NODELAY " << strerror(errno));
+    }
+
+    // Clients always speak first, so a connection is only worth waking the
+    // acceptor for once its first request is there
+    if (options.defer_accept_s > 0 &&
+        setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &options.defer_accept_s, sizeof(options.defer_accept_s)) == -1) {
+        LOG_WARN("Error setting TCP_DEFER_ACCEPT " << strerror(errno));
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port); // CHECK THIS IF SOMETHING IS WRONG
+
+    // Needed to convert ip string to machine usable ip
+    if (ip.empty()) {
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+    }
+    else {
+        if (inet_pton(AF_INET, ip.c_str(), &server_addr.sin_addr) <= 0) {
+            LOG_ERROR("Error setting address server side " << strerror(errno));
+            throw("Error setting address server side");
+        }
+    }
+
+    if (bind(sockfd, (const struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        LOG_ERROR("Error binding " << strerror(errno));
+        throw("Error binding");
+    }
+
+    if (listen(sockfd, options.backlog) == -1) {
+        LOG_ERROR("Error listening " << strerror(errno));
+        throw("Error listening");
+    }
+
+    // Set peer information for logging purposes
+    peer_ip = "0.0.0.0";
+    peer_port = port;
+    LOG_DEBUG("Server listening on port " << port);
+}
+
+/**
+ * Creates the client socket and connects it to server_addr
+ */
+void NetworkRequestChannel::connect_socket() {
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd == -1) {
+        LOG_ERROR("Error creating socket client side " << strerror(errno));
+        throw("Error creating socket client side");
+    } 
+
+    if (connect(sockfd, (const sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+        LOG_ERROR("Error connecting " << strerror(errno));
+        close(sockfd);
+        throw("Error connecting");
+    }
+    connected = true;
+    set_nodelay();
+}
+
+/**
+ * Disables Nagle's algorithm
+ * 
+ * Requests and responses are small and pipelined; without this the last
+ * message of a burst waits for the peer's delayed ACK.
+ */
+void NetworkRequestChannel::set_nodelay() {
+    int on = 1;
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1) {
+        LOG_ERROR_LIMITED("Error setting TCP_NODELAY " << strerror(errno));
+    }
+}
+
+/**
+ * Asks the server to switch this connection to the binary wire format
+ * 
+ * The HELLO request itself is sent in the text format, so any server can
+ * parse it. A server that accepts replies with the agreed version in the
+ * balance field. Servers that predate the binary format treat the unknown
+ * type as a disconnect, so on any other reply the client reconnects and
+ * keeps using the text format.
+ *
+ * If compression was asked for, the HELLO data offers a codec and level;
+ * a server that supports them echoes them back and both sides then
+ * compress the payloads they mark compressible. Servers that predate
+ * compression ignore the offer and payloads go out as they are.
+ */
+void NetworkRequestChannel::negotiate() {
+    format = TEXT_FORMAT;
+    string offer = compression_level == COMPRESSION_OFF ? "" : PayloadCodec::describe(CODEC_DEFLATE, compression_level);
+    Response resp = send_request(Request(HELLO, 0, BINARY_PROTOCOL_VERSION, "", offer));
+
+    if (resp.success && resp.balance == BINARY_PROTOCOL_VERSION) {
+        format = BINARY_FORMAT;
+        if (!offer.empty() && resp.data == offer) {
+            codec = CODEC_DEFLATE;
+        }
+        return;
     }
+
+    close(sockfd);
+    connect_socket();
 }
 
 /**
@@ -125,22 +328,28 @@ NetworkRequestChannel::NetworkRequestChannel(const std::string& ip, int port, Si
  * socket connection that was established by accepting a client connection.
  */
 NetworkRequestChannel::NetworkRequestChannel(int fd) 
-    : my_side(SERVER_SIDE), sockfd(fd), client_addr_len(sizeof(client_addr)) {
+    : my_side(SERVER_SIDE), sockfd(fd), client_addr_len(sizeof(client_addr)), connected(true),
+      format(TEXT_FORMAT), payload_pending(false), payload_compressed(false), codec(CODEC_NONE),
+      compression_level(COMPRESSION_OFF), next_request_id(1), reply_to(0), bytes_received(0), bytes_sent(0),
+      reply_suppressed(false), deadline(chrono::steady_clock::time_point::max()), deadline_passed(false),
+      received(QUIT) {
+    pipe_fds[0] = pipe_fds[1] = -1;
     
     // TODO: Implement this constructor function
     if (getpeername(sockfd, (struct sockaddr*)&client_addr, &client_addr_len) == -1) {
-        cerr << "Error getting peer info " << strerror(errno) << endl;
+        LOG_ERROR("Error getting peer info " << strerror(errno));
         throw("Error getting peer info");
     }
 
     // Store the IP address and port in peer_ip and peer_port
     char ip[INET_ADDRSTRLEN];
     if (inet_ntop(AF_INET, &client_addr.sin_addr, ip, sizeof(ip)) == NULL) {
-        cerr << "Error getting ip " << strerror(errno) << endl;
+        LOG_ERROR("Error getting ip " << strerror(errno));
         throw("Error getting ip");
     }
     peer_ip = std::string(ip);
     peer_port = ntohs(client_addr.sin_port);
+    // TCP_NODELAY is inherited from the listening socket
 }
 
 /**
@@ -152,27 +361,33 @@ NetworkRequestChannel::~NetworkRequestChannel() {
     // TODO: Implement the destructor
 
     if (close(sockfd) == -1) {
-        cerr << "Error closing socket " << strerror(errno) << endl;
+        LOG_ERROR_LIMITED("Error closing socket " << strerror(errno));
     }
     
+    if (pipe_fds[0] != -1) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+    }
 }
 
 /**
  * Accepts a new client connection on a server socket
+ *
+ * The new socket is non-blocking and close-on-exec from the start, which
+ * saves the fcntl() calls per connection an EventLoop would otherwise need.
  */
 int NetworkRequestChannel::accept_connection() {
     // TODO: Accept a new client connection
-    int new_sockfd = accept(sockfd, (struct sockaddr*)&client_addr, &client_addr_len);
+    client_addr_len = sizeof(client_addr);
+    int new_sockfd = accept4(sockfd, (struct sockaddr*)&client_addr, &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
     if (new_sockfd == -1) {
-        cerr << "Error accepting socket " << strerror(errno) << endl;
+        // A non-blocking listener simply has nothing left to accept
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            LOG_ERROR_LIMITED("Error accepting socket " << strerror(errno));
+        }
         return -1;
     }
 
-    // Print connection information for logging purposes
-    cout << "Accepted connection from " 
-         << inet_ntoa(client_addr.sin_addr) << ":" 
-         << ntohs(client_addr.sin_port) << endl;
-    
     return new_sockfd; // Replace this with the actual new socket file descriptor
 }
 
@@ -184,6 +399,423 @@ int NetworkRequestChannel::get_socket_fd() const {
     return sockfd;
 }
 
+/**
+ * Switches the socket to non-blocking mode
+ * 
+ * Used by the EventLoop for the listening socket and for every accepted
+ * connection. The send/receive methods keep their blocking semantics by
+ * waiting for readiness whenever the socket would block mid-message.
+ */
+void NetworkRequestChannel::set_nonblocking() {
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        LOG_ERROR("Error setting socket non-blocking " << strerror(errno));
+        throw("Error setting socket non-blocking");
+    }
+}
+
+bool NetworkRequestChannel::is_connected() const {
+    return connected;
+}
+
+WireFormat NetworkRequestChannel::get_wire_format() const {
+    return format;
+}
+
+bool NetworkRequestChannel::compresses_payloads() const {
+    return format == BINARY_FORMAT && codec != CODEC_NONE;
+}
+
+Response& NetworkRequestChannel::scratch_response() {
+    scratch.reset();
+    return scratch;
+}
+
+/**
+ * Empties the per-connection buffers for the next request, releasing any
+ * that a large message grew past ARENA_RETAIN
+ */
+void NetworkRequestChannel::reset_arena() {
+    trim(frame_in);
+    trim(frame_out);
+    trim(received.filename);
+    trim(received.data);
+    trim(scratch.data);
+    trim(scratch.message);
+}
+
+/**
+ * Waits until the socket is readable or writable
+ * 
+ * @param events POLLIN or POLLOUT
+ * @return false if the wait timed out or failed
+ */
+bool NetworkRequestChannel::wait_ready(short events) {
+    struct pollfd pfd;
+    pfd.fd = sockfd;
+    pfd.events = events;
+    pfd.revents = 0;
+
+    int i;
+    do {
+        i = poll(&pfd, 1, IO_TIMEOUT_MS);
+    } while (i == -1 && errno == EINTR);
+
+    return i > 0;
+}
+
+/**
+ * Sends a list of buffers with as few syscalls as possible
+ * 
+ * MSG_NOSIGNAL keeps a client that hung up from killing the process with SIGPIPE.
+ * The iovec array is consumed as data is sent. Pass MSG_MORE in flags when
+ * more data follows immediately so the kernel can coalesce the segments.
+ */
+bool NetworkRequestChannel::send_iov(struct iovec* iov, int count, int flags) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+
+    while (count > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t i = sendmsg(sockfd, &msg, MSG_NOSIGNAL | flags);
+        if (i == -1) {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_ready(POLLOUT)) continue;
+            connected = false;
+            return false;
+        }
+
+        // Skip the buffers that went out completely
+        size_t sent = i;
+        bytes_sent += sent;
+        while (count > 0 && sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return true;
+}
+
+/**
+ * Sends one message: the 4-byte length header followed by the body
+ */
+bool NetworkRequestChannel::send_frame(const char* body, size_t len, int flags) {
+    uint32_t length = htonl(len);
+    struct iovec iov[2];
+    iov[0].iov_base = &length;
+    iov[0].iov_len = 4;
+    iov[1].iov_base = const_cast<char*>(body);
+    iov[1].iov_len = len;
+    return send_iov(iov, 2, flags);
+}
+
+/**
+ * Sends len bytes of a file starting at offset with sendfile(2)
+ * 
+ * Returns false if the socket failed or the file ended early. In the latter
+ * case the peer has been promised more bytes than exist, so the connection
+ * is marked as disconnected.
+ */
+bool NetworkRequestChannel::sendfile_all(int file_fd, off_t& offset, size_t len) {
+    while (len > 0) {
+        ssize_t n = sendfile(sockfd, file_fd, &offset, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_ready(POLLOUT)) continue;
+            connected = false;
+            return false;
+        }
+        if (n == 0) {
+            connected = false;
+            errno = EIO;
+            return false;
+        }
+        bytes_sent += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * Receives exactly len bytes
+ * 
+ * Returns false on error or when the peer closed the connection.
+ */
+bool NetworkRequestChannel::recv_all(char* buf, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        ssize_t i = recv(sockfd, buf + received, len - received, 0);
+        if (i == 0) {
+            connected = false;
+            errno = 0;
+            return false;
+        }
+        if (i == -1) {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_ready(POLLIN)) continue;
+            connected = false;
+            return false;
+        }
+        received += i;
+        bytes_received += i;
+    }
+    return true;
+}
+
+/**
+ * Receives one message into body
+ * 
+ * Messages larger than MAX_MESSAGE_SIZE are refused and the connection is
+ * dropped; large payloads have to use the streaming methods instead.
+ */
+bool NetworkRequestChannel::recv_frame(string& body) {
+    char length_buf[4];
+    if (!recv_all(length_buf, 4)) {
+        return false;
+    }
+
+    uint32_t length;
+    memcpy(&length, length_buf, 4);
+    length = ntohl(length);
+
+    if (length > MAX_MESSAGE_SIZE) {
+        LOG_ERROR_LIMITED("Message of " << length << " bytes from " << get_peer_address() << " exceeds limit");
+        connected = false;
+        errno = EMSGSIZE;
+        return false;
+    }
+
+    body.resize(length);
+    return length == 0 || recv_all(&body[0], length);
+}
+
+/**
+ * Streams everything readable from in_fd as chunks, then the terminating empty chunk
+ * 
+ * Memory use is bounded by CHUNK_SIZE no matter how large the payload is.
+ * With compressed the chunks are encoded with the negotiated codec.
+ * Returns false if in_fd could not be read or the socket failed.
+ */
+bool NetworkRequestChannel::send_payload(int in_fd, bool compressed) {
+    chunk_buf.resize(CHUNK_SIZE);
+    bool ok = true;
+
+    while (true) {
+        ssize_t n = read(in_fd, &chunk_buf[0], CHUNK_SIZE);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            ok = (n == 0);
+            break;
+        }
+        if (!send_chunk(&chunk_buf[0], n, compressed)) {
+            return false;
+        }
+    }
+
+    return send_frame(NULL, 0) && ok;
+}
+
+/**
+ * Sends len bytes of a streamed payload
+ * 
+ * Uncompressed they go out as one chunk. Compressed they are cut into
+ * CHUNK_SIZE pieces, each encoded into a chunk of its own, so receivers
+ * never need more than CHUNK_SIZE to decode one. Empty data sends nothing,
+ * since an empty chunk would end the payload.
+ */
+bool NetworkRequestChannel::send_chunk(const char* data, size_t len, bool compressed, int flags) {
+    if (!compressed) {
+        return len == 0 || send_frame(data, len, flags);
+    }
+
+    while (len > 0) {
+        size_t n = len < CHUNK_SIZE ? len : CHUNK_SIZE;
+        encoder.encode(codec, compression_level, data, n, encoded_out);
+        if (!send_frame(encoded_out.data(), encoded_out.size(), flags)) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * Receives a chunked payload, writing it to out_fd and/or appending it to out
+ * 
+ * The whole payload is always consumed so the connection stays in sync,
+ * even if writing to out_fd fails. Pass out_fd = -1 and out = NULL to discard.
+ * With offset the payload is written there (and offset advanced) like
+ * pwrite(2) instead of at the descriptor's current offset.
+ * At most CHUNK_SIZE bytes are buffered in user space regardless of how
+ * large the sender's chunks are.
+ */
+bool NetworkRequestChannel::recv_payload(int out_fd, string* out, off_t* offset) {
+    payload_pending = false;
+    if (payload_compressed) {
+        return recv_compressed_payload(out_fd, out, offset);
+    }
+    chunk_buf.resize(CHUNK_SIZE);
+    bool ok = true;
+
+    while (true) {
+        char length_buf[4];
+        if (!recv_all(length_buf, 4)) {
+            return false;
+        }
+
+        uint32_t length;
+        memcpy(&length, length_buf, 4);
+        length = ntohl(length);
+        if (length == 0) break;
+
+        // Chunks may be larger than the buffer, so they are moved piecewise
+        size_t remaining = length;
+        if (out_fd >= 0 && !out && ok) {
+            if (!splice_to_fd(out_fd, remaining, ok, offset)) {
+                return false;
+            }
+        }
+
+        while (remaining > 0) {
+            size_t n = remaining < CHUNK_SIZE ? remaining : CHUNK_SIZE;
+            if (!recv_all(&chunk_buf[0], n)) {
+                return false;
+            }
+            if (out_fd >= 0 && ok) {
+                ok = write_out(out_fd, &chunk_buf[0], n, offset);
+            }
+            if (out) {
+                out->append(&chunk_buf[0], n);
+            }
+            remaining -= n;
+        }
+    }
+    return ok;
+}
+
+/**
+ * Receives a FLAG_COMPRESSED payload like recv_payload()
+ * 
+ * Every chunk is read whole and decoded into chunk_buf, so the data always
+ * passes through user space. A chunk that cannot be decoded fails the
+ * payload but the rest is still consumed; one larger than any sender
+ * produces means the stream cannot be trusted and drops the connection.
+ */
+bool NetworkRequestChannel::recv_compressed_payload(int out_fd, string* out, off_t* offset) {
+    payload_compressed = false;
+    chunk_buf.resize(CHUNK_SIZE);
+    bool ok = true;
+
+    while (true) {
+        char length_buf[4];
+        if (!recv_all(length_buf, 4)) {
+            return false;
+        }
+
+        uint32_t length;
+        memcpy(&length, length_buf, 4);
+        length = ntohl(length);
+        if (length == 0) break;
+        if (length > PayloadCodec::HEADER_SIZE + CHUNK_SIZE) {
+            LOG_ERROR_LIMITED("Compressed chunk of " << length << " bytes from " << peer_ip);
+            connected = false;
+            errno = EPROTO;
+            return false;
+        }
+
+        encoded_in.resize(length);
+        if (!recv_all(&encoded_in[0], length)) {
+            return false;
+        }
+        if (!ok) continue;
+
+        size_t n;
+        if (!decoder.decode(encoded_in.data(), length, &chunk_buf[0], CHUNK_SIZE, n)) {
+            LOG_ERROR_LIMITED("Corrupt compressed chunk from " << peer_ip);
+            ok = false;
+            continue;
+        }
+        if (out_fd >= 0) {
+            ok = write_out(out_fd, &chunk_buf[0], n, offset);
+        }
+        if (out) {
+            out->append(&chunk_buf[0], n);
+        }
+    }
+    return ok;
+}
+
+/**
+ * Moves up to len bytes of a chunk from the socket into out_fd with splice(2)
+ * 
+ * The data goes socket -> pipe -> file without being copied into user space.
+ * len is reduced by the amount consumed from the socket; if out_fd cannot be
+ * spliced to, the rest is left for the buffered path. write_ok is cleared if
+ * writing to out_fd fails. A non-NULL offset is where the data goes in out_fd
+ * and is advanced past it. Returns false only if the socket failed.
+ */
+bool NetworkRequestChannel::splice_to_fd(int out_fd, size_t& len, bool& write_ok, off_t* offset) {
+    if (pipe_fds[0] == -1 && pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        pipe_fds[0] = pipe_fds[1] = -1;
+        return true;
+    }
+
+    while (len > 0) {
+        size_t want = len < CHUNK_SIZE ? len : CHUNK_SIZE;
+        ssize_t n = splice(sockfd, NULL, pipe_fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == 0) {
+            connected = false;
+            errno = 0;
+            return false;
+        }
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_ready(POLLIN)) continue;
+            if (errno == EINVAL) return true; // Not spliceable, use the buffered path
+            connected = false;
+            return false;
+        }
+        len -= n;
+        bytes_received += n;
+
+        // Empty the pipe into the destination
+        while (n > 0) {
+            ssize_t m = splice(pipe_fds[0], NULL, out_fd, offset, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m == -1 && errno == EINTR) continue;
+            if (m <= 0) {
+                // Destination failed: drop what is in the pipe, drain the rest normally
+                write_ok = false;
+                chunk_buf.resize(CHUNK_SIZE);
+                while (n > 0) {
+                    ssize_t r = read(pipe_fds[0], &chunk_buf[0], n);
+                    if (r == -1 && errno == EINTR) continue;
+                    if (r <= 0) break;
+                    n -= r;
+                }
+                return true;
+            }
+            n -= m;
+        }
+    }
+    return true;
+}
+
+/**
+ * Drops a streamed payload that the caller never read
+ */
+void NetworkRequestChannel::discard_pending() {
+    if (payload_pending) {
+        recv_payload(-1, NULL);
+    }
+}
+
 /**
  * Sends a request to the server and waits for a response
  * 
@@ -192,151 +824,484 @@ int NetworkRequestChannel::get_socket_fd() const {
  * 
  * This method:
  * Sends the length of the request followed by the request itself and receives the responses.
+ * A streamed response payload is collected into resp.data.
  * 
- * The wire format uses a 4-byte length header followed by the serialized data.
- * Request format: TYPE|USER_ID|AMOUNT|FILENAME|DATA
- * Response format: SUCCESS|BALANCE|DATA|MESSAGE
+ * The wire format uses a 4-byte length header followed by the serialized data
+ * in the format negotiated for this connection (see common.h).
+ * Text request format: TYPE|USER_ID|AMOUNT|FILENAME|DATA
+ * Text response format: SUCCESS|BALANCE|DATA|MESSAGE
  * 
  * @throws May throw exceptions on network errors
  */
 Response NetworkRequestChannel::send_request(const Request& req) {
-    // Format: TYPE|USER_ID|AMOUNT|FILENAME|DATA
-    stringstream ss;
-    ss << static_cast<int>(req.type) << "|"
-       << req.user_id << "|"
-       << req.amount << "|"
-       << req.filename << "|"
-       << req.data;
-    
-    string request_str = ss.str();
-    
-    // Add message length as header (4 bytes)
-    // Convert the request string length to network byte order
-    uint32_t length = htonl(request_str.length());
-    char length_buf[4];
-    memcpy(length_buf, &length, 4);
-
-    // TODO : Implement the send_request function
-    size_t sent = 0;
-    int i  = 0;
-    // Send header
-    while(sent < 4) {
-        i = send(sockfd, length_buf + sent, 4 - sent, 0);
-        if (i == -1) {
-            perror("Send failed in send_request");
-            return Response(false, 0, "", "Send failed");
+    Response resp = send_request_stream(req, -1);
+    if (resp.streamed) {
+        resp.streamed = false;
+        if (!recv_payload(-1, &resp.data)) {
+            LOG_ERROR_LIMITED("Receive failed in send_request: " << strerror(errno));
+            return Response(false, 0, "", "Receive failed");
         }
-        sent += i;
     }
+    return resp;
+}
 
-    char message_buf[1024];
-    memcpy(message_buf, request_str.c_str(), request_str.size());
-    
-    sent = 0;
-    
-    while (sent < request_str.size()) { // Sending whole message
-        i = send(sockfd, message_buf + sent, request_str.size() - sent, 0);
-        if (i == -1) {
-            perror("Send failed in send_request");
+/**
+ * Sends a request whose payload is read from a file descriptor
+ * 
+ * @param req The Request object to send; req.data is ignored if in_fd is valid
+ * @param in_fd Descriptor to stream the payload from, or -1 to send req.data
+ * @return Response from the server
+ * 
+ * On a binary connection the payload is sent in CHUNK_SIZE chunks straight
+ * from in_fd. Text connections fall back to sending it inline. If the
+ * response is streamed, its payload is left on the connection for
+ * receive_payload(resp, fd).
+ */
+Response NetworkRequestChannel::send_request_stream(const Request& req, int in_fd) {
+    if (!in_flight_ids.empty()) {
+        return Response(false, 0, "", "Pipelined responses still pending");
+    }
+    discard_pending();
+
+    bool stream = (in_fd >= 0 && format == BINARY_FORMAT);
+    bool compressed = stream && req.compressible && compresses_payloads();
+    frame_out.clear();
+    if (in_fd >= 0) {
+        Request copy(req.type, req.user_id, req.amount, req.filename);
+        copy.offset = req.offset;
+        copy.length = req.length;
+        copy.streamed = stream;
+        copy.compressible = compressed;
+        if (!stream && !read_all(in_fd, copy.data)) {
+            return Response(false, 0, "", "Failed to read payload");
+        }
+        copy.serialize(format, frame_out);
+    } else {
+        req.serialize(format, frame_out);
+    }
+    uint32_t request_id = next_request_id++;
+    stamp_request_id(frame_out, request_id);
+
+    // Send header and the whole message
+    if (!send_frame(frame_out.data(), frame_out.size())) {
+        LOG_ERROR_LIMITED("Send failed in send_request: " << strerror(errno));
+        return Response(false, 0, "", "Send failed");
+    }
+
+    if (stream && !send_payload(in_fd, compressed)) {
+        if (!connected) {
+            LOG_ERROR_LIMITED("Send failed in send_request: " << strerror(errno));
             return Response(false, 0, "", "Send failed");
         }
-        sent += i;
+        // The server still answers; report the local read failure afterwards
     }
 
     // Read response header first
-    size_t n = recv(sockfd, length_buf, 4, 0);
-    if (n != 4) {
-        perror("Receive failed in send_request");
+    if (!recv_frame(frame_in)) {
+        LOG_ERROR_LIMITED("Receive failed in send_request: " << strerror(errno));
         return Response(false, 0, "", "Receive failed");
     }
 
-    uint32_t resp_converted;
-    memcpy(&resp_converted, length_buf, 4);
-    resp_converted = ntohl(resp_converted);
+    Response resp = Response::parseResponse(frame_in);
+    payload_pending = resp.streamed;
+    payload_compressed = resp.compressible;
+    if (format == BINARY_FORMAT && resp.request_id != request_id) {
+        LOG_ERROR_LIMITED("Response to request " << resp.request_id << " while waiting for " << request_id);
+        connected = false;
+        return Response(false, 0, "", "Response out of order");
+    }
+    return resp;
+}
 
-    char resp_buf[1024];
-    size_t received = 0;
-    i = 0;
+/**
+ * Queues a request to be sent by the next flush_requests()
+ * 
+ * @param req The Request object to send
+ * @return The request ID the matching response will carry
+ * 
+ * Queued requests are sent together and their responses are read back in
+ * order with receive_response(), so N requests cost one round trip instead of N.
+ * Callers should read responses before queueing more than the socket buffers
+ * can hold (send_pipelined does this automatically).
+ */
+uint32_t NetworkRequestChannel::queue_request(const Request& req) {
+    uint32_t request_id = next_request_id++;
+    append_frame(outbox, req, format, request_id);
+    in_flight_ids.push_back(request_id);
+    return request_id;
+}
 
-    // Receiving whole message
-    while (received < resp_converted) {
-        i = recv(sockfd, resp_buf + received, resp_converted - received, 0);
-        if (i == -1) {
-            perror("Receive failed in send_request");
+/**
+ * Sends every queued request with as few writev-style syscalls as possible
+ * 
+ * @return false if the socket failed
+ */
+bool NetworkRequestChannel::flush_requests() {
+    discard_pending();
+    return flush_outbox("flush_requests");
+}
+
+/**
+ * Writes every queued message
+ * 
+ * The messages are framed back to back in one buffer, so they go out
+ * together with as few syscalls as the socket allows.
+ * 
+ * @param caller Name used in the error message
+ * @return false if the socket failed
+ */
+bool NetworkRequestChannel::flush_outbox(const char* caller) {
+    if (outbox.empty()) return true;
+
+    struct iovec iov;
+    iov.iov_base = &outbox[0];
+    iov.iov_len = outbox.size();
+    bool ok = send_iov(&iov, 1);
+
+    outbox.clear();
+    trim(outbox);
+    if (!ok) {
+        LOG_ERROR_LIMITED("Send failed in " << caller << ": " << strerror(errno));
+    }
+    return ok;
+}
+
+/**
+ * Reads the response to the oldest flushed request
+ * 
+ * @return Response from the server; a streamed payload is collected into data
+ * 
+ * On binary connections the response's request ID is checked against the
+ * request it should answer and the connection is abandoned on a mismatch.
+ */
+Response NetworkRequestChannel::receive_response() {
+    if (in_flight_ids.empty()) {
+        return Response(false, 0, "", "No request in flight");
+    }
+    discard_pending();
+
+    uint32_t request_id = in_flight_ids.front();
+    in_flight_ids.pop_front();
+
+    if (!recv_frame(frame_in)) {
+        LOG_ERROR_LIMITED("Receive failed in receive_response: " << strerror(errno));
+        return Response(false, 0, "", "Receive failed");
+    }
+
+    Response resp = Response::parseResponse(frame_in);
+    if (format == BINARY_FORMAT && resp.request_id != request_id) {
+        LOG_ERROR_LIMITED("Response to request " << resp.request_id << " while waiting for " << request_id);
+        connected = false;
+        return Response(false, 0, "", "Response out of order");
+    }
+
+    if (resp.streamed) {
+        resp.streamed = false;
+        if (!recv_payload(-1, &resp.data)) {
+            LOG_ERROR_LIMITED("Receive failed in receive_response: " << strerror(errno));
             return Response(false, 0, "", "Receive failed");
         }
-        received += i;
     }
+    return resp;
+}
 
-    resp_buf[resp_converted] = '\0';
+/**
+ * Sends several requests in one flush and collects their responses in order
+ * 
+ * Requests go out in windows of PIPELINE_WINDOW. Without reading responses
+ * in between, a long enough pipeline would fill both socket buffers and
+ * deadlock client and server.
+ */
+vector<Response> NetworkRequestChannel::send_pipelined(const vector<Request>& reqs) {
+    vector<Response> responses;
+    responses.reserve(reqs.size());
 
-    // Decode response
-    string delimiter = "|";
-    size_t pos = 0;
-    bool success;
-    double balance;
-    std::string data;
-    std::string message;
-    string response_str(resp_buf);
+    for (size_t start = 0; start < reqs.size(); start += PIPELINE_WINDOW) {
+        size_t end = reqs.size() - start < PIPELINE_WINDOW ? reqs.size() : start + PIPELINE_WINDOW;
+        for (size_t i = start; i < end; i++) {
+            queue_request(reqs[i]);
+        }
+        bool flushed = flush_requests();
 
-    // Parse response using same delimiter format
-    if ((pos = response_str.find(delimiter)) != string::npos) {
-        success = (response_str.substr(0, pos) == "1");
-        response_str.erase(0, pos + delimiter.length());
+        for (size_t i = start; i < end; i++) {
+            if (!flushed || !connected) {
+                in_flight_ids.clear();
+                responses.push_back(Response(false, 0, "", "Send failed"));
+                continue;
+            }
+            responses.push_back(receive_response());
+        }
     }
-    if ((pos = response_str.find(delimiter)) != string::npos) {
-        balance = stod(response_str.substr(0, pos));
-        response_str.erase(0, pos + delimiter.length());
+    return responses;
+}
+
+/**
+ * Sends several requests as one BATCH request that the server applies in a single pass
+ * 
+ * @return One response per request, in order
+ * 
+ * Requires the binary format; text connections fall back to send_pipelined.
+ */
+vector<Response> NetworkRequestChannel::send_batch(const vector<Request>& reqs) {
+    if (format != BINARY_FORMAT) {
+        return send_pipelined(reqs);
     }
-    if ((pos = response_str.find(delimiter)) != string::npos) {
-        data = response_str.substr(0, pos);
-        message = response_str.substr(pos + delimiter.length());
+
+    Response resp = send_request(Request(BATCH, 0, reqs.size(), "", Request::serializeBatch(reqs)));
+    vector<Response> responses;
+    if (resp.success) {
+        responses = Response::parseBatch(resp.data);
     }
-    
-    return Response(success, balance, data, message);
+    while (responses.size() < reqs.size()) {
+        responses.push_back(Response(false, 0, "", resp.success ? "Missing batch response" : resp.message));
+    }
+    return responses;
+}
+
+/**
+ * Sends a request the server will not answer
+ * 
+ * @param req The Request object to send
+ * @return false if it could not be sent
+ * 
+ * Nothing is read back, so a one-way request costs one write. Pipelined
+ * requests already in flight are unaffected. On a text connection the flag
+ * cannot be sent, so the request makes a normal round trip instead.
+ */
+bool NetworkRequestChannel::send_one_way(const Request& req) {
+    if (format != BINARY_FORMAT) {
+        if (!in_flight_ids.empty()) return false;
+        return send_request(req).success;
+    }
+
+    Request copy = req;
+    copy.one_way = true;
+    copy.streamed = false;
+    frame_out.clear();
+    copy.serialize(format, frame_out);
+    stamp_request_id(frame_out, next_request_id++);
+
+    if (!flush_outbox("send_one_way") || !send_frame(frame_out.data(), frame_out.size())) {
+        LOG_ERROR_LIMITED("Send failed in send_one_way: " << strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Assigns the next request ID without sending anything
+ *
+ * Lets a multiplexing caller register where the response should go before
+ * the request is sent, so the reader never sees an ID it does not know.
+ */
+uint32_t NetworkRequestChannel::reserve_request_id() {
+    return next_request_id++;
+}
+
+/**
+ * Sends a request carrying an ID from reserve_request_id() without reading anything
+ *
+ * @param req The Request object to send; its data goes inline
+ * @param request_id ID the response will echo
+ * @return false if the connection is not binary or the send failed
+ */
+bool NetworkRequestChannel::send_tagged(const Request& req, uint32_t request_id) {
+    if (format != BINARY_FORMAT) return false;
+
+    Request copy = req;
+    copy.streamed = false;
+    frame_out.clear();
+    copy.serialize(format, frame_out);
+    stamp_request_id(frame_out, request_id);
+
+    if (!send_frame(frame_out.data(), frame_out.size())) {
+        LOG_ERROR_LIMITED("Send failed in send_tagged: " << strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Adds a request carrying an ID from reserve_request_id() to the outbox
+ *
+ * @param req The Request object to send; its data goes inline
+ * @param request_id ID the response will echo (binary connections only)
+ *
+ * Nothing is sent until flush_requests(), so a multiplexing caller can
+ * write a whole burst of requests with one syscall.
+ */
+void NetworkRequestChannel::queue_tagged(const Request& req, uint32_t request_id) {
+    if (!req.streamed) {
+        append_frame(outbox, req, format, request_id);
+        return;
+    }
+
+    Request copy = req;
+    copy.streamed = false;
+    append_frame(outbox, copy, format, request_id);
+}
+
+/**
+ * Reads the next response, whichever request it answers
+ *
+ * @param resp Set to the response; a streamed payload is collected into data
+ * @return false once the connection failed or was closed
+ */
+bool NetworkRequestChannel::receive_tagged(Response& resp) {
+    if (!recv_frame(frame_in)) {
+        return false;
+    }
+
+    Response::parse(frame_in, resp);
+    if (resp.streamed) {
+        resp.streamed = false;
+        if (!recv_payload(-1, &resp.data)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Returns the byte counters and resets them
+void NetworkRequestChannel::take_byte_counts(uint64_t& received, uint64_t& sent) {
+    received = bytes_received;
+    sent = bytes_sent;
+    bytes_received = bytes_sent = 0;
+}
+
+bool NetworkRequestChannel::peek_request_type(RequestType& type) {
+    // Frame length, then the binary header's magic, version and type or the text format's "TYPE|"
+    char buf[8];
+    ssize_t n = recv(sockfd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT);
+    if (n < 6) return false;
+
+    int t = 0;
+    if (static_cast<uint8_t>(buf[4]) == BINARY_MAGIC) {
+        if (n < 7) return false;
+        t = static_cast<uint8_t>(buf[6]);
+    } else {
+        ssize_t i = 4;
+        for (; i < n && buf[i] >= '0' && buf[i] <= '9'; i++) {
+            t = t * 10 + (buf[i] - '0');
+        }
+        if (i == 4 || i == n || buf[i] != '|') return false;
+    }
+    if (t >= NUM_REQUEST_TYPES) return false;
+    type = static_cast<RequestType>(t);
+    return true;
+}
+
+void NetworkRequestChannel::set_deadline(chrono::steady_clock::time_point when) {
+    deadline = when;
+    deadline_passed.store(false, memory_order_relaxed);
+}
+
+void NetworkRequestChannel::expire_deadline() {
+    deadline_passed.store(true, memory_order_relaxed);
+}
+
+bool NetworkRequestChannel::deadline_exceeded() const {
+    return deadline_passed.load(memory_order_relaxed);
+}
+
+/**
+ * Checks whether more request bytes are already waiting on the socket
+ * 
+ * Used by the EventLoop to answer pipelined requests without waiting for
+ * another epoll round.
+ */
+bool NetworkRequestChannel::has_pending_input() {
+    char c;
+    ssize_t n = recv(sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n > 0;
 }
 
 /**
  * Receives a request from a client
  * 
- * @return The received Request object
+ * @return The received Request, held by the channel until the next call
  * 
  * This method:
- * Receives the length of the incoming request (4-byte header) and the actual data
+ * Receives the length of the incoming request (4-byte header) and the actual data.
+ * If the request is streamed, its payload is left on the connection for
+ * receive_payload(req, fd); it is discarded if the handler never reads it.
  * 
+ * The frame, the request parsed from it and scratch_response() reuse the
+ * connection's buffers, which are reset (not freed) here for every request,
+ * so a steady stream of requests is received without allocating.
  */
-Request NetworkRequestChannel::receive_request() {
+const Request& NetworkRequestChannel::receive_request() {
     // TODO: Implement the receive_request function
-    char req_buf[1024];
-    int i;
-    char length_buf[4];
+    discard_pending();
+    reset_arena();
 
-    size_t n = recv(sockfd, length_buf, 4, 0);
-    if (n != 4) {
-        perror("Receive failed in receive_request");
-        return Request(QUIT);
+    Request& r = received;
+    if (!recv_frame(frame_in)) {
+        // errno is cleared when the client simply hung up
+        if (errno != 0) LOG_ERROR_LIMITED("Receive failed in receive_request: " << strerror(errno));
+        r.reset(QUIT);
+        return r;
     }
 
-    uint32_t req_converted;
-    memcpy(&req_converted, length_buf, 4);
-    req_converted = ntohl(req_converted);
+    Request::parse(frame_in, r);
+    payload_pending = r.streamed;
+    payload_compressed = r.compressible;
+    reply_to = r.request_id;
+    reply_suppressed = r.one_way;
 
-    size_t received = 0;
+    // Format and compression negotiation is answered here; callers just ignore HELLO
+    if (r.type == HELLO) {
+        bool accepted = (r.amount == BINARY_PROTOCOL_VERSION);
+        bool compress = accepted && PayloadCodec::parse(r.data, codec, compression_level);
+        send_response(Response(accepted, accepted ? BINARY_PROTOCOL_VERSION : 0, compress ? r.data : "",
+                               accepted ? "Binary format negotiated" : "Unsupported protocol version"));
+        if (accepted) format = BINARY_FORMAT;
+        if (!compress) codec = CODEC_NONE;
+    }
 
-    // Receiving whole message
-    while (received < req_converted) {
-        i = recv(sockfd, req_buf + received, req_converted - received, 0);
-        if (i == -1) {
-            perror("Receive failed in receive_request");
-            return Request(QUIT);
-        }
-        received += i;
+    return r;
+}
+
+/**
+ * Writes the payload of a received request or response to a file descriptor
+ * 
+ * @param out_fd Destination descriptor, or -1 to discard the payload
+ * @return false if the payload could not be received or written
+ * 
+ * Works for both inline (data) and streamed payloads.
+ */
+bool NetworkRequestChannel::receive_payload(const Request& req, int out_fd) {
+    if (!req.streamed) {
+        return out_fd < 0 || write_all(out_fd, req.data.data(), req.data.size());
     }
+    return payload_pending && recv_payload(out_fd, NULL);
+}
 
-    req_buf[req_converted] = '\0';
-    
+bool NetworkRequestChannel::receive_payload(const Response& resp, int out_fd) {
+    if (!resp.streamed) {
+        return out_fd < 0 || write_all(out_fd, resp.data.data(), resp.data.size());
+    }
+    return payload_pending && recv_payload(out_fd, NULL);
+}
+
+/**
+ * Receives a payload into out_fd starting at offset, like pwrite(2)
+ * 
+ * The descriptor's own offset is left alone, so several connections can
+ * fill different parts of one file through the same descriptor.
+ */
+bool NetworkRequestChannel::receive_payload_at(const Request& req, int out_fd, off_t offset) {
+    if (!req.streamed) {
+        return write_out(out_fd, req.data.data(), req.data.size(), &offset);
+    }
+    return payload_pending && recv_payload(out_fd, NULL, &offset);
+}
 
-    return Request::parseRequest(req_buf);
+bool NetworkRequestChannel::receive_payload_at(const Response& resp, int out_fd, off_t offset) {
+    if (!resp.streamed) {
+        return write_out(out_fd, resp.data.data(), resp.data.size(), &offset);
+    }
+    return payload_pending && recv_payload(out_fd, NULL, &offset);
 }
 
 /**
@@ -348,45 +1313,332 @@ Request NetworkRequestChannel::receive_request() {
  * Sends the length of the response followed by the response itself
  * 
  * The wire format uses a 4-byte length header followed by the serialized data.
- * Response format: SUCCESS|BALANCE|DATA|MESSAGE
+ * Text response format: SUCCESS|BALANCE|DATA|MESSAGE
+ * Nothing is sent if the request being answered was one-way.
  */
 void NetworkRequestChannel::send_response(const Response& resp) {
-    // Format: SUCCESS|BALANCE|DATA|MESSAGE
-    stringstream ss;
-    ss << (resp.success ? "1" : "0") << "|"
-       << resp.balance << "|"
-       << resp.data << "|"
-       << resp.message;
-    
-    string response_str = ss.str();
-    
-    uint32_t length = htonl(response_str.length());
-    char length_buf[4];
-    memcpy(length_buf, &length, 4);
-
-    // TODO: Implement the send_response function
-    size_t sent = 0;
-    int i  = 0;
-    // Send header
-    while(sent < 4) {
-        i = send(sockfd, length_buf + sent, 4 - sent, 0);
-        if (i == -1) {
-            perror("Send failed in send_response");
+    send_response_stream(resp, -1);
+}
+
+/**
+ * Queues a response to be sent by the next flush_responses()
+ * 
+ * @param resp The Response object to send (answers the last received request)
+ * 
+ * Responses a server holds back keep their order: any response sent
+ * directly afterwards flushes the queue first.
+ */
+void NetworkRequestChannel::queue_response(const Response& resp) {
+    discard_pending();
+    if (reply_suppressed) return;
+
+    append_frame(outbox, resp, format, reply_to);
+}
+
+/**
+ * Sends every queued response in one go
+ * 
+ * @return false if the socket failed
+ */
+bool NetworkRequestChannel::flush_responses() {
+    return flush_outbox("flush_responses");
+}
+
+/**
+ * Sends a response whose payload is read from a file descriptor
+ * 
+ * @param resp The Response object to send; resp.data is ignored if in_fd is valid
+ * @param in_fd Descriptor to stream the payload from, or -1 to send resp.data
+ * 
+ * Text connections fall back to sending the payload inline.
+ */
+void NetworkRequestChannel::send_response_stream(const Response& resp, int in_fd) {
+    // A request payload the handler did not want still has to be consumed
+    discard_pending();
+    if (reply_suppressed) return;
+
+    // Keep responses in request order
+    if (!flush_outbox("send_response")) return;
+
+    bool stream = (in_fd >= 0 && format == BINARY_FORMAT);
+    bool compressed = stream && resp.compressible && compresses_payloads();
+    frame_out.clear();
+    if (in_fd >= 0) {
+        Response copy(resp.success, resp.balance, "", resp.message);
+        copy.streamed = stream;
+        copy.compressible = compressed;
+        if (!stream && !read_all(in_fd, copy.data)) {
+            copy = Response(false, 0, "", "Failed to read payload");
         }
-        sent += i;
+        copy.serialize(format, frame_out);
+    } else {
+        resp.serialize(format, frame_out);
     }
+    stamp_request_id(frame_out, reply_to);
 
-    char message_buf[1024];
-    memcpy(message_buf, response_str.c_str(), response_str.size());
-    
-    sent = 0;
-    
-    while (sent < response_str.size()) { // Sending whole message
-        i = send(sockfd, message_buf + sent, response_str.size() - sent, 0);
-        if (i == -1) {
-            perror("Send failed in send_response");
+    // Send header and the whole message
+    if (!send_frame(frame_out.data(), frame_out.size())) {
+        LOG_ERROR_LIMITED("Send failed in send_response: " << strerror(errno));
+        return;
+    }
+
+    if (stream && !send_payload(in_fd, compressed) && !connected) {
+        LOG_ERROR_LIMITED("Send failed in send_response: " << strerror(errno));
+    }
+}
+
+/**
+ * Sends a response whose payload is produced piece by piece
+ * 
+ * @param resp The Response object to send; resp.data is ignored
+ * @param next Fills its argument with the next piece; returns false when done
+ * 
+ * Each piece becomes one chunk of a streamed payload. Text connections
+ * cannot stream, so there the pieces are collected into data first.
+ */
+void NetworkRequestChannel::send_response_chunks(const Response& resp, function<bool(string&)> next) {
+    discard_pending();
+    if (reply_suppressed) return;
+
+    string chunk;
+    if (format != BINARY_FORMAT) {
+        Response copy(resp.success, resp.balance, "", resp.message);
+        while (next(chunk)) copy.data.append(chunk);
+        send_response(copy);
+        return;
+    }
+
+    if (!flush_outbox("send_response_chunks")) return;
+
+    Response copy(resp.success, resp.balance, "", resp.message);
+    copy.streamed = true;
+    copy.compressible = resp.compressible && compresses_payloads();
+    frame_out.clear();
+    copy.serialize(format, frame_out);
+    stamp_request_id(frame_out, reply_to);
+
+    if (!send_frame(frame_out.data(), frame_out.size(), MSG_MORE)) {
+        LOG_ERROR_LIMITED("Send failed in send_response_chunks: " << strerror(errno));
+        return;
+    }
+
+    while (next(chunk)) {
+        if (!send_chunk(chunk.data(), chunk.size(), copy.compressible, MSG_MORE)) {
+            LOG_ERROR_LIMITED("Send failed in send_response_chunks: " << strerror(errno));
+            return;
         }
-        sent += i;
     }
-    
-}
\ No newline at end of file
+
+    if (!send_frame(NULL, 0)) {
+        LOG_ERROR_LIMITED("Send failed in send_response_chunks: " << strerror(errno));
+    }
+}
+
+/**
+ * Sends a response followed by the contents of a regular file without copying
+ * it through user space
+ * 
+ * @param resp The Response object to send; resp.data is ignored
+ * @param file_fd Open regular file to send from the beginning
+ * 
+ * The payload uses the normal chunked framing, but each chunk is written by
+ * sendfile(2) directly from the page cache to the socket, so a download costs
+ * one syscall per MAX_SENDFILE_CHUNK instead of several user-space copies.
+ * Text connections, non-regular files and payloads to be compressed (which
+ * have to be read anyway) fall back to send_response_stream.
+ */
+void NetworkRequestChannel::send_response_file(const Response& resp, int file_fd) {
+    if (reply_suppressed) {
+        discard_pending();
+        return;
+    }
+
+    struct stat st;
+    if (format != BINARY_FORMAT || (resp.compressible && compresses_payloads()) ||
+        fstat(file_fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        send_response_stream(resp, file_fd);
+        return;
+    }
+
+    discard_pending();
+    if (!flush_outbox("send_response_file")) return;
+
+    Response copy(resp.success, resp.balance, "", resp.message);
+    copy.streamed = true;
+    frame_out.clear();
+    copy.serialize(format, frame_out);
+    stamp_request_id(frame_out, reply_to);
+
+    if (!send_frame(frame_out.data(), frame_out.size(), MSG_MORE)) {
+        LOG_ERROR_LIMITED("Send failed in send_response_file: " << strerror(errno));
+        return;
+    }
+
+    off_t offset = 0;
+    uint64_t remaining = st.st_size;
+    while (remaining > 0) {
+        uint32_t chunk = remaining < MAX_SENDFILE_CHUNK ? remaining : MAX_SENDFILE_CHUNK;
+        uint32_t length = htonl(chunk);
+        struct iovec iov;
+        iov.iov_base = &length;
+        iov.iov_len = 4;
+
+        if (!send_iov(&iov, 1, MSG_MORE) || !sendfile_all(file_fd, offset, chunk)) {
+            LOG_ERROR_LIMITED("Send failed in send_response_file: " << strerror(errno));
+            return;
+        }
+        remaining -= chunk;
+    }
+
+    if (!send_frame(NULL, 0)) {
+        LOG_ERROR_LIMITED("Send failed in send_response_file: " << strerror(errno));
+    }
+}
+
+/**
+ * Sends a response followed by a byte range of a regular file, read through mmap(2)
+ * 
+ * @param resp The Response object to send; resp.data is ignored
+ * @param file_fd Open regular file
+ * @param offset First byte to send
+ * @param length Bytes to send; the range must lie within the file
+ * 
+ * The range is mapped MAP_WINDOW bytes at a time and every window goes out
+ * as one chunk written straight from the mapping. MADV_SEQUENTIAL and
+ * MADV_WILLNEED start readahead at the range instead of the start of the
+ * file and let the kernel drop the pages once they are sent. The file must
+ * not shrink while it is mapped, which is why uploads replace files by
+ * renaming instead of rewriting them. Compressed ranges are encoded from
+ * the mapping. Text connections get the range inline.
+ */
+void NetworkRequestChannel::send_response_range(const Response& resp, int file_fd, uint64_t offset, uint64_t length) {
+    discard_pending();
+    if (reply_suppressed) return;
+
+    Response copy(resp.success, resp.balance, "", resp.message);
+    copy.streamed = (format == BINARY_FORMAT);
+    if (!copy.streamed) {
+        copy.data.resize(length);
+        size_t done = 0;
+        while (done < length) {
+            ssize_t n = pread(file_fd, &copy.data[done], length - done, offset + done);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) {
+                copy = Response(false, 0, "", "Failed to read payload");
+                break;
+            }
+            done += n;
+        }
+        send_response(copy);
+        return;
+    }
+
+    if (!flush_outbox("send_response_range")) return;
+
+    copy.compressible = resp.compressible && compresses_payloads();
+    frame_out.clear();
+    copy.serialize(format, frame_out);
+    stamp_request_id(frame_out, reply_to);
+
+    if (!send_frame(frame_out.data(), frame_out.size(), MSG_MORE)) {
+        LOG_ERROR_LIMITED("Send failed in send_response_range: " << strerror(errno));
+        return;
+    }
+
+    // Mappings must start on a page boundary
+    static const uint64_t page = sysconf(_SC_PAGESIZE);
+    while (length > 0) {
+        uint64_t start = offset & ~(page - 1);
+        size_t skip = offset - start;
+        size_t chunk = length < MAP_WINDOW - skip ? length : MAP_WINDOW - skip;
+
+        void* map = mmap(NULL, skip + chunk, PROT_READ, MAP_SHARED, file_fd, start);
+        if (map == MAP_FAILED) {
+            // The peer was promised more bytes than it will get
+            LOG_ERROR_LIMITED("mmap failed in send_response_range: " << strerror(errno));
+            connected = false;
+            return;
+        }
+        madvise(map, skip + chunk, MADV_SEQUENTIAL);
+        madvise(map, skip + chunk, MADV_WILLNEED);
+
+        bool sent = send_chunk(static_cast<char*>(map) + skip, chunk, copy.compressible, MSG_MORE);
+        munmap(map, skip + chunk);
+        if (!sent) {
+            LOG_ERROR_LIMITED("Send failed in send_response_range: " << strerror(errno));
+            return;
+        }
+        offset += chunk;
+        length -= chunk;
+    }
+
+    if (!send_frame(NULL, 0)) {
+        LOG_ERROR_LIMITED("Send failed in send_response_range: " << strerror(errno));
+    }
+}
+
+/**
+ * Serializes a streamed response around a payload of payload_length bytes
+ * 
+ * @param resp The response; its data is ignored
+ * @param payload_length Size of the payload the caller writes into payload()
+ * 
+ * Layout: header frame, one chunk of payload_length bytes, the empty chunk
+ * (just the header and the empty chunk if there is no payload).
+ */
+PreparedResponse::PreparedResponse(const Response& resp, size_t payload_length)
+    : header(resp.success, resp.balance, "", resp.message), payload_length(payload_length) {
+    Response copy = header;
+    copy.streamed = true;
+    string body = copy.serialize(BINARY_FORMAT);
+
+    frames.reserve(4 + body.size() + 4 + payload_length + 4);
+    uint32_t length = htonl(body.size());
+    frames.append(reinterpret_cast<const char*>(&length), 4);
+    frames.append(body);
+    if (payload_length > 0) {
+        length = htonl(payload_length);
+        frames.append(reinterpret_cast<const char*>(&length), 4);
+    }
+    payload_offset = frames.size();
+    frames.resize(payload_offset + payload_length + 4, '\0');
+}
+
+/**
+ * Sends a prepared response with the request ID of the request being answered
+ * 
+ * @param prepared Frames serialized ahead of time; they are not modified, so
+ *                 several connections may send the same ones at once
+ * 
+ * The ID is written into the header on the way out, which sends the
+ * buffer in three pieces with one sendmsg(2) instead of copying it. Text
+ * connections get an ordinary response carrying the payload.
+ */
+void NetworkRequestChannel::send_prepared(const PreparedResponse& prepared) {
+    discard_pending();
+    if (reply_suppressed) return;
+
+    if (format != BINARY_FORMAT) {
+        Response copy = prepared.header;
+        copy.data.assign(prepared.payload(), prepared.payload_size());
+        send_response(copy);
+        return;
+    }
+
+    if (!flush_outbox("send_prepared")) return;
+
+    // Frame length(4), magic, version, success, flags, then the request ID
+    const size_t id_offset = 8;
+    uint32_t id = htonl(reply_to);
+    struct iovec iov[3];
+    iov[0].iov_base = const_cast<char*>(prepared.frames.data());
+    iov[0].iov_len = id_offset;
+    iov[1].iov_base = &id;
+    iov[1].iov_len = 4;
+    iov[2].iov_base = const_cast<char*>(prepared.frames.data()) + id_offset + 4;
+    iov[2].iov_len = prepared.frames.size() - id_offset - 4;
+
+    if (!send_iov(iov, 3)) {
+        LOG_ERROR_LIMITED("Send failed in send_prepared: " << strerror(errno));
+    }
+}
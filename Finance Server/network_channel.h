@@ -2,11 +2,47 @@
 #define _NETWORK_CHANNEL_H_
 
 #include "common.h"
+#include "compression.h"
 #include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
+/*
+ * A streamed response serialized once for the binary format, to be sent any
+ * number of times by send_prepared(), e.g. from a cache. The header, the
+ * payload as a single chunk and the terminating chunk sit in one buffer
+ * that goes out in one write; only the request ID is filled in per send.
+ *
+ * Construct it with the payload's length, then write the payload into payload().
+ */
+class PreparedResponse {
+public:
+    PreparedResponse(const Response& resp, size_t payload_length);
+    
+    char* payload() { return &frames[payload_offset]; }
+    const char* payload() const { return frames.data() + payload_offset; }
+    size_t payload_size() const { return payload_length; }
+    
+    // Bytes held, for memory accounting
+    size_t size() const { return frames.size(); }
+    
+private:
+    friend class NetworkRequestChannel;
+    
+    Response header;        // Without data; for text connections
+    std::string frames;
+    size_t payload_offset;
+    size_t payload_length;
+};
+
 /*
  * NetworkRequestChannel class
  * 
@@ -18,32 +54,204 @@ class NetworkRequestChannel {
 public:
     enum Side {SERVER_SIDE, CLIENT_SIDE};
     
+    // How a SERVER_SIDE channel listens
+    struct ListenOptions {
+        int backlog;            // Handshaken connections the kernel queues for accept()
+        bool reuse_port;        // SO_REUSEPORT: listeners sharing the port split its connections
+        int defer_accept_s;     // TCP_DEFER_ACCEPT: hold a connection back until its first
+                                // request arrives (at most this long), 0 to disable
+        
+        ListenOptions() : backlog(SOMAXCONN), reuse_port(false), defer_accept_s(5) {}
+    };
+    
     // For server: ip="" means listen on all interfaces
-    // For client: connect to specified IP and port
-    NetworkRequestChannel(const std::string& ip, int port, Side side);
+    // For client: connect to specified IP and port, negotiating the preferred wire format
+    // and, on binary connections, payload compression at the given level (COMPRESSION_*)
+    NetworkRequestChannel(const std::string& ip, int port, Side side,
+                          WireFormat preferred = BINARY_FORMAT, int compression = COMPRESSION_OFF);
+    
+    // For server: listen with non-default options
+    NetworkRequestChannel(const std::string& ip, int port, const ListenOptions& options);
     
     // For server: use after accept() returns a new client socket
     NetworkRequestChannel(int sockfd);
     
     ~NetworkRequestChannel();
     
-    // Communication methods (similar to RequestChannel)
+    // Communication methods (similar to RequestChannel). The request
+    // receive_request() returns stays valid until it is called again.
     Response send_request(const Request& req);
-    Request receive_request();
+    const Request& receive_request();
     void send_response(const Response& resp);
     
+    // An empty response owned by the channel for answering the current
+    // request; filling it in instead of a new Response reuses its buffers
+    Response& scratch_response();
+    
+    // Streaming variants: payloads of any size move between the socket and a
+    // file descriptor in CHUNK_SIZE pieces instead of through Request/Response::data
+    Response send_request_stream(const Request& req, int in_fd);
+    bool receive_payload(const Request& req, int out_fd);
+    bool receive_payload(const Response& resp, int out_fd);
+    void send_response_stream(const Response& resp, int in_fd);
+    
+    // Payloads written at offset of out_fd (pwrite semantics), leaving its file offset alone
+    bool receive_payload_at(const Request& req, int out_fd, off_t offset);
+    bool receive_payload_at(const Response& resp, int out_fd, off_t offset);
+    
+    // Zero-copy variant for regular files: the payload goes out with sendfile(2)
+    void send_response_file(const Response& resp, int file_fd);
+    
+    // Byte ranges of regular files (offset and length within the file), read
+    // through a memory mapping of just that range
+    void send_response_range(const Response& resp, int file_fd, uint64_t offset, uint64_t length);
+    
+    // Sends a response serialized ahead of time, answering the last received request
+    void send_prepared(const PreparedResponse& prepared);
+    
+    // Generated payloads: next(chunk) is called until it returns false and
+    // every chunk it fills is sent, so the payload is never held in full
+    void send_response_chunks(const Response& resp, std::function<bool(std::string&)> next);
+    
+    // Pipelining: queue requests, send them in one flush, then read the
+    // responses back in order (matched by request ID on binary connections)
+    uint32_t queue_request(const Request& req);
+    bool flush_requests();
+    Response receive_response();
+    std::vector<Response> send_pipelined(const std::vector<Request>& reqs);
+    
+    // Sends the requests as one BATCH request applied by the server in one pass
+    std::vector<Response> send_batch(const std::vector<Request>& reqs);
+    
+    // Sends a request without waiting for (or getting) a response. Text
+    // connections cannot do that and fall back to a round trip.
+    bool send_one_way(const Request& req);
+    
+    // Multiplexing (binary connections only): one thread sends tagged
+    // requests while another reads the responses and matches them to their
+    // senders by request ID. Sending and receiving may run concurrently, but
+    // each side must be used by one thread at a time.
+    uint32_t reserve_request_id();
+    bool send_tagged(const Request& req, uint32_t request_id);
+    bool receive_tagged(Response& resp);
+    
+    // Queues a tagged request for flush_requests() without tracking it for
+    // receive_response(). Text connections can be used too: the ID is not
+    // sent and responses come back in the order the requests were queued.
+    void queue_tagged(const Request& req, uint32_t request_id);
+    
+    // Deferred responses: held back until flush_responses() sends them in one
+    // write, e.g. once the changes they acknowledge are durable
+    void queue_response(const Response& resp);
+    bool flush_responses();
+    
     // New methods specific to networking
-    int accept_connection(); // Returns socket fd for new connection
+    int accept_connection(); // Returns non-blocking socket fd for new connection, -1 if none
     std::string get_peer_address() const;
     int get_socket_fd() const;
     
+    // Event loop support: switch the socket to non-blocking mode and check
+    // whether the peer is still there after the last receive
+    void set_nonblocking();
+    bool is_connected() const;
+    WireFormat get_wire_format() const;
+    bool has_pending_input();
+    
+    // Type of the next request waiting in the socket, read without consuming
+    // it; false if its header has not arrived
+    bool peek_request_type(RequestType& type);
+    
+    // Whether payloads marked compressible go out compressed on this connection
+    bool compresses_payloads() const;
+    
+    // Bytes moved through the socket since the last call, for metrics
+    void take_byte_counts(uint64_t& received, uint64_t& sent);
+    
+    // Deadline of the request being handled (time_point::max() if it has
+    // none). The server's timer wheel calls expire_deadline() when it passes,
+    // so long-running handlers can poll deadline_exceeded() and give up.
+    void set_deadline(std::chrono::steady_clock::time_point when);
+    void expire_deadline();
+    bool deadline_exceeded() const;
+    
 private:
+    void listen_socket(const std::string& ip, int port, const ListenOptions& options);
+    void connect_socket();
+    void negotiate();
+    void set_nodelay();
+    
+    // Transfer exactly len bytes, waiting for readiness if the socket is non-blocking
+    bool send_iov(struct iovec* iov, int count, int flags = 0);
+    bool send_frame(const char* body, size_t len, int flags = 0);
+    bool sendfile_all(int file_fd, off_t& offset, size_t len);
+    bool recv_all(char* buf, size_t len);
+    bool recv_frame(std::string& body);
+    bool wait_ready(short events);
+    
+    // Chunked payloads (see FLAG_STREAMED in common.h), compressed chunk by
+    // chunk if FLAG_COMPRESSED is set
+    bool send_payload(int in_fd, bool compressed);
+    bool send_chunk(const char* data, size_t len, bool compressed, int flags = 0);
+    bool recv_payload(int out_fd, std::string* out, off_t* offset = NULL);
+    bool recv_compressed_payload(int out_fd, std::string* out, off_t* offset);
+    bool splice_to_fd(int out_fd, size_t& len, bool& write_ok, off_t* offset);
+    void discard_pending();
+    
+    bool flush_outbox(const char* caller);
+    void reset_arena();
+    
+
     Side my_side;
     int sockfd;
     struct sockaddr_in server_addr, client_addr;
     socklen_t client_addr_len;
     std::string peer_ip;
     int peer_port;
+    std::atomic<bool> connected;  // Cleared by either side of a multiplexed channel
+    WireFormat format;
+    
+    // A streamed payload has been announced but not read yet, and whether it is compressed
+    bool payload_pending;
+    bool payload_compressed;
+    std::vector<char> chunk_buf;
+    
+    // Codec agreed in HELLO for payloads this side sends (CODEC_NONE if none).
+    // Sending and receiving have their own codec state and buffers, so a
+    // multiplexed channel needs no lock for them either.
+    Codec codec;
+    int compression_level;
+    PayloadCodec encoder, decoder;
+    std::string encoded_out, encoded_in;
+    
+    // Pipe used to splice received payloads into files, created on first use
+    int pipe_fds[2];
+    
+    // Request IDs: the next one to assign as a client, the one to echo as a server
+    uint32_t next_request_id;
+    uint32_t reply_to;
+    
+    // Socket traffic not yet collected by take_byte_counts(). Each is only
+    // touched by its own direction, so a multiplexed channel needs no lock.
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
+    
+    // The last received request was one-way, so responses to it are dropped
+    bool reply_suppressed;
+    
+    std::chrono::steady_clock::time_point deadline;
+    std::atomic<bool> deadline_passed;  // Set from the event loop thread
+    
+    // Per-connection arena, kept from one request to the next: the last frame
+    // received and sent, the last request received and the scratch response.
+    // Receiving and sending use separate buffers (see multiplexing above).
+    std::string frame_in, frame_out;
+    Request received;
+    Response scratch;
+    
+    // Queued (not yet flushed) requests or responses framed back to back, and
+    // flushed requests awaiting a response
+    std::string outbox;
+    std::deque<uint32_t> in_flight_ids;
 };
 
 #endif
\ No newline at end of file
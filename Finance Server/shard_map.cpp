@@ -0,0 +1,226 @@
+#include "shard_map.h"
+#include "logger.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+using namespace std;
+
+const uint64_t ShardMap::BLOCK_SIZE;
+const int ShardMap::VNODES;
+const char* const ShardMap::WRONG_SHARD = "Wrong shard";
+
+// splitmix64 finalizer: spreads consecutive block numbers over the ring
+static uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// FNV-1a, for node names
+static uint64_t hash_name(const string& name) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (char c : name) {
+        h ^= static_cast<unsigned char>(c);
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * Creates a map over the given nodes
+ *
+ * @param nodes Node names ("host:port"); the order only matters for owner()'s indices
+ * @param epoch Version of the map, higher for every rebalance
+ */
+ShardMap::ShardMap(const vector<string>& nodes, uint64_t epoch) : map_epoch(epoch), nodes(nodes) {
+    build_ring();
+}
+
+void ShardMap::build_ring() {
+    ring.clear();
+    ring.reserve(nodes.size() * VNODES);
+    for (size_t n = 0; n < nodes.size(); n++) {
+        uint64_t base = hash_name(nodes[n]);
+        for (int v = 0; v < VNODES; v++) {
+            ring.push_back(make_pair(mix(base ^ mix(v)), static_cast<int>(n)));
+        }
+    }
+    sort(ring.begin(), ring.end());
+}
+
+int ShardMap::owner_of_block(uint64_t block) const {
+    if (ring.empty()) return -1;
+    // The first point clockwise from the block's hash, wrapping around
+    auto it = lower_bound(ring.begin(), ring.end(), make_pair(mix(block), -1));
+    if (it == ring.end()) it = ring.begin();
+    return it->second;
+}
+
+int ShardMap::find(const string& name) const {
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i] == name) return i;
+    }
+    return -1;
+}
+
+string ShardMap::serialize() const {
+    string out = to_string(map_epoch) + " ";
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (i > 0) out += ",";
+        out += nodes[i];
+    }
+    return out;
+}
+
+/**
+ * Parses a map
+ *
+ * @param text "EPOCH NODE,NODE,..." or just the node list (epoch 1); an
+ *             epoch with no nodes is an empty map
+ * @return false if the text is malformed or names a node twice
+ */
+bool ShardMap::parse(string_view text, ShardMap& out) {
+    uint64_t epoch = 1;
+    size_t space = text.find(' ');
+    if (space != string_view::npos) {
+        string number(text.substr(0, space));
+        char* end;
+        epoch = strtoull(number.c_str(), &end, 10);
+        if (number.empty() || *end != '\0') return false;
+        text.remove_prefix(space + 1);
+    }
+
+    vector<string> nodes;
+    while (!text.empty()) {
+        size_t comma = text.find(',');
+        string name(text.substr(0, comma));
+        string host;
+        int port;
+        if (!split_node(name, host, port)) return false;
+        if (std::find(nodes.begin(), nodes.end(), name) != nodes.end()) return false;
+        nodes.push_back(name);
+        if (comma == string_view::npos) break;
+        text.remove_prefix(comma + 1);
+    }
+    out = ShardMap(nodes, epoch);
+    return true;
+}
+
+bool ShardMap::split_node(const string& name, string& host, int& port) {
+    size_t colon = name.rfind(':');
+    if (colon == string::npos || colon == 0 || colon + 1 == name.size()) return false;
+    char* end;
+    long p = strtol(name.c_str() + colon + 1, &end, 10);
+    if (*end != '\0' || p <= 0 || p > 65535) return false;
+    host = name.substr(0, colon);
+    port = p;
+    return true;
+}
+
+void ShardAssignment::update() {
+    map_self = map.find(self);
+    previous_self = previous.find(self);
+    arrived.assign(previous.size(), false);
+    for (size_t i = 0; i < previous.size(); i++) {
+        arrived[i] = imported.count(previous.node(i)) > 0;
+    }
+}
+
+bool ShardAssignment::serves(int64_t user_id) const {
+    uint64_t block = static_cast<uint64_t>(user_id) / ShardMap::BLOCK_SIZE;
+    if (map_self < 0 || map.owner_of_block(block) != map_self) return false;
+    if (previous.empty()) return true;
+
+    // Moving in: only once its previous owner has handed it over
+    int from = previous.owner_of_block(block);
+    return from == previous_self || arrived[from];
+}
+
+bool ShardAssignment::imports_complete() const {
+    for (size_t i = 0; i < previous.size(); i++) {
+        if (static_cast<int>(i) != previous_self && !arrived[i]) return false;
+    }
+    return true;
+}
+
+/**
+ * Writes the assignment so a restarted server resumes where it was
+ *
+ * @return false if the file could not be written; the old one is left in place
+ */
+bool ShardAssignment::save(const string& path) const {
+    string temp_path = path + ".tmp";
+    ostringstream text;
+    text << self << "\n" << map.serialize() << "\n" << previous.serialize() << "\n";
+    bool first = true;
+    for (const string& name : imported) {
+        text << (first ? "" : ",") << name;
+        first = false;
+    }
+    text << "\n";
+    string data = text.str();
+
+    int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        LOG_ERROR("Error creating " << temp_path << " " << strerror(errno));
+        return false;
+    }
+    bool ok = write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size()) && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(temp_path.c_str(), path.c_str()) == -1) {
+        LOG_ERROR("Error writing " << path << " " << strerror(errno));
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    // Make the rename itself durable
+    string dir_copy = path;
+    int dfd = open(dirname(&dir_copy[0]), O_RDONLY | O_DIRECTORY);
+    if (dfd != -1) {
+        fsync(dfd);
+        close(dfd);
+    }
+    return true;
+}
+
+/**
+ * Reads a file written by save()
+ *
+ * @return false if there is none or it is malformed; the assignment is then unchanged
+ */
+bool ShardAssignment::load(const string& path) {
+    ifstream in(path);
+    string self_line, map_line, previous_line, imported_line;
+    if (!getline(in, self_line) || !getline(in, map_line) || !getline(in, previous_line)) return false;
+    getline(in, imported_line);
+
+    ShardMap parsed_map, parsed_previous;
+    if (!ShardMap::parse(map_line, parsed_map) || !ShardMap::parse(previous_line, parsed_previous)) {
+        LOG_ERROR("Malformed shard state in " << path);
+        return false;
+    }
+
+    set<string> parsed_imported;
+    string_view rest(imported_line);
+    while (!rest.empty()) {
+        size_t comma = rest.find(',');
+        parsed_imported.insert(string(rest.substr(0, comma)));
+        if (comma == string_view::npos) break;
+        rest.remove_prefix(comma + 1);
+    }
+
+    self = self_line;
+    map = parsed_map;
+    previous = parsed_previous;
+    imported = parsed_imported;
+    update();
+    return true;
+}
@@ -0,0 +1,110 @@
+#ifndef _SHARD_MAP_H_
+#define _SHARD_MAP_H_
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <set>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * ShardMap class
+ *
+ * Which finance server owns which accounts. User IDs are grouped into
+ * blocks of BLOCK_SIZE consecutive IDs (one AccountStore page, so a
+ * server's accounts fill whole pages) and blocks are placed on a consistent
+ * hash ring with VNODES points per node. Adding or removing a node only
+ * moves the blocks between it and its neighbours on the ring: going from 4
+ * to 16 nodes moves about three quarters of the blocks, and each new node
+ * takes its share from all of the old ones.
+ *
+ * Nodes are named "host:port", the address clients connect to. Every map
+ * has an epoch; a rebalance installs a map with a higher one.
+ * serialize() gives "EPOCH NODE,NODE,..." for the wire and the state file.
+ */
+class ShardMap {
+public:
+    static const uint64_t BLOCK_SIZE = 1024;
+    static const int VNODES = 128;
+
+    // Message of the response a server sends for accounts it does not own;
+    // its data holds the server's map
+    static const char* const WRONG_SHARD;
+
+    ShardMap() : map_epoch(0) {}
+    ShardMap(const std::vector<std::string>& nodes, uint64_t epoch);
+
+    // Parses serialize() output; a bare "NODE,NODE" list gets epoch 1
+    static bool parse(std::string_view text, ShardMap& out);
+    std::string serialize() const;
+
+    // Index of the node owning user_id, or of block; -1 for an empty map
+    int owner(int64_t user_id) const { return owner_of_block(static_cast<uint64_t>(user_id) / BLOCK_SIZE); }
+    int owner_of_block(uint64_t block) const;
+
+    const std::string& node(int index) const { return nodes[index]; }
+    const std::vector<std::string>& node_names() const { return nodes; }
+    int find(const std::string& name) const;    // -1 if not a node of this map
+    size_t size() const { return nodes.size(); }
+    bool empty() const { return nodes.empty(); }
+    uint64_t epoch() const { return map_epoch; }
+
+    bool operator==(const ShardMap& other) const {
+        return map_epoch == other.map_epoch && nodes == other.nodes;
+    }
+    bool operator!=(const ShardMap& other) const { return !(*this == other); }
+
+    // Splits "host:port"
+    static bool split_node(const std::string& name, std::string& host, int& port);
+
+private:
+    void build_ring();
+
+    uint64_t map_epoch;
+    std::vector<std::string> nodes;
+    std::vector<std::pair<uint64_t, int>> ring;     // Point, node index; sorted
+};
+
+/*
+ * ShardAssignment class
+ *
+ * A finance server's own view of the cluster: its node name, the map it
+ * serves by and, while a rebalance is in progress, the map before it and
+ * the nodes whose blocks moving here have arrived. A block moving in is
+ * only served once it has, so no account is ever served by two nodes or
+ * from a stale copy; in between its requests are answered WRONG_SHARD and
+ * clients retry.
+ */
+class ShardAssignment {
+public:
+    std::string self;
+    ShardMap map;
+    ShardMap previous;              // Empty unless rebalancing
+    std::set<std::string> imported; // Nodes of previous whose blocks have arrived
+
+    ShardAssignment() : map_self(-1), previous_self(-1) {}
+
+    bool rebalancing() const { return !previous.empty(); }
+
+    // Recomputes the lookups serves() uses; call after changing the fields
+    void update();
+
+    // Whether this node answers requests for user_id right now
+    bool serves(int64_t user_id) const;
+
+    // Whether the blocks moving here from every other node have arrived
+    bool imports_complete() const;
+
+    // State file written atomically (temporary file, fsync, rename)
+    bool save(const std::string& path) const;
+    bool load(const std::string& path);
+
+private:
+    int map_self;                   // Index of self in map, -1 if not in it
+    int previous_self;
+    std::vector<bool> arrived;      // By node of previous: in imported
+};
+
+#endif
@@ -13,7 +13,6 @@ using namespace std;
 namespace SignalHandling {
     // Initialize atomic flags
     std::atomic<bool> shutdown_requested(false);
-    std::atomic<bool> timeout_occurred(false);
     std::atomic<int> child_exited(0);
     
     // Server process registry
@@ -25,14 +24,6 @@ namespace SignalHandling {
         memset(&sa, 0, sizeof(sa));
         sigemptyset(&sa.sa_mask);
 
-        // Set up SIGALRM handler
-        sa.sa_handler = sigalrm_handler;
-        sa.sa_flags = 0;
-        if (sigaction(SIGALRM, &sa, NULL) == -1) {
-            perror("Failed to set SIGALRM handler");
-            exit(1);
-        }
-        
         // Set up SIGINT handler
         sa.sa_handler = sigint_handler;
         sa.sa_flags = 0;
@@ -68,12 +59,6 @@ namespace SignalHandling {
         }
     }
     
-    void sigalrm_handler(int sig) {
-        timeout_occurred = true;
-        write(STDOUT_FILENO, "SIGALRM fired!\n", 15);
-        log_signal_event("SIGALRM received - operation timed out");
-    }
-    
     void sigchld_handler(int sig) {
         int status;
         pid_t pid;
@@ -120,16 +105,6 @@ namespace SignalHandling {
         }
     }
     
-    bool wait_with_timeout(int seconds) {
-        timeout_occurred = false;
-        alarm(seconds);
-        return true;
-    }
-    
-    void cancel_timeout() {
-        alarm(0);
-    }
-    
     void register_server(pid_t pid, const std::string& name) {
         server_processes.push_back({pid, name, true});
         
@@ -11,7 +11,6 @@
 namespace SignalHandling {
     // Signal flags (using std::atomic for thread safety)
     extern std::atomic<bool> shutdown_requested;
-    extern std::atomic<bool> timeout_occurred;
     extern std::atomic<int> child_exited;
     
     // Server process tracking
@@ -26,14 +25,11 @@ namespace SignalHandling {
     // Signal handlers
     void setup_handlers();
     void sigint_handler(int sig);
-    void sigalrm_handler(int sig);
     void sigchld_handler(int sig);
     
     // Signal operations
     void block_signals();
     void unblock_signals();
-    bool wait_with_timeout(int seconds);
-    void cancel_timeout();
     
     // Server management
     void register_server(pid_t pid, const std::string& name);
@@ -44,19 +40,4 @@ namespace SignalHandling {
     void log_signal_event(const std::string& message);
 }
 
-// Helper template for executing functions with timeout
-template<typename Func>
-bool execute_with_timeout(Func operation, int timeout_seconds) {
-    SignalHandling::timeout_occurred = false;
-    
-    // Set alarm
-    alarm(timeout_seconds);
-    
-    bool result = operation();
-    
-    // Cancel alarm
-    alarm(0);
-    return result && !SignalHandling::timeout_occurred;
-}
-
 #endif
\ No newline at end of file
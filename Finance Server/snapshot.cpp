@@ -0,0 +1,151 @@
+#include "snapshot.h"
+#include "logger.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+static const uint32_t SNAPSHOT_MAGIC = 0x504E5346;  // "FSNP"
+static const uint32_t SNAPSHOT_VERSION = 1;
+static const size_t HEADER_SIZE = 24;
+
+/**
+ * Copies the store into a new snapshot file
+ *
+ * @param store Store to copy; writers must be paused for a consistent image
+ * @param seq Last write-ahead log record reflected in the store
+ * @param path Where commit() will put the snapshot
+ *
+ * @throws Exits with error message if the file cannot be created, reserved or mapped
+ */
+Snapshot::Snapshot(const AccountStore& store, uint64_t seq, const string& path)
+    : path(path), temp_path(path + ".tmp"), fd(-1), image(NULL), size(0) {
+    uint64_t pages = store.page_count();
+    size = HEADER_SIZE + pages * AccountStore::PAGE_IMAGE_SIZE;
+
+    // The blocks are reserved up front: storing into a hole of a sparse file
+    // on a full disk would raise SIGBUS instead of failing
+    fd = open(temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int err = fd == -1 ? errno : posix_fallocate(fd, 0, size);
+    if (err != 0) {
+        LOG_ERROR("Error creating snapshot " << temp_path << " " << strerror(err));
+        if (fd != -1) {
+            close(fd);
+            unlink(temp_path.c_str());
+        }
+        throw("Error creating snapshot");
+    }
+
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        LOG_ERROR("Error mapping snapshot " << temp_path << " " << strerror(errno));
+        close(fd);
+        unlink(temp_path.c_str());
+        throw("Error mapping snapshot");
+    }
+    image = static_cast<char*>(mem);
+
+    memcpy(image, &SNAPSHOT_MAGIC, 4);
+    memcpy(image + 4, &SNAPSHOT_VERSION, 4);
+    memcpy(image + 8, &seq, 8);
+    memcpy(image + 16, &pages, 8);
+    for (uint64_t i = 0; i < pages; i++) {
+        store.copy_page(i, image + HEADER_SIZE + i * AccountStore::PAGE_IMAGE_SIZE);
+    }
+}
+
+Snapshot::~Snapshot() {
+    if (image) munmap(image, size);
+    if (fd != -1) {
+        close(fd);
+        unlink(temp_path.c_str());
+    }
+}
+
+/**
+ * Syncs the image and atomically replaces the previous snapshot with it
+ *
+ * @return false if any step failed (the previous snapshot is left in place)
+ */
+bool Snapshot::commit() {
+    if (msync(image, size, MS_SYNC) == -1 || fsync(fd) == -1) {
+        LOG_ERROR("Error syncing snapshot " << strerror(errno));
+        return false;
+    }
+    if (rename(temp_path.c_str(), path.c_str()) == -1) {
+        LOG_ERROR("Error installing snapshot " << strerror(errno));
+        return false;
+    }
+    close(fd);
+    fd = -1;
+
+    // Make the rename itself durable
+    string dir_copy = path;
+    int dfd = open(dirname(&dir_copy[0]), O_RDONLY | O_DIRECTORY);
+    if (dfd != -1) {
+        fsync(dfd);
+        close(dfd);
+    }
+    return true;
+}
+
+/**
+ * Loads a snapshot into a store
+ *
+ * @param store Empty store to fill
+ * @param path Snapshot file; a missing file is not an error
+ * @return Sequence number covered by the snapshot, 0 if there is none
+ *
+ * @throws Exits with error message if the snapshot exists but cannot be read:
+ *         the log it covers is gone, so starting without it would lose balances
+ */
+uint64_t Snapshot::load(AccountStore& store, const string& path) {
+    int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in == -1) {
+        if (errno == ENOENT) return 0;
+        LOG_ERROR("Error opening snapshot " << path << " " << strerror(errno));
+        throw("Error opening snapshot");
+    }
+
+    struct stat st;
+    if (fstat(in, &st) == -1 || (size_t)st.st_size < HEADER_SIZE) {
+        LOG_ERROR("Truncated snapshot " << path);
+        close(in);
+        throw("Truncated snapshot");
+    }
+
+    void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in, 0);
+    close(in);
+    if (mem == MAP_FAILED) {
+        LOG_ERROR("Error mapping snapshot " << path << " " << strerror(errno));
+        throw("Error mapping snapshot");
+    }
+    const char* data = static_cast<const char*>(mem);
+
+    uint32_t magic, version;
+    uint64_t seq, pages;
+    memcpy(&magic, data, 4);
+    memcpy(&version, data + 4, 4);
+    memcpy(&seq, data + 8, 8);
+    memcpy(&pages, data + 16, 8);
+
+    if (magic != SNAPSHOT_MAGIC || version != SNAPSHOT_VERSION ||
+        (size_t)st.st_size != HEADER_SIZE + pages * AccountStore::PAGE_IMAGE_SIZE) {
+        LOG_ERROR("Invalid snapshot " << path);
+        munmap(mem, st.st_size);
+        throw("Invalid snapshot");
+    }
+
+    for (uint64_t i = 0; i < pages; i++) {
+        store.load_page(data + HEADER_SIZE + i * AccountStore::PAGE_IMAGE_SIZE);
+    }
+    munmap(mem, st.st_size);
+    return seq;
+}
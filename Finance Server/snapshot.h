@@ -0,0 +1,43 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include "account_store.h"
+#include <string>
+#include <cstdint>
+
+/*
+ * Snapshot class
+ *
+ * Point-in-time image of an AccountStore covering the write-ahead log up
+ * to a sequence number. Creating a Snapshot copies every page straight
+ * into an mmap'd temporary file; commit() then syncs it and renames it over
+ * the previous snapshot, so the copy (which needs writers paused) is kept
+ * separate from the slow part.
+ *
+ * File layout (native byte order): magic(4) version(4) seq(8) pages(8)
+ * followed by one AccountStore page image per page.
+ */
+class Snapshot {
+public:
+    Snapshot(const AccountStore& store, uint64_t seq, const std::string& path);
+    ~Snapshot();
+
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    // Makes the snapshot durable and replaces the previous one
+    bool commit();
+
+    // Loads the snapshot at path into an empty store. Returns the sequence
+    // number it covers, or 0 if there is none; throws if it cannot be read.
+    static uint64_t load(AccountStore& store, const std::string& path);
+
+private:
+    std::string path;
+    std::string temp_path;
+    int fd;
+    char* image;
+    size_t size;
+};
+
+#endif
@@ -1,44 +1,365 @@
 #include "thread_pool.h"
 
-ThreadPool::ThreadPool(size_t numThreads) : stop(false), activeTasks(0) {
+// Initial per-worker deque capacity (grows on demand)
+static const int64_t DEQUE_CAPACITY = 256;
+
+// External submissions that can be queued before enqueue() waits for workers
+static const size_t INJECTION_CAPACITY = 1 << 16;
+
+// Rounds of stealing an idle worker tries before going to sleep
+static const int SPIN_ROUNDS = 64;
+
+// Finished task nodes each thread keeps for reuse
+static const size_t NODE_CACHE_LIMIT = 1024;
+
+// Pool and deque index of the calling thread, if it is a pool worker
+static thread_local ThreadPool* current_pool = nullptr;
+static thread_local size_t current_index = 0;
+
+// Per-thread free list of task nodes
+struct NodeCache {
+    TaskNode* head = nullptr;
+    size_t count = 0;
+
+    ~NodeCache() {
+        while (head) {
+            TaskNode* next = head->next;
+            delete head;
+            head = next;
+        }
+    }
+};
+
+static thread_local NodeCache node_cache;
+
+// Nodes released by threads whose cache is full, for threads whose cache is
+// empty. An event loop thread allocates every node it submits while the
+// workers release them, so without this it would allocate for every task.
+// Pushes are CAS loops; nodes are only ever taken all at once with exchange(),
+// so there is no ABA problem.
+static std::atomic<TaskNode*> spilled_nodes(nullptr);
+
+// Frees the spilled nodes at exit, once no pool is left to use them
+static struct SpilledNodes {
+    ~SpilledNodes() {
+        TaskNode* node = spilled_nodes.exchange(nullptr);
+        while (node) {
+            TaskNode* next = node->next;
+            delete node;
+            node = next;
+        }
+    }
+} spilled_nodes_owner;
+
+WorkStealingDeque::WorkStealingDeque() : top(0), bottom(0) {
+    buffers.emplace_back(new Buffer(DEQUE_CAPACITY));
+    buffer.store(buffers.back().get(), std::memory_order_relaxed);
+}
+
+WorkStealingDeque::~WorkStealingDeque() {}
+
+void WorkStealingDeque::push(TaskNode* node) {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    Buffer* buf = buffer.load(std::memory_order_relaxed);
+
+    if (b - t > buf->capacity - 1) {
+        buf = grow(buf, b, t);
+    }
+    buf->put(b, node);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+}
+
+TaskNode* WorkStealingDeque::pop() {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    Buffer* buf = buffer.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+
+    if (t > b) {
+        // Empty
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    TaskNode* node = buf->get(b);
+    if (t == b) {
+        // Last element: race thieves for it
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed)) {
+            node = nullptr;
+        }
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return node;
+}
+
+TaskNode* WorkStealingDeque::steal() {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+
+    if (t >= b) return nullptr;
+
+    Buffer* buf = buffer.load(std::memory_order_acquire);
+    TaskNode* node = buf->get(t);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                     std::memory_order_relaxed)) {
+        // Lost the race to the owner or another thief
+        return nullptr;
+    }
+    return node;
+}
+
+bool WorkStealingDeque::empty() const {
+    int64_t t = top.load(std::memory_order_acquire);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    return t >= b;
+}
+
+WorkStealingDeque::Buffer* WorkStealingDeque::grow(Buffer* old, int64_t b, int64_t t) {
+    Buffer* bigger = new Buffer(old->capacity * 2);
+    for (int64_t i = t; i < b; i++) {
+        bigger->put(i, old->get(i));
+    }
+    buffers.emplace_back(bigger);
+    buffer.store(bigger, std::memory_order_release);
+    return bigger;
+}
+
+InjectionQueue::InjectionQueue(size_t capacity)
+    : cells(new Cell[capacity]), mask(capacity - 1), enqueue_pos(0), dequeue_pos(0) {
+    for (size_t i = 0; i < capacity; i++) {
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+        cells[i].node = nullptr;
+    }
+}
+
+bool InjectionQueue::try_push(TaskNode* node) {
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+        cell = &cells[pos & mask];
+        size_t seq = cell->sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            return false;  // Full
+        } else {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    cell->node = node;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+TaskNode* InjectionQueue::try_pop() {
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+        cell = &cells[pos & mask];
+        size_t seq = cell->sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            return nullptr;  // Empty
+        } else {
+            pos = dequeue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    TaskNode* node = cell->node;
+    cell->sequence.store(pos + mask + 1, std::memory_order_release);
+    return node;
+}
+
+bool InjectionQueue::empty() const {
+    return dequeue_pos.load(std::memory_order_acquire) >= enqueue_pos.load(std::memory_order_acquire);
+}
+
+ThreadPool::ThreadPool(size_t numThreads)
+    : injection(INJECTION_CAPACITY), sleepers(0), stop(false), pending(0) {
+    if (numThreads == 0) numThreads = 1;
+
     for (size_t i = 0; i < numThreads; ++i) {
-        workers.emplace_back([this] {
-            while (true) {
-                std::function<void()> task;
-                {
-                    std::unique_lock<std::mutex> lock(queueMutex);
-                    condition.wait(lock, [this] { return stop || !tasks.empty(); });
-
-                    if (stop && tasks.empty()) return;
-
-                    task = std::move(tasks.front());
-                    tasks.pop();
-                }
-                ++activeTasks;
-                task();
-                --activeTasks;
-                condition.notify_all();
-            }
-        });
+        deques.emplace_back(new WorkStealingDeque());
+    }
+    for (size_t i = 0; i < numThreads; ++i) {
+        workers.emplace_back([this, i] { worker_loop(i); });
     }
 }
 
 ThreadPool::~ThreadPool() {
     {
-        std::unique_lock<std::mutex> lock(queueMutex);
-        condition.wait(lock, [this] { return tasks.empty() && activeTasks == 0; });
+        std::unique_lock<std::mutex> lock(doneMutex);
+        doneCondition.wait(lock, [this] { return pending.load() == 0; });
+    }
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
         stop = true;
     }
-    condition.notify_all();
+    wakeCondition.notify_all();
     for (std::thread &worker : workers) {
         worker.join();
     }
 }
 
-void ThreadPool::enqueue(std::function<void()> task) {
-    {
-        std::unique_lock<std::mutex> lock(queueMutex);
-        tasks.push(task);
+size_t ThreadPool::size() const {
+    return workers.size();
+}
+
+TaskNode* ThreadPool::allocate_node() {
+    NodeCache& cache = node_cache;
+    if (!cache.head) {
+        // Adopt everything other threads spilled
+        cache.head = spilled_nodes.exchange(nullptr, std::memory_order_acquire);
+        for (TaskNode* n = cache.head; n; n = n->next) cache.count++;
+    }
+    if (cache.head) {
+        TaskNode* node = cache.head;
+        cache.head = node->next;
+        cache.count--;
+        return node;
+    }
+    return new TaskNode();
+}
+
+void ThreadPool::release_node(TaskNode* node) {
+    node->task.reset();
+    NodeCache& cache = node_cache;
+    if (cache.count >= NODE_CACHE_LIMIT) {
+        node->next = spilled_nodes.load(std::memory_order_relaxed);
+        while (!spilled_nodes.compare_exchange_weak(node->next, node, std::memory_order_release,
+                                                    std::memory_order_relaxed)) {}
+        return;
+    }
+    node->next = cache.head;
+    cache.head = node;
+    cache.count++;
+}
+
+void ThreadPool::submit(TaskNode** nodes, size_t count) {
+    pending.fetch_add(count);
+
+    if (current_pool == this) {
+        // Spawned by one of our workers: keep it local, idle workers steal it
+        WorkStealingDeque& own = *deques[current_index];
+        for (size_t i = 0; i < count; i++) {
+            own.push(nodes[i]);
+        }
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            while (!injection.try_push(nodes[i])) {
+                // Queue full: let the workers catch up
+                wake(workers.size());
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    wake(count);
+}
+
+void ThreadPool::wake(size_t count) {
+    // Pairs with the fence in worker_loop: either the sleeper sees the new
+    // task when it re-checks, or we see the sleeper and notify it
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int idle = sleepers.load(std::memory_order_relaxed);
+    if (idle == 0) return;
+
+    std::lock_guard<std::mutex> lock(sleepMutex);
+    if (count >= (size_t)idle) {
+        wakeCondition.notify_all();
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            wakeCondition.notify_one();
+        }
+    }
+}
+
+TaskNode* ThreadPool::find_task(size_t index) {
+    TaskNode* node = deques[index]->pop();
+    if (node) return node;
+
+    node = injection.try_pop();
+    if (node) return node;
+
+    // Steal from the other workers, starting after ourselves
+    size_t n = deques.size();
+    for (size_t i = 1; i < n; i++) {
+        node = deques[(index + i) % n]->steal();
+        if (node) return node;
+    }
+    return nullptr;
+}
+
+void ThreadPool::run(TaskNode* node) {
+    node->task();
+    release_node(node);
+
+    if (pending.fetch_sub(1) == 1) {
+        std::lock_guard<std::mutex> lock(doneMutex);
+        doneCondition.notify_all();
     }
-    condition.notify_one();
-}
\ No newline at end of file
+}
+
+void ThreadPool::worker_loop(size_t index) {
+    current_pool = this;
+    current_index = index;
+
+    while (true) {
+        TaskNode* node = find_task(index);
+        for (int spin = 0; !node && spin < SPIN_ROUNDS; spin++) {
+            std::this_thread::yield();
+            node = find_task(index);
+        }
+        if (node) {
+            run(node);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleepers.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        node = find_task(index);
+        if (node) {
+            sleepers.fetch_sub(1);
+            lock.unlock();
+            run(node);
+            continue;
+        }
+        if (stop) {
+            sleepers.fetch_sub(1);
+            return;
+        }
+
+        wakeCondition.wait(lock);
+        sleepers.fetch_sub(1);
+    }
+}
+
+void ThreadPool::ParallelRange::work() {
+    while (true) {
+        size_t chunk = next.fetch_add(1);
+        if (chunk >= chunks) return;
+
+        size_t lo = begin + chunk * grain;
+        size_t hi = (end - lo > grain) ? lo + grain : end;
+        body(lo, hi);
+
+        if (done.fetch_add(1) + 1 == chunks) {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished.notify_all();
+        }
+    }
+}
+
+void ThreadPool::ParallelRange::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [this] { return done.load() == chunks; });
+}
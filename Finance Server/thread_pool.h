@@ -2,26 +2,312 @@
 #define THREAD_POOL_H
 
 #include <vector>
-#include <queue>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
 #include <functional>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Task class
+ *
+ * Move-only replacement for std::function<void()>. Callables up to
+ * INLINE_SIZE bytes (every lambda in this code base) are stored inside the
+ * Task itself, so wrapping them never allocates.
+ */
+class Task {
+public:
+    Task() : ops(nullptr) {}
+
+    template<typename F, typename = typename std::enable_if<
+        !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+    Task(F&& f) {
+        typedef typename std::decay<F>::type Fn;
+        store<Fn>(std::forward<F>(f), std::integral_constant<bool, fits_inline<Fn>()>());
+    }
+
+    Task(Task&& other) : ops(other.ops) {
+        if (ops) {
+            ops->relocate(&storage, &other.storage);
+            other.ops = nullptr;
+        }
+    }
+
+    Task& operator=(Task&& other) {
+        if (this != &other) {
+            reset();
+            ops = other.ops;
+            if (ops) {
+                ops->relocate(&storage, &other.storage);
+                other.ops = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() { reset(); }
+
+    void operator()() { ops->invoke(&storage); }
+    explicit operator bool() const { return ops != nullptr; }
+
+    void reset() {
+        if (ops) {
+            ops->destroy(&storage);
+            ops = nullptr;
+        }
+    }
 
-class ThreadPool {
 private:
-    std::vector<std::thread> workers;
-    std::queue<std::function<void()>> tasks;
-    std::mutex queueMutex;
-    std::condition_variable condition;
-    bool stop;
-    std::atomic<int> activeTasks;
+    static const size_t INLINE_SIZE = 48;
+
+    struct Ops {
+        void (*invoke)(void*);
+        void (*relocate)(void* dst, void* src);
+        void (*destroy)(void*);
+    };
+
+    template<typename Fn>
+    static constexpr bool fits_inline() {
+        return sizeof(Fn) <= INLINE_SIZE &&
+               alignof(Fn) <= alignof(std::max_align_t) &&
+               std::is_nothrow_move_constructible<Fn>::value;
+    }
+
+    // Callable stored in place
+    template<typename Fn>
+    struct InlineOps {
+        static void invoke(void* p) { (*static_cast<Fn*>(p))(); }
+        static void relocate(void* dst, void* src) {
+            new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+            static_cast<Fn*>(src)->~Fn();
+        }
+        static void destroy(void* p) { static_cast<Fn*>(p)->~Fn(); }
+        static const Ops ops;
+    };
 
+    // Callable too large for the inline buffer: storage holds a pointer
+    template<typename Fn>
+    struct HeapOps {
+        static void invoke(void* p) { (**static_cast<Fn**>(p))(); }
+        static void relocate(void* dst, void* src) { *static_cast<Fn**>(dst) = *static_cast<Fn**>(src); }
+        static void destroy(void* p) { delete *static_cast<Fn**>(p); }
+        static const Ops ops;
+    };
+
+    template<typename Fn, typename F>
+    void store(F&& f, std::true_type) {
+        new (&storage) Fn(std::forward<F>(f));
+        ops = &InlineOps<Fn>::ops;
+    }
+
+    template<typename Fn, typename F>
+    void store(F&& f, std::false_type) {
+        *reinterpret_cast<Fn**>(&storage) = new Fn(std::forward<F>(f));
+        ops = &HeapOps<Fn>::ops;
+    }
+
+    typename std::aligned_storage<INLINE_SIZE, alignof(std::max_align_t)>::type storage;
+    const Ops* ops;
+};
+
+template<typename Fn>
+const Task::Ops Task::InlineOps<Fn>::ops = { &InlineOps<Fn>::invoke, &InlineOps<Fn>::relocate, &InlineOps<Fn>::destroy };
+
+template<typename Fn>
+const Task::Ops Task::HeapOps<Fn>::ops = { &HeapOps<Fn>::invoke, &HeapOps<Fn>::relocate, &HeapOps<Fn>::destroy };
+
+// Queue entry; nodes are recycled through a per-thread cache, and through a
+// shared one when they are allocated and finished on different threads
+struct TaskNode {
+    Task task;
+    TaskNode* next;
+};
+
+/*
+ * Chase-Lev work-stealing deque
+ *
+ * The owning worker pushes and pops at the bottom without locks; any other
+ * worker may steal from the top. The buffer grows on demand and retired
+ * buffers are kept until the deque is destroyed since a thief may still be
+ * reading them.
+ */
+class WorkStealingDeque {
+public:
+    WorkStealingDeque();
+    ~WorkStealingDeque();
+
+    void push(TaskNode* node);   // Owner only
+    TaskNode* pop();             // Owner only
+    TaskNode* steal();           // Any thread
+    bool empty() const;
+
+private:
+    struct Buffer {
+        int64_t capacity;
+        std::unique_ptr<std::atomic<TaskNode*>[]> slots;
+        explicit Buffer(int64_t cap) : capacity(cap), slots(new std::atomic<TaskNode*>[cap]) {}
+        TaskNode* get(int64_t i) const { return slots[i & (capacity - 1)].load(std::memory_order_relaxed); }
+        void put(int64_t i, TaskNode* n) { slots[i & (capacity - 1)].store(n, std::memory_order_relaxed); }
+    };
+
+    Buffer* grow(Buffer* old, int64_t bottom, int64_t top);
+
+    std::atomic<int64_t> top;
+    std::atomic<int64_t> bottom;
+    std::atomic<Buffer*> buffer;
+    std::vector<std::unique_ptr<Buffer>> buffers;
+};
+
+/*
+ * Bounded lock-free MPMC queue (Vyukov) for tasks submitted from outside the pool
+ */
+class InjectionQueue {
+public:
+    explicit InjectionQueue(size_t capacity);
+
+    bool try_push(TaskNode* node);
+    TaskNode* try_pop();
+    bool empty() const;
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        TaskNode* node;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueue_pos;
+    alignas(64) std::atomic<size_t> dequeue_pos;
+};
+
+/*
+ * ThreadPool class
+ *
+ * Work-stealing scheduler: every worker owns a deque, tasks submitted by a
+ * worker of this pool go to its own deque, and tasks from other threads
+ * go through the lock-free injection queue. Idle workers steal before they
+ * sleep, and sleeping workers are only woken when there is work for them.
+ * The destructor waits until every submitted task has run.
+ */
+class ThreadPool {
 public:
     ThreadPool(size_t numThreads);
     ~ThreadPool();
-    void enqueue(std::function<void()> task);
+
+    template<typename F>
+    void enqueue(F&& task) {
+        TaskNode* node = allocate_node();
+        node->task = Task(std::forward<F>(task));
+        submit(&node, 1);
+    }
+
+    // Submits every callable in [first, last), moving from the elements
+    template<typename It>
+    void enqueue_bulk(It first, It last) {
+        TaskNode* nodes[BULK_BATCH];
+        size_t count = 0;
+        for (; first != last; ++first) {
+            TaskNode* node = allocate_node();
+            node->task = Task(std::move(*first));
+            nodes[count++] = node;
+            if (count == BULK_BATCH) {
+                submit(nodes, count);
+                count = 0;
+            }
+        }
+        if (count > 0) submit(nodes, count);
+    }
+
+    /**
+     * Runs body(lo, hi) over [begin, end) split into chunks of grain indices
+     * and returns once every chunk is done
+     *
+     * Helper tasks claim chunks from a shared counter and the calling thread
+     * works through them too, so a call never waits on a busy pool and costs
+     * at most one task per worker regardless of the range size.
+     *
+     * @param grain Indices per chunk (size it so a chunk stays in cache)
+     * @param max_parallelism Upper bound on threads used, 0 for the pool size
+     */
+    template<typename F>
+    void parallel_for(size_t begin, size_t end, size_t grain, F body, size_t max_parallelism = 0) {
+        if (begin >= end) return;
+        if (grain == 0) grain = 1;
+
+        std::shared_ptr<ParallelRange> range = std::make_shared<ParallelRange>();
+        range->begin = begin;
+        range->end = end;
+        range->grain = grain;
+        range->chunks = (end - begin + grain - 1) / grain;
+        range->body = [&body](size_t lo, size_t hi) { body(lo, hi); };
+
+        size_t helpers = workers.size();
+        if (max_parallelism > 0 && max_parallelism - 1 < helpers) helpers = max_parallelism - 1;
+        if (range->chunks - 1 < helpers) helpers = range->chunks - 1;
+
+        std::vector<Task> tasks;
+        tasks.reserve(helpers);
+        for (size_t i = 0; i < helpers; i++) {
+            tasks.emplace_back([range] { range->work(); });
+        }
+        enqueue_bulk(tasks.begin(), tasks.end());
+
+        range->work();
+        range->wait();
+    }
+
+    size_t size() const;
+
+private:
+    // Shared by the caller and the helper tasks of one parallel_for
+    struct ParallelRange {
+        size_t begin, end, grain, chunks;
+        std::function<void(size_t, size_t)> body;
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> done{0};
+        std::mutex mutex;
+        std::condition_variable finished;
+
+        void work();
+        void wait();
+    };
+
+    // Tasks enqueue_bulk() submits at a time
+    static const size_t BULK_BATCH = 64;
+
+    static TaskNode* allocate_node();
+    static void release_node(TaskNode* node);
+
+    void submit(TaskNode** nodes, size_t count);
+    void worker_loop(size_t index);
+    TaskNode* find_task(size_t index);
+    void run(TaskNode* node);
+    void wake(size_t count);
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<WorkStealingDeque>> deques;
+    InjectionQueue injection;
+
+    // Sleeping workers
+    std::mutex sleepMutex;
+    std::condition_variable wakeCondition;
+    std::atomic<int> sleepers;
+    bool stop;
+
+    // Tasks submitted but not finished, used by the destructor
+    std::atomic<size_t> pending;
+    std::mutex doneMutex;
+    std::condition_variable doneCondition;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,98 @@
+#include "timer_wheel.h"
+
+using namespace std;
+
+TimerWheel::TimerWheel(Clock::duration tick, size_t slots)
+    : origin(Clock::now()), tick(tick), slots(slots > 0 ? slots : 1), current(0), count(0) {
+    for (Timer& head : this->slots) {
+        head.prev = head.next = &head;
+    }
+}
+
+// Ticks from the wheel's origin to when, rounded up so no timer fires early
+uint64_t TimerWheel::ticks_until(Clock::time_point when) const {
+    if (when <= origin) return 0;
+    return (when - origin + tick - Clock::duration(1)) / tick;
+}
+
+void TimerWheel::unlink(Timer* timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = nullptr;
+}
+
+/**
+ * Schedules a timer
+ *
+ * @param timer Timer to schedule; it must stay alive until it fires or is cancelled
+ * @param when Time it fires at; a time already past fires on the next advance()
+ */
+void TimerWheel::schedule(Timer* timer, Clock::time_point when) {
+    if (timer->scheduled()) {
+        unlink(timer);
+    } else {
+        count++;
+    }
+
+    uint64_t t = ticks_until(when);
+    timer->tick = t > current ? t : current;
+
+    Timer& head = slots[timer->tick % slots.size()];
+    timer->prev = head.prev;
+    timer->next = &head;
+    head.prev->next = timer;
+    head.prev = timer;
+}
+
+void TimerWheel::cancel(Timer* timer) {
+    if (!timer->scheduled()) return;
+    unlink(timer);
+    count--;
+}
+
+/**
+ * Fires the timers due by now
+ *
+ * After a long gap every slot is visited once rather than once per missed tick.
+ */
+void TimerWheel::advance(Clock::time_point now, vector<Timer*>& expired) {
+    if (now < origin) return;
+    uint64_t now_tick = (now - origin) / tick;
+    if (now_tick < current) return;
+
+    uint64_t last = now_tick - current < slots.size() ? now_tick : current + slots.size() - 1;
+    for (uint64_t t = current; t <= last && count > 0; t++) {
+        Timer& head = slots[t % slots.size()];
+        for (Timer* timer = head.next; timer != &head;) {
+            Timer* next = timer->next;
+            if (timer->tick <= now_tick) {
+                unlink(timer);
+                count--;
+                expired.push_back(timer);
+            }
+            timer = next;
+        }
+    }
+    current = now_tick + 1;
+}
+
+/**
+ * Finds how long the caller can sleep before the next advance()
+ *
+ * The first non-empty slot gives a lower bound: its timers may belong to a
+ * later round, in which case the caller just wakes up early.
+ */
+int TimerWheel::next_timeout_ms(Clock::time_point now) const {
+    if (count == 0) return -1;
+
+    for (size_t i = 0; i < slots.size(); i++) {
+        const Timer& head = slots[(current + i) % slots.size()];
+        if (head.next == &head) continue;
+
+        Clock::time_point due = origin + tick * (current + i);
+        if (due <= now) return 0;
+        return chrono::duration_cast<chrono::milliseconds>(due - now + chrono::milliseconds(1) -
+                                                           Clock::duration(1)).count();
+    }
+    return -1;
+}
@@ -0,0 +1,64 @@
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * TimerWheel class
+ *
+ * Hashed timing wheel: a timer due at tick t waits in slot t % slots, so
+ * scheduling, rescheduling and cancelling are O(1) and advancing the clock
+ * only visits the slots it passes. Timers more than one revolution out stay
+ * in their slot until their round comes. The timers are embedded in the
+ * objects they time (an intrusive list per slot), so nothing is allocated
+ * after construction. Timers never fire early and at most one tick late.
+ *
+ * Not thread-safe; callers share a wheel under their own lock.
+ */
+class TimerWheel {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Timer {
+        Timer* prev;        // Both null while not scheduled
+        Timer* next;
+        uint64_t tick;
+        void* owner;        // For whoever handles the timer when it fires
+
+        explicit Timer(void* owner = nullptr) : prev(nullptr), next(nullptr), tick(0), owner(owner) {}
+
+        bool scheduled() const { return prev != nullptr; }
+    };
+
+    explicit TimerWheel(Clock::duration tick = std::chrono::milliseconds(1), size_t slots = 1024);
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // Schedules timer to fire at when, moving it if it was already scheduled
+    void schedule(Timer* timer, Clock::time_point when);
+    void cancel(Timer* timer);
+
+    // Unschedules every timer due by now and appends it to expired
+    void advance(Clock::time_point now, std::vector<Timer*>& expired);
+
+    // Milliseconds until advance() may have a timer to fire, -1 if none is scheduled
+    int next_timeout_ms(Clock::time_point now) const;
+
+    size_t size() const { return count; }
+
+private:
+    uint64_t ticks_until(Clock::time_point when) const;
+    static void unlink(Timer* timer);
+
+    Clock::time_point origin;
+    Clock::duration tick;
+    std::vector<Timer> slots;   // List heads, circular
+    uint64_t current;           // Next tick advance() processes
+    size_t count;
+};
+
+#endif
@@ -0,0 +1,346 @@
+#include "transfer.h"
+#include "channel_pool.h"
+#include "checksum.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <vector>
+#include <cerrno>
+
+using namespace std;
+
+/**
+ * Uploads a file, resuming an interrupted upload of the same name
+ *
+ * @param channel Connection to the file server
+ * @param upload UPLOAD_FILE request naming the file
+ * @param fd File to upload, read from its current offset
+ * @return The server's response
+ *
+ * UPLOAD_STATUS asks how many bytes the server already holds, then the rest
+ * of the file is sent as a ranged UPLOAD_FILE request.
+ */
+Response upload_resumable(NetworkRequestChannel& channel, const Request& upload, int fd) {
+    struct stat st;
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    if (channel.get_wire_format() != BINARY_FORMAT || start == -1 || fstat(fd, &st) == -1 ||
+        !S_ISREG(st.st_mode) || st.st_size <= start) {
+        return channel.send_request_stream(upload, fd);
+    }
+    uint64_t total = st.st_size - start;
+
+    Response status = channel.send_request(Request(UPLOAD_STATUS, upload.user_id, 0, upload.filename));
+    if (!status.success) {
+        if (!channel.is_connected()) return status;
+        // Servers without resumable uploads
+        return channel.send_request_stream(upload, fd);
+    }
+
+    // A partial upload longer than this file belongs to something else and is replaced
+    uint64_t held = status.balance;
+    if (held > total) held = 0;
+    if (lseek(fd, start + held, SEEK_SET) == -1) {
+        return Response(false, 0, "", "Failed to read file");
+    }
+
+    Request piece(UPLOAD_FILE, upload.user_id, upload.amount, upload.filename);
+    piece.compressible = upload.compressible;
+    piece.offset = held;
+    piece.length = total;
+    Response resp = channel.send_request_stream(piece, fd);
+    if (resp.success && held > 0) {
+        resp.message += " (resumed at byte " + to_string(held) + ")";
+    }
+    return resp;
+}
+
+/**
+ * Downloads a file, resuming from what out_fd already holds
+ *
+ * @param channel Connection to the file server
+ * @param download DOWNLOAD_FILE request naming the file
+ * @param out_fd Regular file the download is appended to
+ * @return The server's response; fails if the payload was cut short or could not be written
+ *
+ * If the server's copy shrank below what was already received, the download
+ * starts over.
+ */
+Response download_resumable(NetworkRequestChannel& channel, const Request& download, int out_fd) {
+    off_t held = lseek(out_fd, 0, SEEK_END);
+    if (held == -1) {
+        return Response(false, 0, "", "Could not write output file");
+    }
+
+    Request req(DOWNLOAD_FILE, download.user_id, download.amount, download.filename);
+    if (channel.get_wire_format() == BINARY_FORMAT) {
+        req.offset = held;
+    } else if (held > 0) {
+        held = 0;
+        if (ftruncate(out_fd, 0) == -1 || lseek(out_fd, 0, SEEK_SET) == -1) {
+            return Response(false, 0, "", "Could not write output file");
+        }
+    }
+
+    Response resp = channel.send_request_stream(req, -1);
+    if (!resp.success && held > 0 && channel.is_connected()) {
+        req.offset = held = 0;
+        if (ftruncate(out_fd, 0) == -1 || lseek(out_fd, 0, SEEK_SET) == -1) {
+            return Response(false, 0, "", "Could not write output file");
+        }
+        resp = channel.send_request_stream(req, -1);
+    }
+    if (!resp.success) return resp;
+
+    bool written = channel.receive_payload(resp, out_fd);
+    if (!written) {
+        resp.success = false;
+        resp.message = channel.is_connected() ? "Could not write output file" : "Download interrupted";
+        return resp;
+    }
+
+    // Older servers leave balance at 0 and always send the whole file
+    off_t size = lseek(out_fd, 0, SEEK_CUR);
+    if (resp.balance > 0 && size != static_cast<off_t>(resp.balance)) {
+        resp.success = false;
+        resp.message = "Download incomplete";
+    } else if (held > 0) {
+        resp.message += " (resumed at byte " + to_string(held) + ")";
+    }
+    return resp;
+}
+
+// Clamps the configured stripe size to what a range request can carry
+static size_t stripe_size(const StripeOptions& options) {
+    if (options.stripe_size == 0) return StripeOptions().stripe_size;
+    return options.stripe_size < MAX_STRIPE_SIZE ? options.stripe_size : MAX_STRIPE_SIZE;
+}
+
+static bool read_at(int fd, string& buf, uint64_t offset) {
+    size_t done = 0;
+    while (done < buf.size()) {
+        ssize_t n = pread(fd, &buf[done], buf.size() - done, offset + done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+/*
+ * Ranges shared by the threads of one striped transfer. Each thread leases
+ * a connection of its own and takes the next range until none are left or
+ * one of them failed.
+ */
+class StripeWork {
+public:
+    StripeWork(uint64_t size, size_t stripe, uint64_t first) :
+        size(size), stripe(stripe), count((size + stripe - 1) / stripe), next(first), failed(false) {}
+
+    // Claims the next range; false when done
+    bool take(uint64_t& offset, size_t& length) {
+        if (failed) return false;
+        uint64_t index = next++;
+        if (index >= count) return false;
+        offset = index * stripe;
+        length = size - offset < stripe ? size - offset : stripe;
+        return true;
+    }
+
+    void fail(const string& why) {
+        lock_guard<mutex> lock(error_mutex);
+        if (!failed.exchange(true)) error = why;
+    }
+
+    bool ok() const { return !failed; }
+    string why() {
+        lock_guard<mutex> lock(error_mutex);
+        return error;
+    }
+
+    // Runs body on stripes threads, each with its own connection out of pool.
+    // body(channel, offset, length) returns false if the range failed; a range
+    // whose connection dropped is retried once on a fresh one.
+    void run(ChannelPool& pool, int stripes, function<bool(NetworkRequestChannel&, uint64_t, size_t)> body) {
+        vector<thread> threads;
+        for (int i = 0; i < stripes; i++) {
+            threads.emplace_back([this, &pool, &body] {
+                ChannelPool::Lease lease = pool.acquire();
+                uint64_t offset;
+                size_t length;
+                while (lease && take(offset, length)) {
+                    bool done = body(*lease, offset, length);
+                    if (!done && !lease->is_connected()) {
+                        lease.discard();
+                        lease = pool.acquire();
+                        done = lease && body(*lease, offset, length);
+                    }
+                    if (!done) fail("Transfer of bytes " + to_string(offset) + "-" + to_string(offset + length) + " failed");
+                }
+                if (!lease) fail("No connection to the file server");
+            });
+        }
+        for (thread& t : threads) t.join();
+    }
+
+    const uint64_t size;
+    const size_t stripe;
+    const uint64_t count;
+
+private:
+    atomic<uint64_t> next;
+    atomic<bool> failed;
+    mutex error_mutex;
+    string error;
+};
+
+/**
+ * Uploads a file over several connections at once
+ *
+ * @param channel Connection to the file server, used for the commit
+ * @param host File server the stripe connections go to
+ * @param port Its port
+ * @param upload UPLOAD_FILE request naming the file
+ * @param fd File to upload from its start
+ * @param options How many connections and how large a range each request carries
+ * @return The commit's response
+ *
+ * Every range is an UPLOAD_STRIPE request. The file is hashed while the
+ * ranges are sent, and UPLOAD_COMMIT publishes it on the server only if the
+ * assembled copy hashes the same.
+ */
+Response upload_striped(NetworkRequestChannel& channel, const string& host, int port,
+                        const Request& upload, int fd, const StripeOptions& options) {
+    struct stat st;
+    size_t stripe = stripe_size(options);
+    if (options.stripes <= 1 || channel.get_wire_format() != BINARY_FORMAT || fstat(fd, &st) == -1 ||
+        !S_ISREG(st.st_mode) || static_cast<uint64_t>(st.st_size) <= stripe) {
+        lseek(fd, 0, SEEK_SET);
+        return upload_resumable(channel, upload, fd);
+    }
+
+    StripeWork work(st.st_size, stripe, 0);
+    string digest;
+    bool hashed = false;
+    try {
+        ChannelPool pool(host, port, options.stripes, ChannelPool::EXCLUSIVE, BINARY_FORMAT);
+        
+        // The file is hashed while the stripes are sent
+        thread hasher([&] { hashed = Sha256::file(fd, work.size, digest); });
+        work.run(pool, options.stripes, [&](NetworkRequestChannel& c, uint64_t offset, size_t length) {
+            Request piece(UPLOAD_STRIPE, upload.user_id, upload.amount, upload.filename);
+            piece.compressible = upload.compressible;
+            piece.data.resize(length);
+            if (!read_at(fd, piece.data, offset)) {
+                work.fail("Failed to read file");
+                return true;
+            }
+            piece.offset = offset;
+            piece.length = work.size;
+            Response r = c.send_request(piece);
+            if (!r.success && c.is_connected()) work.fail(r.message);
+            return r.success || c.is_connected();
+        });
+        hasher.join();
+    } catch (const char* e) {
+        return Response(false, 0, "", e);
+    }
+
+    if (!work.ok()) return Response(false, 0, "", work.why());
+    if (!hashed) return Response(false, 0, "", "Failed to read file");
+
+    Request commit(UPLOAD_COMMIT, upload.user_id, upload.amount, upload.filename, digest);
+    commit.length = work.size;
+    Response resp = channel.send_request(commit);
+    if (resp.success) {
+        resp.message += " (" + to_string(work.count) + " stripes over " + to_string(options.stripes) +
+                        " connections, checksum verified)";
+    }
+    return resp;
+}
+
+/**
+ * Downloads a file over several connections at once
+ *
+ * @param channel Connection to the file server
+ * @param host File server the stripe connections go to
+ * @param port Its port
+ * @param download DOWNLOAD_FILE request naming the file
+ * @param out_fd Regular file the download is written to from its start
+ * @param options How many connections and how large a range each request asks for
+ * @return The response to the first range, failed if the transfer or the checksum failed
+ *
+ * The first range comes over channel and tells the size of the file; the
+ * others are spread over options.stripes connections while channel asks
+ * for the server's checksum.
+ */
+Response download_striped(NetworkRequestChannel& channel, const string& host, int port,
+                          const Request& download, int out_fd, const StripeOptions& options) {
+    size_t stripe = stripe_size(options);
+    if (options.stripes <= 1 || channel.get_wire_format() != BINARY_FORMAT) {
+        return download_resumable(channel, download, out_fd);
+    }
+
+    Request first(DOWNLOAD_FILE, download.user_id, download.amount, download.filename);
+    first.length = stripe;
+    Response resp = channel.send_request_stream(first, -1);
+    if (!resp.success) return resp;
+
+    if (ftruncate(out_fd, 0) == -1 || !channel.receive_payload_at(resp, out_fd, 0)) {
+        channel.receive_payload(resp, -1);
+        resp.success = false;
+        resp.message = channel.is_connected() ? "Could not write output file" : "Download interrupted";
+        return resp;
+    }
+
+    uint64_t size = resp.balance;
+    StripeWork work(size, stripe, 1);
+    Response sum;
+    if (work.count > 1) {
+        try {
+            ChannelPool pool(host, port, options.stripes, ChannelPool::EXCLUSIVE, BINARY_FORMAT);
+            thread checksum([&] {
+                sum = channel.send_request(Request(FILE_CHECKSUM, download.user_id, 0, download.filename));
+            });
+            work.run(pool, options.stripes, [&](NetworkRequestChannel& c, uint64_t offset, size_t length) {
+                Request range(DOWNLOAD_FILE, download.user_id, download.amount, download.filename);
+                range.offset = offset;
+                range.length = length;
+                Response r = c.send_request_stream(range, -1);
+                if (!r.success) {
+                    if (c.is_connected()) work.fail(r.message);
+                    return c.is_connected();
+                }
+                if (!c.receive_payload_at(r, out_fd, offset)) {
+                    if (c.is_connected()) work.fail("Could not write output file");
+                    return c.is_connected();
+                }
+                return true;
+            });
+            checksum.join();
+        } catch (const char* e) {
+            work.fail(e);
+        }
+    } else {
+        sum = channel.send_request(Request(FILE_CHECKSUM, download.user_id, 0, download.filename));
+    }
+
+    // A short range or a file changed halfway shows up here
+    string digest;
+    if (work.ok() && (!sum.success || sum.balance != size)) {
+        work.fail(sum.success ? "File changed during download" : sum.message);
+    }
+    if (work.ok() && (!Sha256::file(out_fd, size, digest) || digest != sum.data)) {
+        work.fail("Checksum mismatch");
+    }
+    if (!work.ok()) {
+        bool emptied = ftruncate(out_fd, 0) == 0;
+        return Response(false, 0, "", emptied ? work.why() : work.why() + " (output file left incomplete)");
+    }
+
+    resp.message += " (" + to_string(work.count) + " stripes over " + to_string(options.stripes) +
+                    " connections, checksum verified)";
+    return resp;
+}
@@ -0,0 +1,63 @@
+#ifndef _TRANSFER_H_
+#define _TRANSFER_H_
+
+#include "common.h"
+#include "network_channel.h"
+#include <string>
+#include <cstddef>
+
+/*
+ * Resumable file transfers
+ *
+ * A dropped transfer picks up where it stopped when it is retried (on a new
+ * connection if need be) instead of starting over. Both helpers need a
+ * binary connection for the request ranges and fall back to whole-file
+ * transfers on text connections.
+ *
+ * Uploads collect on the server under the file's name until the announced
+ * size has arrived. Downloads resume from the size of the local file, so
+ * the caller should write into a file that holds only this download, e.g. a
+ * temporary one renamed when the transfer succeeds. Neither side checks
+ * that the bytes already transferred came from the same version of the file.
+ */
+
+// Uploads the file at fd from its current offset to the end, resuming an
+// interrupted upload of upload.filename. The message reports where it resumed.
+Response upload_resumable(NetworkRequestChannel& channel, const Request& upload, int fd);
+
+// Downloads download.filename, appending to out_fd. Bytes already in out_fd
+// are taken to be the start of the file and are not fetched again.
+Response download_resumable(NetworkRequestChannel& channel, const Request& download, int out_fd);
+
+/*
+ * Striped transfers
+ *
+ * One TCP connection rarely fills a fast link, so a large file is cut into
+ * stripe_size ranges that are spread over several connections at once, and
+ * each range is written in place at its offset on the receiving side. The
+ * whole file's SHA-256 is compared end to end: the server checks it before
+ * publishing an upload (UPLOAD_COMMIT), the client after a download
+ * (FILE_CHECKSUM).
+ */
+struct StripeOptions {
+    int stripes;            // Parallel connections; 1 transfers over the given channel alone
+    size_t stripe_size;     // Bytes per range, at most MAX_STRIPE_SIZE
+    
+    StripeOptions() : stripes(1), stripe_size(8 * 1024 * 1024) {}
+};
+
+// Upload ranges travel inline, so they stay well below the largest message
+const size_t MAX_STRIPE_SIZE = 32 * 1024 * 1024;
+
+// Like upload_resumable, but files larger than one stripe go out over
+// options.stripes connections to host:port. channel carries the commit.
+Response upload_striped(NetworkRequestChannel& channel, const std::string& host, int port,
+                        const Request& upload, int fd, const StripeOptions& options);
+
+// Like download_resumable, but files larger than one stripe come in over
+// options.stripes connections to host:port and are written into out_fd at
+// their offsets. On failure out_fd is emptied, since it may have holes.
+Response download_striped(NetworkRequestChannel& channel, const std::string& host, int port,
+                          const Request& download, int out_fd, const StripeOptions& options);
+
+#endif
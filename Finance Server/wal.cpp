@@ -0,0 +1,318 @@
+#include "wal.h"
+#include "logger.h"
+#include <algorithm>
+#include <iterator>
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+/*
+ * On-disk record (native byte order, the log never leaves this machine):
+ * seq(8) user_id(8) value(8) type(1) padding(3) checksum(4)
+ *
+ * The checksum lets replay stop cleanly at a record torn by a crash.
+ */
+static const size_t RECORD_SIZE = 32;
+
+static uint32_t checksum(const char* data, size_t len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= static_cast<uint8_t>(data[i]);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void encode_record(const WalRecord& r, char* out) {
+    memset(out, 0, RECORD_SIZE);
+    memcpy(out, &r.seq, 8);
+    memcpy(out + 8, &r.user_id, 8);
+    memcpy(out + 16, &r.value, 8);
+    out[24] = r.type;
+    uint32_t sum = checksum(out, 28);
+    memcpy(out + 28, &sum, 4);
+}
+
+static bool decode_record(const char* in, WalRecord& r) {
+    uint32_t sum;
+    memcpy(&sum, in + 28, 4);
+    if (sum != checksum(in, 28)) return false;
+
+    memcpy(&r.seq, in, 8);
+    memcpy(&r.user_id, in + 8, 8);
+    memcpy(&r.value, in + 16, 8);
+    r.type = in[24];
+    return r.type >= WalRecord::DEPOSIT && r.type <= WalRecord::DROP_PAGE;
+}
+
+// Makes a created, renamed or deleted file name durable
+static void sync_directory(const string& dir) {
+    int dfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dfd == -1) return;
+    fsync(dfd);
+    close(dfd);
+}
+
+static bool write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+ * Opens the log in a data directory, creating the directory if needed
+ *
+ * @param dir Directory holding the wal-*.log segments
+ *
+ * @throws Exits with error message if the directory cannot be used
+ */
+WriteAheadLog::WriteAheadLog(const string& dir)
+    : dir(dir), fd(-1), appended_seq(0), durable_seq(0), failed(false), stop(false) {
+    if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+        LOG_ERROR("Error creating data directory " << dir << " " << strerror(errno));
+        throw("Error creating data directory");
+    }
+
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        LOG_ERROR("Error opening data directory " << dir << " " << strerror(errno));
+        throw("Error opening data directory");
+    }
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        unsigned long long first;
+        char tail[8];
+        if (sscanf(entry->d_name, "wal-%llu.%7s", &first, tail) == 2 && strcmp(tail, "log") == 0) {
+            segments.push_back(Segment{first, dir + "/" + entry->d_name});
+        }
+    }
+    closedir(d);
+
+    sort(segments.begin(), segments.end(),
+         [](const Segment& a, const Segment& b) { return a.first_seq < b.first_seq; });
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    {
+        lock_guard<mutex> lock(log_mutex);
+        stop = true;
+    }
+    work.notify_all();
+    if (writer.joinable()) writer.join();
+    if (fd != -1) close(fd);
+}
+
+/**
+ * Replays the log on startup
+ *
+ * @param after Records at or below this sequence number are already
+ *              reflected in the loaded snapshot and are skipped
+ * @param apply Called for every remaining record in sequence order
+ * @return Last sequence number found in the log (at least after)
+ *
+ * A segment is read up to its first torn or out-of-order record.
+ */
+uint64_t WriteAheadLog::replay(uint64_t after, function<void(const WalRecord&)> apply) {
+    uint64_t last = after;
+
+    for (const Segment& segment : segments) {
+        int in = open(segment.path.c_str(), O_RDONLY);
+        if (in == -1) {
+            LOG_ERROR("Error opening " << segment.path << " " << strerror(errno));
+            continue;
+        }
+
+        vector<char> block(RECORD_SIZE * 4096);
+        size_t filled = 0;
+        uint64_t prev = 0;
+        bool intact = true;
+        while (intact) {
+            ssize_t n = read(in, block.data() + filled, block.size() - filled);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) break;
+            filled += n;
+
+            size_t used = 0;
+            for (; used + RECORD_SIZE <= filled; used += RECORD_SIZE) {
+                WalRecord r;
+                if (!decode_record(block.data() + used, r) || r.seq <= prev) {
+                    intact = false;
+                    break;
+                }
+                prev = r.seq;
+                if (r.seq > last) {
+                    apply(r);
+                    last = r.seq;
+                }
+            }
+            memmove(block.data(), block.data() + used, filled - used);
+            filled -= used;
+        }
+        close(in);
+    }
+
+    appended_seq = durable_seq = last;
+    return last;
+}
+
+/**
+ * Starts logging into a new segment after everything replayed
+ *
+ * @throws Exits with error message if the segment cannot be created
+ */
+void WriteAheadLog::start() {
+    lock_guard<mutex> lock(log_mutex);
+    open_segment(appended_seq + 1);
+    writer = thread([this] { writer_loop(); });
+}
+
+// Caller holds log_mutex (or the writer is not running yet)
+void WriteAheadLog::open_segment(uint64_t first_seq) {
+    char name[64];
+    snprintf(name, sizeof(name), "wal-%020llu.log", (unsigned long long)first_seq);
+    string path = dir + "/" + name;
+
+    // A segment with this name can only hold torn records from a crash
+    int out = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (out == -1) {
+        LOG_ERROR("Error creating log segment " << path << " " << strerror(errno));
+        throw("Error creating log segment");
+    }
+    sync_directory(dir);
+
+    if (fd != -1) close(fd);
+    fd = out;
+    if (segments.empty() || segments.back().path != path) {
+        segments.push_back(Segment{first_seq, path});
+    }
+}
+
+/**
+ * Adds a record to the current batch
+ *
+ * @return Sequence number to pass to wait_durable()
+ */
+uint64_t WriteAheadLog::append(uint8_t type, int64_t user_id, int64_t value) {
+    WalRecord r;
+    r.type = type;
+    r.user_id = user_id;
+    r.value = value;
+
+    char encoded[RECORD_SIZE];
+    lock_guard<mutex> lock(log_mutex);
+    r.seq = ++appended_seq;
+    encode_record(r, encoded);
+    bool was_empty = buffer.empty();
+    buffer.append(encoded, RECORD_SIZE);
+    if (was_empty) work.notify_one();
+    return r.seq;
+}
+
+bool WriteAheadLog::wait_durable(uint64_t seq) {
+    unique_lock<mutex> lock(log_mutex);
+    durable.wait(lock, [this, seq] { return durable_seq >= seq || failed; });
+    return !failed;
+}
+
+void WriteAheadLog::when_durable(uint64_t seq, function<void(bool)> done) {
+    {
+        lock_guard<mutex> lock(log_mutex);
+        if (durable_seq < seq && !failed) {
+            waiters.push_back(Waiter{seq, move(done)});
+            return;
+        }
+    }
+    done(!failed);
+}
+
+uint64_t WriteAheadLog::last_seq() {
+    lock_guard<mutex> lock(log_mutex);
+    return appended_seq;
+}
+
+/**
+ * Continues the log in a new segment once the current one is durable
+ *
+ * Everything up to last_seq() stays in the old segments, so after a
+ * snapshot at that point they can be removed.
+ */
+void WriteAheadLog::rotate() {
+    unique_lock<mutex> lock(log_mutex);
+    durable.wait(lock, [this] { return durable_seq >= appended_seq || failed; });
+    if (!segments.empty() && segments.back().first_seq == appended_seq + 1) return;
+    open_segment(appended_seq + 1);
+}
+
+void WriteAheadLog::remove_segments_through(uint64_t seq) {
+    lock_guard<mutex> lock(log_mutex);
+
+    // The active segment is always kept
+    size_t removed = 0;
+    while (removed + 1 < segments.size() && segments[removed + 1].first_seq <= seq + 1) {
+        unlink(segments[removed].path.c_str());
+        removed++;
+    }
+    if (removed > 0) {
+        segments.erase(segments.begin(), segments.begin() + removed);
+        sync_directory(dir);
+    }
+}
+
+/**
+ * Group commit: writes and syncs each accumulated batch while requests keep
+ * appending to the next one
+ */
+void WriteAheadLog::writer_loop() {
+    unique_lock<mutex> lock(log_mutex);
+    while (true) {
+        work.wait(lock, [this] { return stop || !buffer.empty(); });
+        if (buffer.empty()) break;
+
+        flushing.swap(buffer);
+        uint64_t batch_end = appended_seq;
+        int out = fd;
+        lock.unlock();
+
+        bool ok = write_all(out, flushing.data(), flushing.size()) && fdatasync(out) == 0;
+        if (!ok) {
+            LOG_ERROR_LIMITED("Error writing write-ahead log " << strerror(errno));
+        }
+        flushing.clear();
+
+        lock.lock();
+        if (ok) {
+            durable_seq = batch_end;
+        } else {
+            failed = true;
+        }
+        durable.notify_all();
+
+        // Callbacks run without the lock so they may append or wait
+        vector<Waiter> ready;
+        auto keep = partition(waiters.begin(), waiters.end(),
+                              [this](const Waiter& w) { return w.seq > durable_seq && !failed; });
+        move(keep, waiters.end(), back_inserter(ready));
+        waiters.erase(keep, waiters.end());
+
+        if (!ready.empty()) {
+            lock.unlock();
+            for (Waiter& w : ready) w.done(ok);
+            lock.lock();
+        }
+    }
+}
@@ -0,0 +1,110 @@
+#ifndef _WAL_H_
+#define _WAL_H_
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+
+/*
+ * One logged account mutation. Amounts are cents; for INTEREST the value
+ * holds the bit pattern of the rate and user_id is unused. SET_BALANCE
+ * records an account handed over by another shard and DROP_PAGE the page
+ * of user_id handed over to one.
+ */
+struct WalRecord {
+    enum Type : uint8_t {DEPOSIT = 1, WITHDRAW = 2, INTEREST = 3, SET_BALANCE = 4, DROP_PAGE = 5};
+
+    uint64_t seq;
+    uint8_t type;
+    int64_t user_id;
+    int64_t value;
+};
+
+/*
+ * WriteAheadLog class
+ *
+ * Append-only log of account mutations with group commit. append() only
+ * copies the record into a buffer; a writer thread writes whatever has
+ * accumulated with one write and one fdatasync while the next batch fills
+ * up, so concurrent requests share a sync instead of paying one each.
+ * wait_durable() blocks until a record has reached the disk; when_durable()
+ * instead calls back once it has, so callers need not hold a thread.
+ *
+ * The log is a series of segment files (wal-<first seq>.log) in the data
+ * directory. rotate() starts a new segment so segments covered by a
+ * snapshot can be deleted.
+ */
+class WriteAheadLog {
+public:
+    WriteAheadLog(const std::string& dir);
+    ~WriteAheadLog();
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    // Feeds every intact record with seq > after to apply, in log order.
+    // Must be called before start(); returns the last sequence number seen.
+    uint64_t replay(uint64_t after, std::function<void(const WalRecord&)> apply);
+
+    // Opens a fresh segment after the replayed ones and starts the writer
+    void start();
+
+    // Buffers a record and returns its sequence number
+    uint64_t append(uint8_t type, int64_t user_id, int64_t value);
+
+    // Blocks until every record up to seq is on disk; false if writing failed
+    bool wait_durable(uint64_t seq);
+
+    // Calls done(durable) once record seq is on disk, immediately if it
+    // already is, otherwise on the writer thread (so done must be quick)
+    void when_durable(uint64_t seq, std::function<void(bool)> done);
+
+    uint64_t last_seq();
+
+    // False once a write or sync has failed; nothing appended since is durable
+    bool healthy() const { return !failed.load(std::memory_order_relaxed); }
+
+    // Waits for the buffered records, then continues in a new segment.
+    // The caller must keep append() from being called concurrently.
+    void rotate();
+
+    // Deletes segments whose records are all at or below seq
+    void remove_segments_through(uint64_t seq);
+
+private:
+    struct Segment {
+        uint64_t first_seq;
+        std::string path;
+    };
+
+    struct Waiter {
+        uint64_t seq;
+        std::function<void(bool)> done;
+    };
+
+    void open_segment(uint64_t first_seq);
+    void writer_loop();
+
+    std::string dir;
+    std::vector<Segment> segments;
+    int fd;
+
+    std::mutex log_mutex;
+    std::condition_variable work;
+    std::condition_variable durable;
+    std::string buffer;     // Records waiting for the writer
+    std::string flushing;   // Records being written (owned by the writer)
+    std::vector<Waiter> waiters;
+    uint64_t appended_seq;
+    uint64_t durable_seq;
+    std::atomic<bool> failed;
+    bool stop;
+    std::thread writer;
+};
+
+#endif